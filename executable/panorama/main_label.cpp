@@ -2,7 +2,8 @@
 
 int main_label(int argc, char **argv) {
   gui::UI::InitGui(argc, argv);
-  misc::Matlab matlab;
+  // launched when the layout is first reconstructed
+  misc::Matlab matlab(std::string(), false, true, true);
 
   std::string impath;
   gui::FileDialog::PickAnImage(PANORAMIX_TEST_DATA_DIR_STR, &impath);
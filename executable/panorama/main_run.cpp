@@ -5,7 +5,13 @@ int main_run(int argc, char **argv) {
   misc::SetCachePath(PANORAMIX_CACHE_DATA_DIR_STR "\\Panorama\\");
   pano::misc::MakeDir(pano::misc::CachePath());
 
-  misc::Matlab matlab;
+  // engines are launched only if some stage misses the cache, the geometric
+  // contexts of the crops are extracted by up to 4 of them concurrently
+  misc::MatlabPool matlabs(4);
+
+  // also save the compact models as .glb files, with the panoramas saved
+  // beside as their textures
+  const bool saveMeshFiles = false;
 
   std::vector<std::string> impaths;
   gui::FileDialog::PickImages(PANORAMIX_TEST_DATA_DIR_STR, &impaths);
@@ -26,6 +32,7 @@ int main_run(int argc, char **argv) {
 
     options.notUseOcclusions = false;
     options.notUseCoplanarity = false;
+    options.useEqualAreaSegmentation = false;
 
     options.refresh_preparation = false;
     options.refresh_mg_init = options.refresh_preparation || false;
@@ -36,12 +43,16 @@ int main_run(int argc, char **argv) {
         options.refresh_lsw || options.refresh_line2leftRightSegs || false;
     options.refresh_mg_reconstructed = options.refresh_mg_occdetected || false;
 
-    RunPanoramaReconstruction(anno, options, matlab, true, false);
+    RunPanoramaReconstruction(anno, options, matlabs, true, false);
 
-    SaveMatlabResultsOfPanoramaReconstruction(anno, options, matlab,
+    SaveMatlabResultsOfPanoramaReconstruction(anno, options, matlabs,
                                               impath + ".result.mat");
-    SaveObjModelResultsOfPanoramaReconstruction(anno, options, matlab,
+    SaveObjModelResultsOfPanoramaReconstruction(anno, options, matlabs,
                                                 impath + ".result.obj");
+    if (saveMeshFiles) {
+      SaveMeshResultsOfPanoramaReconstruction(anno, options, matlabs,
+                                              impath + ".result.glb");
+    }
   }
 
   return 0;
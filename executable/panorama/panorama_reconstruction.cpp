@@ -1,7 +1,10 @@
 #include <chrono>
+#include <iomanip>
 
 #include "geo_context.hpp"
 #include "line_detection.hpp"
+#include "mat_file.hpp"
+#include "mesh_file.hpp"
 #include "panorama_reconstruction.hpp"
 #include "segmentation.hpp"
 
@@ -28,6 +31,9 @@ std::string PanoramaReconstructionOptions::algorithmOptionsTag() const {
   if (notUseCoplanarity) {
     ss << "_nocop";
   }
+  if (useEqualAreaSegmentation) {
+    ss << "_eqarea";
+  }
   return ss.str();
 }
 
@@ -50,6 +56,8 @@ void PanoramaReconstructionOptions::print() const {
             << std::endl;
   std::cout << " notUseOcclusions = " << notUseOcclusions << std::endl;
   std::cout << " notUseCoplanarity = " << notUseCoplanarity << std::endl;
+  std::cout << " useEqualAreaSegmentation = " << useEqualAreaSegmentation
+            << std::endl;
   std::cout << "------------------------------" << std::endl;
   std::cout << " refresh_preparation = " << refresh_preparation << std::endl;
   std::cout << " refresh_mg_init = " << refresh_mg_init << std::endl;
@@ -96,7 +104,7 @@ static const double thetaLarge = DegreesToRadians(15);
 PanoramaReconstructionReport
 RunPanoramaReconstruction(const PILayoutAnnotation &anno,
                           const PanoramaReconstructionOptions &options,
-                          misc::Matlab &matlab, bool showGUI,
+                          misc::MatlabPool &matlabs, bool showGUI,
                           bool writeToFile) {
 
   PanoramaReconstructionReport report;
@@ -186,7 +194,9 @@ RunPanoramaReconstruction(const PILayoutAnnotation &anno,
     }
 
     // estimate segs
-    nsegs = SegmentationForPIGraph(view, line3s, segs, DegreesToRadians(1));
+    nsegs = SegmentationForPIGraph(view, line3s, segs, DegreesToRadians(1),
+                                   10.0, 1.0, 200, 2,
+                                   options.useEqualAreaSegmentation);
     RemoveThinRegionInSegmentation(segs, 1, true);
     RemoveEmbededRegionsInSegmentation(segs, true);
     nsegs = DensifySegmentation(segs, true);
@@ -248,13 +258,34 @@ RunPanoramaReconstruction(const PILayoutAnnotation &anno,
         view.camera, hcamNum, hcamScreenSize.width, hcamScreenSize.height,
         hcamFocal);
     gcs.resize(hcams.size());
+    // each crop is cached by its own camera, only missing ones are computed
+    std::vector<std::string> hcamgcFileNames(hcams.size());
+    std::vector<int> missingHcams;
     for (int i = 0; i < hcams.size(); i++) {
-      auto pim = view.sampled(hcams[i]);
-      auto pgc = ComputeIndoorGeometricContextHedau(matlab, pim.image);
+      std::stringstream ss;
+      Vec3 forward = normalize(hcams[i].forward());
+      ss << "hcamgc_" << hcamScreenSize.width << "_" << hcamScreenSize.height
+         << "_" << hcamFocal << std::fixed << std::setprecision(4) << "_"
+         << forward[0] << "_" << forward[1] << "_" << forward[2];
+      hcamgcFileNames[i] = ss.str();
       gcs[i].component.camera = hcams[i];
-      gcs[i].component.image = pgc;
       gcs[i].score = abs(
           1.0 - normalize(hcams[i].forward()).dot(normalize(view.camera.up())));
+      if (!misc::LoadCache(anno.impath, hcamgcFileNames[i],
+                           gcs[i].component.image)) {
+        missingHcams.push_back(i);
+      }
+    }
+    std::vector<Image> pims(missingHcams.size());
+    for (int k = 0; k < missingHcams.size(); k++) {
+      pims[k] = view.sampled(hcams[missingHcams[k]]).image;
+    }
+    // crops are labelled together by one engine of the caller's pool
+    auto pgcs = ComputeIndoorGeometricContextHedau(matlabs, pims);
+    for (int k = 0; k < missingHcams.size(); k++) {
+      int i = missingHcams[k];
+      gcs[i].component.image = pgcs[k];
+      misc::SaveCache(anno.impath, hcamgcFileNames[i], pgcs[k]);
     }
     misc::SaveCache(anno.impath, hcamsgcsFileName, hcams, gcs);
   }
@@ -356,7 +387,8 @@ RunPanoramaReconstruction(const PILayoutAnnotation &anno,
 
     dp = LocateDeterminablePart(cg, DegreesToRadians(3), false);
     auto start = std::chrono::system_clock::now();
-    double energy = Solve(dp, cg, matlab, 5, 1e6, !options.notUseCoplanarity);
+    double energy = Solve(dp, cg, *matlabs.acquire(), 5, 1e6,
+                          !options.notUseCoplanarity);
     report.time_solve_lp = ElapsedInMS(start);
     if (IsInfOrNaN(energy)) {
       std::cout << "solve failed" << std::endl;
@@ -414,7 +446,7 @@ std::vector<LineSidingWeight> GetPanoramaReconstructionOcclusionResult(
 
 void SaveMatlabResultsOfPanoramaReconstruction(
     const PILayoutAnnotation &anno,
-    const PanoramaReconstructionOptions &options, misc::Matlab &matlab,
+    const PanoramaReconstructionOptions &options, misc::MatlabPool &matlabs,
     const std::string &fileName) {
   PIGraph<PanoramicCamera> mg;
   PIConstraintGraph cg;
@@ -423,24 +455,27 @@ void SaveMatlabResultsOfPanoramaReconstruction(
     std::cout << "failed to load panoramix result, performing "
                  "RunPanoramaReconstruction ..."
               << std::endl;
-    RunPanoramaReconstruction(anno, options, matlab, false);
+    RunPanoramaReconstruction(anno, options, matlabs, false);
     GetPanoramaReconstructionResult(anno, options, mg, cg, dp);
   }
 
-  misc::MAT matFile(fileName, misc::MAT::Write);
+  misc::MATFileWriter matFile(fileName);
+  if (matFile.null()) {
+    return;
+  }
 
   // segs
-  matFile.setVar("segs", cv::InputArray(mg.segs + 1));
-  auto planes = misc::MXA::createStructMatrix(mg.nsegs, 1,
-                                              {"reconstructed", "plane_coeff"});
+  matFile.setVar("segs", misc::MATValue(cv::Mat(mg.segs + 1)));
+  auto planes = misc::MATValue::createStructMatrix(
+      mg.nsegs, 1, {"reconstructed", "plane_coeff"});
+  std::vector<Plane3> seg2plane(mg.nsegs);
   for (int seg = 0; seg < mg.nsegs; seg++) {
     int ent = cg.seg2ent[seg];
     bool reconstructed = Contains(dp.determinableEnts, ent);
     planes.setField("reconstructed", seg, reconstructed);
     if (reconstructed) {
-      planes.setField("plane_coeff", seg,
-                      misc::MXA(Plane3ToEquation(
-                          cg.entities[ent].supportingPlane.reconstructed)));
+      seg2plane[seg] = cg.entities[ent].supportingPlane.reconstructed;
+      planes.setField("plane_coeff", seg, Plane3ToEquation(seg2plane[seg]));
     }
   }
   matFile.setVar("planes", planes);
@@ -466,34 +501,35 @@ void SaveMatlabResultsOfPanoramaReconstruction(
     }
   }
 
-  auto lines = misc::MXA::createStructMatrix(reconstructedLines.size(), 1,
-                                             {"line_p1", "line_p2"});
+  auto lines = misc::MATValue::createStructMatrix(
+      reconstructedLines.size(), 1, {"line_p1", "line_p2"});
   for (int i = 0; i < reconstructedLines.size(); i++) {
-    lines.setField("line_p1", i, misc::MXA(reconstructedLines[i].first));
-    lines.setField("line_p2", i, misc::MXA(reconstructedLines[i].second));
+    lines.setField("line_p1", i, reconstructedLines[i].first);
+    lines.setField("line_p2", i, reconstructedLines[i].second);
   }
   matFile.setVar("lines", lines);
 
 
   // depthMap
+  auto seg2planeTable = MakeSegPlaneTable(seg2plane);
+  Image3d dirs = DirectionField(mg.view.camera);
   Imaged depthMap(mg.segs.size(), 0.0);
-  for (auto it = depthMap.begin(); it != depthMap.end(); ++it) {
-    int seg = mg.segs(it.pos());
-    int ent = cg.seg2ent[seg];
-    bool reconstructed = Contains(dp.determinableEnts, ent);
-    if (reconstructed) {
-      auto & plane = cg.entities[ent].supportingPlane.reconstructed;
-      Vec3 dir = mg.view.camera.direction(it.pos());
-      double depth = norm(Intersection(Ray3(Origin(), dir), plane));
-      *it = depth;
+  ParallelStride(depthMap.rows, DefaultConcurrency(), [&](int y, int) {
+    const Vec3 *dirRow = dirs[y];
+    const int *segRow = mg.segs[y];
+    double *row = depthMap[y];
+    for (int x = 0; x < depthMap.cols; x++) {
+      if (seg2planeTable.valid[segRow[x]]) {
+        row[x] = seg2planeTable.depth(segRow[x], dirRow[x]);
+      }
     }
-  }
+  });
   matFile.setVar("depths", depthMap);
 }
 
 void SaveObjModelResultsOfPanoramaReconstruction(
     const PILayoutAnnotation &anno,
-    const PanoramaReconstructionOptions &options, misc::Matlab &matlab,
+    const PanoramaReconstructionOptions &options, misc::MatlabPool &matlabs,
     const std::string &fileName) {
 
   std::ofstream ofs(fileName);
@@ -508,37 +544,158 @@ void SaveObjModelResultsOfPanoramaReconstruction(
     std::cout << "failed to load panoramix result, performing "
                  "RunPanoramaReconstruction ..."
               << std::endl;
-    RunPanoramaReconstruction(anno, options, matlab, false);
+    RunPanoramaReconstruction(anno, options, matlabs, false);
     GetPanoramaReconstructionResult(anno, options, mg, cg, dp);
   }
 
   auto compactPolygons = CompactModel(dp, cg, mg, 0.1);
-  
-  // write vertex
-  std::vector<Point3> vertices;
-  std::vector<std::vector<int>> faceInds;
-  for (auto & poly : compactPolygons) {
-    if (poly.corners.empty()) {
+
+  // write into a buffer, then into the file at once
+  std::ostringstream vss, fss;
+  int vertsNum = 0;
+  for (auto &poly : compactPolygons) {
+    if (poly.corners.size() < 3) {
       continue;
     }
-    int prevVertNum = vertices.size();
-    vertices.insert(vertices.end(), poly.corners.begin(), poly.corners.end());
-    faceInds.push_back(
-        MakeIotaRange<int>(prevVertNum, prevVertNum + poly.corners.size())
-            .evalAsStdVector());
+    fss << "f";
+    for (auto &v : poly.corners) {
+      vss << "v " << v[0] << " " << v[1] << " " << v[2] << "\n";
+      fss << " " << ++vertsNum;
+    }
+    fss << "\n";
   }
+  ofs << vss.str() << fss.str();
+}
 
-  for (auto & v : vertices) {
-    ofs << "v " << v[0] << " " << v[1] << " " << v[2] << std::endl;
+namespace {
+// adds the compact model as an object
+// - with texture coordinates, the polygons are split into pieces cut by the
+//   seam and the poles, and subdivided only where texture coordinates
+//   interpolated linearly are off by more than maxTextureError pixels, texture
+//   coordinates are the positions of the piece corners on the panorama
+void AddCompactModelToMeshFile(const PIGraph<PanoramicCamera> &mg,
+                               const PIConstraintGraph &cg,
+                               const PICGDeterminablePart &dp,
+                               bool withTexCoords, double maxTextureError,
+                               int texture, misc::MeshFile &meshFile) {
+  auto compactPolygons = CompactModel(dp, cg, mg, 0.1);
+  if (!withTexCoords) {
+    meshFile.addObject(compactPolygons);
+    return;
   }
-  for (auto & f : faceInds) {
-    if (f.size() < 3) {
+
+  auto &cam = mg.view.camera;
+  auto sz = cam.screenSize();
+  std::vector<Polygon3> pieces;
+  std::vector<std::vector<Vec2>> texCoords;
+  for (auto &poly : compactPolygons) {
+    if (poly.corners.size() < 3 || poly.normal == Origin()) {
       continue;
     }
-    ofs << "f ";
-    for (int vid : f) {
-      ofs << (vid + 1) << "/" << 1 << "/" << 1 << " ";
+    Vec3 x, y;
+    std::tie(x, y) = ProposeXYDirectionsFromZDirection(poly.normal);
+    TriangulatePolygon(
+        poly.corners.begin(), poly.corners.end(),
+        [&x, &y](const Point3 &v) { return Vec2(v.dot(x), v.dot(y)); },
+        [&](const Point3 &a, const Point3 &b, const Point3 &c) {
+          SplitPanoramicTriangleByError(
+              cam, a, b, c, maxTextureError,
+              [&](const Point3 *points, const Point2 *corners) {
+                if (points[0] == points[1] || points[1] == points[2] ||
+                    points[2] == points[0]) {
+                  return; // the pole spread on the pole row
+                }
+                pieces.emplace_back(
+                    std::vector<Point3>(points, points + 3), poly.normal);
+                std::vector<Vec2> uvs(3);
+                for (int k = 0; k < 3; k++) {
+                  uvs[k] = Vec2(corners[k][0] / sz.width,
+                                corners[k][1] / sz.height);
+                }
+                texCoords.push_back(std::move(uvs));
+              });
+        });
+  }
+  meshFile.addObject(pieces, texCoords, texture);
+}
+
+// saves the panorama beside the mesh file as a texture, returns its uri
+std::string SaveTexture(const PIGraph<PanoramicCamera> &mg,
+                        const std::string &texturePath) {
+  if (!cv::imwrite(texturePath, mg.view.image)) {
+    return std::string();
+  }
+  return misc::NameOfFile(texturePath);
+}
+
+bool SaveMeshFile(const misc::MeshFile &meshFile, const std::string &fileName,
+                  const std::vector<std::string> &textureURIs) {
+  auto ext = fileName.substr(std::min(fileName.rfind('.'), fileName.size()));
+  std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+  if (ext == ".ply") {
+    return meshFile.savePLY(fileName);
+  } else if (ext == ".glb") {
+    return meshFile.saveGLB(fileName, textureURIs);
+  }
+  std::cout << "unsupported mesh file format: " << ext << std::endl;
+  return false;
+}
+}
+
+bool SaveMeshResultsOfPanoramaReconstruction(
+    const PILayoutAnnotation &anno,
+    const PanoramaReconstructionOptions &options, misc::MatlabPool &matlabs,
+    const std::string &fileName, bool withTexture, double maxTextureError) {
+
+  PIGraph<PanoramicCamera> mg;
+  PIConstraintGraph cg;
+  PICGDeterminablePart dp;
+  if (!GetPanoramaReconstructionResult(anno, options, mg, cg, dp)) {
+    std::cout << "failed to load panoramix result, performing "
+                 "RunPanoramaReconstruction ..."
+              << std::endl;
+    RunPanoramaReconstruction(anno, options, matlabs, false);
+    GetPanoramaReconstructionResult(anno, options, mg, cg, dp);
+  }
+
+  misc::MeshFile meshFile;
+  AddCompactModelToMeshFile(mg, cg, dp, withTexture, maxTextureError, 0,
+                            meshFile);
+
+  // the panorama is saved beside as the texture
+  std::vector<std::string> textureURIs;
+  if (withTexture) {
+    textureURIs.push_back(SaveTexture(mg, fileName + ".texture.png"));
+  }
+  return SaveMeshFile(meshFile, fileName, textureURIs);
+}
+
+bool SaveMeshResultsOfPanoramaReconstructions(
+    const std::vector<PILayoutAnnotation> &annos,
+    const PanoramaReconstructionOptions &options, misc::MatlabPool &matlabs,
+    const std::string &fileName, bool withTexture, double maxTextureError) {
+
+  misc::MeshFile meshFile;
+  std::vector<std::string> textureURIs;
+  for (auto &anno : annos) {
+    PIGraph<PanoramicCamera> mg;
+    PIConstraintGraph cg;
+    PICGDeterminablePart dp;
+    if (!GetPanoramaReconstructionResult(anno, options, mg, cg, dp)) {
+      std::cout << "failed to load panoramix result, performing "
+                   "RunPanoramaReconstruction ..."
+                << std::endl;
+      RunPanoramaReconstruction(anno, options, matlabs, false);
+      GetPanoramaReconstructionResult(anno, options, mg, cg, dp);
+    }
+    // each room is textured by its own panorama
+    const int texture = textureURIs.size();
+    AddCompactModelToMeshFile(mg, cg, dp, withTexture, maxTextureError,
+                              texture, meshFile);
+    if (withTexture) {
+      textureURIs.push_back(SaveTexture(
+          mg, fileName + ".texture" + std::to_string(texture) + ".png"));
     }
-    ofs << std::endl;
   }
+  return SaveMeshFile(meshFile, fileName, textureURIs);
 }
@@ -33,6 +33,8 @@ struct PanoramaReconstructionOptions {
   bool notUseOcclusions;
 
   bool notUseCoplanarity;
+  // segment on an equal area grid of the panorama instead of its pixels
+  bool useEqualAreaSegmentation;
 
   static const std::string parseOption(bool b);
   std::string algorithmOptionsTag() const;
@@ -53,7 +55,8 @@ struct PanoramaReconstructionOptions {
   template <class Archiver> void serialize(Archiver &ar) {
     ar(useWallPrior, usePrincipleDirectionPrior, useGeometricContextPrior,
        useGTOcclusions, looseLinesSecondTime, looseSegsSecondTime,
-       restrictSegsSecondTime, notUseOcclusions, notUseCoplanarity);
+       restrictSegsSecondTime, notUseOcclusions, notUseCoplanarity,
+       useEqualAreaSegmentation);
     ar(refresh_preparation, refresh_mg_init, refresh_line2leftRightSegs,
        refresh_mg_oriented, refresh_lsw, refresh_mg_occdetected,
        refresh_mg_reconstructed);
@@ -89,7 +92,7 @@ struct PanoramaReconstructionReport {
 PanoramaReconstructionReport
 RunPanoramaReconstruction(const PILayoutAnnotation &anno,
                           const PanoramaReconstructionOptions &options,
-                          misc::Matlab &matlab, bool showGUI,
+                          misc::MatlabPool &matlabs, bool showGUI,
                           bool writeToFile = false);
 
 // get result
@@ -104,20 +107,39 @@ std::vector<LineSidingWeight> GetPanoramaReconstructionOcclusionResult(
 // save matlab results
 void SaveMatlabResultsOfPanoramaReconstruction(
     const PILayoutAnnotation &anno,
-    const PanoramaReconstructionOptions &options, misc::Matlab &matlab,
+    const PanoramaReconstructionOptions &options, misc::MatlabPool &matlabs,
     const std::string &fileName);
 
 // save .obj model files
 void SaveObjModelResultsOfPanoramaReconstruction(
     const PILayoutAnnotation &anno,
-    const PanoramaReconstructionOptions &options, misc::Matlab &matlab,
+    const PanoramaReconstructionOptions &options, misc::MatlabPool &matlabs,
     const std::string &fileName);
 
+// save binary .ply or .glb mesh files, the panorama is saved beside as the
+// texture if required
+// - textured polygons are subdivided until texture coordinates are off by no
+//   more than maxTextureError pixels of the panorama
+bool SaveMeshResultsOfPanoramaReconstruction(
+    const PILayoutAnnotation &anno,
+    const PanoramaReconstructionOptions &options, misc::MatlabPool &matlabs,
+    const std::string &fileName, bool withTexture = true,
+    double maxTextureError = 1.0);
+
+// save the rooms into one binary .ply or .glb mesh file, one object each
+// - all rooms are collected in memory first and then written at once
+// - each room is textured by its own panorama, saved beside with its index
+bool SaveMeshResultsOfPanoramaReconstructions(
+    const std::vector<PILayoutAnnotation> &annos,
+    const PanoramaReconstructionOptions &options, misc::MatlabPool &matlabs,
+    const std::string &fileName, bool withTexture = true,
+    double maxTextureError = 1.0);
+
 // get surface normal maps
 template <class CameraT>
 std::vector<Image3d> GetSurfaceNormalMapsOfPanoramaReconstruction(
     const std::vector<CameraT> &testCams, const PILayoutAnnotation &anno,
-    const PanoramaReconstructionOptions &options, misc::Matlab &matlab) {
+    const PanoramaReconstructionOptions &options, misc::MatlabPool &matlabs) {
 
   PIGraph<PanoramicCamera> mg;
   PIConstraintGraph cg;
@@ -126,20 +148,20 @@ std::vector<Image3d> GetSurfaceNormalMapsOfPanoramaReconstruction(
     std::cout << "failed to load panoramix result, performing "
                  "RunPanoramaReconstruction ..."
               << std::endl;
-    RunPanoramaReconstruction(anno, options, matlab, false);
+    RunPanoramaReconstruction(anno, options, matlabs, false);
     GetPanoramaReconstructionResult(anno, options, mg, cg, dp);
   }
 
+  auto seg2normal = ComputeSegNormals(dp, cg, mg, true);
   std::vector<Image3d> surfaceNormalMaps(testCams.size());
-  ParallelRun(
-      testCams.size(), std::thread::hardware_concurrency() - 1, [&](int i) {
-        std::cout
-            << "computing surface normal map for panoramix on testCamera - "
-            << i << std::endl;
-        auto &map = surfaceNormalMaps[i];
-        auto &cam = testCams[i];
-        map = SurfaceNormalMap(cam, dp, cg, mg, true);
-      });
+  // cameras in parallel, rows of each map on its own thread
+  ParallelStride(testCams.size(), DefaultConcurrency(), [&](int i, int) {
+    std::cout << "computing surface normal map for panoramix on testCamera - "
+              << i << std::endl;
+    auto &map = surfaceNormalMaps[i];
+    auto &cam = testCams[i];
+    map = SurfaceNormalMap(cam, seg2normal, mg, 1);
+  });
   return surfaceNormalMaps;
 }
 
@@ -147,7 +169,7 @@ std::vector<Image3d> GetSurfaceNormalMapsOfPanoramaReconstruction(
 template <class CameraT>
 std::vector<Imaged> GetSurfaceDepthMapsOfPanoramaReconstruction(
     const std::vector<CameraT> &testCams, const PILayoutAnnotation &anno,
-    const PanoramaReconstructionOptions &options, misc::Matlab &matlab) {
+    const PanoramaReconstructionOptions &options, misc::MatlabPool &matlabs) {
 
   PIGraph<PanoramicCamera> mg;
   PIConstraintGraph cg;
@@ -156,19 +178,46 @@ std::vector<Imaged> GetSurfaceDepthMapsOfPanoramaReconstruction(
     std::cout << "failed to load panoramix result, performing "
                  "RunPanoramaReconstruction ..."
               << std::endl;
-    RunPanoramaReconstruction(anno, options, matlab, false);
+    RunPanoramaReconstruction(anno, options, matlabs, false);
     GetPanoramaReconstructionResult(anno, options, mg, cg, dp);
   }
 
+  auto seg2plane = MakeSegPlaneTable(ComputeSegPlanes(dp, cg, mg, true));
   std::vector<Imaged> surfaceDepthMaps(testCams.size());
-  ParallelRun(
-      testCams.size(), std::thread::hardware_concurrency() - 1, [&](int i) {
-        std::cout
-            << "computing surface normal map for panoramix on testCamera - "
-            << i << std::endl;
-        auto &map = surfaceDepthMaps[i];
-        auto &cam = testCams[i];
-        map = SurfaceDepthMap(cam, dp, cg, mg, true);
-      });
+  // cameras in parallel, rows of each map on its own thread
+  ParallelStride(testCams.size(), DefaultConcurrency(), [&](int i, int) {
+    std::cout << "computing surface depth map for panoramix on testCamera - "
+              << i << std::endl;
+    auto &map = surfaceDepthMaps[i];
+    auto &cam = testCams[i];
+    map = SurfaceDepthMap(cam, seg2plane, mg, 1);
+  });
   return surfaceDepthMaps;
 }
+
+// get depths, normals and segment ids of the compact model rendered by
+// rasterization
+template <class CameraT>
+std::vector<SurfaceRendering> GetSurfaceRenderingsOfPanoramaReconstruction(
+    const std::vector<CameraT> &testCams, const PILayoutAnnotation &anno,
+    const PanoramaReconstructionOptions &options, misc::MatlabPool &matlabs) {
+
+  PIGraph<PanoramicCamera> mg;
+  PIConstraintGraph cg;
+  PICGDeterminablePart dp;
+  if (!GetPanoramaReconstructionResult(anno, options, mg, cg, dp)) {
+    std::cout << "failed to load panoramix result, performing "
+                 "RunPanoramaReconstruction ..."
+              << std::endl;
+    RunPanoramaReconstruction(anno, options, matlabs, false);
+    GetPanoramaReconstructionResult(anno, options, mg, cg, dp);
+  }
+
+  // polygons are indexed by segments
+  auto compactPolygons = CompactModel(dp, cg, mg, 0.1);
+  std::vector<SurfaceRendering> renderings(testCams.size());
+  for (int i = 0; i < testCams.size(); i++) {
+    renderings[i] = RenderPolygons(testCams[i], compactPolygons);
+  }
+  return renderings;
+}
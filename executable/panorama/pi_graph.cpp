@@ -111,11 +111,177 @@ double PixelWeight(const PanoramicCamera &cam, const Pixel &p) {
 }
 double PixelWeight(const PerspectiveCamera &cam, const Pixel &p) { return 1.0; }
 
+namespace {
+
+struct PixelEdge {
+  int ind1, ind2;
+  double weight;
+};
+
+// whether dir and dir2 lie on different sides of a nearby line
+bool IsSeperatedByLines(const Vec3 &dir, const Vec3 &dir2,
+                        const std::set<int> &nearbyLines,
+                        const std::vector<Classified<Line3>> &lines,
+                        double lineExtendAngle) {
+  for (int lineid : nearbyLines) {
+    auto line = normalize(lines[lineid].component);
+    Vec3 normal = normalize(line.first.cross(line.second));
+    if (dir.dot(normal) * dir2.dot(normal) < -1e-10 &&
+        DistanceAngleFromPointToLine(dir, line) < lineExtendAngle &&
+        DistanceAngleFromPointToLine(dir2, line) < lineExtendAngle) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// graph based segmentation [Felzenszwalb 2004], vertices are weighted by
+// their areas, small regions are merged afterwards
+MergeFindSet<double> SegmentGraph(const std::vector<double> &vertices,
+                                  std::vector<PixelEdge> &edges, double c,
+                                  double minSize) {
+  std::sort(edges.begin(), edges.end(),
+            [](const PixelEdge &e1, const PixelEdge &e2) {
+              return e1.weight < e2.weight;
+            });
+
+  std::vector<double> thresholds(vertices.size(), c);
+  MergeFindSet<double> mfset(vertices.begin(), vertices.end());
+  for (int i = 0; i < edges.size(); i++) {
+    const PixelEdge &edge = edges[i];
+    int a = mfset.find(edge.ind1);
+    int b = mfset.find(edge.ind2);
+    if (a == b) {
+      continue;
+    }
+    if (edge.weight <= thresholds[a] && edge.weight <= thresholds[b]) {
+      mfset.join(a, b);
+      a = mfset.find(a);
+      thresholds[a] = edge.weight + c / mfset.data(a);
+    }
+  }
+  while (true) {
+    bool merged = false;
+    for (int i = 0; i < edges.size(); i++) {
+      const PixelEdge &edge = edges[i];
+      int a = mfset.find(edge.ind1);
+      int b = mfset.find(edge.ind2);
+      if (a == b) {
+        continue;
+      }
+      if (mfset.data(a) < minSize || mfset.data(b) < minSize) {
+        mfset.join(a, b);
+        merged = true;
+      }
+    }
+    if (!merged) {
+      break;
+    }
+  }
+  return mfset;
+}
+
+// segments on a reduced panorama grid where row y only keeps about
+// width * cos(latitude) cells, so every cell covers about the same area
+// - cells take the mean colors of the pixels they cover, and are connected
+//   to their horizontal neighbors (wrapping around) and to the cells in the
+//   adjacent rows overlapping them in longitude
+// - the poles shrink to single cells, no special polar connections needed
+int SegmentationOnEqualAreaGrid(const PanoramicView &view,
+                                const Image3ub &smoothed,
+                                const std::vector<Classified<Line3>> &lines,
+                                const RTreeMap<Vec3, int> &linesRTree,
+                                double lineSampleAngle, Imagei &segs,
+                                double lineExtendAngle, double c,
+                                double minSize) {
+  int width = smoothed.cols;
+  int height = smoothed.rows;
+
+  PanoramaEqualAreaGrid grid(width, height);
+  auto &rowWidths = grid.rowWidths;
+  auto &rowOffsets = grid.rowOffsets;
+  int ncells = grid.cellsNum();
+  std::vector<double> vertices(ncells, 0.0);
+  std::vector<Vec3> colors(ncells);
+  std::vector<Vec3> dirs(ncells);
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < rowWidths[y]; x++) {
+      int cell = rowOffsets[y] + x;
+      auto range = grid.pixelsOfCell(x, y);
+      Vec3 colorSum;
+      for (int px = range.first; px < range.second; px++) {
+        colorSum += Vec3(smoothed(y, px)[0], smoothed(y, px)[1],
+                         smoothed(y, px)[2]);
+        vertices[cell] += PixelWeight(view.camera, Pixel(px, y));
+      }
+      colors[cell] = colorSum / double(range.second - range.first);
+      dirs[cell] = normalize(view.camera.toSpace(
+          Point2((range.first + range.second - 1) / 2.0, y)));
+    }
+  }
+
+  std::vector<PixelEdge> edges;
+  edges.reserve(3 * ncells);
+  std::set<int> nearbyLines;
+  auto addEdge = [&](int cell1, int cell2) {
+    if (IsSeperatedByLines(dirs[cell1], dirs[cell2], nearbyLines, lines,
+                           lineExtendAngle)) {
+      return;
+    }
+    edges.push_back(PixelEdge{cell1, cell2,
+                              ColorDistance(colors[cell1], colors[cell2],
+                                            false)});
+  };
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < rowWidths[y]; x++) {
+      int cell = rowOffsets[y] + x;
+      nearbyLines.clear();
+      linesRTree.search(BoundingBox(dirs[cell]).expand(lineSampleAngle * 3),
+                        [&nearbyLines](const std::pair<Vec3, int> &lineSample) {
+                          nearbyLines.insert(lineSample.second);
+                          return true;
+                        });
+
+      // the next cell in the row
+      if (rowWidths[y] > 2 || (rowWidths[y] == 2 && x == 0)) {
+        addEdge(cell, rowOffsets[y] + (x + 1) % rowWidths[y]);
+      }
+      // the overlapping cells in the next row
+      if (y + 1 < height) {
+        auto range = grid.pixelsOfCell(x, y);
+        int cell1 = grid.cellOfPixel(y + 1, range.first);
+        int cell2 = grid.cellOfPixel(y + 1, range.second - 1);
+        for (int cc = cell1; cc <= cell2; cc++) {
+          addEdge(cell, cc);
+        }
+      }
+    }
+  }
+
+  auto mfset = SegmentGraph(vertices, edges, c, minSize);
+
+  // back to the panorama pixels
+  std::unordered_map<int, int> compIntSet;
+  segs = Imagei(height, width);
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      int comp = mfset.find(grid.cellOfPixel(y, x));
+      if (compIntSet.find(comp) == compIntSet.end()) {
+        compIntSet.insert(std::make_pair(comp, (int)compIntSet.size()));
+      }
+      segs(y, x) = compIntSet[comp];
+    }
+  }
+  return mfset.setsCount();
+}
+}
+
 int SegmentationForPIGraph(const PanoramicView &view,
                            const std::vector<Classified<Line3>> &lines,
                            Imagei &segs, double lineExtendAngle, double sigma,
                            double c, double minSize,
-                           int widthThresToRemoveThinRegions) {
+                           int widthThresToRemoveThinRegions,
+                           bool useEqualAreaGrid) {
 
   Image3ub im = view.image;
   int width = im.cols;
@@ -128,8 +294,8 @@ int SegmentationForPIGraph(const PanoramicView &view,
   }
 
   // register lines in RTree
-  RTreeMap<Vec3, int> linesRTree;
   static const double lineSampleAngle = DegreesToRadians(2);
+  std::vector<std::pair<Vec3, int>> lineSampleDirs;
   for (int i = 0; i < lines.size(); i++) {
     if (lines[i].claz == -1) { // don't consider clutter lines here
       continue;
@@ -139,9 +305,16 @@ int SegmentationForPIGraph(const PanoramicView &view,
     for (double a = 0.0; a <= spanAngle + lineSampleAngle / 2;
          a += lineSampleAngle) {
       auto direction = RotateDirection(line.first, line.second, a);
-      linesRTree.emplace(normalize(direction), i);
+      lineSampleDirs.emplace_back(normalize(direction), i);
     }
   }
+  RTreeMap<Vec3, int> linesRTree(lineSampleDirs.begin(), lineSampleDirs.end());
+
+  if (useEqualAreaGrid) {
+    return SegmentationOnEqualAreaGrid(view, smoothed, lines, linesRTree,
+                                       lineSampleAngle, segs, lineExtendAngle,
+                                       c, minSize);
+  }
 
   // register pixel ind -> spatial direction
   std::vector<Vec3> ind2dir(width * height);
@@ -168,10 +341,7 @@ int SegmentationForPIGraph(const PanoramicView &view,
     }
   }
   // collect edges
-  struct Edge {
-    int ind1, ind2;
-    double weight;
-  };
+  using Edge = PixelEdge;
   std::vector<Edge> edges;
   edges.reserve(4 * width * height);
 
@@ -199,19 +369,8 @@ int SegmentationForPIGraph(const PanoramicView &view,
         Pixel p2(xx, yy);
         Vec3 dir2 = ind2dir[Sub2Ind(p2, width, height)];
 
-        bool isSeperatedByLine = false;
-        for (int lineid : nearbyLines) {
-          auto line = normalize(lines[lineid].component);
-          Vec3 normal = normalize(line.first.cross(line.second));
-          if (dir.dot(normal) * dir2.dot(normal) < -1e-10 &&
-              DistanceAngleFromPointToLine(dir, line) < lineExtendAngle &&
-              DistanceAngleFromPointToLine(dir2, line) < lineExtendAngle) {
-            isSeperatedByLine = true;
-            break;
-          }
-        }
-
-        if (isSeperatedByLine) {
+        if (IsSeperatedByLines(dir, dir2, nearbyLines, lines,
+                               lineExtendAngle)) {
           continue;
         }
 
@@ -238,43 +397,7 @@ int SegmentationForPIGraph(const PanoramicView &view,
   }
 
   // segmentation
-  std::sort(edges.begin(), edges.end(), [](const Edge &e1, const Edge &e2) {
-    return e1.weight < e2.weight;
-  });
-
-  std::vector<double> thresholds(vertices.size(), c);
-  MergeFindSet<Vertex> mfset(vertices.begin(), vertices.end());
-  for (int i = 0; i < edges.size(); i++) {
-    const Edge &edge = edges[i];
-    int a = mfset.find(edge.ind1);
-    int b = mfset.find(edge.ind2);
-    if (a == b) {
-      continue;
-    }
-    if (edge.weight <= thresholds[a] && edge.weight <= thresholds[b]) {
-      mfset.join(a, b);
-      a = mfset.find(a);
-      thresholds[a] = edge.weight + c / mfset.data(a);
-    }
-  }
-  while (true) {
-    bool merged = false;
-    for (int i = 0; i < edges.size(); i++) {
-      const Edge &edge = edges[i];
-      int a = mfset.find(edge.ind1);
-      int b = mfset.find(edge.ind2);
-      if (a == b) {
-        continue;
-      }
-      if (mfset.data(a) < minSize || mfset.data(b) < minSize) {
-        mfset.join(a, b);
-        merged = true;
-      }
-    }
-    if (!merged) {
-      break;
-    }
-  }
+  auto mfset = SegmentGraph(vertices, edges, c, minSize);
 
   int numCCs = mfset.setsCount();
   std::unordered_map<int, int> compIntSet;
@@ -858,13 +981,13 @@ PIGraph<PanoramicCamera> BuildPIGraph(
   mg.bndPiece2segRelation.resize(mg.bndPiece2dirs.size(), SegRelation::Unknown);
 
   // register bndPiece dirs in RTree
-  RTreeMap<Vec3, int> bndPieceRTree;
+  std::vector<std::pair<Vec3, int>> bndPieceDirs;
   for (int i = 0; i < mg.bndPiece2dirs.size(); i++) {
     for (auto &d : mg.bndPiece2dirs[i]) {
-      bndPieceRTree.emplace(normalize(d), i);
+      bndPieceDirs.emplace_back(normalize(d), i);
     }
   }
-  RTreeMap<Vec3, int> lineRTree;
+  RTreeMap<Vec3, int> bndPieceRTree(bndPieceDirs.begin(), bndPieceDirs.end());
   const double lineSampleAngle = bndPieceBoundToLineAngleThres / 5.0;
   std::vector<std::vector<Vec3>> lineSamples(mg.lines.size());
   for (int i = 0; i < mg.lines.size(); i++) {
@@ -875,7 +998,6 @@ PIGraph<PanoramicCamera> BuildPIGraph(
       Vec3 sample = normalize(
           RotateDirection(line.component.first, line.component.second, a));
       lineSamples[i].push_back(sample);
-      lineRTree.emplace(sample, i);
     }
   }
 
@@ -1554,13 +1676,13 @@ PIGraph<PanoramicCamera> BuildPIGraph(
   mg.bndPiece2segRelation.resize(mg.bndPiece2dirs.size(), SegRelation::Unknown);
 
   // register bndPiece dirs in RTree
-  RTreeMap<Vec3, int> bndPieceRTree;
+  std::vector<std::pair<Vec3, int>> bndPieceDirs;
   for (int i = 0; i < mg.bndPiece2dirs.size(); i++) {
     for (auto &d : mg.bndPiece2dirs[i]) {
-      bndPieceRTree.emplace(normalize(d), i);
+      bndPieceDirs.emplace_back(normalize(d), i);
     }
   }
-  RTreeMap<Vec3, int> lineRTree;
+  RTreeMap<Vec3, int> bndPieceRTree(bndPieceDirs.begin(), bndPieceDirs.end());
   const double lineSampleAngle = bndPieceBoundToLineAngleThres / 5.0;
   std::vector<std::vector<Vec3>> lineSamples(mg.lines.size());
   for (int i = 0; i < mg.lines.size(); i++) {
@@ -1571,7 +1693,6 @@ PIGraph<PanoramicCamera> BuildPIGraph(
       Vec3 sample = normalize(
           RotateDirection(line.component.first, line.component.second, a));
       lineSamples[i].push_back(sample);
-      lineRTree.emplace(sample, i);
     }
   }
 
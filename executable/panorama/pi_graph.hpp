@@ -122,13 +122,16 @@ template <class CameraT> struct PIGraph {
   }
 };
 
+// useEqualAreaGrid: segment on a grid whose rows shrink with cos(latitude),
+// which holds about 2/pi of the panorama pixels
 int SegmentationForPIGraph(const PanoramicView &view,
                            const std::vector<Classified<Line3>> &lines,
                            Imagei &segs,
                            double lineExtendAngle = DegreesToRadians(5),
                            double sigma = 10.0, double c = 1.0,
                            double minSize = 200,
-                           int widthThresToRemoveThinRegions = 2);
+                           int widthThresToRemoveThinRegions = 2,
+                           bool useEqualAreaGrid = false);
 
 PIGraph<PanoramicCamera> BuildPIGraph(
     const PanoramicView &view, const std::vector<Vec3> &vps, int verticalVPId,
@@ -165,16 +168,25 @@ CollectFeatureMeanOnSegs(const PIGraph<PIGraphCameraT> &mg, const CameraT &pcam,
     if (regionMaskView.image.empty()) {
       continue;
     }
-    auto sampler = MakeCameraSampler(regionMaskView.camera, pcam);
-    auto featureOnRegion = sampler(feature);
+    std::vector<Pixel> maskPixels;
+    cv::findNonZero(regionMaskView.image, maskPixels);
+    if (maskPixels.empty()) {
+      continue;
+    }
+    // only sample the bounding box of the region
+    auto sampler = MakeCameraSampler(regionMaskView.camera, pcam,
+                                     cv::boundingRect(maskPixels));
+    Image_<Vec<T, N>> featureOnRegion = sampler.sampleROI(feature);
+    const cv::Rect &roi = sampler.roi();
+    const Imageub &visible = sampler.visibleROI();
     int votes = 0;
     Vec<T, N> featureSum;
-    for (auto it = regionMaskView.image.begin();
-         it != regionMaskView.image.end(); ++it) {
-      if (!*it) {
+    for (const Pixel &p : maskPixels) {
+      // pixels the feature camera cannot see are not counted
+      if (!roi.contains(p) || !visible(p - roi.tl())) {
         continue;
       }
-      featureSum += featureOnRegion(it.pos());
+      featureSum += featureOnRegion(p - roi.tl());
       votes += 1;
     }
     auto featureMean = featureSum / std::max(votes, 1);
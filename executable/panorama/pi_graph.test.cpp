@@ -0,0 +1,63 @@
+#include "../../panoramix/panoramix.unittest.hpp"
+
+#include "pi_graph.hpp"
+
+using namespace pano;
+using namespace pano::experimental;
+
+// a panorama of random colored patches that are about the same in space, the
+// patches are the cells of a tilted 3d grid cut by the unit sphere
+TEST(PIGraphTest, SegmentationOnEqualAreaGrid) {
+  auto view = CreatePanoramicView(Image3ub(256, 512));
+  const Vec3 z = normalize(Vec3(1, 2, 3));
+  Vec3 x, y;
+  std::tie(x, y) = ProposeXYDirectionsFromZDirection(z);
+  const double cellsPerUnit = 6;
+  for (auto it = view.image.begin(); it != view.image.end(); ++it) {
+    Vec3 dir = normalize(view.camera.toSpace(it.pos()));
+    std::seed_seq seeds = {int(std::floor(dir.dot(x) * cellsPerUnit)),
+                           int(std::floor(dir.dot(y) * cellsPerUnit)),
+                           int(std::floor(dir.dot(z) * cellsPerUnit))};
+    std::mt19937 rng(seeds);
+    std::uniform_int_distribution<int> channel(0, 255);
+    *it = Vec3ub(channel(rng), channel(rng), channel(rng));
+  }
+
+  Imagei segs;
+  int nsegs = SegmentationForPIGraph(view, {}, segs, DegreesToRadians(1), 0.0,
+                                     1.0, 100, 2, true);
+  ASSERT_EQ(segs.size(), view.image.size());
+  ASSERT_GT(nsegs, 0);
+
+  // areas on the sphere, and centers of the segments
+  std::vector<double> areas(nsegs, 0.0);
+  std::vector<Vec3> centers(nsegs);
+  for (auto it = segs.begin(); it != segs.end(); ++it) {
+    ASSERT_GE(*it, 0);
+    ASSERT_LT(*it, nsegs);
+    Vec3 dir = normalize(view.camera.toSpace(it.pos()));
+    double weight = sqrt(Square(dir[0]) + Square(dir[1])); // cos(latitude)
+    areas[*it] += weight;
+    centers[*it] += dir * weight;
+  }
+
+  // segments near the poles are about as large as those at the equator
+  double polarArea = 0, equatorialArea = 0;
+  int npolar = 0, nequatorial = 0;
+  for (int i = 0; i < nsegs; i++) {
+    double angle = AngleBetweenDirected(centers[i], Vec3(0, 0, 1));
+    if (angle < M_PI / 6 || angle > M_PI * 5 / 6) {
+      polarArea += areas[i];
+      npolar++;
+    } else if (angle > M_PI / 3 && angle < M_PI * 2 / 3) {
+      equatorialArea += areas[i];
+      nequatorial++;
+    }
+  }
+  ASSERT_GT(npolar, 10);
+  ASSERT_GT(nequatorial, 10);
+  polarArea /= npolar;
+  equatorialArea /= nequatorial;
+  EXPECT_LT(polarArea, equatorialArea * 1.5);
+  EXPECT_GT(polarArea, equatorialArea / 1.5);
+}
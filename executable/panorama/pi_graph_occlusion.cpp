@@ -4,6 +4,7 @@
 #include "factor_graph.hpp"
 #include "geo_context.hpp"
 #include "line_detection.hpp"
+#include "parallel.hpp"
 #include "segmentation.hpp"
 #include "utility.hpp"
 
@@ -899,71 +900,107 @@ struct LineLabelCost {
   }
 };
 
-// assume that all oclcusions are described by lines
-void DetectOcclusions(PIGraph<PanoramicCamera> &mg,
-                      double minAngleSizeOfLineInTJunction,
-                      double lambdaShrinkForHLineDetectionInTJunction,
-                      double lambdaShrinkForVLineDetectionInTJunction,
-                      double angleSizeForPixelsNearLines) {
+namespace {
+
+// collects pixels within angleSizeForPixelsNearLines from each line (with
+// their projections inside the line), and the segs they belong to with the
+// weighted local center directions and the weights
+void CollectPixelsAndSegsNearLines(
+    const PIGraph<PanoramicCamera> &mg, double angleSizeForPixelsNearLines,
+    std::vector<std::set<Pixel>> &line2nearbyPixels,
+    std::vector<std::map<int, Vec3>> &line2nearbySegsWithLocalCenterDir,
+    std::vector<std::map<int, double>> &line2nearbySegsWithWeight) {
 
   int width = mg.segs.cols;
   int height = mg.segs.rows;
+  const int concurrency = DefaultConcurrency();
 
-  RTreeMap<Vec3, std::pair<Line3, int>> lineSamplesTree;
+  // cut lines into pieces spanning sampleAngle, indexed by their centers
+  const double sampleAngle = angleSizeForPixelsNearLines / 3.0;
+  std::vector<std::pair<Vec3, std::pair<Line3, int>>> lineSamples;
   for (int i = 0; i < mg.nlines(); i++) {
     auto &line = mg.lines[i].component;
     double spanAngle = AngleBetweenDirected(line.first, line.second);
-    for (double a = 0.0; a < spanAngle;
-         a += angleSizeForPixelsNearLines / 3.0) {
+    for (double a = 0.0; a < spanAngle; a += sampleAngle) {
       Vec3 sample1 = normalize(RotateDirection(line.first, line.second, a));
-      Vec3 sample2 = normalize(RotateDirection(
-          line.first, line.second, a + angleSizeForPixelsNearLines / 3.0));
-      lineSamplesTree.emplace(normalize(sample1 + sample2),
-                              std::make_pair(Line3(sample1, sample2), i));
+      Vec3 sample2 =
+          normalize(RotateDirection(line.first, line.second, a + sampleAngle));
+      lineSamples.emplace_back(normalize(sample1 + sample2),
+                               std::make_pair(Line3(sample1, sample2), i));
     }
   }
+  DirectionMap<std::pair<Line3, int>> lineSamplesMap(
+      lineSamples.begin(), lineSamples.end(), angleSizeForPixelsNearLines);
+
+  std::vector<Vec3> dirs(width * height);
+  ParallelStride(height, concurrency, [&](int y, int) {
+    for (int x = 0; x < width; x++) {
+      dirs[y * width + x] = normalize(mg.view.camera.toSpace(Pixel(x, y)));
+    }
+  });
+
+  // a pixel near a piece is within sampleAngle / 2 more from its center
+  // d(dir, line) < angleSizeForPixelsNearLines && lambda(dir, line) \in [0, 1]
+  auto projectionRatio = [&mg](const Vec3 &dir, int line) {
+    return ProjectionOfPointOnLine(dir, normalize(mg.lines[line].component))
+        .ratio;
+  };
+  std::vector<int> offsets, sampleIds;
+  lineSamplesMap.search(
+      dirs, angleSizeForPixelsNearLines + sampleAngle / 2.0, offsets,
+      sampleIds,
+      [&dirs, &projectionRatio, angleSizeForPixelsNearLines](
+          int i, const std::pair<Vec3, std::pair<Line3, int>> &lineSample) {
+        auto dirOnLine =
+            DistanceFromPointToLine(dirs[i], lineSample.second.first)
+                .second.position;
+        return AngleBetweenDirected(dirs[i], dirOnLine) <
+                   angleSizeForPixelsNearLines &&
+               IsBetween(projectionRatio(dirs[i], lineSample.second.second),
+                         0.0, 1.0);
+      },
+      concurrency);
+
+  line2nearbyPixels.assign(mg.nlines(), std::set<Pixel>());
+  line2nearbySegsWithLocalCenterDir.assign(mg.nlines(), std::map<int, Vec3>());
+  line2nearbySegsWithWeight.assign(mg.nlines(), std::map<int, double>());
+  for (int y = 0; y < height; y++) {
+    double weight = cos((y - (height - 1) / 2.0) / (height - 1) * M_PI);
+    for (int x = 0; x < width; x++) {
+      Pixel p(x, y);
+      int i = y * width + x;
+      const Vec3 &dir = dirs[i];
+      int seg = mg.segs(p);
+      for (int k = offsets[i]; k < offsets[i + 1]; k++) {
+        int line = lineSamplesMap.entry(sampleIds[k]).second.second;
+        double lambda = projectionRatio(dir, line);
+        line2nearbyPixels[line].insert(p);
+        line2nearbySegsWithLocalCenterDir[line][seg] += dir * weight;
+        // the closer to the center, the more important it is!
+        line2nearbySegsWithWeight[line][seg] +=
+            weight * Gaussian(lambda - 0.5, 0.1);
+      }
+    }
+  }
+}
+}
+
+// assume that all oclcusions are described by lines
+void DetectOcclusions(PIGraph<PanoramicCamera> &mg,
+                      double minAngleSizeOfLineInTJunction,
+                      double lambdaShrinkForHLineDetectionInTJunction,
+                      double lambdaShrinkForVLineDetectionInTJunction,
+                      double angleSizeForPixelsNearLines) {
 
   // collect lines' nearby pixels and segs
-  std::vector<std::set<Pixel>> line2nearbyPixels(mg.nlines());
-  std::vector<std::map<int, Vec3>> line2nearbySegsWithLocalCenterDir(
-      mg.nlines());
+  std::vector<std::set<Pixel>> line2nearbyPixels;
+  std::vector<std::map<int, Vec3>> line2nearbySegsWithLocalCenterDir;
   std::vector<std::map<int, bool>> line2nearbySegsWithOnLeftFlag(mg.nlines());
-  std::vector<std::map<int, double>> line2nearbySegsWithWeight(mg.nlines());
-
-  for (auto it = mg.segs.begin(); it != mg.segs.end(); ++it) {
-    Pixel p = it.pos();
-    double weight = cos((p.y - (height - 1) / 2.0) / (height - 1) * M_PI);
-    Vec3 dir = normalize(mg.view.camera.toSpace(p));
-    int seg = *it;
-    lineSamplesTree.search(
-        BoundingBox(dir).expand(angleSizeForPixelsNearLines * 3),
-        [&mg, &dir, &line2nearbyPixels, &line2nearbySegsWithLocalCenterDir,
-         &line2nearbySegsWithWeight, angleSizeForPixelsNearLines, p, seg,
-         weight](const std::pair<Vec3, std::pair<Line3, int>> &lineSample) {
-          auto line = normalize(mg.lines[lineSample.second.second].component);
-          auto dirOnLine = DistanceFromPointToLine(dir, lineSample.second.first)
-                               .second.position;
-          double angleDist = AngleBetweenDirected(dir, dirOnLine);
-          double lambda = ProjectionOfPointOnLine(dir, line)
-                              .ratio; // the projected position on line
-          if (angleDist < angleSizeForPixelsNearLines &&
-              IsBetween(lambda, 0.0, 1.0)) {
-            line2nearbyPixels[lineSample.second.second].insert(p);
-            auto &localCenterDir =
-                line2nearbySegsWithLocalCenterDir[lineSample.second.second]
-                                                 [seg];
-            localCenterDir += dir * weight;
-            double &segWeight =
-                line2nearbySegsWithWeight[lineSample.second.second][seg];
-            segWeight +=
-                weight *
-                Gaussian(
-                    lambda - 0.5,
-                    0.1); // the closer to the center, the more important it is!
-          }
-          return true;
-        });
-  }
+  std::vector<std::map<int, double>> line2nearbySegsWithWeight;
+  CollectPixelsAndSegsNearLines(
+      mg, angleSizeForPixelsNearLines, line2nearbyPixels,
+      line2nearbySegsWithLocalCenterDir, line2nearbySegsWithWeight);
+
   for (int i = 0; i < mg.nlines(); i++) {
     auto &nearbySegsWithLocalCenterDir = line2nearbySegsWithLocalCenterDir[i];
     auto &line = mg.lines[i].component;
@@ -2158,14 +2195,28 @@ std::vector<LineSidingWeight> ComputeLinesSidingWeights2(
     std::vector<std::map<int, double>> *line2leftSegsWithWeightPtr,
     std::vector<std::map<int, double>> *line2rightSegsWithWeightPtr) {
 
-  std::vector<std::map<int, double>> line2leftSegsWithWeight(mg.nlines());
-  std::vector<std::map<int, double>> line2rightSegsWithWeight(mg.nlines());
+  // segs near lines and their weights, sorted by segs
+  std::vector<std::vector<std::pair<int, double>>> line2leftSegsWithWeight(
+      mg.nlines());
+  std::vector<std::vector<std::pair<int, double>>> line2rightSegsWithWeight(
+      mg.nlines());
 
-  for (int line = 0; line < mg.nlines(); line++) {
+  // lines are swept in parallel, each thread accumulates the weights of a
+  // line in dense per-seg arrays, and then collects the touched segs
+  const int conc = DefaultConcurrency();
+  std::vector<std::vector<double>> threadSegWeights(conc * 2);
+  std::vector<std::vector<int>> threadTouchedSegs(conc * 2);
+  std::vector<Imageub> threadMasks(conc);
+  ParallelStride(mg.nlines(), conc, [&](int line, int t) {
+    std::vector<double> *segWeights = &threadSegWeights[t * 2];
+    std::vector<int> *touchedSegs = &threadTouchedSegs[t * 2];
+    Imageub &mask = threadMasks[t];
+    segWeights[0].resize(mg.nsegs, 0.0);
+    segWeights[1].resize(mg.nsegs, 0.0);
     auto &l = mg.lines[line].component;
     int claz = mg.lines[line].claz;
     if (claz == -1) {
-      continue;
+      return;
     }
     for (int vpid = 0; vpid < mg.vps.size(); vpid++) {
       if (vpid == claz) {
@@ -2183,9 +2234,10 @@ std::vector<LineSidingWeight> ComputeLinesSidingWeights2(
                                       AngleBetweenDirected(l.second, vp));
       double sweepAngle =
           std::min(angleSizeForPixelsNearLines, lineAngleToVP - 1e-4);
-      std::vector<Vec3> sweepQuad = {normalize(l.first), normalize(l.second),
-                                     RotateDirection(l.second, vp, sweepAngle),
-                                     RotateDirection(l.first, vp, sweepAngle)};
+      std::vector<Vec3> sweepQuad = {
+          normalize(l.first), normalize(l.second),
+          RotateDirection(l.second, vp, sweepAngle),
+          RotateDirection(l.first, vp, sweepAngle)};
       Vec3 z = normalize(l.center());
       Vec3 y = normalize(normalize(l).direction());
       Vec3 x = normalize(y.cross(z));
@@ -2194,42 +2246,71 @@ std::vector<LineSidingWeight> ComputeLinesSidingWeights2(
       int h = std::ceil(
           (2 * tan(AngleBetweenDirected(l.first, l.second) / 2.0) + 0.01) *
           focal * 1.5);
-      PerspectiveCamera pc(w, h, Point2(w / 2.0, h / 2.0), focal, Origin(), z,
-                           y);
-
-      Imagei sampledSegs = MakeCameraSampler(pc, mg.view.camera)(mg.segs);
+      PerspectiveCamera pc(w, h, Point2(w / 2.0, h / 2.0), focal, Origin(),
+                           z, y);
 
       std::vector<Point2i> quadProjs(4);
       for (int i = 0; i < 4; i++) {
         quadProjs[i] = pc.toScreen(sweepQuad[i]);
-        // assert(IsBetween(quadProjs[i][0], 0));
-        // assert(IsBetween(quadProjs[i][1], 0));
         quadProjs[i][0] = BoundBetween(quadProjs[i][0], 0, w);
         quadProjs[i][1] = BoundBetween(quadProjs[i][1], 0, h);
       }
-      Imageub mask(pc.screenSize(), false);
+      mask.create(h, w);
+      mask.setTo(false);
       cv::fillConvexPoly(mask, quadProjs, true);
 
-      for (auto it = sampledSegs.begin(); it != sampledSegs.end(); ++it) {
-        if (!mask(it.pos())) {
-          continue;
+      // only pixels in the sweep quad sample mg.segs, the nearest one with
+      // replicated borders as the camera sampler does
+      auto &weights = segWeights[onLeft ? 0 : 1];
+      auto &touched = touchedSegs[onLeft ? 0 : 1];
+      const Point2 &pp = pc.principlePoint();
+      for (int py = 0; py < h; py++) {
+        const uint8_t *maskRow = mask[py];
+        for (int px = 0; px < w; px++) {
+          if (!maskRow[px]) {
+            continue;
+          }
+          Point2 p = mg.view.camera.toScreen(pc.toSpace(Point2(px, py)));
+          int seg = mg.segs(BoundBetween(cvRound(p[1]), 0, mg.segs.rows - 1),
+                            BoundBetween(cvRound(p[0]), 0, mg.segs.cols - 1));
+          double pixelDistToEyeSquared =
+              Square(px - pp[0]) + Square(py - pp[1]) + focal * focal;
+          if (weights[seg] == 0.0) {
+            touched.push_back(seg);
+          }
+          weights[seg] += 1.0 * focal * focal / pixelDistToEyeSquared;
         }
-        int seg = *it;
-        double pixelDistToEyeSquared =
-            Square(Distance(ecast<double>(it.pos()), pc.principlePoint())) +
-            focal * focal;
-        (onLeft ? line2leftSegsWithWeight
-                : line2rightSegsWithWeight)[line][seg] +=
-            1.0 * focal * focal / pixelDistToEyeSquared;
       }
     }
-  }
+
+    for (int k = 0; k < 2; k++) {
+      auto &segsWithWeight =
+          (k == 0 ? line2leftSegsWithWeight : line2rightSegsWithWeight)[line];
+      std::sort(touchedSegs[k].begin(), touchedSegs[k].end());
+      segsWithWeight.reserve(touchedSegs[k].size());
+      for (int seg : touchedSegs[k]) {
+        segsWithWeight.emplace_back(seg, segWeights[k][seg]);
+        segWeights[k][seg] = 0.0;
+      }
+      touchedSegs[k].clear();
+    }
+  });
 
   if (line2leftSegsWithWeightPtr) {
-    *line2leftSegsWithWeightPtr = line2leftSegsWithWeight;
+    line2leftSegsWithWeightPtr->resize(mg.nlines());
+    for (int line = 0; line < mg.nlines(); line++) {
+      (*line2leftSegsWithWeightPtr)[line] = std::map<int, double>(
+          line2leftSegsWithWeight[line].begin(),
+          line2leftSegsWithWeight[line].end());
+    }
   }
   if (line2rightSegsWithWeightPtr) {
-    *line2rightSegsWithWeightPtr = line2rightSegsWithWeight;
+    line2rightSegsWithWeightPtr->resize(mg.nlines());
+    for (int line = 0; line < mg.nlines(); line++) {
+      (*line2rightSegsWithWeightPtr)[line] = std::map<int, double>(
+          line2rightSegsWithWeight[line].begin(),
+          line2rightSegsWithWeight[line].end());
+    }
   }
 
   // collect lines' nearby tjunction legs
@@ -2723,66 +2804,15 @@ std::vector<std::array<std::set<int>, 2>>
 CollectSegsNearLines(const PIGraph<PanoramicCamera> &mg,
                      double angleSizeForPixelsNearLines) {
 
-  int width = mg.segs.cols;
-  int height = mg.segs.rows;
-
-  RTreeMap<Vec3, std::pair<Line3, int>> lineSamplesTree;
-  for (int i = 0; i < mg.nlines(); i++) {
-    auto &line = mg.lines[i].component;
-    double spanAngle = AngleBetweenDirected(line.first, line.second);
-    for (double a = 0.0; a < spanAngle;
-         a += angleSizeForPixelsNearLines / 3.0) {
-      Vec3 sample1 = normalize(RotateDirection(line.first, line.second, a));
-      Vec3 sample2 = normalize(RotateDirection(
-          line.first, line.second, a + angleSizeForPixelsNearLines / 3.0));
-      lineSamplesTree.emplace(normalize(sample1 + sample2),
-                              std::make_pair(Line3(sample1, sample2), i));
-    }
-  }
-
   // collect lines' nearby pixels and segs
-  std::vector<std::set<Pixel>> line2nearbyPixels(mg.nlines());
-  std::vector<std::map<int, Vec3>> line2nearbySegsWithLocalCenterDir(
-      mg.nlines());
+  std::vector<std::set<Pixel>> line2nearbyPixels;
+  std::vector<std::map<int, Vec3>> line2nearbySegsWithLocalCenterDir;
   std::vector<std::map<int, bool>> line2nearbySegsWithOnLeftFlag(mg.nlines());
-  std::vector<std::map<int, double>> line2nearbySegsWithWeight(mg.nlines());
-
-  for (auto it = mg.segs.begin(); it != mg.segs.end(); ++it) {
-    Pixel p = it.pos();
-    double weight = cos((p.y - (height - 1) / 2.0) / (height - 1) * M_PI);
-    Vec3 dir = normalize(mg.view.camera.toSpace(p));
-    int seg = *it;
-    lineSamplesTree.search(
-        BoundingBox(dir).expand(angleSizeForPixelsNearLines * 3),
-        [&mg, &dir, &line2nearbyPixels, &line2nearbySegsWithLocalCenterDir,
-         &line2nearbySegsWithWeight, angleSizeForPixelsNearLines, p, seg,
-         weight](const std::pair<Vec3, std::pair<Line3, int>> &lineSample) {
-          auto line = normalize(mg.lines[lineSample.second.second].component);
-          // d(dir, line) < angleSizeForPixelsNearLines && lambda(dir, line) \in
-          // [0, 1]
-          auto dirOnLine = DistanceFromPointToLine(dir, lineSample.second.first)
-                               .second.position;
-          double angleDist = AngleBetweenDirected(dir, dirOnLine);
-          double lambda = ProjectionOfPointOnLine(dir, line)
-                              .ratio; // the projected position on line
-          if (angleDist < angleSizeForPixelsNearLines &&
-              IsBetween(lambda, 0.0, 1.0)) {
-            line2nearbyPixels[lineSample.second.second].insert(p);
-            auto &localCenterDir =
-                line2nearbySegsWithLocalCenterDir[lineSample.second.second]
-                                                 [seg];
-            localCenterDir += dir * weight;
-            double &segWeight =
-                line2nearbySegsWithWeight[lineSample.second.second][seg];
-            segWeight +=
-                weight *
-                Gaussian(
-                    lambda - 0.5,
-                    0.1); // the closer to the center, the more important it is!
-          }
-          return true;
-        });
-  }
+  std::vector<std::map<int, double>> line2nearbySegsWithWeight;
+  CollectPixelsAndSegsNearLines(
+      mg, angleSizeForPixelsNearLines, line2nearbyPixels,
+      line2nearbySegsWithLocalCenterDir, line2nearbySegsWithWeight);
+
   for (int i = 0; i < mg.nlines(); i++) {
     auto &nearbySegsWithLocalCenterDir = line2nearbySegsWithLocalCenterDir[i];
     auto &line = mg.lines[i].component;
@@ -518,5 +518,20 @@ std::vector<Plane3> ComputeSegPlanes(const PICGDeterminablePart &dp,
   }
   return seg2planes;
 }
+
+SegPlaneTable MakeSegPlaneTable(const std::vector<Plane3> &seg2plane) {
+  SegPlaneTable table;
+  table.equations.resize(seg2plane.size());
+  table.valid.resize(seg2plane.size(), false);
+  for (int seg = 0; seg < seg2plane.size(); seg++) {
+    auto &plane = seg2plane[seg];
+    if (plane.normal == Origin() || plane.anchor.dot(plane.normal) == 0.0) {
+      continue;
+    }
+    table.equations[seg] = Plane3ToEquation(plane);
+    table.valid[seg] = true;
+  }
+  return table;
+}
 }
 }
\ No newline at end of file
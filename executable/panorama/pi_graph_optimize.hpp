@@ -1,5 +1,7 @@
 #pragma once
 
+#include "rasterization.hpp"
+
 #include "pi_graph_solve.hpp"
 
 namespace pano {
@@ -51,57 +53,77 @@ std::vector<Vec3> ComputeSegNormals(const PICGDeterminablePart &dp,
                                     const PIConstraintGraph &cg,
                                     const PIGraph<PanoramicCamera> &mg, bool smoothed);
 
+std::vector<Plane3> ComputeSegPlanes(const PICGDeterminablePart &dp,
+                                     const PIConstraintGraph &cg,
+                                     const PIGraph<PanoramicCamera> &mg, bool smoothed);
+
+// dense per segment plane table
+// - equations[seg] is the equation (ax + by + cz = 1) of the plane of seg,
+//   only meaningful if valid[seg]
+struct SegPlaneTable {
+  std::vector<Vec3> equations;
+  std::vector<uint8_t> valid;
+
+  // depth of the plane of seg along the unit direction dir
+  double depth(int seg, const Vec3 &dir) const {
+    return 1.0 / std::abs(equations[seg].dot(dir));
+  }
+};
+
+// planes with zero normals or passing the origin are invalid
+SegPlaneTable MakeSegPlaneTable(const std::vector<Plane3> &seg2plane);
+
+// the map functions below fill rows on concurrency threads, callers running
+// them in parallel already should pass 1 to keep one level of threads
+// - pixels take the segments of the panorama seen along their directions
+template <class CameraT>
+Image3d SurfaceNormalMap(const CameraT &cam,
+                         const std::vector<Vec3> &seg2normal,
+                         const PIGraph<PanoramicCamera> &mg,
+                         int concurrency = DefaultConcurrency()) {
+  Imagei segs = SampleByDirections(mg.view.camera, mg.segs,
+                                   DirectionField(cam, concurrency),
+                                   concurrency);
+  Image3d snm(segs.size());
+  ParallelStride(snm.rows, concurrency, [&](int y, int) {
+    const int *segRow = segs[y];
+    Vec3 *row = snm[y];
+    for (int x = 0; x < snm.cols; x++) {
+      row[x] = seg2normal[segRow[x]];
+    }
+  });
+  return snm;
+}
+
 template <class CameraT>
 Image3d SurfaceNormalMap(const CameraT &cam, const PICGDeterminablePart &dp,
                          const PIConstraintGraph &cg, const PIGraph<PanoramicCamera> &mg,
                          bool smoothed) {
-  auto seg2normal = ComputeSegNormals(dp, cg, mg, smoothed);
-  Image3d snm(cam.screenSize());
-  for (auto it = snm.begin(); it != snm.end(); ++it) {
-    auto p = it.pos();
-    auto dir = normalize(cam.toSpace(p));
-    auto pp = ToPixel(mg.view.camera.toScreen(dir));
-    pp.x = WrapBetween(pp.x, 0, mg.segs.cols);
-    pp.y = BoundBetween(pp.y, 0, mg.segs.rows - 1);
-    int seg = mg.segs(pp);
-    *it = seg2normal[seg];
-  }
-  return snm;
+  return SurfaceNormalMap(cam, ComputeSegNormals(dp, cg, mg, smoothed), mg);
 }
 
-std::vector<Plane3> ComputeSegPlanes(const PICGDeterminablePart &dp,
-                                     const PIConstraintGraph &cg,
-                                     const PIGraph<PanoramicCamera> &mg, bool smoothed);
-
+// seg2plane should be computed by ComputeSegPlanes
 template <class CameraT>
-Imaged SurfaceDepthMap(const CameraT &cam, const PICGDeterminablePart &dp,
-                       const PIConstraintGraph &cg, const PIGraph<PanoramicCamera> &mg,
-                       bool smoothed = true) {
-  auto seg2plane = ComputeSegPlanes(dp, cg, mg, true);
-  Imaged depths(cam.screenSize(), 0.0);
-  double minv = std::numeric_limits<double>::max();
-  double maxv = 0.0;
-  for (auto it = depths.begin(); it != depths.end(); ++it) {
-    auto pos = it.pos();
-    int seg = mg.segs(pos);
-    if (!mg.seg2control[seg].used) {
-      *it = -1;
-      continue;
-    }
-    auto &plane = seg2plane[seg];
-    if (plane.normal == Origin()) {
-      continue;
-    }
-    Vec3 dir = normalize(cam.toSpace(pos));
-    double depth = norm(Intersection(Ray3(Origin(), dir), plane));
-    if (depth < minv) {
-      minv = depth;
-    }
-    if (depth > maxv) {
-      maxv = depth;
+Imaged SurfaceDepthMap(const CameraT &cam, const SegPlaneTable &seg2plane,
+                       const PIGraph<PanoramicCamera> &mg,
+                       int concurrency = DefaultConcurrency()) {
+  Image3d dirs = DirectionField(cam, concurrency);
+  Imagei segs = SampleByDirections(mg.view.camera, mg.segs, dirs, concurrency);
+  Imaged depths(dirs.size(), 0.0);
+  ParallelStride(depths.rows, concurrency, [&](int y, int) {
+    const Vec3 *dirRow = dirs[y];
+    const int *segRow = segs[y];
+    double *row = depths[y];
+    for (int x = 0; x < depths.cols; x++) {
+      int seg = segRow[x];
+      if (!mg.seg2control[seg].used) {
+        row[x] = -1;
+      } else if (seg2plane.valid[seg]) {
+        row[x] = seg2plane.depth(seg, dirRow[x]);
+      }
     }
-    *it = depth;
-  }
+  });
+
   // fill the holes
   std::vector<double> ordered(depths.begin(), depths.end());
   ordered.erase(std::remove(ordered.begin(), ordered.end(), 0.0),
@@ -115,5 +137,13 @@ Imaged SurfaceDepthMap(const CameraT &cam, const PICGDeterminablePart &dp,
 
   return depths;
 }
+
+template <class CameraT>
+Imaged SurfaceDepthMap(const CameraT &cam, const PICGDeterminablePart &dp,
+                       const PIConstraintGraph &cg, const PIGraph<PanoramicCamera> &mg,
+                       bool smoothed = true) {
+  return SurfaceDepthMap(
+      cam, MakeSegPlaneTable(ComputeSegPlanes(dp, cg, mg, true)), mg);
+}
 }
 }
\ No newline at end of file
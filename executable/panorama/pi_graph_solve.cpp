@@ -315,14 +315,11 @@ void ReconstructLayoutAnnotation(PILayoutAnnotation &anno,
 
   int neqs = eid;
 
-  auto A1 = MakeSparseMatFromElements(neqs, nvars, A1triplets.begin(),
-                                      A1triplets.end());
-  auto A2 = MakeSparseMatFromElements(neqs, nvars, A2triplets.begin(),
-                                      A2triplets.end());
-
   matlab << "clear;";
-  matlab.setVar("A1", A1);
-  matlab.setVar("A2", A2);
+  matlab.setVar("A1",
+                misc::MXA::createSparseMatrix(neqs, nvars, A1triplets, true));
+  matlab.setVar("A2",
+                misc::MXA::createSparseMatrix(neqs, nvars, A2triplets, true));
 
   matlab << "m = size(A1, 1);"; // number of equations
   matlab << "n = size(A1, 2);"; // number of variables
@@ -519,21 +516,19 @@ double Solve(const PICGDeterminablePart &dp, PIConstraintGraph &cg,
   matlab << "clear;";
 
   int neqsA = eidA;
-  matlab.setVar("A1", MakeSparseMatFromElements(
-                          neqsA, nvars, A1triplets.begin(), A1triplets.end()));
-  matlab.setVar("A2", MakeSparseMatFromElements(
-                          neqsA, nvars, A2triplets.begin(), A2triplets.end()));
+  matlab.setVar("A1",
+                misc::MXA::createSparseMatrix(neqsA, nvars, A1triplets, true));
+  matlab.setVar("A2",
+                misc::MXA::createSparseMatrix(neqsA, nvars, A2triplets, true));
   matlab << "A1(isnan(A1)) = 0;";
   matlab << "A2(isnan(A2)) = 0;";
 
   int neqsC = eidC;
   if (neqsC != 0) {
-    matlab.setVar("C1",
-                  MakeSparseMatFromElements(neqsC, nvars, C1triplets.begin(),
-                                            C1triplets.end()));
-    matlab.setVar("C2",
-                  MakeSparseMatFromElements(neqsC, nvars, C2triplets.begin(),
-                                            C2triplets.end()));
+    matlab.setVar("C1", misc::MXA::createSparseMatrix(neqsC, nvars,
+                                                      C1triplets, true));
+    matlab.setVar("C2", misc::MXA::createSparseMatrix(neqsC, nvars,
+                                                      C2triplets, true));
   } else {
     matlab << "C1 = zeros(0, size(A1, 2));";
     matlab << "C2 = zeros(0, size(A2, 2));";
@@ -3,6 +3,7 @@
 #include "basic_types.hpp"
 #include "line_detection.hpp"
 #include "manhattan.hpp"
+#include "parallel.hpp"
 
 namespace pano {
 namespace core {
@@ -214,99 +215,289 @@ template <class T> struct IsCameraImpl {
 template <class T>
 struct IsCamera : std::integral_constant<bool, IsCameraImpl<T>::value> {};
 
+// coarse footprint of the input camera screen on the output camera screen
+// - stored as column spans of visible cellSize x cellSize cells per cell row
+// - cells are marked by testing the cell corners and by projecting samples
+//   along the input screen border, then dilated by one cell
+class ScreenFootprint {
+public:
+  ScreenFootprint() : _cellSize(1) {}
+  template <class OutCameraT, class InCameraT>
+  ScreenFootprint(const OutCameraT &outCam, const InCameraT &inCam,
+                  int cellSize = 16);
+
+  int cellSize() const { return _cellSize; }
+  // bounding rect of the footprint on the output screen
+  const cv::Rect &roi() const { return _roi; }
+  bool empty() const { return _roi.area() == 0; }
+  // pixel column spans [begin, end) that may be visible on row y
+  const std::vector<Vec2i> &spans(int y) const {
+    return _spans[y / _cellSize];
+  }
+
+private:
+  int _cellSize;
+  cv::Rect _roi;
+  std::vector<std::vector<Vec2i>> _spans;
+};
+
 // sample image from image using camera conversion
+// - the bounding roi of the footprint of the input camera on the output
+//   screen (optionally restricted to a given roi) is mapped on construction
+// - operator() maps the rest of the output screen on each call, so pixels
+//   off the footprint get the border mode values of their real projections
+// - operator() returns images of the whole output screen, sampleROI() returns
+//   images of roi() only, whose pixel (0, 0) is roi().tl() on the screen
+// - pixels the input camera cannot see are filled by the border mode,
+//   visibleROI() marks the ones it sees in the layout of sampleROI()
 template <class OutCameraT, class InCameraT> class CameraSampler {
   static_assert(IsCamera<OutCameraT>::value && IsCamera<InCameraT>::value,
                 "OutCameraT and InCameraT should both be cameras!");
 
 public:
+  // an empty roi stands for the whole output screen
   template <class OCamT, class ICamT>
-  CameraSampler(OCamT &&outCam, ICamT &&inCam)
+  CameraSampler(OCamT &&outCam, ICamT &&inCam,
+                const cv::Rect &roi = cv::Rect())
       : _outCam(std::forward<OCamT>(outCam)),
         _inCam(std::forward<ICamT>(inCam)) {
     assert(outCam.eye() == inCam.eye());
-    auto outCamSize = _outCam.screenSize();
-    _mapx = cv::Mat::zeros(outCamSize, CV_32FC1);
-    _mapy = cv::Mat::zeros(outCamSize, CV_32FC1);
-    for (int j = 0; j < outCamSize.height; j++) {
-      for (int i = 0; i < outCamSize.width; i++) {
-        Vec2 screenp(i, j);
-        Vec3 p3 = _outCam.toSpace(screenp);
-        if (!_inCam.isVisibleOnScreen(p3)) {
-          _mapx.at<float>(j, i) = -1;
-          _mapy.at<float>(j, i) = -1;
-          continue;
-        }
-        Vec2 screenpOnInCam = _inCam.toScreen(p3);
-        _mapx.at<float>(j, i) = static_cast<float>(screenpOnInCam(0));
-        _mapy.at<float>(j, i) = static_cast<float>(screenpOnInCam(1));
-      }
+    ScreenFootprint footprint(_outCam, _inCam);
+    _roi = footprint.roi();
+    if (roi.area() > 0) {
+      _roi &= roi;
+    }
+    cv::Mat mapx, mapy;
+    makeMaps(_roi, mapx, mapy);
+    _mapx = mapx;
+    _mapy = mapy;
+    _visible = Imageub::zeros(_roi.size());
+    auto inSize = _inCam.screenSize();
+    for (auto it = _visible.begin(); it != _visible.end(); ++it) {
+      Pixel pin = RoundToPixel(Point2(_mapx.at<float>(it.pos()),
+                                      _mapy.at<float>(it.pos())));
+      *it = pin.x >= 0 && pin.x < inSize.width && pin.y >= 0 &&
+            pin.y < inSize.height;
     }
   }
 
-  Image operator()(const Image &inputIm, int borderMode = cv::BORDER_REPLICATE,
-                   const cv::Scalar &borderValue = cv::Scalar(0, 0, 0,
-                                                              0)) const {
-    Image outputIm;
-    cv::remap(inputIm, outputIm, _mapx, _mapy,
-              inputIm.channels() <= 4 ? cv::INTER_LINEAR : cv::INTER_NEAREST,
-              borderMode, borderValue);
-    return outputIm;
+  const cv::Rect &roi() const { return _roi; }
+  const Imageub &visibleROI() const { return _visible; }
+
+  template <class ImageT, class... ArgTs>
+  auto operator()(const ImageT &inputIm, ArgTs &&... args) const {
+    return sample(inputIm, true, std::forward<ArgTs>(args)...);
+  }
+  template <class ImageT, class... ArgTs>
+  auto sampleROI(const ImageT &inputIm, ArgTs &&... args) const {
+    return sample(inputIm, false, std::forward<ArgTs>(args)...);
+  }
+
+private:
+  Image sample(const Image &inputIm, bool fullScreen,
+               int borderMode = cv::BORDER_REPLICATE,
+               const cv::Scalar &borderValue = cv::Scalar(0, 0, 0, 0)) const {
+    return remap(inputIm, fullScreen,
+                 inputIm.channels() <= 4 ? cv::INTER_LINEAR
+                                         : cv::INTER_NEAREST,
+                 borderMode, borderValue);
   }
 
   template <class T>
-  Image_<T> operator()(const Image_<T> &inputIm,
-                        int borderMode = cv::BORDER_REPLICATE,
-                        const T &borderValue = T()) const {
-    Image_<T> outputIm;
-    cv::remap(inputIm, outputIm, _mapx, _mapy, cv::INTER_NEAREST, borderMode,
-              borderValue);
-    return outputIm;
+  Image_<T> sample(const Image_<T> &inputIm, bool fullScreen,
+                   int borderMode = cv::BORDER_REPLICATE,
+                   const T &borderValue = T()) const {
+    return remap(inputIm, fullScreen, cv::INTER_NEAREST, borderMode,
+                 borderValue);
   }
 
   template <class T, int N, class = std::enable_if_t<(N <= 4)>>
-  Image_<Vec<T, N>>
-  operator()(const Image_<Vec<T, N>> &inputIm,
-             int borderMode = cv::BORDER_REPLICATE,
-             const Vec<T, N> &borderValue = Vec<T, N>()) const {
-    Image outputIm;
+  Image_<Vec<T, N>> sample(const Image_<Vec<T, N>> &inputIm, bool fullScreen,
+                           int borderMode = cv::BORDER_REPLICATE,
+                           const Vec<T, N> &borderValue = Vec<T, N>()) const {
     cv::Scalar bv;
     for (int i = 0; i < N; i++) {
       bv[i] = borderValue[i];
     }
-    cv::remap(inputIm, outputIm, _mapx, _mapy, cv::INTER_NEAREST, borderMode,
-              bv);
-    return outputIm;
+    return remap(inputIm, fullScreen, cv::INTER_NEAREST, borderMode, bv);
   }
 
   template <class T, int N, class = std::enable_if_t<(N > 4)>, class = void>
-  Image_<Vec<T, N>>
-  operator()(const Image_<Vec<T, N>> &inputIm,
-             int borderMode = cv::BORDER_REPLICATE,
-             const Vec<T, N> &borderValue = Vec<T, N>()) const {
+  Image_<Vec<T, N>> sample(const Image_<Vec<T, N>> &inputIm, bool fullScreen,
+                           int borderMode = cv::BORDER_REPLICATE,
+                           const Vec<T, N> &borderValue = Vec<T, N>()) const {
     std::vector<Image> channels;
     cv::split(inputIm, channels);
     for (int i = 0; i < N; i++) {
       auto &c = channels[i];
-      cv::remap(c, c, _mapx, _mapy, cv::INTER_NEAREST, borderMode,
-                borderValue[i]);
+      c = remap(c, fullScreen, cv::INTER_NEAREST, borderMode, borderValue[i]);
     }
     Image_<Vec<T, N>> result;
     cv::merge(channels, result);
     return result;
   }
 
+  Image remap(const Image &inputIm, bool fullScreen, int interpolation,
+              int borderMode, const cv::Scalar &borderValue) const {
+    if (!fullScreen) {
+      Image roiIm;
+      if (_roi.area() > 0) {
+        cv::remap(inputIm, roiIm, _mapx, _mapy, interpolation, borderMode,
+                  borderValue);
+      }
+      return roiIm;
+    }
+    cv::Mat mapx, mapy;
+    makeMaps(cv::Rect(cv::Point(0, 0), _outCam.screenSize()), mapx, mapy);
+    Image outputIm;
+    cv::remap(inputIm, outputIm, mapx, mapy, interpolation, borderMode,
+              borderValue);
+    return outputIm;
+  }
+
+  // maps the pixels of rect on the output screen to the input screen, those
+  // the input camera cannot see to (-1, -1)
+  // - pixels of the roi are copied from its maps once they exist
+  void makeMaps(const cv::Rect &rect, cv::Mat &mapx, cv::Mat &mapy) const {
+    mapx.create(rect.size(), CV_32FC1);
+    mapy.create(rect.size(), CV_32FC1);
+    for (int j = rect.y; j < rect.y + rect.height; j++) {
+      float *rowx = mapx.ptr<float>(j - rect.y);
+      float *rowy = mapy.ptr<float>(j - rect.y);
+      for (int i = rect.x; i < rect.x + rect.width; i++) {
+        float &x = rowx[i - rect.x];
+        float &y = rowy[i - rect.x];
+        if (!_mapx.empty() && _roi.contains(Pixel(i, j))) {
+          x = _mapx.at<float>(j - _roi.y, i - _roi.x);
+          y = _mapy.at<float>(j - _roi.y, i - _roi.x);
+          continue;
+        }
+        Vec2 screenp(i, j);
+        Vec3 p3 = _outCam.toSpace(screenp);
+        if (!_inCam.isVisibleOnScreen(p3)) {
+          x = y = -1;
+          continue;
+        }
+        Vec2 screenpOnInCam = _inCam.toScreen(p3);
+        x = static_cast<float>(screenpOnInCam(0));
+        y = static_cast<float>(screenpOnInCam(1));
+      }
+    }
+  }
+
 private:
   OutCameraT _outCam;
   InCameraT _inCam;
+  cv::Rect _roi;
   cv::Mat _mapx, _mapy;
+  Imageub _visible;
 };
 
 template <class OutCameraT, class InCameraT>
 CameraSampler<std::decay_t<OutCameraT>, std::decay_t<InCameraT>>
-MakeCameraSampler(OutCameraT &&outCam, InCameraT &&inCam) {
+MakeCameraSampler(OutCameraT &&outCam, InCameraT &&inCam,
+                  const cv::Rect &roi = cv::Rect()) {
   return CameraSampler<std::decay_t<OutCameraT>, std::decay_t<InCameraT>>(
-      std::forward<OutCameraT>(outCam), std::forward<InCameraT>(inCam));
+      std::forward<OutCameraT>(outCam), std::forward<InCameraT>(inCam), roi);
+}
+
+
+template <class OutCameraT, class InCameraT>
+ScreenFootprint::ScreenFootprint(const OutCameraT &outCam,
+                                 const InCameraT &inCam, int cellSize)
+    : _cellSize(std::max(cellSize, 1)) {
+  auto outSize = outCam.screenSize();
+  auto inSize = inCam.screenSize();
+  int rows = (outSize.height + _cellSize - 1) / _cellSize;
+  int cols = (outSize.width + _cellSize - 1) / _cellSize;
+  _spans.resize(std::max(rows, 0));
+  if (rows <= 0 || cols <= 0) {
+    return;
+  }
+  auto isVisible = [&inCam, &inSize](const Point3 &p3) {
+    if (!inCam.isVisibleOnScreen(p3)) {
+      return false;
+    }
+    Pixel p = RoundToPixel(inCam.toScreen(p3));
+    return p.x >= 0 && p.x < inSize.width && p.y >= 0 && p.y < inSize.height;
+  };
+
+  std::vector<uint8_t> marks(rows * cols, false);
+  auto mark = [&marks, rows, cols](int r, int c) {
+    if (r >= 0 && r < rows && c >= 0 && c < cols) {
+      marks[r * cols + c] = true;
+    }
+  };
+  // cell corners
+  for (int r = 0; r <= rows; r++) {
+    for (int c = 0; c <= cols; c++) {
+      Point2 p(std::min(c * _cellSize, outSize.width - 1),
+               std::min(r * _cellSize, outSize.height - 1));
+      if (isVisible(outCam.toSpace(p))) {
+        mark(r - 1, c - 1);
+        mark(r - 1, c);
+        mark(r, c - 1);
+        mark(r, c);
+      }
+    }
+  }
+  // input screen border and center
+  auto markInScreen = [&](const Point2 &pin) {
+    Point3 p3 = inCam.toSpace(pin);
+    if (!outCam.isVisibleOnScreen(p3)) {
+      return;
+    }
+    Pixel p = RoundToPixel(outCam.toScreen(p3));
+    mark(p.y / _cellSize, p.x / _cellSize);
+  };
+  double step = std::max(_cellSize / 2, 1);
+  for (double x = 0; x < inSize.width; x += step) {
+    markInScreen(Point2(x, 0));
+    markInScreen(Point2(x, inSize.height - 1));
+  }
+  for (double y = 0; y < inSize.height; y += step) {
+    markInScreen(Point2(0, y));
+    markInScreen(Point2(inSize.width - 1, y));
+  }
+  markInScreen(Point2(inSize.width - 1, inSize.height - 1));
+  markInScreen(Point2(inSize.width / 2.0, inSize.height / 2.0));
+
+  // dilate and collect spans
+  std::vector<uint8_t> dilated(rows * cols, false);
+  for (int r = 0; r < rows; r++) {
+    for (int c = 0; c < cols; c++) {
+      if (!marks[r * cols + c]) {
+        continue;
+      }
+      for (int rr = std::max(r - 1, 0); rr <= std::min(r + 1, rows - 1); rr++) {
+        for (int cc = std::max(c - 1, 0); cc <= std::min(c + 1, cols - 1);
+             cc++) {
+          dilated[rr * cols + cc] = true;
+        }
+      }
+    }
+  }
+  int minx = outSize.width, miny = outSize.height, maxx = 0, maxy = 0;
+  for (int r = 0; r < rows; r++) {
+    for (int c = 0; c < cols; c++) {
+      if (!dilated[r * cols + c]) {
+        continue;
+      }
+      int begin = c;
+      while (c < cols && dilated[r * cols + c]) {
+        c++;
+      }
+      Vec2i span(begin * _cellSize, std::min(c * _cellSize, outSize.width));
+      _spans[r].push_back(span);
+      minx = std::min(minx, span[0]);
+      maxx = std::max(maxx, span[1]);
+      miny = std::min(miny, r * _cellSize);
+      maxy = std::max(maxy, std::min((r + 1) * _cellSize, outSize.height));
+    }
+  }
+  if (minx < maxx && miny < maxy) {
+    _roi = cv::Rect(minx, miny, maxx - minx, maxy - miny);
+  }
 }
 
 
@@ -381,6 +572,74 @@ View<CameraT, Image_<T>> MakeView(const CameraT &c) {
   return View<CameraT, Image_<T>>(c);
 }
 
+// fused weighted average of views, rows of the output are processed in
+// parallel, each row only gathers from the views whose footprints cover it
+// - views are sampled at their nearest pixels, as the former per view remaps
+//   did: both the Image_<T> views and the float count images resolved to the
+//   nearest neighbor overloads of CameraSampler
+// - sums are kept in double, so 8 bit images do not saturate
+template <class OutCameraT, class T, class ViewAtT, class WeightAtT>
+Image_<T> CombineViews(const OutCameraT &camera, int nviews, ViewAtT viewAt,
+                       WeightAtT weightAt) {
+  static const int channels = cv::DataType<T>::channels;
+  using channel_type = typename cv::DataType<T>::channel_type;
+  auto size = camera.screenSize();
+  Image_<T> combined = Image_<T>::zeros(size);
+
+  const int conc = DefaultConcurrency();
+  std::vector<ScreenFootprint> footprints(nviews);
+  ParallelStride(nviews, conc, [&](int i, int) {
+    if (weightAt(i) != 0) {
+      footprints[i] = ScreenFootprint(camera, viewAt(i).camera);
+    }
+  });
+
+  std::vector<std::vector<double>> threadSums(conc), threadWeights(conc);
+  ParallelStride(size.height, conc, [&](int y, int t) {
+    auto &sums = threadSums[t];
+    auto &weights = threadWeights[t];
+    sums.assign(size.width * channels, 0.0);
+    weights.assign(size.width, 0.0);
+    for (int i = 0; i < nviews; i++) {
+      if (footprints[i].empty()) {
+        continue;
+      }
+      const auto &view = viewAt(i);
+      const double weight = weightAt(i);
+      const auto inSize = view.camera.screenSize();
+      for (const Vec2i &span : footprints[i].spans(y)) {
+        for (int x = span[0]; x < span[1]; x++) {
+          Point3 p3 = camera.toSpace(Point2(x, y));
+          if (!view.camera.isVisibleOnScreen(p3)) {
+            continue;
+          }
+          Pixel p = RoundToPixel(view.camera.toScreen(p3));
+          if (p.x < 0 || p.x >= inSize.width || p.y < 0 ||
+              p.y >= inSize.height) {
+            continue;
+          }
+          auto value = reinterpret_cast<const channel_type *>(&view.image(p));
+          double *sum = sums.data() + x * channels;
+          for (int c = 0; c < channels; c++) {
+            sum[c] += value[c] * weight;
+          }
+          weights[x] += weight;
+        }
+      }
+    }
+    T *row = combined[y];
+    for (int x = 0; x < size.width; x++) {
+      double weight = std::max(weights[x], 1.0);
+      auto value = reinterpret_cast<channel_type *>(row + x);
+      for (int c = 0; c < channels; c++) {
+        value[c] =
+            cv::saturate_cast<channel_type>(sums[x * channels + c] / weight);
+      }
+    }
+  });
+  return combined;
+}
+
 template <class OutCameraT, class InCameraT, class T,
           class = std::enable_if_t<IsCamera<std::decay_t<InCameraT>>::value &&
                                    IsCamera<std::decay_t<OutCameraT>>::value>>
@@ -390,22 +649,14 @@ Combine(const OutCameraT &camera,
   if (views.empty()) {
     return View<OutCameraT, Image_<T>>();
   }
-  Image_<T> converted = Image_<T>::zeros(camera.screenSize());
-  static const int channels = cv::DataType<T>::channels;
-  Imagef counts(camera.screenSize(), 0.0f);
-  for (int i = 0; i < views.size(); i++) {
-    auto sampler = MakeCameraSampler(camera, views[i].camera);
-    auto piece = sampler(views[i].image, cv::BORDER_CONSTANT);
-    converted += piece;
-    counts += sampler(Imagef::ones(views[i].image.size()), cv::BORDER_CONSTANT);
-  }
   View<OutCameraT, Image_<T>> v;
   v.camera = camera;
-  v.image = Image_<T>::zeros(camera.screenSize());
-  for (auto it = converted.begin(); it != converted.end(); ++it) {
-    float count = counts(it.pos());
-    v.image(it.pos()) = *it / std::max(count, 1.0f);
-  }
+  v.image = CombineViews<OutCameraT, T>(
+      camera, views.size(),
+      [&views](int i) -> const View<InCameraT, Image_<T>> & {
+        return views[i];
+      },
+      [](int i) { return 1.0; });
   return v;
 }
 
@@ -418,46 +669,78 @@ Combine(const OutCameraT &camera,
   if (views.empty()) {
     return View<OutCameraT, Image_<T>>();
   }
-  static const int channels = cv::DataType<T>::channels;
-  using channel_type = typename cv::DataType<T>::channel_type;
-  Image_<T> converted = Image_<T>::zeros(camera.screenSize());
-  Imagef counts(camera.screenSize(), 0.0f);
-  for (int i = 0; i < views.size(); i++) {
-    auto sampler = MakeCameraSampler(camera, views[i].component.camera);
-    auto piece = sampler(views[i].component.image, cv::BORDER_CONSTANT);
-    for (auto it = converted.begin(); it != converted.end(); ++it) {
-      *it += (piece(it.pos()) * views[i].weight());
-    }
-    counts +=
-        sampler(Imagef(views[i].component.image.size(), views[i].weight()),
-                cv::BORDER_CONSTANT);
-  }
   View<OutCameraT, Image_<T>> v;
   v.camera = camera;
-  v.image = Image_<T>::zeros(camera.screenSize());
-  for (auto it = converted.begin(); it != converted.end(); ++it) {
-    float count = counts(it.pos());
-    v.image(it.pos()) = *it / std::max(count, 1.0f);
-  }
+  v.image = CombineViews<OutCameraT, T>(
+      camera, views.size(),
+      [&views](int i) -> const View<InCameraT, Image_<T>> & {
+        return views[i].component;
+      },
+      [&views](int i) { return double(views[i].weight()); });
   return v;
 }
 
 template <class CameraT, class InCameraT, class T>
 T MeanInMask(const View<InCameraT, Image_<T>> &source,
              const View<CameraT, Imageub> &maskView) {
-  Image_<T> converted = source.sampled(maskView.camera).image;
   int votes = 0;
   T featureSum;
-  for (auto it = maskView.image.begin(); it != maskView.image.end(); ++it) {
-    if (!*it) {
+  std::vector<Pixel> maskPixels;
+  cv::findNonZero(maskView.image, maskPixels);
+  if (maskPixels.empty()) {
+    return featureSum;
+  }
+  auto sampler = MakeCameraSampler(maskView.camera, source.camera,
+                                   cv::boundingRect(maskPixels));
+  Image_<T> converted = sampler.sampleROI(source.image);
+  const cv::Rect &roi = sampler.roi();
+  const Imageub &visible = sampler.visibleROI();
+  for (const Pixel &p : maskPixels) {
+    if (!roi.contains(p) || !visible(p - roi.tl())) {
       continue;
     }
-    featureSum += converted(it.pos());
+    featureSum += converted(p - roi.tl());
     votes += 1;
   }
   return featureSum * (1.0 / std::max(votes, 1));
 }
 
+// unit directions of all pixels of the camera, rows are computed on
+// concurrency threads
+template <class CameraT>
+Image3d DirectionField(const CameraT &cam,
+                       int concurrency = DefaultConcurrency()) {
+  Image3d dirs(cam.screenSize());
+  ParallelStride(dirs.rows, concurrency, [&](int y, int) {
+    Vec3 *row = dirs[y];
+    for (int x = 0; x < dirs.cols; x++) {
+      row[x] = normalize(cam.toSpace(Pixel(x, y)));
+    }
+  });
+  return dirs;
+}
+
+// nearest pixels of a panorama seen along the directions (e.g. those of a
+// DirectionField of another camera), longitudes wrap around and latitudes
+// are clamped to the pole rows
+template <class T>
+Image_<T> SampleByDirections(const PanoramicCamera &cam, const Image_<T> &im,
+                             const Image3d &dirs,
+                             int concurrency = DefaultConcurrency()) {
+  Image_<T> sampled(dirs.size());
+  ParallelStride(dirs.rows, concurrency, [&](int y, int) {
+    const Vec3 *dirRow = dirs[y];
+    T *row = sampled[y];
+    for (int x = 0; x < dirs.cols; x++) {
+      auto p = ToPixel(cam.toScreen(dirRow[x]));
+      p.x = WrapBetween(p.x, 0, im.cols);
+      p.y = BoundBetween(p.y, 0, im.rows - 1);
+      row[x] = im(p);
+    }
+  });
+  return sampled;
+}
+
 using PerspectiveView = View<PerspectiveCamera>;
 using PanoramicView = View<PanoramicCamera>;
 using PartialPanoramicView = View<PartialPanoramicCamera>;
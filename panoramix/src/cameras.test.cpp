@@ -109,4 +109,299 @@ TEST(Camera, CameraSampler) {
 
   auto combined2 = core::Combine(panoView.camera, ppanoViews);
   gui::AsCanvas(combined2.image).show();
-}
\ No newline at end of file
+}
+namespace {
+// whether the input camera sees the output pixel, as the footprint defines it
+template <class OutCameraT, class InCameraT>
+bool SeenByInCamera(const OutCameraT &outCam, const InCameraT &inCam,
+                    const core::Pixel &p) {
+  core::Vec3 p3 = outCam.toSpace(core::Point2(p.x, p.y));
+  if (!inCam.isVisibleOnScreen(p3)) {
+    return false;
+  }
+  core::Pixel pin = core::RoundToPixel(inCam.toScreen(p3));
+  return pin.x >= 0 && pin.x < inCam.screenSize().width && pin.y >= 0 &&
+         pin.y < inCam.screenSize().height;
+}
+
+template <class OutCameraT, class InCameraT>
+void ExpectFootprintCovers(const OutCameraT &outCam, const InCameraT &inCam) {
+  core::ScreenFootprint footprint(outCam, inCam);
+  auto sz = outCam.screenSize();
+  int seen = 0;
+  for (int y = 0; y < sz.height; y++) {
+    for (int x = 0; x < sz.width; x++) {
+      if (!SeenByInCamera(outCam, inCam, core::Pixel(x, y))) {
+        continue;
+      }
+      seen++;
+      bool covered = false;
+      for (const core::Vec2i &span : footprint.spans(y)) {
+        covered |= span[0] <= x && x < span[1];
+      }
+      ASSERT_TRUE(covered) << "pixel (" << x << ", " << y << ")";
+      ASSERT_TRUE(footprint.roi().contains(core::Pixel(x, y)));
+    }
+  }
+  ASSERT_GT(seen, 0);
+}
+
+template <class OutCameraT, class InCameraT>
+void ExpectROISamplingIsCrop(const OutCameraT &outCam,
+                             const InCameraT &inCam) {
+  auto insz = inCam.screenSize();
+  core::Image3ub im(insz);
+  cv::randu(im, cv::Scalar::all(0), cv::Scalar::all(255));
+
+  auto fullSampler = core::MakeCameraSampler(outCam, inCam);
+  // a roi sticking out of the footprint on the top left, so both sampled and
+  // unseen pixels are compared
+  const cv::Rect &fr = fullSampler.roi();
+  cv::Rect roi(fr.x - fr.width / 4, fr.y - fr.height / 4, fr.width / 2,
+               fr.height / 2);
+  auto roiSampler = core::MakeCameraSampler(outCam, inCam, roi);
+  const cv::Rect &r = roiSampler.roi();
+  ASSERT_GT(r.area(), 0);
+  ASSERT_EQ(r, r & roi);
+  ASSERT_EQ(r, r & fullSampler.roi());
+
+  core::Image3ub full = fullSampler(im);
+  core::Image3ub part = roiSampler.sampleROI(im);
+  ASSERT_EQ(r.size(), part.size());
+  ASSERT_EQ(0, cv::norm(full(r), part, cv::NORM_INF));
+
+  // the visibility masks agree and match the definition pixel by pixel
+  cv::Rect rInFull = r - fullSampler.roi().tl();
+  ASSERT_EQ(0, cv::norm(fullSampler.visibleROI()(rInFull),
+                        roiSampler.visibleROI(), cv::NORM_INF));
+  for (int y = 0; y < r.height; y++) {
+    for (int x = 0; x < r.width; x++) {
+      core::Pixel p(x + r.x, y + r.y);
+      ASSERT_EQ(SeenByInCamera(outCam, inCam, p),
+                roiSampler.visibleROI()(y, x) != 0);
+    }
+  }
+}
+
+// the maps of the sampler before footprints, over the whole output screen
+template <class OutCameraT, class InCameraT>
+void MakeFullScreenMaps(const OutCameraT &outCam, const InCameraT &inCam,
+                        cv::Mat &mapx, cv::Mat &mapy) {
+  auto sz = outCam.screenSize();
+  mapx.create(sz, CV_32FC1);
+  mapy.create(sz, CV_32FC1);
+  for (int y = 0; y < sz.height; y++) {
+    for (int x = 0; x < sz.width; x++) {
+      core::Vec3 p3 = outCam.toSpace(core::Point2(x, y));
+      if (!inCam.isVisibleOnScreen(p3)) {
+        mapx.at<float>(y, x) = mapy.at<float>(y, x) = -1;
+        continue;
+      }
+      core::Point2 q = inCam.toScreen(p3);
+      mapx.at<float>(y, x) = static_cast<float>(q[0]);
+      mapy.at<float>(y, x) = static_cast<float>(q[1]);
+    }
+  }
+}
+
+template <class OutCameraT, class InCameraT, class T>
+core::Image_<T> FullScreenSample(const OutCameraT &outCam,
+                                 const InCameraT &inCam,
+                                 const core::Image_<T> &im) {
+  cv::Mat mapx, mapy;
+  MakeFullScreenMaps(outCam, inCam, mapx, mapy);
+  core::Image_<T> sampled;
+  cv::remap(im, sampled, mapx, mapy, cv::INTER_NEAREST, cv::BORDER_REPLICATE);
+  return sampled;
+}
+
+template <class OutCameraT, class InCameraT>
+void ExpectSamplingAsFullScreen(const OutCameraT &outCam,
+                                const InCameraT &inCam) {
+  core::Image3ub im(inCam.screenSize());
+  cv::randu(im, cv::Scalar::all(0), cv::Scalar::all(255));
+  core::Imagei ids(inCam.screenSize());
+  cv::randu(ids, cv::Scalar(0), cv::Scalar(1000));
+
+  auto sampler = core::MakeCameraSampler(outCam, inCam);
+  core::Image3ub expected = FullScreenSample(outCam, inCam, im);
+  core::Image3ub sampled = sampler(im);
+  ASSERT_EQ(expected.size(), sampled.size());
+  ASSERT_EQ(0, cv::norm(expected, sampled, cv::NORM_INF));
+  core::Image3ub roiSampled = sampler.sampleROI(im);
+  ASSERT_EQ(0, cv::norm(expected(sampler.roi()), roiSampled, cv::NORM_INF));
+
+  core::Imagei expectedIds = FullScreenSample(outCam, inCam, ids);
+  core::Imagei sampledIds = sampler(ids);
+  ASSERT_EQ(0, cv::norm(expectedIds, sampledIds, cv::NORM_INF));
+}
+}
+
+TEST(Camera, ScreenFootprintCoversProjection) {
+  core::PanoramicCamera panoCam(1000 / M_PI / 2.0);
+  float camPositions[4][3] = {{1, 0, 0}, {0, 1, 0}, {-1, 0.3, 0}, {0, -1, 1}};
+  for (int i = 0; i < 4; i++) {
+    core::Point3 center(camPositions[i][0], camPositions[i][1],
+                        camPositions[i][2]);
+    core::PerspectiveCamera perspCam(500, 600, core::Point2(250, 300), 150,
+                                     core::Point3(0, 0, 0), center,
+                                     core::Vec3(0, 0, -1));
+    ExpectFootprintCovers(panoCam, perspCam);
+    ExpectFootprintCovers(perspCam, panoCam);
+    core::PartialPanoramicCamera ppanoCam(500, 600, 250, core::Point3(0, 0, 0),
+                                          center, panoCam.up());
+    ExpectFootprintCovers(panoCam, ppanoCam);
+  }
+}
+
+TEST(Camera, CameraSamplerROIIsCropOfFullScreen) {
+  core::PanoramicCamera panoCam(1000 / M_PI / 2.0);
+  core::PerspectiveCamera perspCam(500, 600, core::Point2(250, 300), 150,
+                                   core::Point3(0, 0, 0),
+                                   core::Point3(1, 0.2, 0.1),
+                                   core::Vec3(0, 0, -1));
+  ExpectROISamplingIsCrop(panoCam, perspCam);
+  ExpectROISamplingIsCrop(perspCam, panoCam);
+  core::PartialPanoramicCamera ppanoCam(500, 600, 250, core::Point3(0, 0, 0),
+                                        core::Point3(0, 1, 0), panoCam.up());
+  ExpectROISamplingIsCrop(panoCam, ppanoCam);
+}
+
+TEST(Camera, SampleByDirections) {
+  // the octant of a direction as a label
+  auto octant = [](const core::Vec3 &d) {
+    return (d[0] > 0 ? 1 : 0) + (d[1] > 0 ? 2 : 0) + (d[2] > 0 ? 4 : 0);
+  };
+  core::PanoramicCamera panoCam(50);
+  core::Imagei labels(panoCam.screenSize());
+  for (auto it = labels.begin(); it != labels.end(); ++it) {
+    *it = octant(panoCam.toSpace(it.pos()));
+  }
+  // cameras both larger and smaller than the panorama
+  std::vector<core::PerspectiveCamera> perspCams = {
+      core::PerspectiveCamera(640, 480, core::Point2(320, 240), 200,
+                              core::Point3(0, 0, 0), core::Point3(1, 1, 0.5),
+                              core::Vec3(0, 0, 1)),
+      core::PerspectiveCamera(120, 90, core::Point2(60, 45), 50,
+                              core::Point3(0, 0, 0),
+                              core::Point3(-1, 0.3, -0.8),
+                              core::Vec3(0, 0, 1))};
+  auto expectLabels = [&](const core::Image3d &dirs) {
+    core::Imagei sampled = core::SampleByDirections(panoCam, labels, dirs);
+    ASSERT_EQ(dirs.size(), sampled.size());
+    for (auto it = dirs.begin(); it != dirs.end(); ++it) {
+      const core::Vec3 &d = *it;
+      // pixels near the octant borders may round to either side
+      if (std::abs(d[0]) < 0.05 || std::abs(d[1]) < 0.05 ||
+          std::abs(d[2]) < 0.05) {
+        continue;
+      }
+      ASSERT_EQ(octant(d), sampled(it.pos()));
+    }
+  };
+  for (auto &cam : perspCams) {
+    core::Image3d dirs = core::DirectionField(cam);
+    ASSERT_EQ(cam.screenSize(), dirs.size());
+    expectLabels(dirs);
+  }
+  expectLabels(core::DirectionField(core::PanoramicCamera(100)));
+}
+
+TEST(Camera, CameraSamplerMatchesFullScreenMaps) {
+  core::PanoramicCamera panoCam(1000 / M_PI / 2.0);
+  // looking aside, so many front facing pixels of one perspective camera
+  // fall off the screen of the other and take the replicated border
+  core::PerspectiveCamera perspCam1(500, 600, core::Point2(250, 300), 150,
+                                    core::Point3(0, 0, 0),
+                                    core::Point3(1, 0.2, 0.1),
+                                    core::Vec3(0, 0, -1));
+  core::PerspectiveCamera perspCam2(400, 300, core::Point2(200, 150), 200,
+                                    core::Point3(0, 0, 0),
+                                    core::Point3(1, 0.8, -0.2),
+                                    core::Vec3(0, 0, -1));
+  core::PartialPanoramicCamera ppanoCam(500, 600, 250, core::Point3(0, 0, 0),
+                                        core::Point3(0, 1, 0), panoCam.up());
+  ExpectSamplingAsFullScreen(panoCam, perspCam1);
+  ExpectSamplingAsFullScreen(perspCam1, panoCam);
+  ExpectSamplingAsFullScreen(perspCam1, perspCam2);
+  ExpectSamplingAsFullScreen(perspCam2, perspCam1);
+  ExpectSamplingAsFullScreen(panoCam, ppanoCam);
+}
+
+namespace {
+// the former Combine, a remap of each view and of its weights, with the sums
+// in double instead of saturating in T
+template <class OutCameraT, class InCameraT, class T>
+core::Image_<T>
+CombineByRemaps(const OutCameraT &camera,
+                const std::vector<core::View<InCameraT, core::Image_<T>>> &views,
+                const std::vector<double> &weights) {
+  static const int channels = cv::DataType<T>::channels;
+  auto sz = camera.screenSize();
+  cv::Mat sums = cv::Mat::zeros(sz, CV_64FC(channels));
+  cv::Mat counts = cv::Mat::zeros(sz, CV_64FC1);
+  for (int i = 0; i < views.size(); i++) {
+    cv::Mat mapx, mapy, im, piece, count;
+    MakeFullScreenMaps(camera, views[i].camera, mapx, mapy);
+    views[i].image.convertTo(im, CV_64F);
+    cv::remap(im, piece, mapx, mapy, cv::INTER_NEAREST, cv::BORDER_CONSTANT);
+    cv::remap(cv::Mat::ones(im.size(), CV_64FC1), count, mapx, mapy,
+              cv::INTER_NEAREST, cv::BORDER_CONSTANT);
+    sums += piece * weights[i];
+    counts += count * weights[i];
+  }
+  counts = cv::max(counts, 1.0);
+  std::vector<cv::Mat> countChannels(channels, counts);
+  cv::Mat divisors;
+  cv::merge(countChannels, divisors);
+  core::Image_<T> combined;
+  cv::Mat(sums / divisors).convertTo(combined, cv::DataType<T>::depth);
+  return combined;
+}
+
+// a view whose pixels are colored by their directions, so views agree on
+// every direction they share
+core::View<core::PerspectiveCamera, core::Image3ub>
+DirectionColoredView(const core::PerspectiveCamera &cam) {
+  core::Image3ub im(cam.screenSize());
+  for (auto it = im.begin(); it != im.end(); ++it) {
+    core::Vec3 d = core::normalize(cam.toSpace(it.pos()));
+    for (int c = 0; c < 3; c++) {
+      (*it)[c] = cv::saturate_cast<uint8_t>(128 + 100 * d[c]);
+    }
+  }
+  return core::MakeView(im, cam);
+}
+}
+
+TEST(Camera, CombineAsPerViewRemaps) {
+  // the first view covers the whole output, the others overlap it partly
+  float centers[3][3] = {{1, 0, 0}, {1, 0.6, 0}, {1, -0.4, 0.5}};
+  std::vector<core::View<core::PerspectiveCamera, core::Image3ub>> views;
+  std::vector<core::Weighted<decltype(views)::value_type, double>>
+      weightedViews;
+  for (int i = 0; i < 3; i++) {
+    core::PerspectiveCamera cam(
+        500, 600, core::Point2(250, 300), 150, core::Point3(0, 0, 0),
+        core::Point3(centers[i][0], centers[i][1], centers[i][2]),
+        core::Vec3(0, 0, -1));
+    views.push_back(DirectionColoredView(cam));
+    weightedViews.push_back(core::WeightAs(views.back(), i + 1.0));
+  }
+  core::PerspectiveCamera outCam(200, 150, core::Point2(100, 75), 200,
+                                 core::Point3(0, 0, 0),
+                                 core::Point3(1, 0.1, 0.05),
+                                 core::Vec3(0, 0, -1));
+
+  // projections are rounded in double here and in float by remap, which
+  // may pick a neighbor of the pixel, so a few levels of difference are
+  // allowed
+  core::Image3ub combined = core::Combine(outCam, views).image;
+  core::Image3ub expected = CombineByRemaps(outCam, views, {1.0, 1.0, 1.0});
+  ASSERT_EQ(expected.size(), combined.size());
+  EXPECT_LE(cv::norm(expected, combined, cv::NORM_INF), 3);
+
+  core::Image3ub weighted = core::Combine(outCam, weightedViews).image;
+  expected = CombineByRemaps(outCam, views, {1.0, 2.0, 3.0});
+  EXPECT_LE(cv::norm(expected, weighted, cv::NORM_INF), 3);
+}
@@ -1,11 +1,14 @@
 #pragma once
 
 #include <memory>
+#include <thread>
+#include <unordered_map>
 
 #include "basic_types.hpp"
 #include "handle.hpp"
 #include "iterators.hpp"
 #include "meta.hpp"
+#include "parallel.hpp"
 #include "utility.hpp"
 
 namespace pano {
@@ -118,6 +121,186 @@ private:
   size_t _nelements;
 };
 
+// PackedRTree
+// - a static rtree bulk loaded by Sort-Tile-Recursive packing
+// - items and nodes are stored in contiguous arrays level by level, searching
+//   does no allocation
+template <class T, class BoxT> class PackedRTree {
+public:
+  using BoxType = BoxT;
+  using ValueType = typename BoxType::Type;
+  static const int Dimension = BoxType::Dimension;
+  static const int NodeCapacity = 16;
+
+  PackedRTree() : _leafNodesNum(0) {}
+  template <class IterT, class BoundingBoxFunctorT>
+  PackedRTree(IterT begin, IterT end, BoundingBoxFunctorT &&bboxFun);
+
+public:
+  size_t size() const { return _items.size(); }
+  bool empty() const { return _items.empty(); }
+  void clear() {
+    _items.clear();
+    _itemBoxes.clear();
+    _nodes.clear();
+    _leafNodesNum = 0;
+  }
+
+  // callback(const T &) returns false to stop searching, returns the number of
+  // visited items
+  template <class CallbackFunctorT>
+  int search(const BoxType &b, CallbackFunctorT &&callback) const {
+    int foundCount = 0;
+    if (!_nodes.empty()) {
+      searchNode(_nodes.size() - 1, b, foundCount, callback);
+    }
+    return foundCount;
+  }
+
+private:
+  struct Node {
+    BoxType box;
+    int first, count; // children range in _items (leaves) or _nodes
+  };
+
+  static bool Overlap(const BoxType &a, const BoxType &b) {
+    for (int i = 0; i < Dimension; i++) {
+      if (a.minCorner[i] > b.maxCorner[i] || b.minCorner[i] > a.maxCorner[i]) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // sorts boxes[first, last) into tiles of NodeCapacity
+  template <class BoxGetterT>
+  static void SortTileRecursive(int *first, int *last, int dim,
+                                const BoxGetterT &box);
+
+  template <class CallbackFunctorT>
+  bool searchNode(int nodeId, const BoxType &b, int &foundCount,
+                  CallbackFunctorT &callback) const;
+
+private:
+  std::vector<T> _items;
+  std::vector<BoxType> _itemBoxes;
+  std::vector<Node> _nodes;
+  int _leafNodesNum;
+};
+
+// PackedRTree
+template <class T, class BoxT> const int PackedRTree<T, BoxT>::Dimension;
+template <class T, class BoxT> const int PackedRTree<T, BoxT>::NodeCapacity;
+
+template <class T, class BoxT>
+template <class IterT, class BoundingBoxFunctorT>
+PackedRTree<T, BoxT>::PackedRTree(IterT begin, IterT end,
+                                  BoundingBoxFunctorT &&bboxFun)
+    : _leafNodesNum(0) {
+  std::vector<T> items(begin, end);
+  std::vector<BoxType> boxes;
+  boxes.reserve(items.size());
+  for (auto &item : items) {
+    boxes.push_back(bboxFun(item));
+  }
+
+  // leaves
+  std::vector<int> order(items.size());
+  std::iota(order.begin(), order.end(), 0);
+  SortTileRecursive(order.data(), order.data() + order.size(), 0,
+                    [&boxes](int i) -> const BoxType & { return boxes[i]; });
+  _items.reserve(items.size());
+  _itemBoxes.reserve(items.size());
+  for (int i : order) {
+    _items.push_back(std::move(items[i]));
+    _itemBoxes.push_back(boxes[i]);
+  }
+  for (int first = 0; first < _items.size(); first += NodeCapacity) {
+    Node node;
+    node.first = first;
+    node.count = std::min<int>(NodeCapacity, _items.size() - first);
+    for (int i = first; i < first + node.count; i++) {
+      node.box |= _itemBoxes[i];
+    }
+    _nodes.push_back(node);
+  }
+  _leafNodesNum = _nodes.size();
+
+  // upper levels, each one packs the previous level into parents
+  int levelFirst = 0;
+  while (_nodes.size() - levelFirst > 1) {
+    int levelLast = _nodes.size();
+    order.resize(levelLast - levelFirst);
+    std::iota(order.begin(), order.end(), levelFirst);
+    SortTileRecursive(
+        order.data(), order.data() + order.size(), 0,
+        [this](int i) -> const BoxType & { return _nodes[i].box; });
+    std::vector<Node> level(order.size());
+    for (int i = 0; i < order.size(); i++) {
+      level[i] = _nodes[order[i]];
+    }
+    std::copy(level.begin(), level.end(), _nodes.begin() + levelFirst);
+    for (int first = levelFirst; first < levelLast; first += NodeCapacity) {
+      Node node;
+      node.first = first;
+      node.count = std::min(NodeCapacity, levelLast - first);
+      for (int i = first; i < first + node.count; i++) {
+        node.box |= _nodes[i].box;
+      }
+      _nodes.push_back(node);
+    }
+    levelFirst = levelLast;
+  }
+}
+
+template <class T, class BoxT>
+template <class BoxGetterT>
+void PackedRTree<T, BoxT>::SortTileRecursive(int *first, int *last, int dim,
+                                             const BoxGetterT &box) {
+  auto byCenter = [&box, dim](int a, int b) {
+    return box(a).minCorner[dim] + box(a).maxCorner[dim] <
+           box(b).minCorner[dim] + box(b).maxCorner[dim];
+  };
+  std::sort(first, last, byCenter);
+  int n = last - first;
+  if (dim == Dimension - 1 || n <= NodeCapacity) {
+    return;
+  }
+  int tilesNum = (n + NodeCapacity - 1) / NodeCapacity;
+  int slicesNum =
+      int(std::ceil(std::pow(double(tilesNum), 1.0 / (Dimension - dim))));
+  int sliceSize = NodeCapacity * ((tilesNum + slicesNum - 1) / slicesNum);
+  for (int *sliceFirst = first; sliceFirst < last; sliceFirst += sliceSize) {
+    SortTileRecursive(sliceFirst, std::min(sliceFirst + sliceSize, last),
+                      dim + 1, box);
+  }
+}
+
+template <class T, class BoxT>
+template <class CallbackFunctorT>
+bool PackedRTree<T, BoxT>::searchNode(int nodeId, const BoxType &b,
+                                      int &foundCount,
+                                      CallbackFunctorT &callback) const {
+  const Node &node = _nodes[nodeId];
+  if (nodeId < _leafNodesNum) {
+    for (int i = node.first; i < node.first + node.count; i++) {
+      if (Overlap(b, _itemBoxes[i])) {
+        ++foundCount;
+        if (!callback(_items[i])) {
+          return false;
+        }
+      }
+    }
+  } else {
+    for (int i = node.first; i < node.first + node.count; i++) {
+      if (Overlap(b, _nodes[i].box) &&
+          !searchNode(i, b, foundCount, callback)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
 
 // RTreeSet
 template <class T, class BoundingBoxFunctorT = DefaultBoundingBoxFunctor>
@@ -132,18 +315,19 @@ public:
       : _rtree(std::make_unique<third_party::RTree<T, ValueType, Dimension>>()),
         _bbox(bboxFun) {}
 
+  // bulk loads the elements, later insertions go to a dynamic rtree
   template <class IterT>
   RTreeSet(IterT begin, IterT end,
            const BoundingBoxFunctorT &bboxFun = BoundingBoxFunctorT())
       : _rtree(std::make_unique<third_party::RTree<T, ValueType, Dimension>>()),
-        _bbox(bboxFun) {
-    insert(begin, end);
-  }
+        _packed(begin, end, bboxFun), _bbox(bboxFun) {}
 
   RTreeSet(RTreeSet &&r)
-      : _rtree(std::move(r._rtree)), _bbox(std::move(r._bbox)) {}
+      : _rtree(std::move(r._rtree)), _packed(std::move(r._packed)),
+        _bbox(std::move(r._bbox)) {}
   RTreeSet &operator=(RTreeSet &&r) {
     _rtree = std::move(r._rtree);
+    _packed = std::move(r._packed);
     _bbox = std::move(r._bbox);
     return *this;
   }
@@ -152,13 +336,16 @@ public:
   RTreeSet &operator=(const RTreeSet &) = delete;
 
 public:
-  size_t size() const { return _rtree->Count(); }
+  size_t size() const { return _packed.size() + _rtree->Count(); }
   bool empty() const { return size() == 0; }
 
-  void clear() { return _rtree->RemoveAll(); }
+  void clear() {
+    _packed.clear();
+    _rtree->RemoveAll();
+  }
 
   void insert(const T &t) {
-    auto box = bbox(t);
+    auto box = _bbox(t);
     _rtree->Insert(box.minCorner.val, box.maxCorner.val, t);
   }
 
@@ -171,15 +358,22 @@ public:
 
   template <class CallbackFunctorT>
   int search(const BoxType &b, CallbackFunctorT &&callback) const {
-    return _rtree->Search(b.minCorner.val, b.maxCorner.val, callback);
+    bool stopped = false;
+    int foundCount = _packed.search(b, [&callback, &stopped](const T &t) {
+      return !(stopped = !callback(t));
+    });
+    if (!stopped) {
+      foundCount += _rtree->Search(b.minCorner.val, b.maxCorner.val, callback);
+    }
+    return foundCount;
   }
   int count(const BoxType &b) const {
-    return _rtree->Search(b.minCorner.val, b.maxCorner.val,
-                          StaticConstantFunctor<bool, true>());
+    return search(b, StaticConstantFunctor<bool, true>());
   }
 
 private:
   std::unique_ptr<third_party::RTree<T, ValueType, Dimension>> _rtree;
+  PackedRTree<T, BoxType> _packed;
   BoundingBoxFunctorT _bbox;
 };
 
@@ -198,19 +392,24 @@ public:
                third_party::RTree<std::pair<T, ValT>, ValueType, Dimension>>()),
         _bbox(bboxFun) {}
 
+  // bulk loads the key-value pairs, later insertions go to a dynamic rtree
   template <class IterT>
   RTreeMap(IterT begin, IterT end,
            const BoundingBoxFunctorT &bboxFun = BoundingBoxFunctorT())
       : _rtree(std::make_unique<
                third_party::RTree<std::pair<T, ValT>, ValueType, Dimension>>()),
-        _bbox(bboxFun) {
-    insert(begin, end);
-  }
+        _packed(begin, end,
+                [&bboxFun](const std::pair<T, ValT> &p) {
+                  return bboxFun(p.first);
+                }),
+        _bbox(bboxFun) {}
 
   RTreeMap(RTreeMap &&r)
-      : _rtree(std::move(r._rtree)), _bbox(std::move(r._bbox)) {}
+      : _rtree(std::move(r._rtree)), _packed(std::move(r._packed)),
+        _bbox(std::move(r._bbox)) {}
   RTreeMap &operator=(RTreeMap &&r) {
     _rtree = std::move(r._rtree);
+    _packed = std::move(r._packed);
     _bbox = std::move(r._bbox);
     return *this;
   }
@@ -219,10 +418,13 @@ public:
   RTreeMap &operator=(const RTreeMap &) = delete;
 
 public:
-  size_t size() const { return _rtree->Count(); }
+  size_t size() const { return _packed.size() + _rtree->Count(); }
   bool empty() const { return size() == 0; }
 
-  void clear() { return _rtree->RemoveAll(); }
+  void clear() {
+    _packed.clear();
+    _rtree->RemoveAll();
+  }
 
   void insert(const std::pair<T, ValT> &p) {
     auto box = _bbox(p.first);
@@ -243,19 +445,181 @@ public:
 
   template <class CallbackFunctorT>
   int search(const BoxType &b, CallbackFunctorT &&callback) const {
-    return _rtree->Search(b.minCorner.val, b.maxCorner.val, callback);
+    bool stopped = false;
+    int foundCount = _packed.search(
+        b, [&callback, &stopped](const std::pair<T, ValT> &p) {
+          return !(stopped = !callback(p));
+        });
+    if (!stopped) {
+      foundCount += _rtree->Search(b.minCorner.val, b.maxCorner.val, callback);
+    }
+    return foundCount;
   }
   int count(const BoxType &b) const {
-    return _rtree->Search(b.minCorner.val, b.maxCorner.val,
-                          StaticConstantFunctor<bool, true>());
+    return search(b, StaticConstantFunctor<bool, true>());
   }
 
 private:
   std::unique_ptr<third_party::RTree<std::pair<T, ValT>, ValueType, Dimension>>
       _rtree;
+  PackedRTree<std::pair<T, ValT>, BoxType> _packed;
   BoundingBoxFunctorT _bbox;
 };
 
+// DirectionMap
+// - maps unit directions to values, directions are hashed into a uniform 3d
+//   grid with cells of cellAngle wide so a search within angle only visits
+//   cells within ceil(angle / cellAngle) steps around the query direction
+template <class ValT> class DirectionMap {
+public:
+  using EntryType = std::pair<Vec3, ValT>;
+
+  explicit DirectionMap(double cellAngle)
+      : _cellSize(cellAngle), _res(int(std::ceil(2.0 / cellAngle)) + 3) {
+    assert(cellAngle > 0);
+  }
+  template <class IterT>
+  DirectionMap(IterT begin, IterT end, double cellAngle)
+      : DirectionMap(cellAngle) {
+    insert(begin, end);
+  }
+
+public:
+  size_t size() const { return _entries.size(); }
+  bool empty() const { return _entries.empty(); }
+  void clear() {
+    _entries.clear();
+    _cells.clear();
+  }
+
+  const EntryType &entry(int id) const { return _entries[id]; }
+
+  void insert(const EntryType &e) {
+    _cells[cellKey(cellOf(e.first))].push_back(_entries.size());
+    _entries.push_back(e);
+  }
+  void emplace(const Vec3 &dir, const ValT &val) {
+    insert(std::make_pair(dir, val));
+  }
+  template <class IterT> void insert(IterT begin, IterT end) {
+    while (begin != end) {
+      insert(*begin);
+      ++begin;
+    }
+  }
+
+  // callback(const EntryType &) is called for entries within angle from dir,
+  // returns false to stop, returns the number of visited entries
+  template <class CallbackFunctorT>
+  int search(const Vec3 &dir, double angle,
+             CallbackFunctorT &&callback) const {
+    int foundCount = 0;
+    forEachIdNear(dir, angle, [this, &dir, angle, &foundCount,
+                               &callback](int id) {
+      if (AngleBetweenDirected(dir, _entries[id].first) > angle) {
+        return true;
+      }
+      ++foundCount;
+      return bool(callback(_entries[id]));
+    });
+    return foundCount;
+  }
+  bool contains(const Vec3 &dir, double angle) const {
+    return search(dir, angle, StaticConstantFunctor<bool, false>()) > 0;
+  }
+
+  // batched search, the ids of entries within angle from dirs[i] and accepted
+  // by filter(i, entry) are stored in entryIds[offsets[i], offsets[i + 1])
+  // - queries are split among threads, filter is called concurrently
+  template <class FilterT>
+  void search(const std::vector<Vec3> &dirs, double angle,
+              std::vector<int> &offsets, std::vector<int> &entryIds,
+              FilterT &&filter,
+              int concurrency = std::thread::hardware_concurrency()) const;
+
+private:
+  Vec3i cellOf(const Vec3 &v) const {
+    return Vec3i(int(std::floor((v[0] + 1.0) / _cellSize)) + 1,
+                 int(std::floor((v[1] + 1.0) / _cellSize)) + 1,
+                 int(std::floor((v[2] + 1.0) / _cellSize)) + 1);
+  }
+  int64_t cellKey(const Vec3i &c) const {
+    return (int64_t(c[0]) * _res + c[1]) * _res + c[2];
+  }
+  template <class FunT>
+  void forEachIdNear(const Vec3 &dir, double angle, FunT &&fun) const;
+
+private:
+  double _cellSize;
+  int64_t _res;
+  std::vector<EntryType> _entries;
+  std::unordered_map<int64_t, std::vector<int>> _cells;
+};
+
+template <class ValT>
+template <class FilterT>
+void DirectionMap<ValT>::search(const std::vector<Vec3> &dirs, double angle,
+                                std::vector<int> &offsets,
+                                std::vector<int> &entryIds, FilterT &&filter,
+                                int concurrency) const {
+  const int n = dirs.size();
+  concurrency = std::max(1, std::min(concurrency, n));
+  // each thread handles a contiguous chunk of queries
+  const int chunkSize = (n + concurrency - 1) / concurrency;
+  std::vector<std::vector<int>> chunkIds(concurrency);
+  offsets.assign(n + 1, 0);
+  ParallelRun(concurrency, concurrency, [&](int t) {
+    auto &ids = chunkIds[t];
+    for (int i = t * chunkSize; i < std::min(n, (t + 1) * chunkSize); i++) {
+      search(dirs[i], angle, [&filter, &ids, this, i](const EntryType &e) {
+        if (filter(i, e)) {
+          ids.push_back(&e - _entries.data());
+        }
+        return true;
+      });
+      offsets[i + 1] = ids.size();
+    }
+  });
+  // make offsets global
+  entryIds.clear();
+  for (int t = 0; t < concurrency; t++) {
+    int base = entryIds.size();
+    for (int i = t * chunkSize; i < std::min(n, (t + 1) * chunkSize); i++) {
+      offsets[i + 1] += base;
+    }
+    entryIds.insert(entryIds.end(), chunkIds[t].begin(), chunkIds[t].end());
+  }
+}
+
+template <class ValT>
+template <class FunT>
+void DirectionMap<ValT>::forEachIdNear(const Vec3 &dir, double angle,
+                                       FunT &&fun) const {
+  // the chord is never longer than the arc
+  const int r = std::max(1, int(std::ceil(angle / _cellSize)));
+  const Vec3i c = cellOf(dir);
+  Vec3i lo, hi;
+  for (int k = 0; k < 3; k++) {
+    lo[k] = std::max<int>(c[k] - r, 0);
+    hi[k] = std::min<int>(c[k] + r, _res - 1);
+  }
+  for (int x = lo[0]; x <= hi[0]; x++) {
+    for (int y = lo[1]; y <= hi[1]; y++) {
+      for (int z = lo[2]; z <= hi[2]; z++) {
+        auto it = _cells.find(cellKey(Vec3i(x, y, z)));
+        if (it == _cells.end()) {
+          continue;
+        }
+        for (int id : it->second) {
+          if (!fun(id)) {
+            return;
+          }
+        }
+      }
+    }
+  }
+}
+
 // simple RTree
 template <class BoxT, class T> class RTree {
 public:
@@ -20,6 +20,75 @@ TEST(ContainerTest, RTreeWrapperLargeData) {
   EXPECT_EQ(lines.size(), rtree.size());
 }
 
+TEST(ContainerTest, RTreeMapBulkLoad) {
+  std::vector<std::pair<core::Vec3, int>> dirs(20000);
+  for (int i = 0; i < dirs.size(); i++) {
+    core::Vec3 d(randf() - 0.5, randf() - 0.5, randf() - 0.5);
+    dirs[i] = std::make_pair(core::normalize(d), i);
+  }
+  core::RTreeMap<core::Vec3, int> rtree(dirs.begin(), dirs.end() - 100);
+  rtree.insert(dirs.end() - 100, dirs.end());
+  ASSERT_EQ(dirs.size(), rtree.size());
+
+  for (int k = 0; k < 100; k++) {
+    auto box = core::BoundingBox(dirs[k * 199].first).expand(0.05);
+    std::vector<int> found;
+    int count =
+        rtree.search(box, [&found](const std::pair<core::Vec3, int> &d) {
+          found.push_back(d.second);
+          return true;
+        });
+    std::vector<int> truth;
+    for (auto &d : dirs) {
+      if (box.contains(d.first)) {
+        truth.push_back(d.second);
+      }
+    }
+    std::sort(found.begin(), found.end());
+    EXPECT_EQ(truth.size(), count);
+    EXPECT_EQ(truth, found);
+  }
+}
+
+TEST(ContainerTest, DirectionMapBatchedSearch) {
+  auto randomDir = []() {
+    return core::normalize(
+        core::Vec3(randf() - 0.5, randf() - 0.5, randf() - 0.5));
+  };
+  std::vector<std::pair<core::Vec3, int>> dirs(20000);
+  for (int i = 0; i < dirs.size(); i++) {
+    dirs[i] = std::make_pair(randomDir(), i);
+  }
+  core::DirectionMap<int> dirMap(dirs.begin(), dirs.end(), 0.05);
+  ASSERT_EQ(dirs.size(), dirMap.size());
+
+  std::vector<core::Vec3> queries(300);
+  std::generate(queries.begin(), queries.end(), randomDir);
+  for (double angle : {0.02, 0.05, 0.12}) {
+    std::vector<int> offsets, entryIds;
+    dirMap.search(queries, angle, offsets, entryIds,
+                  [](int, const std::pair<core::Vec3, int> &d) {
+                    return d.second % 2 == 0;
+                  });
+    ASSERT_EQ(queries.size() + 1, offsets.size());
+    for (int q = 0; q < queries.size(); q++) {
+      std::vector<int> found;
+      for (int k = offsets[q]; k < offsets[q + 1]; k++) {
+        found.push_back(dirMap.entry(entryIds[k]).second);
+      }
+      std::sort(found.begin(), found.end());
+      std::vector<int> truth;
+      for (auto &d : dirs) {
+        if (d.second % 2 == 0 &&
+            core::AngleBetweenDirected(queries[q], d.first) <= angle) {
+          truth.push_back(d.second);
+        }
+      }
+      EXPECT_EQ(truth, found);
+    }
+  }
+}
+
 TEST(ContainerTest, MaxHeap) {
   std::vector<double> data(50000);
   std::generate(data.begin(), data.end(), randf);
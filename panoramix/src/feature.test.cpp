@@ -3,6 +3,7 @@
 #include "segmentation.hpp"
 #include "utility.hpp"
 #include "canvas.hpp"
+#include "containers.hpp"
 #include "gui_util.hpp"
 
 #include "../panoramix.unittest.hpp"
@@ -27,6 +28,254 @@ TEST(Feature, LineSegmentExtractor) {
       .show();
 }
 
+TEST(Feature, LineSegmentExtractorGradientGrouping) {
+  core::Image3ub im =
+      core::ImageRead(PANORAMIX_TEST_DATA_DIR_STR "/building.jpg");
+  if (im.empty()) {
+    return;
+  }
+  core::LineSegmentExtractor::Params params;
+  params.algorithm = core::LineSegmentExtractor::GradientGrouping;
+  core::LineSegmentExtractor lineseg(params);
+  auto lines = lineseg(im);
+  ASSERT_FALSE(lines.empty());
+  auto box = core::BoundingBox(im).expand(params.minLength);
+  for (auto &l : lines) {
+    EXPECT_TRUE(box.contains(l.first) && box.contains(l.second));
+  }
+}
+
+TEST(Feature, LineSegmentExtractorLSDContext) {
+  core::Image3ub im =
+      core::ImageRead(PANORAMIX_TEST_DATA_DIR_STR "/building.jpg");
+  if (im.empty()) {
+    return;
+  }
+  core::LineSegmentExtractor::Params params;
+  params.algorithm = core::LineSegmentExtractor::LSD;
+  core::LineSegmentExtractor lineseg(params);
+
+  core::LSDContext context;
+  auto lines = lineseg(im, context);
+  auto linesReused = lineseg(im, context);
+  ASSERT_EQ(lines.size(), linesReused.size());
+
+  // gray and float inputs are read in place and give the same segments
+  cv::Mat gray, grayf;
+  cv::cvtColor(im, gray, CV_BGR2GRAY);
+  gray.convertTo(grayf, CV_32FC1);
+  auto linesGray = lineseg(gray, context);
+  auto linesFloat = lineseg(grayf, context);
+  ASSERT_EQ(lines.size(), linesGray.size());
+  ASSERT_EQ(lines.size(), linesFloat.size());
+  for (int i = 0; i < lines.size(); i++) {
+    EXPECT_TRUE(lines[i] == linesReused[i]);
+    EXPECT_TRUE(lines[i] == linesGray[i]);
+    EXPECT_TRUE(lines[i] == linesFloat[i]);
+  }
+}
+
+TEST(Feature, LineSegmentExtractorTiledLSD) {
+  core::Image3ub im =
+      core::ImageRead(PANORAMIX_TEST_DATA_DIR_STR "/indoor_pano1.jpg");
+  if (im.empty()) {
+    return;
+  }
+  core::LineSegmentExtractor::Params params;
+  params.algorithm = core::LineSegmentExtractor::LSD;
+  params.minLength = 30;
+  core::LineSegmentExtractor lineseg(params);
+  params.tileSize = 256;
+  core::LineSegmentExtractor linesegTiled(params);
+
+  auto lines = lineseg(im);
+  auto linesTiled = linesegTiled(im);
+  EXPECT_LE(linesTiled.size(), lines.size() * 1.05);
+  EXPECT_GE(linesTiled.size(), lines.size() * 0.9);
+
+  // seam duplicates are merged, so the tiled segments have no more collinear
+  // overlapping pairs left to merge than the single tile ones
+  auto mergeable = [](const std::vector<core::Line2> &ls) {
+    auto merged = core::MergeLines(ls, core::DegreesToRadians(3), 2.0, 2.0);
+    return ls.size() - merged.size();
+  };
+  EXPECT_LE(mergeable(linesTiled), mergeable(lines));
+
+  // almost all single tile segments are covered by a tiled segment
+  core::RTreeMap<core::Line2, int> tiledBoxes;
+  for (int i = 0; i < linesTiled.size(); i++) {
+    tiledBoxes.emplace(linesTiled[i], i);
+  }
+  int ncovered = 0;
+  for (auto &l : lines) {
+    bool covered = false;
+    tiledBoxes.search(core::BoundingBox(l).expand(3.0),
+                      [&l, &covered](const std::pair<core::Line2, int> &t) {
+                        if (core::Distance(l.first, t.first) < 3.0 &&
+                            core::Distance(l.second, t.first) < 3.0) {
+                          covered = true;
+                          return false;
+                        }
+                        return true;
+                      });
+    ncovered += covered;
+  }
+  EXPECT_GE(ncovered, lines.size() * 0.95);
+}
+
+TEST(Feature, LineSegmentExtractorTiledLSDMergesSeams) {
+  using namespace core;
+
+  // dark shapes whose edges cross the seams of 128 pixel tiles
+  Imageub im(400, 400, uint8_t(255));
+  cv::rectangle(im, cv::Point(40, 60), cv::Point(340, 200), cv::Scalar(0),
+                -1);
+  std::vector<cv::Point> diamond = {
+      {200, 220}, {280, 300}, {200, 380}, {120, 300}};
+  cv::fillConvexPoly(im, diamond, cv::Scalar(0));
+
+  LineSegmentExtractor::Params params;
+  params.algorithm = LineSegmentExtractor::LSD;
+  params.minLength = 30;
+  LineSegmentExtractor lineseg(params);
+  params.tileSize = 128;
+  params.tileOverlap = 16;
+  LineSegmentExtractor linesegTiled(params);
+
+  LSDContext context;
+  auto lines = lineseg(im, context);
+  ASSERT_GE(lines.size(), 8);
+  // the second run reuses the contexts pooled by the first one
+  for (int run = 0; run < 2; run++) {
+    auto linesTiled = linesegTiled(im, context);
+    // each edge is found once, not once per tile it crosses
+    ASSERT_EQ(linesTiled.size(), lines.size());
+    for (auto &l : lines) {
+      int ncopies = 0;
+      for (auto &t : linesTiled) {
+        ncopies += Distance(l.first, t) < 2.0 && Distance(l.second, t) < 2.0 &&
+                   Distance(t.first, l) < 2.0 && Distance(t.second, l) < 2.0;
+      }
+      EXPECT_EQ(ncopies, 1);
+    }
+  }
+}
+
+TEST(Feature, MergeLinesOfPyramid) {
+  using namespace core;
+  // three collinear segments, each overlapping only the part the previous
+  // one adds to the line
+  std::vector<std::vector<Line2>> levelLines = {
+      {Line2(Point2(0, 0), Point2(100, 0))},
+      {Line2(Point2(80, 0.5), Point2(200, 0.5))},
+      {Line2(Point2(180, -0.5), Point2(300, -0.5)),
+       Line2(Point2(0, 50), Point2(100, 50))}};
+  auto lines = MergeLinesOfPyramid(levelLines, {1.0, 2.0, 4.0});
+  ASSERT_EQ(lines.size(), 2);
+  EXPECT_LT(Distance(lines[0].first, Point2(0, 0)), 1e-8);
+  EXPECT_LT(Distance(lines[0].second, Point2(300, 0)), 1e-8);
+  EXPECT_TRUE(lines[1] == levelLines[2][1]);
+}
+
+TEST(Feature, ClassifyLines) {
+  using namespace core;
+
+  // 3d lines lying on great circles through the three axes
+  std::vector<Vec3> vps = {Vec3(1, 0, 0), Vec3(0, 1, 0), Vec3(0, 0, 1)};
+  std::default_random_engine rng;
+  std::uniform_real_distribution<double> coord(-1, 1);
+  std::vector<Classified<Line3>> line3s;
+  std::vector<int> truth3;
+  for (int i = 0; i < 300; i++) {
+    int c = i % 3;
+    Vec3 p = normalize(Vec3(coord(rng), coord(rng), coord(rng)));
+    Vec3 q = normalize(p + vps[c] * 0.2);
+    line3s.push_back(ClassifyAs(Line3(p, q), -1));
+    truth3.push_back(c);
+  }
+  auto line3sFloat = line3s;
+  DenseMatd scores3 =
+      ClassifyLines(line3s, vps, M_PI / 3.0, 0.1, 0.8, M_PI / 18.0);
+  DenseMat<float> scores3f;
+  ClassifyLines(line3sFloat, vps, &scores3f, M_PI / 3.0, 0.1, 0.8,
+                M_PI / 18.0);
+  ASSERT_EQ(scores3f.rows, line3s.size());
+  ASSERT_EQ(scores3f.cols, vps.size());
+  for (int i = 0; i < line3s.size(); i++) {
+    EXPECT_EQ(line3s[i].claz, line3sFloat[i].claz);
+    if (scores3(i, truth3[i]) >= 0) { // not too close to its vp
+      EXPECT_EQ(line3s[i].claz, truth3[i]);
+    }
+    for (int j = 0; j < vps.size(); j++) {
+      EXPECT_NEAR(scores3(i, j), scores3f(i, j), 1e-5);
+    }
+  }
+
+  // 2d lines pointing to two finite and one infinite vp
+  std::vector<HPoint2> hvps = {HPoint2(Point2(-500, 200), 1.0),
+                               HPoint2(Point2(1500, 220), 1.0),
+                               HPoint2(Point2(0, 1), 0.0)};
+  std::uniform_real_distribution<double> position(0, 500);
+  std::vector<Classified<Line2>> line2s;
+  std::vector<int> truth2;
+  for (int i = 0; i < 300; i++) {
+    int c = i % 3;
+    Point2 p(position(rng), position(rng));
+    Vec2 dir = normalize((hvps[c] - HPoint2(p)).numerator);
+    line2s.push_back(ClassifyAs(Line2(p, p + dir * 30.0), -1));
+    truth2.push_back(c);
+  }
+  auto line2sNoScores = line2s;
+  ClassifyLines(line2s, hvps, M_PI / 3.0, 0.1, 0.8, 10.0);
+  ClassifyLines(line2sNoScores, hvps, nullptr, M_PI / 3.0, 0.1, 0.8, 10.0);
+  for (int i = 0; i < line2s.size(); i++) {
+    EXPECT_EQ(line2s[i].claz, truth2[i]);
+    EXPECT_EQ(line2s[i].claz, line2sNoScores[i].claz);
+  }
+}
+
+TEST(Feature, MergeLines3) {
+  using namespace core;
+
+  // overlapping arcs on four great circles, and one reversed arc on each
+  std::vector<Vec3> normals = {Vec3(1, 0, 0), Vec3(0, 1, 0), Vec3(0, 0, 1),
+                               normalize(Vec3(1, 1, 1))};
+  std::vector<Line3> lines;
+  for (auto &n : normals) {
+    Vec3 x, y;
+    std::tie(x, y) = ProposeXYDirectionsFromZDirection(n);
+    auto at = [&x, &y](double a) { return x * cos(a) + y * sin(a); };
+    lines.emplace_back(at(0.0), at(0.2));
+    lines.emplace_back(at(0.15), at(0.35));
+    lines.emplace_back(at(0.3), at(0.5));
+    lines.emplace_back(at(0.4), at(0.1));
+  }
+  std::shuffle(lines.begin(), lines.end(), std::default_random_engine());
+
+  // the reversed arcs are not merged into the others
+  auto merged = MergeLines(lines, DegreesToRadians(3));
+  ASSERT_EQ(normals.size() * 2, merged.size());
+  std::vector<int> forwardNum(normals.size(), 0);
+  std::vector<int> reversedNum(normals.size(), 0);
+  for (auto &line : merged) {
+    Vec3 normal = normalize(line.first.cross(line.second));
+    double length = AngleBetweenDirected(line.first, line.second);
+    for (int i = 0; i < normals.size(); i++) {
+      if (AngleBetweenDirected(normal, normals[i]) < 1e-6) {
+        EXPECT_NEAR(0.5, length, 1e-6);
+        forwardNum[i]++;
+      } else if (AngleBetweenDirected(normal, Vec3(-normals[i])) < 1e-6) {
+        EXPECT_NEAR(0.3, length, 1e-6);
+        reversedNum[i]++;
+      }
+    }
+  }
+  for (int i = 0; i < normals.size(); i++) {
+    EXPECT_EQ(1, forwardNum[i]);
+    EXPECT_EQ(1, reversedNum[i]);
+  }
+}
+
 TEST(Feature, FeatureExtractor) {
   core::SegmentationExtractor segmenter;
   core::LineSegmentExtractor::Params params;
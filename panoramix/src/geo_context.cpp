@@ -16,6 +16,7 @@
 #include "clock.hpp"
 #include "eigen.hpp"
 #include "matlab_api.hpp"
+#include "parallel.hpp"
 
 namespace pano {
 namespace core {
@@ -80,6 +81,41 @@ Image5d ComputeIndoorGeometricContextHedau(misc::Matlab &matlab,
   return MergeGeometricContextLabelsHedau(rawgc);
 }
 
+std::vector<Image5d>
+ComputeIndoorGeometricContextHedau(misc::MatlabPool &matlabs,
+                                   const std::vector<Image> &ims) {
+  if (ims.empty()) {
+    return std::vector<Image5d>();
+  }
+  // the engine and mx apis are not thread safe, so the crops go to a single
+  // engine at once and are spread over its parallel workers, parfor runs
+  // serially without the parallel computing toolbox
+  std::vector<Image7d> rawgcs(ims.size());
+  {
+    auto matlab = matlabs.acquire();
+    misc::MXA cells = misc::MXA::createCellMatrix(ims.size(), 1, true);
+    for (int i = 0; i < ims.size(); i++) {
+      cells.setCell(i, misc::MXA(ims[i]));
+    }
+    *matlab << "clear;";
+    matlab->setVar("ims", cells);
+    *matlab << "confs = cell(size(ims));\n"
+               "parfor i = 1:numel(ims)\n"
+               "  [~, ~, confs{i}] = gc(ims{i});\n"
+               "end";
+    misc::MXA confs = matlab->var("confs");
+    for (int i = 0; i < ims.size(); i++) {
+      rawgcs[i] = confs.cell(i).toCVMat();
+      assert(rawgcs[i].size() == ims[i].size());
+    }
+  }
+  std::vector<Image5d> gcs(ims.size());
+  ParallelStride(ims.size(), DefaultConcurrency(), [&](int i, int) {
+    gcs[i] = MergeGeometricContextLabelsHedau(rawgcs[i]);
+  });
+  return gcs;
+}
+
 Image6d MergeGeometricContextLabelsHedau(const Image7d &rawgc,
                                          const Vec3 &forward,
                                          const Vec3 &hvp1) {
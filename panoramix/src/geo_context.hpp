@@ -28,6 +28,11 @@ Image5d MergeGeometricContextLabelsHedau(const Image7d &rawgc);
 // ComputeGeometricContext
 Image5d ComputeIndoorGeometricContextHedau(misc::Matlab &matlab,
                                            const Image &im);
+// - all images are passed to one engine of the pool, gc runs on them in a
+//   parfor and only the label merging runs on threads here
+std::vector<Image5d>
+ComputeIndoorGeometricContextHedau(misc::MatlabPool &matlabs,
+                                   const std::vector<Image> &ims);
 
 inline GeometricContextIndex MaxGeometricIndex(const Vec5 &gcv) {
   return (GeometricContextIndex)(std::max_element(gcv.val, gcv.val + 5) -
@@ -0,0 +1,303 @@
+#include "pch.hpp"
+
+#include <bitset>
+#include <queue>
+
+#include "jlinkage.hpp"
+#include "parallel.hpp"
+#include "utility.hpp"
+
+namespace pano {
+namespace core {
+
+namespace {
+
+inline int PopCount(uint64_t word) {
+  return static_cast<int>(std::bitset<64>(word).count());
+}
+
+// returns the number of shared preferences, and sets the Jaccard distance
+inline int JaccardDistance(const uint64_t *ps1, const uint64_t *ps2,
+                           int wordsNum, float &distance) {
+  int intersectionNum = 0, unionNum = 0;
+  for (int w = 0; w < wordsNum; w++) {
+    intersectionNum += PopCount(ps1[w] & ps2[w]);
+    unionNum += PopCount(ps1[w] | ps2[w]);
+  }
+  distance =
+      unionNum == 0 ? 1.0f : 1.0f - float(intersectionNum) / float(unionNum);
+  return intersectionNum;
+}
+
+struct ClusterPair {
+  float distance;
+  int cluster1, cluster2;
+  int stamp1, stamp2;
+  inline bool operator>(const ClusterPair &p) const {
+    return std::tie(distance, cluster1, cluster2) >
+           std::tie(p.distance, p.cluster1, p.cluster2);
+  }
+};
+
+static const int HypothesesBlockSize = 256;
+}
+
+int LineJLinkage::operator()(const std::vector<Line2> &lines,
+                             std::vector<int> &labels) const {
+  const int n = lines.size();
+  labels.resize(n);
+  if (n < 2) {
+    std::fill(labels.begin(), labels.end(), 0);
+    return n;
+  }
+
+  const int concurrency = std::max(_params.concurrency, 1);
+  const int hypothesesNum = std::max(_params.hypothesesNum, 1);
+  const int k = std::min(_params.samplingNeighborsNum, n - 1);
+  const int km = _params.mergeNeighborsNum > 0
+                     ? std::min(_params.mergeNeighborsNum, n - 1)
+                     : 0;
+  const int kn = std::max(k, km);
+
+  // flat point data
+  std::vector<float> x1s(n), y1s(n), x2s(n), y2s(n), mxs(n), mys(n);
+  std::vector<Vec3f> homoLines(n);
+  for (int i = 0; i < n; i++) {
+    x1s[i] = lines[i].first[0];
+    y1s[i] = lines[i].first[1];
+    x2s[i] = lines[i].second[0];
+    y2s[i] = lines[i].second[1];
+    mxs[i] = (x1s[i] + x2s[i]) / 2.0f;
+    mys[i] = (y1s[i] + y2s[i]) / 2.0f;
+    homoLines[i] =
+        Vec3f(x1s[i], y1s[i], 1.0f).cross(Vec3f(x2s[i], y2s[i], 1.0f));
+  }
+
+  // kn nearest neighbors in endpoint space, nearest first
+  std::vector<int> neighbors(n * kn);
+  if (kn > 0) {
+    std::vector<std::vector<std::pair<float, int>>> threadNearest(concurrency);
+    ParallelStride(n, concurrency, [&](int i, int t) {
+      auto &nearest = threadNearest[t];
+      nearest.clear();
+      for (int j = 0; j < n; j++) {
+        if (j == i) {
+          continue;
+        }
+        float d = Square(x1s[i] - x1s[j]) + Square(y1s[i] - y1s[j]) +
+                  Square(x2s[i] - x2s[j]) + Square(y2s[i] - y2s[j]);
+        if (nearest.size() == kn && d >= nearest.back().first) {
+          continue;
+        }
+        auto pos = std::upper_bound(nearest.begin(), nearest.end(),
+                                    std::make_pair(d, j));
+        nearest.insert(pos, std::make_pair(d, j));
+        if (nearest.size() > kn) {
+          nearest.pop_back();
+        }
+      }
+      for (int q = 0; q < kn; q++) {
+        neighbors[i * kn + q] = nearest[q].second;
+      }
+    });
+  }
+
+  // hypotheses, sampled in fixed blocks each with its own random engine
+  std::vector<float> vxs(hypothesesNum), vys(hypothesesNum),
+      vzs(hypothesesNum);
+  const int blocksNum =
+      (hypothesesNum + HypothesesBlockSize - 1) / HypothesesBlockSize;
+  ParallelStride(blocksNum, concurrency, [&](int b, int) {
+    std::seed_seq seeds = {_params.seed, unsigned(b)};
+    std::mt19937 rng(seeds);
+    std::uniform_int_distribution<int> firstDist(0, n - 1);
+    std::uniform_int_distribution<int> secondDist(0, n - 2);
+    std::uniform_int_distribution<int> neighborDist(0, std::max(k - 1, 0));
+    std::bernoulli_distribution useNeighbor(_params.neighborSamplingProb);
+    for (int h = b * HypothesesBlockSize;
+         h < std::min((b + 1) * HypothesesBlockSize, hypothesesNum); h++) {
+      int i = firstDist(rng);
+      int j = -1;
+      if (k > 0 && useNeighbor(rng)) {
+        j = neighbors[i * kn + neighborDist(rng)];
+      } else {
+        j = secondDist(rng);
+        if (j >= i) {
+          j++;
+        }
+      }
+      Vec3f vp = homoLines[i].cross(homoLines[j]);
+      float vpNorm = norm(vp);
+      if (vpNorm < 1e-12f) {
+        vp = Vec3f(0, 0, 0); // prefered by no line
+      } else {
+        vp /= vpNorm;
+      }
+      vxs[h] = vp[0];
+      vys[h] = vp[1];
+      vzs[h] = vp[2];
+    }
+  });
+
+  // preference sets, one row of packed bits per line
+  const int wordsNum = (hypothesesNum + 63) / 64;
+  std::vector<uint64_t> prefs(size_t(n) * wordsNum);
+  const float thres2 = Square(_params.inlierThreshold);
+  ParallelStride(n, concurrency, [&](int i, int) {
+    const float x1 = x1s[i], y1 = y1s[i], mx = mxs[i], my = mys[i];
+    uint64_t *ps = prefs.data() + size_t(i) * wordsNum;
+    for (int w = 0; w < wordsNum; w++) {
+      const int first = w * 64;
+      const int num = std::min(hypothesesNum - first, 64);
+      const float *vx = vxs.data() + first;
+      const float *vy = vys.data() + first;
+      const float *vz = vzs.data() + first;
+      uint64_t bits = 0;
+      for (int q = 0; q < num; q++) {
+        // the line joining the midpoint and the vanishing point
+        float a = my * vz[q] - vy[q];
+        float b = vx[q] - mx * vz[q];
+        float c = mx * vy[q] - my * vx[q];
+        float dist = a * x1 + b * y1 + c;
+        bits |= uint64_t(dist * dist < thres2 * (a * a + b * b)) << q;
+      }
+      ps[w] = bits;
+    }
+  });
+
+  // candidate pairs, lines and their km nearest neighbors as the kd-tree
+  // range of the original J-Linkage, or all pairs if km is 0
+  std::vector<std::pair<int, int>> candidates;
+  for (int i = 0; i < n; i++) {
+    for (int q = 0; q < km; q++) {
+      int j = neighbors[i * kn + q];
+      candidates.emplace_back(std::min(i, j), std::max(i, j));
+    }
+  }
+  std::sort(candidates.begin(), candidates.end());
+  candidates.erase(std::unique(candidates.begin(), candidates.end()),
+                   candidates.end());
+
+  // initial distances, only pairs sharing preferences can be merged
+  std::vector<std::vector<ClusterPair>> threadPairs(concurrency);
+  auto addPair = [&](int i, int j, std::vector<ClusterPair> &pairs) {
+    float distance = 1.0f;
+    if (JaccardDistance(prefs.data() + size_t(i) * wordsNum,
+                        prefs.data() + size_t(j) * wordsNum, wordsNum,
+                        distance) > 0) {
+      pairs.push_back(ClusterPair{distance, i, j, 0, 0});
+    }
+  };
+  if (km > 0) {
+    ParallelStride(int(candidates.size()), concurrency, [&](int c, int t) {
+      addPair(candidates[c].first, candidates[c].second, threadPairs[t]);
+    });
+  } else {
+    ParallelStride(n, concurrency, [&](int i, int t) {
+      for (int j = i + 1; j < n; j++) {
+        addPair(i, j, threadPairs[t]);
+      }
+    });
+  }
+
+  std::vector<std::vector<int>> adjacents(n);
+  std::vector<ClusterPair> heapData;
+  for (auto &pairs : threadPairs) {
+    for (auto &p : pairs) {
+      adjacents[p.cluster1].push_back(p.cluster2);
+      adjacents[p.cluster2].push_back(p.cluster1);
+    }
+    heapData.insert(heapData.end(), pairs.begin(), pairs.end());
+    std::vector<ClusterPair>().swap(pairs);
+  }
+  std::priority_queue<ClusterPair, std::vector<ClusterPair>,
+                      std::greater<ClusterPair>>
+      heap(std::greater<ClusterPair>(), std::move(heapData));
+
+  // agglomerative clustering
+  std::vector<int> parents(n), stamps(n, 0);
+  std::iota(parents.begin(), parents.end(), 0);
+  auto root = [&parents](int c) {
+    while (parents[c] != c) {
+      parents[c] = parents[parents[c]];
+      c = parents[c];
+    }
+    return c;
+  };
+  std::vector<bool> alive(n, true);
+  std::vector<int> newAdjacents;
+  std::vector<int> visits(n, -1);
+  for (int merges = 0; !heap.empty();) {
+    ClusterPair p = heap.top();
+    heap.pop();
+    const int c1 = p.cluster1, c2 = p.cluster2;
+    if (!alive[c1] || !alive[c2] || stamps[c1] != p.stamp1 ||
+        stamps[c2] != p.stamp2) {
+      continue; // outdated
+    }
+
+    // merge c2 into c1
+    uint64_t *ps1 = prefs.data() + size_t(c1) * wordsNum;
+    const uint64_t *ps2 = prefs.data() + size_t(c2) * wordsNum;
+    for (int w = 0; w < wordsNum; w++) {
+      ps1[w] &= ps2[w];
+    }
+    alive[c2] = false;
+    parents[c2] = c1;
+    stamps[c1]++;
+
+    // the candidates of the merged cluster are those of c1 and c2, resolved
+    // to the clusters they were merged into, that still share preferences
+    newAdjacents.clear();
+    visits[c1] = merges;
+    for (int from : {c1, c2}) {
+      for (int a : adjacents[from]) {
+        const int c = root(a);
+        if (visits[c] == merges) {
+          continue;
+        }
+        visits[c] = merges;
+        float distance = 1.0f;
+        if (JaccardDistance(ps1, prefs.data() + size_t(c) * wordsNum,
+                            wordsNum, distance) > 0) {
+          newAdjacents.push_back(c);
+          heap.push(c1 < c
+                        ? ClusterPair{distance, c1, c, stamps[c1], stamps[c]}
+                        : ClusterPair{distance, c, c1, stamps[c], stamps[c1]});
+        }
+      }
+    }
+    adjacents[c1] = newAdjacents;
+    std::vector<int>().swap(adjacents[c2]);
+    merges++;
+  }
+
+  // label clusters by size
+  std::vector<int> roots(n);
+  std::vector<int> clusterSizes(n, 0);
+  for (int i = 0; i < n; i++) {
+    roots[i] = root(i);
+    clusterSizes[roots[i]]++;
+  }
+  std::vector<int> clusters;
+  for (int i = 0; i < n; i++) {
+    if (alive[i]) {
+      clusters.push_back(i);
+    }
+  }
+  std::stable_sort(clusters.begin(), clusters.end(),
+                   [&clusterSizes](int a, int b) {
+                     return clusterSizes[a] > clusterSizes[b];
+                   });
+  std::vector<int> clusterLabels(n, -1);
+  for (int i = 0; i < clusters.size(); i++) {
+    clusterLabels[clusters[i]] = i;
+  }
+  for (int i = 0; i < n; i++) {
+    labels[i] = clusterLabels[roots[i]];
+  }
+
+  return clusters.size();
+}
+}
+}
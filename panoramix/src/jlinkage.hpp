@@ -0,0 +1,63 @@
+#pragma once
+
+#include <thread>
+
+#include "basic_types.hpp"
+
+namespace pano {
+namespace core {
+
+// J-Linkage clustering of 2d line segments by their vanishing points
+// - hypotheses are the vanishing points of randomly sampled line pairs, the
+//   second line is drawn from the k nearest neighbors (in endpoint space) of
+//   the first one with probability neighborSamplingProb, otherwise uniformly;
+//   the defaults (k = 3, always from neighbors) follow the nearest neighbor
+//   sampling of the original J-Linkage VP detector
+// - a line prefers a hypothesis if its first endpoint lies within
+//   inlierThreshold pixels from the line joining its midpoint and the
+//   vanishing point [Tardif 2009]
+// - preference sets are packed into 64 bit words, clusters are merged
+//   greedily by their minimal Jaccard distance until all distances are 1
+// - as the kd-tree range of the original, only clusters holding one of the
+//   mergeNeighborsNum nearest neighbors of each other's lines are merged;
+//   mergeNeighborsNum <= 0 compares all pairs, which costs O(n^2)
+// - results only depend on the seed, not on the concurrency
+class LineJLinkage {
+public:
+  struct Params {
+    inline Params()
+        : hypothesesNum(5000), inlierThreshold(2.0f), samplingNeighborsNum(3),
+          neighborSamplingProb(1.0), mergeNeighborsNum(2),
+          concurrency(std::max(1u, std::thread::hardware_concurrency())),
+          seed(0) {}
+    int hypothesesNum;
+    float inlierThreshold;
+    int samplingNeighborsNum;
+    double neighborSamplingProb;
+    int mergeNeighborsNum;
+    int concurrency;
+    unsigned seed;
+    template <class Archive> inline void serialize(Archive &ar) {
+      ar(hypothesesNum, inlierThreshold, samplingNeighborsNum,
+         neighborSamplingProb, mergeNeighborsNum, concurrency, seed);
+    }
+  };
+
+public:
+  inline explicit LineJLinkage(const Params &params = Params())
+      : _params(params) {}
+  const Params &params() const { return _params; }
+  Params &params() { return _params; }
+
+  // returns the number of clusters, labels are numbered by cluster size in
+  // descending order
+  int operator()(const std::vector<Line2> &lines,
+                 std::vector<int> &labels) const;
+
+  template <class Archive> inline void serialize(Archive &ar) { ar(_params); }
+
+private:
+  Params _params;
+};
+}
+}
@@ -0,0 +1,144 @@
+#include <random>
+
+#include "jlinkage.hpp"
+#include "utility.hpp"
+
+#include "../panoramix.unittest.hpp"
+
+using namespace pano;
+
+namespace {
+
+// three groups of noisy segments pointing to known vanishing points, plus
+// random clutter labeled -1
+void MakeLinesOfThreeVanishingPoints(std::vector<core::Line2> &lines,
+                                     std::vector<int> &groundTruth) {
+  using namespace core;
+  std::mt19937 rng(3);
+  std::uniform_real_distribution<double> position(0, 640);
+  std::uniform_real_distribution<double> noise(-0.5, 0.5);
+  const Point2 vps[] = {{320, -3000}, {-800, 240}, {1600, 260}};
+  for (int c = 0; c < 3; c++) {
+    for (int i = 0; i < 150; i++) {
+      Point2 p(position(rng), position(rng) * 0.75);
+      Vec2 dir = normalize(vps[c] - p);
+      double length = 20 + position(rng) / 10;
+      lines.emplace_back(p + Vec2(noise(rng), noise(rng)),
+                         p + dir * length + Vec2(noise(rng), noise(rng)));
+      groundTruth.push_back(c);
+    }
+  }
+  for (int i = 0; i < 50; i++) {
+    lines.emplace_back(Point2(position(rng), position(rng)),
+                       Point2(position(rng), position(rng)));
+    groundTruth.push_back(-1);
+  }
+}
+}
+
+TEST(JLinkageTest, ClusterLinesByVanishingPoints) {
+  using namespace core;
+
+  std::vector<Line2> lines;
+  std::vector<int> groundTruth;
+  MakeLinesOfThreeVanishingPoints(lines, groundTruth);
+
+  // 8 neighbors connect the scattered groups, as does comparing all pairs
+  for (int mergeNeighborsNum : {8, 0}) {
+    std::vector<int> labelsSingleThread;
+    LineJLinkage jlinkage;
+    jlinkage.params().mergeNeighborsNum = mergeNeighborsNum;
+    jlinkage.params().concurrency = 1;
+    int classNum = jlinkage(lines, labelsSingleThread);
+
+    std::vector<int> labels;
+    jlinkage.params().concurrency = 4;
+    EXPECT_EQ(classNum, jlinkage(lines, labels));
+    EXPECT_TRUE(labels == labelsSingleThread);
+
+    ASSERT_GE(classNum, 3);
+    std::set<int> majorLabels;
+    for (int c = 0; c < 3; c++) {
+      std::vector<int> counts(classNum, 0);
+      for (int i = 0; i < lines.size(); i++) {
+        if (groundTruth[i] == c) {
+          counts[labels[i]]++;
+        }
+      }
+      int majorLabel = std::max_element(counts.begin(), counts.end()) -
+                       counts.begin();
+      EXPECT_GT(counts[majorLabel], 150 * 0.8);
+      // the three largest clusters
+      EXPECT_LT(majorLabel, 3);
+      majorLabels.insert(majorLabel);
+    }
+    EXPECT_EQ(majorLabels.size(), 3);
+  }
+}
+
+TEST(JLinkageTest, MergeOnlyNeighboringLines) {
+  using namespace core;
+
+  std::vector<Line2> lines;
+  std::vector<int> groundTruth;
+  MakeLinesOfThreeVanishingPoints(lines, groundTruth);
+
+  LineJLinkage jlinkage;
+  ASSERT_EQ(jlinkage.params().mergeNeighborsNum, 2);
+  std::vector<int> labels;
+  int classNum = jlinkage(lines, labels);
+
+  std::vector<int> labelsSingleThread;
+  jlinkage.params().concurrency = 1;
+  EXPECT_EQ(classNum, jlinkage(lines, labelsSingleThread));
+  EXPECT_TRUE(labels == labelsSingleThread);
+
+  // with 2 neighbors the groups scattered over the image fall apart into
+  // more clusters than comparing all pairs gives
+  std::vector<int> labelsAllPairs;
+  jlinkage.params().mergeNeighborsNum = 0;
+  EXPECT_GT(classNum, jlinkage(lines, labelsAllPairs));
+
+  // every cluster is connected by links between lines and their 2 nearest
+  // neighbors in endpoint space
+  const int n = lines.size();
+  std::vector<std::vector<int>> links(n);
+  for (int i = 0; i < n; i++) {
+    std::vector<std::pair<double, int>> dists;
+    for (int j = 0; j < n; j++) {
+      if (j != i) {
+        Vec2 d1 = lines[i].first - lines[j].first;
+        Vec2 d2 = lines[i].second - lines[j].second;
+        dists.emplace_back(d1.dot(d1) + d2.dot(d2), j);
+      }
+    }
+    std::partial_sort(dists.begin(), dists.begin() + 2, dists.end());
+    for (int q = 0; q < 2; q++) {
+      links[i].push_back(dists[q].second);
+      links[dists[q].second].push_back(i);
+    }
+  }
+  std::vector<bool> visited(n, false);
+  std::vector<int> componentsNum(classNum, 0);
+  for (int i = 0; i < n; i++) {
+    if (visited[i]) {
+      continue;
+    }
+    componentsNum[labels[i]]++;
+    std::vector<int> stack = {i};
+    visited[i] = true;
+    while (!stack.empty()) {
+      int j = stack.back();
+      stack.pop_back();
+      for (int k : links[j]) {
+        if (!visited[k] && labels[k] == labels[i]) {
+          visited[k] = true;
+          stack.push_back(k);
+        }
+      }
+    }
+  }
+  for (int c = 0; c < classNum; c++) {
+    EXPECT_EQ(componentsNum[c], 1);
+  }
+}
@@ -7,6 +7,7 @@ extern "C" {
 #include "clock.hpp"
 #include "containers.hpp"
 #include "line_detection.hpp"
+#include "parallel.hpp"
 #include "utility.hpp"
 
 namespace pano {
@@ -16,122 +17,152 @@ namespace core {
 
 namespace {
 
+// collinear (angle < angleThres, distance to the longer one's line <
+// distanceThres) and overlapping, or leaving a gap < gapThres
+bool CanMergeLines(const Line2 &a, const Line2 &b, double angleThres,
+                   double distanceThres, double gapThres) {
+  const Line2 &ref = a.length() >= b.length() ? a : b;
+  const Line2 &other = a.length() >= b.length() ? b : a;
+  if (AngleBetweenUndirected(ref.direction(), other.direction()) >
+      angleThres) {
+    return false;
+  }
+  Ray2 refRay = ref.ray();
+  if (Distance(other.first, refRay) > distanceThres ||
+      Distance(other.second, refRay) > distanceThres) {
+    return false;
+  }
+  Vec2 dir = normalize(ref.direction());
+  double r1 = (other.first - ref.first).dot(dir);
+  double r2 = (other.second - ref.first).dot(dir);
+  double gap = std::max(std::min(r1, r2) - ref.length(), -std::max(r1, r2));
+  return gap < gapThres;
+}
+
 void ExtractLines(const cv::Mat &im, std::vector<Line2> &lines, int minlen,
                   int xborderw, int yborderw, int numDir) {
 
-  std::cout << "image processing..." << std::endl;
+  assert(numDir > 2 && numDir <= 32);
 
   cv::Mat gim;
-  cv::cvtColor(im, gim, CV_BGR2GRAY);
+  if (im.channels() == 3) {
+    cv::cvtColor(im, gim, CV_BGR2GRAY);
+  } else {
+    gim = im;
+  }
   int h = gim.rows;
   int w = gim.cols;
 
-  cv::Mat dx, dy;
+  cv::Mat dx, dy, angles;
   cv::Mat ggim;
   cv::GaussianBlur(gim, ggim, cv::Size(7, 7), 1.5);
-  cv::Sobel(ggim, dx, CV_64F, 1, 0);
-  cv::Sobel(ggim, dy, CV_64F, 0, 1);
+  cv::Sobel(ggim, dx, CV_32F, 1, 0);
+  cv::Sobel(ggim, dy, CV_32F, 0, 1);
+  cv::phase(dx, dy, angles); // vectorized atan2 in [0, 2pi)
 
   cv::Mat imCanny;
   cv::Canny(gim, imCanny, 5, 20);
 
-  std::cout << "gradient binning..." << std::endl;
-
-  cv::Mat imBinIds(im.size(), CV_32SC1); // int32_t
-  std::vector<std::set<int>> pixelIdsSet(numDir);
-
-  for (int x = 0; x < imCanny.cols; x++) {
-    for (int y = 0; y < imCanny.rows; y++) {
-      if (imCanny.at<uchar>(y, x) > 0) {
-        double a = atan(dy.at<double>(y, x) / dx.at<double>(y, x));
-        if (isnan(a)) { // NaN
-          continue;
-        }
-        // compute bin id
-        int binId = int((a / M_PI + 0.5) * numDir);
-        if (binId == -1)
-          binId = 0;
-        if (binId == numDir)
-          binId = numDir - 1;
-
-        int pixelId = y + imCanny.rows * x;
-
-        imBinIds.at<int32_t>(y, x) = binId;
-
-        pixelIdsSet[(binId + numDir - 1) % numDir].insert(pixelId);
-        pixelIdsSet[binId].insert(pixelId);
-        pixelIdsSet[(binId + 1) % numDir].insert(pixelId);
-      } else {
-        imBinIds.at<int32_t>(y, x) = -1;
+  // gradient binning, row major
+  // binMasks holds the bins each edge pixel still belongs to, an edge pixel
+  // starts in its orientation bin and the two neighboring bins
+  std::vector<uint32_t> binMasks(w * h, 0);
+  std::vector<std::vector<int>> binPixelIds(numDir);
+  for (int y = 0; y < h; y++) {
+    const uchar *cannyRow = imCanny.ptr<uchar>(y);
+    const float *angleRow = angles.ptr<float>(y);
+    const float *dxRow = dx.ptr<float>(y);
+    const float *dyRow = dy.ptr<float>(y);
+    for (int x = 0; x < w; x++) {
+      if (cannyRow[x] == 0 || dxRow[x] == 0 && dyRow[x] == 0) {
+        continue;
+      }
+      // fold the direction to [-pi/2, pi/2), as atan(dy/dx) does
+      double a = angleRow[x];
+      if (a >= M_PI) {
+        a -= M_PI;
+      }
+      if (a >= M_PI_2) {
+        a -= M_PI;
+      }
+      int binId = BoundBetween(int((a / M_PI + 0.5) * numDir), 0, numDir - 1);
+      int pixelId = x + y * w;
+      for (int b : {(binId + numDir - 1) % numDir, binId,
+                    (binId + 1) % numDir}) {
+        binMasks[pixelId] |= 1u << b;
+        binPixelIds[b].push_back(pixelId);
       }
     }
   }
 
-  std::vector<int> xs, ys, ids;
-  xs.reserve(512);
-  ys.reserve(512);
+  // connected components per bin
+  std::vector<int> visitedStamps(w * h, -1);
+  std::vector<int> ids;
   ids.reserve(512);
 
-  std::cout << "collecting pixels.." << std::endl;
+  static const int xdirs[] = {1, 1, 0, -1, -1, -1, 0, 1};
+  static const int ydirs[] = {0, 1, 1, 1, 0, -1, -1, -1};
 
   for (int binId = 0; binId < numDir; binId++) {
-    // search in bins
-    auto pixelIdNotSearchedYet = pixelIdsSet[binId];
+    uint32_t binBit = 1u << binId;
+    uint32_t consumeBits = binBit | 1u << (binId + numDir - 1) % numDir |
+                           1u << (binId + 1) % numDir;
 
-    while (true) {
-      if (pixelIdNotSearchedYet.empty())
-        break;
-      int rootId = *pixelIdNotSearchedYet.begin();
+    for (int rootId : binPixelIds[binId]) {
+      if (!(binMasks[rootId] & binBit) || visitedStamps[rootId] == binId) {
+        continue;
+      }
 
       // BFS
-      xs.clear();
-      ys.clear();
       ids.clear();
-      int x = rootId / imCanny.rows;
-      int y = rootId - imCanny.rows * x;
-      xs.push_back(x);
-      ys.push_back(y);
       ids.push_back(rootId);
-
-      // used for search only
-      pixelIdNotSearchedYet.erase(rootId);
-      int head = 0;
-
-      static const int xdirs[] = {1, 1, 0, -1, -1, -1, 0, 1};
-      static const int ydirs[] = {0, 1, 1, 1, 0, -1, -1, -1};
-      while (true) {
-        if (head == xs.size())
-          break;
-        x = xs[head];
-        y = ys[head];
+      visitedStamps[rootId] = binId;
+      for (int head = 0; head < ids.size(); head++) {
+        int x = ids[head] % w;
+        int y = ids[head] / w;
         for (int k = 0; k < 8; k++) {
           int nx = x + xdirs[k];
           int ny = y + ydirs[k];
-          int npixelId = ny + imCanny.rows * nx;
-          if (pixelIdNotSearchedYet.find(npixelId) !=
-              pixelIdNotSearchedYet.end()) {
-            xs.push_back(nx);
-            ys.push_back(ny);
+          if (nx < 0 || nx >= w || ny < 0 || ny >= h) {
+            continue;
+          }
+          int npixelId = nx + ny * w;
+          if ((binMasks[npixelId] & binBit) &&
+              visitedStamps[npixelId] != binId) {
+            visitedStamps[npixelId] = binId;
             ids.push_back(npixelId);
-            pixelIdNotSearchedYet.erase(npixelId);
           }
         }
-        head++;
       }
 
-      int edgeSize = (int)xs.size();
+      int edgeSize = (int)ids.size();
       if (edgeSize < minlen)
         continue;
 
-      cv::Mat xsmat(xs), ysmat(ys);
-      double meanx = cv::mean(xsmat).val[0], meany = cv::mean(ysmat).val[0];
-      cv::Mat zmx = xsmat - meanx, zmy = ysmat - meany;
-
+      double sumx = 0, sumy = 0;
+      int minx = w, maxx = 0, miny = h, maxy = 0;
+      for (int pid : ids) {
+        int x = pid % w;
+        int y = pid / w;
+        sumx += x;
+        sumy += y;
+        minx = std::min(minx, x);
+        maxx = std::max(maxx, x);
+        miny = std::min(miny, y);
+        maxy = std::max(maxy, y);
+      }
+      double meanx = sumx / edgeSize, meany = sumy / edgeSize;
+
+      Mat<double, 2, 2> D(0.0, 0.0, 0.0, 0.0);
+      for (int pid : ids) {
+        double zmx = pid % w - meanx;
+        double zmy = pid / w - meany;
+        D(0, 0) += zmx * zmx;
+        D(0, 1) += zmx * zmy;
+        D(1, 1) += zmy * zmy;
+      }
+      D(1, 0) = D(0, 1);
       cv::Mat v, lambda;
-      Mat<double, 2, 2> D;
-      D(0, 0) = cv::sum(zmx.mul(zmx)).val[0];
-      D(0, 1) = D(1, 0) = cv::sum(zmx.mul(zmy)).val[0];
-      D(1, 1) = cv::sum(zmy.mul(zmy)).val[0];
       cv::eigen(D, lambda, v);
 
       double theta = atan2(v.at<double>(0, 1), v.at<double>(0, 0));
@@ -143,16 +174,9 @@ void ExtractLines(const cv::Mat &im, std::vector<Line2> &lines, int minlen,
       // build line
       if (confidence >= 200) { ////
         for (int pid : ids) {
-          pixelIdsSet[binId].erase(pid);
-          pixelIdsSet[(binId - 1 + numDir) % numDir].erase(pid);
-          pixelIdsSet[(binId + 1) % numDir].erase(pid);
+          binMasks[pid] &= ~consumeBits;
         }
 
-        auto xends = std::minmax_element(xs.begin(), xs.end());
-        auto yends = std::minmax_element(ys.begin(), ys.end());
-        double minx = *xends.first, maxx = *xends.second;
-        double miny = *yends.first, maxy = *yends.second;
-
         if (maxx <= xborderw || minx >= w - xborderw || maxy <= yborderw ||
             miny >= h - yborderw)
           continue;
@@ -168,36 +192,22 @@ void ExtractLines(const cv::Mat &im, std::vector<Line2> &lines, int minlen,
       }
     }
   }
-
-  std::cout << "done" << std::endl;
 }
 
-void ExtractLinesUsingLSD(const cv::Mat &im, std::vector<Line2> &lines,
-                          double minlen, int xbwidth, int ybwidth,
+void ExtractLinesUsingLSD(LSDContext &context, const cv::Mat &im,
+                          std::vector<Line2> &lines, double minlen,
+                          int xbwidth, int ybwidth,
                           std::vector<double> *lineWidths = nullptr,
                           std::vector<double> *anglePrecisions = nullptr,
                           std::vector<double> *negLog10NFAs = nullptr) {
 
-  cv::Mat gim;
-  cv::cvtColor(im, gim, CV_BGR2GRAY);
-  gim.convertTo(gim, CV_64FC1);
-  // cv::imshow("gim", gim);
-  // cv::waitKey();
-
-  int h = gim.rows;
-  int w = gim.cols;
-
-  double *imgData = new double[h * w];
-  for (int x = 0; x < w; x++) {
-    for (int y = 0; y < h; y++) {
-      imgData[x + y * w] = gim.at<double>(cv::Point(x, y));
-    }
-  }
+  int h = im.rows;
+  int w = im.cols;
 
   int nOut;
 
   // x1,y1,x2,y2,width,p,-log10(NFA)
-  double *linesData = lsd(&nOut, imgData, w, h);
+  const double *linesData = context.detect(im, nOut);
 
   lines.clear();
   lines.reserve(nOut);
@@ -235,18 +245,157 @@ void ExtractLinesUsingLSD(const cv::Mat &im, std::vector<Line2> &lines,
       negLog10NFAs->push_back(linesData[7 * i + 6]);
     }
   }
+}
+
+void ExtractLinesUsingTiledLSD(LSDContext &context, LSDContextPool &pool,
+                               const cv::Mat &im, std::vector<Line2> &lines,
+                               double minlen, int xbwidth, int ybwidth,
+                               int tileSize, int tileOverlap) {
+
+  int h = im.rows;
+  int w = im.cols;
+
+  // tile cores partition the image, tile rois pad the cores by tileOverlap
+  std::vector<cv::Rect> cores, rois;
+  for (int y = 0; y < h; y += tileSize) {
+    for (int x = 0; x < w; x += tileSize) {
+      cv::Rect core(x, y, std::min(tileSize, w - x), std::min(tileSize, h - y));
+      int x1 = std::max(0, x - tileOverlap);
+      int y1 = std::max(0, y - tileOverlap);
+      int x2 = std::min(w, core.x + core.width + tileOverlap);
+      int y2 = std::min(h, core.y + core.height + tileOverlap);
+      cores.push_back(core);
+      rois.emplace_back(x1, y1, x2 - x1, y2 - y1);
+    }
+  }
+
+  int ntiles = cores.size();
+  int concurrency = std::min(DefaultConcurrency(), ntiles);
+  // the first thread uses the caller's context, the others ones of the pool
+  std::vector<std::unique_ptr<LSDContext>> poolContexts(concurrency - 1);
+  for (auto &c : poolContexts) {
+    c = pool.acquire();
+  }
+  std::vector<std::vector<Line2>> ownedLines(ntiles), seamLines(ntiles);
+
+  ParallelStride(ntiles, concurrency, [&](int i, int t) {
+    std::vector<Line2> ls;
+    // no border filtering here, tile borders are not image borders
+    ExtractLinesUsingLSD(t == 0 ? context : *poolContexts[t - 1], im(rois[i]),
+                         ls, 0.0, -1, -1);
+    Point2 offset(rois[i].x, rois[i].y);
+    const cv::Rect &core = cores[i];
+    for (auto &l : ls) {
+      l += offset;
+      // each segment belongs to the tile whose core holds its center, this
+      // drops the copies detected again in the neighbors' overlaps
+      auto c = l.center();
+      if (c[0] < core.x || c[0] >= core.x + core.width || c[1] < core.y ||
+          c[1] >= core.y + core.height) {
+        continue;
+      }
+      // segments reaching out of the core may be cut by a seam
+      bool inCore = true;
+      for (auto &p : {l.first, l.second}) {
+        inCore = inCore && p[0] >= core.x + 1.0 &&
+                 p[0] <= core.x + core.width - 1.0 && p[1] >= core.y + 1.0 &&
+                 p[1] <= core.y + core.height - 1.0;
+      }
+      (inCore ? ownedLines[i] : seamLines[i]).push_back(l);
+    }
+  });
+  for (auto &c : poolContexts) {
+    pool.release(std::move(c));
+  }
 
-  delete[] linesData;
-  delete[] imgData;
+  std::vector<Line2> allSeamLines;
+  lines.clear();
+  for (int i = 0; i < ntiles; i++) {
+    lines.insert(lines.end(), ownedLines[i].begin(), ownedLines[i].end());
+    allSeamLines.insert(allSeamLines.end(), seamLines[i].begin(),
+                        seamLines[i].end());
+  }
+  auto stitched = MergeLines(allSeamLines, DegreesToRadians(3), 2.0, 2.0);
+  lines.insert(lines.end(), stitched.begin(), stitched.end());
+
+  // filter as ExtractLinesUsingLSD does on the whole image
+  auto isBad = [minlen, xbwidth, ybwidth, w, h](const Line2 &line) {
+    return line.length() < minlen ||
+           line.first[0] <= xbwidth && line.second[0] <= xbwidth ||
+           line.first[0] >= w - xbwidth && line.second[0] >= w - xbwidth ||
+           line.first[1] <= ybwidth && line.second[1] <= ybwidth ||
+           line.first[1] >= h - ybwidth && line.second[1] >= h - ybwidth;
+  };
+  lines.erase(std::remove_if(lines.begin(), lines.end(), isBad), lines.end());
 }
 }
 
+LSDContext::LSDContext() : _ws(lsd_workspace_new()) {}
+
+LSDContext::~LSDContext() { lsd_workspace_free(_ws); }
+
+std::unique_ptr<LSDContext> LSDContextPool::acquire() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (_free.empty()) {
+    return std::make_unique<LSDContext>();
+  }
+  auto context = std::move(_free.back());
+  _free.pop_back();
+  return context;
+}
+
+void LSDContextPool::release(std::unique_ptr<LSDContext> context) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  _free.push_back(std::move(context));
+}
+
+const double *LSDContext::detect(const cv::Mat &im, int &nOut, double scale) {
+  const cv::Mat *gim = &im;
+  if (im.type() == CV_8UC3) {
+    cv::cvtColor(im, _gray, CV_BGR2GRAY);
+    gim = &_gray;
+  } else if (im.type() == CV_8UC4) {
+    cv::cvtColor(im, _gray, CV_BGRA2GRAY);
+    gim = &_gray;
+  }
+
+  int pixelType = LSD_PIXEL_UCHAR;
+  switch (gim->type()) {
+  case CV_8UC1:
+    pixelType = LSD_PIXEL_UCHAR;
+    break;
+  case CV_32FC1:
+    pixelType = LSD_PIXEL_FLOAT;
+    break;
+  case CV_64FC1:
+    pixelType = LSD_PIXEL_DOUBLE;
+    break;
+  default:
+    SHOULD_NEVER_BE_CALLED("unsupported image type");
+  }
+
+  return lsd_workspace_scale(_ws, &nOut, gim->ptr(), pixelType, gim->cols,
+                             gim->rows, (int)gim->step[0], scale);
+}
+
 LineSegmentExtractor::Feature LineSegmentExtractor::
 operator()(const Image &im) const {
+  static thread_local LSDContext context;
+  return (*this)(im, context);
+}
+
+LineSegmentExtractor::Feature LineSegmentExtractor::
+operator()(const Image &im, LSDContext &context) const {
   LineSegmentExtractor::Feature lines;
-  if (_params.algorithm == LSD) {
-    ExtractLinesUsingLSD(im, lines, _params.minLength, _params.xBorderWidth,
-                         _params.yBorderWidth);
+  if (_params.algorithm == LSD && _params.tileSize > 0 &&
+      (im.cols > _params.tileSize || im.rows > _params.tileSize)) {
+    ExtractLinesUsingTiledLSD(context, *_tileContexts, im, lines,
+                              _params.minLength, _params.xBorderWidth,
+                              _params.yBorderWidth, _params.tileSize,
+                              _params.tileOverlap);
+  } else if (_params.algorithm == LSD) {
+    ExtractLinesUsingLSD(context, im, lines, _params.minLength,
+                         _params.xBorderWidth, _params.yBorderWidth);
   } else if (_params.algorithm == GradientGrouping) {
     ExtractLines(im, lines, _params.minLength, _params.xBorderWidth,
                  _params.yBorderWidth, _params.numDirs);
@@ -256,22 +405,91 @@ operator()(const Image &im) const {
 
 LineSegmentExtractor::Feature LineSegmentExtractor::
 operator()(const Image &im, int pyramidHeight, int minSize) const {
-  Feature lines;
-  Image image = im.clone();
+  // build all levels first
+  std::vector<Image> levels;
+  Image image = im;
   for (int i = 0; i < pyramidHeight; i++) {
     if (image.cols < minSize || image.rows < minSize)
       break;
-    Feature ls = (*this)(image);
-    for (auto &l : ls) {
-      lines.push_back(l * (double(im.cols) / image.cols));
-    }
+    levels.push_back(image);
     cv::pyrDown(image, image);
   }
-  return lines;
+  if (levels.empty()) {
+    return Feature();
+  }
+
+  // extract on all levels concurrently
+  int nlevels = levels.size();
+  std::vector<Feature> levelLines(nlevels);
+  ParallelRun(nlevels, nlevels, [this, &im, &levels, &levelLines](int i) {
+    LSDContext context;
+    levelLines[i] = (*this)(levels[i], context);
+    for (auto &l : levelLines[i]) {
+      l *= double(im.cols) / levels[i].cols;
+    }
+  });
+
+  std::vector<double> scales(nlevels);
+  for (int i = 0; i < nlevels; i++) {
+    scales[i] = double(im.cols) / levels[i].cols;
+  }
+  return MergeLinesOfPyramid(std::move(levelLines), scales);
 }
 
 #pragma endregion LineSegmentExtractor
 
+std::vector<Line2>
+MergeLinesOfPyramid(std::vector<std::vector<Line2>> levelLines,
+                    const std::vector<double> &scales) {
+  assert(levelLines.size() == scales.size());
+  if (levelLines.empty()) {
+    return std::vector<Line2>();
+  }
+  std::vector<Line2> lines = std::move(levelLines.front());
+  RTreeMap<Line2, int> lineBoxes;
+  for (int i = 0; i < lines.size(); i++) {
+    lineBoxes.emplace(lines[i], i);
+  }
+  for (int k = 1; k < levelLines.size(); k++) {
+    double scale = scales[k];
+    for (auto &l : levelLines[k]) {
+      int fineId = -1;
+      lineBoxes.search(
+          BoundingBox(l).expand(scale),
+          [&lines, &l, &fineId, scale](const std::pair<Line2, int> &f) {
+            if (CanMergeLines(lines[f.second], l, DegreesToRadians(2), scale,
+                              0.0)) {
+              fineId = f.second;
+              return false;
+            }
+            return true;
+          });
+      if (fineId == -1) {
+        lines.push_back(l);
+        lineBoxes.emplace(l, lines.size() - 1);
+        continue;
+      }
+      // extend the finer line along its own direction
+      Line2 &fine = lines[fineId];
+      Vec2 dir = normalize(fine.direction());
+      double len = fine.length();
+      double r1 = (l.first - fine.first).dot(dir);
+      double r2 = (l.second - fine.first).dot(dir);
+      if (r1 >= 0 && r1 <= len && r2 >= 0 && r2 <= len) {
+        continue;
+      }
+      Point2 anchor = fine.first;
+      fine.first = anchor + dir * std::min({0.0, r1, r2});
+      fine.second = anchor + dir * std::max({len, r1, r2});
+      // index the extended box under the same id, the old box lies inside it
+      // so searches reaching the old one reach the new one as well
+      lineBoxes.emplace(fine, fineId);
+    }
+  }
+  return lines;
+}
+
+
 std::vector<HPoint2>
 ComputeLineIntersections(const std::vector<Line2> &lines,
                          std::vector<std::pair<int, int>> *lineids,
@@ -361,247 +579,558 @@ ComputeLineIntersections(const std::vector<Line3> &lines,
   return interps;
 }
 
-DenseMatd ClassifyLines(std::vector<Classified<Line2>> &lines,
-                        const std::vector<HPoint2> &vps, double angleThreshold,
-                        double sigma, double scoreThreshold,
-                        double avoidVPDistanceThreshold) {
+namespace {
 
-  size_t nlines = lines.size();
-  size_t npoints = vps.size();
-  DenseMatd linescorestable(nlines, npoints, 0.0);
-  for (int i = 0; i < nlines; i++) {
-    auto &line = lines[i];
-    // classify lines
-    line.claz = -1;
-
-    // get score based on angle
-    for (int j = 0; j < vps.size(); j++) {
-      auto &point = vps[j];
-      double angle =
-          std::min(AngleBetweenDirected(
-                       line.component.direction(),
-                       (point - HPoint2(line.component.center())).numerator),
-                   AngleBetweenDirected(
-                       -line.component.direction(),
-                       (point - HPoint2(line.component.center())).numerator));
-      double score = exp(-(angle / angleThreshold) * (angle / angleThreshold) /
-                         sigma / sigma / 2);
-      if (avoidVPDistanceThreshold >= 0.0 &&
-          Distance(point.value(), line.component) < avoidVPDistanceThreshold) {
-        linescorestable(i, j) = -1.0;
-      } else {
-        linescorestable(i, j) = (angle > angleThreshold) ? 0 : score;
+// the top two scores of a row, ties keep the first index
+template <class T>
+inline void TopTwo(const T *scores, int n, int &maxId, T &maxScore,
+                   T &secondScore) {
+  maxId = -1;
+  maxScore = secondScore = -std::numeric_limits<T>::infinity();
+  for (int j = 0; j < n; j++) {
+    if (scores[j] > maxScore) {
+      secondScore = maxScore;
+      maxScore = scores[j];
+      maxId = j;
+    } else if (scores[j] > secondScore) {
+      secondScore = scores[j];
+    }
+  }
+}
+
+// lines are classified in blocks of LinesPerBlock
+// - the coordinates of the lines of a block are unpacked into flat arrays
+//   beside those of the vps, the angles of all (line, vp) pairs of the block
+//   are computed in one pass, then their gaussian scores by a single cv::exp
+//   call, which runs on SIMD in OpenCV
+// - acos/asin stay scalar, they are only evaluated for pairs within
+//   angleThreshold
+const int LinesPerBlock = 256;
+
+// scores of all lines (rows) against all vps (cols) are written to the
+// row-major table, lines are classified on the fly
+// - rowStride = 0 reuses a single row when the table is not wanted
+template <class T>
+void ClassifyLines2D(std::vector<Classified<Line2>> &lines,
+                     const std::vector<HPoint2> &vps, double angleThreshold,
+                     double sigma, double scoreThreshold,
+                     double avoidVPDistanceThreshold, T *table,
+                     size_t rowStride) {
+  const int nlines = lines.size();
+  const int npoints = vps.size();
+  if (npoints == 0) {
+    for (auto &line : lines) {
+      line.claz = -1;
+    }
+    return;
+  }
+
+  std::vector<double> vxs(npoints), vys(npoints), vws(npoints);
+  for (int j = 0; j < npoints; j++) {
+    vxs[j] = vps[j].numerator[0];
+    vys[j] = vps[j].numerator[1];
+    vws[j] = vps[j].denominator;
+  }
+  // angle > angleThreshold <=> |cos(angle)| < minAbsCos
+  const double minAbsCos =
+      angleThreshold < M_PI_2 ? cos(angleThreshold) : -1.0;
+  const double scoreFactor = -0.5 / Square(angleThreshold * sigma);
+  const bool avoidVP = avoidVPDistanceThreshold >= 0.0;
+  const double avoidDistance2 = Square(avoidVPDistanceThreshold);
+
+  // the lines of a block
+  const int B = LinesPerBlock;
+  std::vector<double> x1s(B), y1s(B), dxs(B), dys(B), cxs(B), cys(B);
+  std::vector<double> dirNorms(B), len2s(B);
+  // the exponents of the scores and whether pairs are within angleThreshold
+  cv::Mat_<double> exponents(1, B * npoints);
+  cv::Mat gaussians;
+  std::vector<uint8_t> withinAngle(B * npoints);
+
+  for (int i0 = 0; i0 < nlines; i0 += B) {
+    const int m = std::min(B, nlines - i0);
+    for (int k = 0; k < m; k++) {
+      auto &line = lines[i0 + k].component;
+      const Vec2 dir = line.direction();
+      const Point2 c = line.center();
+      x1s[k] = line.first[0];
+      y1s[k] = line.first[1];
+      dxs[k] = dir[0];
+      dys[k] = dir[1];
+      cxs[k] = c[0];
+      cys[k] = c[1];
+      len2s[k] = dir.dot(dir);
+      dirNorms[k] = sqrt(len2s[k]);
+    }
+
+    double *ex = exponents[0];
+    for (int k = 0; k < m; k++) {
+      for (int j = 0; j < npoints; j++) {
+        // direction from center to vp
+        double vx = vxs[j] - cxs[k] * vws[j];
+        double vy = vys[j] - cys[k] * vws[j];
+        double cosAngle = abs(dxs[k] * vx + dys[k] * vy) / dirNorms[k] /
+                          sqrt(vx * vx + vy * vy);
+        bool within = !(cosAngle < minAbsCos);
+        double angle =
+            within && cosAngle < 1.0 - 1e-9 ? acos(cosAngle) : 0.0;
+        ex[k * npoints + j] = angle * angle * scoreFactor;
+        withinAngle[k * npoints + j] = within;
       }
     }
+    cv::exp(exponents.colRange(0, m * npoints), gaussians);
+    const double *gs = gaussians.ptr<double>();
+
+    for (int k = 0; k < m; k++) {
+      T *scores = table + (i0 + k) * rowStride;
+      for (int j = 0; j < npoints; j++) {
+        double score = withinAngle[k * npoints + j] ? gs[k * npoints + j] : 0.0;
+        if (avoidVP) {
+          // distance from the vp to the segment
+          double px = vxs[j] / vws[j], py = vys[j] / vws[j];
+          double t = ((px - x1s[k]) * dxs[k] + (py - y1s[k]) * dys[k]) /
+                     len2s[k];
+          t = BoundBetween(t, 0.0, 1.0);
+          double d2 = Square(px - x1s[k] - t * dxs[k]) +
+                      Square(py - y1s[k] - t * dys[k]);
+          if (d2 < avoidDistance2) {
+            score = -1.0;
+          }
+        }
+        scores[j] = static_cast<T>(score);
+      }
+
+      int maxId;
+      T maxScore, secondScore;
+      TopTwo(scores, npoints, maxId, maxScore, secondScore);
+      lines[i0 + k].claz = maxScore > scoreThreshold ? maxId : -1;
+    }
+  }
+}
+
+template <class T>
+void ClassifyLines3D(std::vector<Classified<Line3>> &lines,
+                     const std::vector<Vec3> &vps, double angleThreshold,
+                     double sigma, double scoreThreshold,
+                     double avoidVPAngleThreshold, double scoreAdvatangeRatio,
+                     T *table, size_t rowStride) {
+  const int nlines = lines.size();
+  const int npoints = vps.size();
+  if (npoints == 0) {
+    for (auto &line : lines) {
+      line.claz = -1;
+    }
+    return;
+  }
+
+  // raw vps are used for angles, normalized ones for distances
+  std::vector<double> pxs(npoints), pys(npoints), pzs(npoints);
+  std::vector<double> uxs(npoints), uys(npoints), uzs(npoints);
+  for (int j = 0; j < npoints; j++) {
+    pxs[j] = vps[j][0];
+    pys[j] = vps[j][1];
+    pzs[j] = vps[j][2];
+    Vec3 u = normalize(vps[j]);
+    uxs[j] = u[0];
+    uys[j] = u[1];
+    uzs[j] = u[2];
+  }
+  // angle > angleThreshold <=> |sin(angle)| > maxAbsSin
+  const double maxAbsSin =
+      angleThreshold < M_PI_2 ? sin(angleThreshold) : 1.0;
+  const double scoreFactor = -0.5 / Square(angleThreshold * sigma);
+  const bool avoidVP = avoidVPAngleThreshold >= 0.0;
+  const double avoidDistance2 = Square(2.0 * sin(avoidVPAngleThreshold / 2.0));
+
+  // the lines of a block: normals, start points and chords from a to b
+  const int B = LinesPerBlock;
+  std::vector<double> nxs(B), nys(B), nzs(B), axs(B), ays(B), azs(B);
+  std::vector<double> dxs(B), dys(B), dzs(B), len2s(B), ads(B);
+  // the exponents of the scores and whether pairs are within angleThreshold
+  cv::Mat_<double> exponents(1, B * npoints);
+  cv::Mat gaussians;
+  std::vector<uint8_t> withinAngle(B * npoints);
+
+  for (int i0 = 0; i0 < nlines; i0 += B) {
+    const int m = std::min(B, nlines - i0);
+    for (int k = 0; k < m; k++) {
+      auto &line = lines[i0 + k].component;
+      const Vec3 a = normalize(line.first);
+      const Vec3 b = normalize(line.second);
+      Vec3 n = line.first.cross(line.second);
+      n /= norm(n);
+      const Vec3 d = b - a;
+      nxs[k] = n[0];
+      nys[k] = n[1];
+      nzs[k] = n[2];
+      axs[k] = a[0];
+      ays[k] = a[1];
+      azs[k] = a[2];
+      dxs[k] = d[0];
+      dys[k] = d[1];
+      dzs[k] = d[2];
+      len2s[k] = d.dot(d);
+      ads[k] = a.dot(d);
+    }
+
+    double *ex = exponents[0];
+    for (int k = 0; k < m; k++) {
+      for (int j = 0; j < npoints; j++) {
+        double s = abs(nxs[k] * pxs[j] + nys[k] * pys[j] + nzs[k] * pzs[j]);
+        bool within = !(s > maxAbsSin);
+        double angle = within ? asin(s) : 0.0;
+        ex[k * npoints + j] = angle * angle * scoreFactor;
+        withinAngle[k * npoints + j] = within;
+      }
+    }
+    cv::exp(exponents.colRange(0, m * npoints), gaussians);
+    const double *gs = gaussians.ptr<double>();
+
+    for (int k = 0; k < m; k++) {
+      T *scores = table + (i0 + k) * rowStride;
+      for (int j = 0; j < npoints; j++) {
+        double score = withinAngle[k * npoints + j] ? gs[k * npoints + j] : 0.0;
+        if (avoidVP) {
+          // distance from +-u to the chord, |u| = |a| = 1
+          double ud = uxs[j] * dxs[k] + uys[j] * dys[k] + uzs[j] * dzs[k];
+          double ua = uxs[j] * axs[k] + uys[j] * ays[k] + uzs[j] * azs[k];
+          double t1 = BoundBetween((ud - ads[k]) / len2s[k], 0.0, 1.0);
+          double t2 = BoundBetween((-ud - ads[k]) / len2s[k], 0.0, 1.0);
+          double d1 =
+              2.0 - 2.0 * ua + t1 * t1 * len2s[k] - 2.0 * t1 * (ud - ads[k]);
+          double d2 =
+              2.0 + 2.0 * ua + t2 * t2 * len2s[k] - 2.0 * t2 * (-ud - ads[k]);
+          if (std::min(d1, d2) < avoidDistance2) {
+            score = -1.0;
+          }
+        }
+        scores[j] = static_cast<T>(score);
+      }
 
-    double curscore = scoreThreshold;
-    for (int j = 0; j < vps.size(); j++) {
-      if (linescorestable(i, j) > curscore) {
-        line.claz = j;
-        curscore = linescorestable(i, j);
+      int maxId;
+      T maxScore, secondScore;
+      TopTwo(scores, npoints, maxId, maxScore, secondScore);
+      lines[i0 + k].claz = -1;
+      if (maxScore >= scoreThreshold &&
+          (npoints <= 1 || maxScore - secondScore >= scoreAdvatangeRatio)) {
+        lines[i0 + k].claz = maxId;
       }
     }
   }
+}
+}
 
+DenseMatd ClassifyLines(std::vector<Classified<Line2>> &lines,
+                        const std::vector<HPoint2> &vps, double angleThreshold,
+                        double sigma, double scoreThreshold,
+                        double avoidVPDistanceThreshold) {
+  DenseMatd linescorestable(lines.size(), vps.size(), 0.0);
+  ClassifyLines2D(lines, vps, angleThreshold, sigma, scoreThreshold,
+                  avoidVPDistanceThreshold, linescorestable.ptr<double>(),
+                  vps.size());
   return linescorestable;
 }
 
+void ClassifyLines(std::vector<Classified<Line2>> &lines,
+                   const std::vector<HPoint2> &vps,
+                   DenseMat<float> *lineVPScores, double angleThreshold,
+                   double sigma, double scoreThreshold,
+                   double avoidVPDistanceThreshold) {
+  if (lineVPScores) {
+    lineVPScores->create(lines.size(), vps.size());
+    ClassifyLines2D(lines, vps, angleThreshold, sigma, scoreThreshold,
+                    avoidVPDistanceThreshold, lineVPScores->ptr<float>(),
+                    vps.size());
+  } else {
+    std::vector<float> scores(vps.size());
+    ClassifyLines2D(lines, vps, angleThreshold, sigma, scoreThreshold,
+                    avoidVPDistanceThreshold, scores.data(), 0);
+  }
+}
+
 DenseMatd ClassifyLines(std::vector<Classified<Line3>> &lines,
                         const std::vector<Vec3> &vps, double angleThreshold,
                         double sigma, double scoreThreshold,
                         double avoidVPAngleThreshold,
                         double scoreAdvatangeRatio) {
+  DenseMatd linescorestable(lines.size(), vps.size(), 0.0);
+  ClassifyLines3D(lines, vps, angleThreshold, sigma, scoreThreshold,
+                  avoidVPAngleThreshold, scoreAdvatangeRatio,
+                  linescorestable.ptr<double>(), vps.size());
+  return linescorestable;
+}
 
-  size_t nlines = lines.size();
-  size_t npoints = vps.size();
-
-  DenseMatd linescorestable(nlines, npoints, 0.0);
-
-  for (size_t i = 0; i < nlines; i++) {
-    const Vec3 &a = lines[i].component.first;
-    const Vec3 &b = lines[i].component.second;
-    Vec3 normab = a.cross(b);
-    normab /= norm(normab);
-
-    // get score based on angle
-    for (int j = 0; j < npoints; j++) {
-      const Vec3 &point = vps[j];
-      double angle = abs(asin(normab.dot(point)));
-      double score = exp(-(angle / angleThreshold) * (angle / angleThreshold) /
-                         sigma / sigma / 2);
-      if (avoidVPAngleThreshold >= 0.0 &&
-          std::min(Distance(normalize(point), normalize(lines[i].component)),
-                   Distance(normalize(-point),
-                            normalize(lines[i].component))) <
-              2.0 * sin(avoidVPAngleThreshold /
-                        2.0)) { // avoid that a line belongs to its nearby vp
-        linescorestable(i, j) = -1.0;
-      } else {
-        linescorestable(i, j) = (angle > angleThreshold) ? 0 : score;
-      }
+void ClassifyLines(std::vector<Classified<Line3>> &lines,
+                   const std::vector<Vec3> &vps, DenseMat<float> *lineVPScores,
+                   double angleThreshold, double sigma, double scoreThreshold,
+                   double avoidVPAngleThreshold, double scoreAdvatangeRatio) {
+  if (lineVPScores) {
+    lineVPScores->create(lines.size(), vps.size());
+    ClassifyLines3D(lines, vps, angleThreshold, sigma, scoreThreshold,
+                    avoidVPAngleThreshold, scoreAdvatangeRatio,
+                    lineVPScores->ptr<float>(), vps.size());
+  } else {
+    std::vector<float> scores(vps.size());
+    ClassifyLines3D(lines, vps, angleThreshold, sigma, scoreThreshold,
+                    avoidVPAngleThreshold, scoreAdvatangeRatio, scores.data(),
+                    0);
+  }
+}
+
+namespace {
+
+// merges lines of a group sharing (approximately) the same great circle
+std::vector<Line3> MergeLineGroup(const std::vector<Line3> &lines,
+                                  const std::vector<Vec3> &normals,
+                                  const std::vector<int> &lineids,
+                                  double mergeAngleThres) {
+  // optimize the normal
+  Vec3 normal;
+  for (int i : lineids) {
+    Vec3 nn =
+        normals[i] * AngleBetweenDirected(lines[i].first, lines[i].second);
+    if (nn.dot(normal) < 0) {
+      nn = -nn;
     }
+    normal += nn;
+  }
+  normal = normalize(normal);
+
+  Vec3 x, y;
+  std::tie(x, y) = ProposeXYDirectionsFromZDirection(normal);
+  assert(x.cross(y).dot(normal) > 0);
 
-    // classify lines
-    lines[i].claz = -1;
-    std::vector<double> scores(npoints, 0.0);
-    for (int j = 0; j < npoints; j++) {
-      scores[j] = linescorestable(i, j);
+  std::vector<std::pair<double, bool>> angleRangeEnds;
+  angleRangeEnds.reserve(lineids.size() * 2);
+  for (int i : lineids) {
+    auto &line = lines[i];
+    double angleFrom = atan2(line.first.dot(y), line.first.dot(x));
+    double angleTo = atan2(line.second.dot(y), line.second.dot(x));
+    assert(IsBetween(angleFrom, -M_PI, M_PI) &&
+           IsBetween(angleTo, -M_PI, M_PI));
+
+    if (normals[i].dot(normal) < 0) {
+      std::swap(angleFrom, angleTo);
     }
-    int maxClaz =
-        std::max_element(scores.begin(), scores.end()) - scores.begin();
-    std::sort(scores.begin(), scores.end(), std::greater<>());
-    if (scores.front() >= scoreThreshold &&
-        (npoints <= 1 || scores.front() - scores[1] >= scoreAdvatangeRatio)) {
-      lines[i].claz = maxClaz;
+
+    if (angleFrom < angleTo) {
+      angleRangeEnds.emplace_back(angleFrom, true);
+      angleRangeEnds.emplace_back(angleTo, false);
+    } else {
+      angleRangeEnds.emplace_back(angleFrom, true);
+      angleRangeEnds.emplace_back(angleTo + M_PI * 2, false);
     }
   }
 
-  return linescorestable;
+  std::sort(
+      angleRangeEnds.begin(), angleRangeEnds.end(),
+      [](const std::pair<double, bool> &a, const std::pair<double, bool> &b) {
+        return a.first < b.first;
+      });
+
+  int occupation = 0;
+  bool occupied = false;
+
+  std::vector<double> mergedAngleRanges;
+  for (auto &stop : angleRangeEnds) {
+    if (stop.second) {
+      occupation++;
+    } else {
+      occupation--;
+    }
+    assert(occupation >= 0);
+    if (!occupied && occupation > 0) {
+      mergedAngleRanges.push_back(stop.first);
+      occupied = true;
+    } else if (occupied && occupation == 0) {
+      mergedAngleRanges.push_back(stop.first);
+      occupied = false;
+    }
+  }
+
+  // merge ranges
+  if (mergeAngleThres > 0) {
+    std::vector<double> mergedAngleRanges2;
+    mergedAngleRanges2.reserve(mergedAngleRanges.size());
+    for (int i = 0; i < mergedAngleRanges.size(); i += 2) {
+      if (mergedAngleRanges2.empty()) {
+        mergedAngleRanges2.push_back(mergedAngleRanges[i]);
+        mergedAngleRanges2.push_back(mergedAngleRanges[i + 1]);
+        continue;
+      }
+      double &lastEnd = mergedAngleRanges2.back();
+      if (mergedAngleRanges[i] >= lastEnd &&
+              mergedAngleRanges[i] - lastEnd < mergeAngleThres ||
+          mergedAngleRanges[i] < lastEnd &&
+              mergedAngleRanges[i] + M_PI * 2 - lastEnd < mergeAngleThres) {
+        lastEnd = mergedAngleRanges[i + 1];
+      } else {
+        mergedAngleRanges2.push_back(mergedAngleRanges[i]);
+        mergedAngleRanges2.push_back(mergedAngleRanges[i + 1]);
+      }
+    }
+    mergedAngleRanges = std::move(mergedAngleRanges2);
+  }
+
+  assert(mergedAngleRanges.size() % 2 == 0);
+
+  // make lines
+  std::vector<Line3> merged;
+  merged.reserve(mergedAngleRanges.size() / 2);
+  for (int i = 0; i < mergedAngleRanges.size(); i += 2) {
+    Vec3 from = x * cos(mergedAngleRanges[i]) + y * sin(mergedAngleRanges[i]);
+    Vec3 to =
+        x * cos(mergedAngleRanges[i + 1]) + y * sin(mergedAngleRanges[i + 1]);
+    merged.emplace_back(from, to);
+  }
+  return merged;
+}
 }
 
 std::vector<Line3> MergeLines(const std::vector<Line3> &lines,
                               double angleThres, double mergeAngleThres) {
 
   assert(angleThres < M_PI_4);
-  RTreeMap<Vec3, int> lineNormals;
-  std::vector<std::pair<std::vector<int>, Vec3>> groups;
-  for (int i = 0; i < lines.size(); i++) {
-    auto &line = lines[i];
-    auto n = normalize(line.first.cross(line.second));
-
-    int nearestGroupId = -1;
-    double minAngle = angleThres;
-    lineNormals.search(
-        BoundingBox(n).expand(angleThres * 3),
-        [&nearestGroupId, &minAngle, &n](const std::pair<Vec3, int> &ln) {
-          double angle = AngleBetweenUndirected(ln.first, n);
-          if (angle < minAngle) {
-            minAngle = angle;
-            nearestGroupId = ln.second;
-          }
-          return true;
-        });
-
-    if (nearestGroupId != -1) { // is in some group
-      groups[nearestGroupId].first.push_back(i);
-    } else { // create a new group
-      groups.emplace_back(std::vector<int>{i}, n);
-      lineNormals.emplace(n, groups.size() - 1);
+  const int n = lines.size();
+  const int concurrency = DefaultConcurrency();
+
+  std::vector<Vec3> normals(n);
+  ParallelStride(n, concurrency, [&](int i, int) {
+    normals[i] = normalize(lines[i].first.cross(lines[i].second));
+  });
+
+  // group seeds: a line becomes a seed if no earlier seed is within angleThres
+  // of its normal
+  // - seeds are at least angleThres away from each other so each grid cell
+  //   only holds a few of them
+  DirectionMap<int> seedDirs(angleThres);
+  std::vector<int> seeds;
+  std::vector<int> groupOfLine(n, -1);
+  for (int i = 0; i < n; i++) {
+    if (!seedDirs.contains(normals[i], angleThres)) {
+      groupOfLine[i] = seeds.size();
+      seedDirs.emplace(normals[i], seeds.size());
+      seeds.push_back(i);
     }
   }
 
-  // optimize normals
-  auto calcWeightedNormal = [&lines](int lineid) {
-    auto &line = lines[lineid];
-    return normalize(line.first.cross(line.second)) *
-           AngleBetweenDirected(line.first, line.second);
-  };
-  for (auto &g : groups) {
-    auto &lineids = g.first;
-    Vec3 nsum = calcWeightedNormal(lineids.front());
-    for (int i = 1; i < g.first.size(); i++) {
-      Vec3 n = calcWeightedNormal(lineids[i]);
-      if (n.dot(nsum) < 0) {
-        n = -n;
-      }
-      nsum += n;
+  // join the nearest seed created before the line
+  ParallelStride(n, concurrency, [&](int i, int) {
+    if (groupOfLine[i] != -1) {
+      return;
     }
-    g.second = normalize(nsum);
+    double minAngle = angleThres;
+    seedDirs.search(normals[i], angleThres,
+                    [&](const std::pair<Vec3, int> &seed) {
+                      int g = seed.second;
+                      if (seeds[g] > i) {
+                        return true;
+                      }
+                      double angle = AngleBetweenDirected(normals[seeds[g]],
+                                                          normals[i]);
+                      if (angle < minAngle ||
+                          (angle == minAngle && groupOfLine[i] != -1 &&
+                           g < groupOfLine[i])) {
+                        minAngle = angle;
+                        groupOfLine[i] = g;
+                      }
+                      return true;
+                    });
+    assert(groupOfLine[i] != -1);
+  });
+
+  std::vector<std::vector<int>> groups(seeds.size());
+  for (int i = 0; i < n; i++) {
+    groups[groupOfLine[i]].push_back(i);
   }
 
+  // merge each group
+  std::vector<std::vector<Line3>> mergedOfGroups(groups.size());
+  const int groupsNum = groups.size();
+  ParallelStride(groupsNum, concurrency, [&](int gid, int) {
+    mergedOfGroups[gid] =
+        MergeLineGroup(lines, normals, groups[gid], mergeAngleThres);
+  });
+
   std::vector<Line3> merged;
   merged.reserve(groups.size() * 2);
+  for (auto &ls : mergedOfGroups) {
+    merged.insert(merged.end(), ls.begin(), ls.end());
+  }
+  return merged;
+}
 
-  // merge the group
-  for (auto &g : groups) {
-    auto &normal = g.second;
-    Vec3 x, y;
-    std::tie(x, y) = ProposeXYDirectionsFromZDirection(normal);
-    assert(x.cross(y).dot(normal) > 0);
-
-    std::vector<std::pair<double, bool>> angleRangeEnds;
-    angleRangeEnds.reserve(g.first.size() * 2);
-    for (int i : g.first) {
-      auto &line = lines[i];
-      auto &n = normalize(line.first.cross(line.second));
-
-      double angleFrom = atan2(line.first.dot(y), line.first.dot(x));
-      double angleTo = atan2(line.second.dot(y), line.second.dot(x));
-      assert(IsBetween(angleFrom, -M_PI, M_PI) &&
-             IsBetween(angleTo, -M_PI, M_PI));
-
-      if (n.dot(normal) < 0) {
-        std::swap(angleFrom, angleTo);
-      }
+std::vector<Line2> MergeLines(const std::vector<Line2> &lines,
+                              double angleThres, double distanceThres,
+                              double gapThres) {
 
-      if (angleFrom < angleTo) {
-        angleRangeEnds.emplace_back(angleFrom, true);
-        angleRangeEnds.emplace_back(angleTo, false);
-      } else {
-        angleRangeEnds.emplace_back(angleFrom, true);
-        angleRangeEnds.emplace_back(angleTo + M_PI * 2, false);
-      }
-    }
+  int n = lines.size();
+  std::vector<std::pair<Line2, int>> lineItems(n);
+  for (int i = 0; i < n; i++) {
+    lineItems[i] = std::make_pair(lines[i], i);
+  }
+  RTreeMap<Line2, int> lineBoxes(lineItems.begin(), lineItems.end());
 
-    std::sort(
-        angleRangeEnds.begin(), angleRangeEnds.end(),
-        [](const std::pair<double, bool> &a, const std::pair<double, bool> &b) {
-          return a.first < b.first;
+  // group
+  std::vector<int> parents(n);
+  std::iota(parents.begin(), parents.end(), 0);
+  std::function<int(int)> root = [&parents, &root](int i) {
+    return parents[i] == i ? i : (parents[i] = root(parents[i]));
+  };
+  for (int i = 0; i < n; i++) {
+    lineBoxes.search(
+        BoundingBox(lines[i]).expand(std::max(distanceThres, gapThres)),
+        [&lines, &parents, &root, angleThres, distanceThres, gapThres,
+         i](const std::pair<Line2, int> &l) {
+          int j = l.second;
+          if (j > i && CanMergeLines(lines[i], lines[j], angleThres,
+                                     distanceThres, gapThres)) {
+            parents[root(j)] = root(i);
+          }
+          return true;
         });
+  }
+  std::map<int, std::vector<int>> groups;
+  for (int i = 0; i < n; i++) {
+    groups[root(i)].push_back(i);
+  }
 
-    int occupation = 0;
-    bool occupied = false;
-
-    std::vector<double> mergedAngleRanges;
-    for (auto &stop : angleRangeEnds) {
-      if (stop.second) {
-        occupation++;
-      } else {
-        occupation--;
-      }
-      assert(occupation >= 0);
-      if (!occupied && occupation > 0) {
-        mergedAngleRanges.push_back(stop.first);
-        occupied = true;
-      } else if (occupied && occupation == 0) {
-        mergedAngleRanges.push_back(stop.first);
-        occupied = false;
-      }
+  // merge the group
+  std::vector<Line2> merged;
+  merged.reserve(groups.size());
+  for (auto &g : groups) {
+    auto &lineids = g.second;
+    if (lineids.size() == 1) {
+      merged.push_back(lines[lineids.front()]);
+      continue;
     }
-
-    // merge ranges
-    if (mergeAngleThres > 0) {
-      std::vector<double> mergedAngleRanges2;
-      mergedAngleRanges2.reserve(mergedAngleRanges.size());
-      for (int i = 0; i < mergedAngleRanges.size(); i += 2) {
-        if (mergedAngleRanges2.empty()) {
-          mergedAngleRanges2.push_back(mergedAngleRanges[i]);
-          mergedAngleRanges2.push_back(mergedAngleRanges[i + 1]);
-          continue;
-        }
-        double &lastEnd = mergedAngleRanges2.back();
-        if (mergedAngleRanges[i] >= lastEnd &&
-                mergedAngleRanges[i] - lastEnd < mergeAngleThres ||
-            mergedAngleRanges[i] < lastEnd &&
-                mergedAngleRanges[i] + M_PI * 2 - lastEnd < mergeAngleThres) {
-          lastEnd = mergedAngleRanges[i + 1];
-        } else {
-          mergedAngleRanges2.push_back(mergedAngleRanges[i]);
-          mergedAngleRanges2.push_back(mergedAngleRanges[i + 1]);
-        }
+    // length weighted direction and center
+    Vec2 dsum = lines[lineids.front()].direction();
+    Point2 csum = lines[lineids.front()].center() *
+                  lines[lineids.front()].length();
+    double lensum = lines[lineids.front()].length();
+    for (int k = 1; k < lineids.size(); k++) {
+      auto &line = lines[lineids[k]];
+      Vec2 d = line.direction();
+      if (d.dot(dsum) < 0) {
+        d = -d;
       }
-      mergedAngleRanges = std::move(mergedAngleRanges2);
+      dsum += d;
+      csum += line.center() * line.length();
+      lensum += line.length();
     }
-
-    assert(mergedAngleRanges.size() % 2 == 0);
-
-    // make lines
-    for (int i = 0; i < mergedAngleRanges.size(); i += 2) {
-      Vec3 from = x * cos(mergedAngleRanges[i]) + y * sin(mergedAngleRanges[i]);
-      Vec3 to =
-          x * cos(mergedAngleRanges[i + 1]) + y * sin(mergedAngleRanges[i + 1]);
-      merged.emplace_back(from, to);
+    Vec2 dir = normalize(dsum);
+    Point2 center = csum / lensum;
+    double from = std::numeric_limits<double>::max();
+    double to = std::numeric_limits<double>::lowest();
+    for (int lineid : lineids) {
+      for (auto &p : {lines[lineid].first, lines[lineid].second}) {
+        double r = (p - center).dot(dir);
+        from = std::min(from, r);
+        to = std::max(to, r);
+      }
     }
+    merged.emplace_back(center + dir * from, center + dir * to);
   }
 
   return merged;
@@ -1,10 +1,49 @@
 #pragma once
 
+#include <mutex>
+
 #include "basic_types.hpp"
 
+struct lsd_workspace_s;
+
 namespace pano {
 namespace core {
 
+// LSD context, owns the scratch buffers of the line segment detector
+// - buffers are reused across calls, so repeated detections on images of
+//   similar size do no large allocation
+// - not thread safe, use one context per thread
+// - computes in double precision only, float images are widened as read
+class LSDContext {
+public:
+  LSDContext();
+  ~LSDContext();
+  LSDContext(const LSDContext &) = delete;
+  LSDContext &operator=(const LSDContext &) = delete;
+
+  // detect on a CV_8UC1, CV_8UC3, CV_8UC4, CV_32FC1 or CV_64FC1 image
+  // - single channel images are read in place via their row pointers
+  // - returns nOut 7-tuples (x1,y1,x2,y2,width,p,-log10(NFA)), the array is
+  //   owned by the context and valid until the next call
+  const double *detect(const cv::Mat &im, int &nOut, double scale = 0.8);
+
+private:
+  lsd_workspace_s *_ws;
+  cv::Mat _gray;
+};
+
+// LSD contexts kept for reuse, thread safe
+class LSDContextPool {
+public:
+  // returns a free context, or a new one if none is free
+  std::unique_ptr<LSDContext> acquire();
+  void release(std::unique_ptr<LSDContext> context);
+
+private:
+  std::mutex _mutex;
+  std::vector<std::unique_ptr<LSDContext>> _free;
+};
+
 // line extractor
 class LineSegmentExtractor {
 public:
@@ -13,28 +52,41 @@ public:
   struct Params {
     inline Params()
         : minLength(15), xBorderWidth(1), yBorderWidth(1), numDirs(8),
-          algorithm(LSD) {}
+          algorithm(LSD), tileSize(0), tileOverlap(32) {}
     int minLength;
     int xBorderWidth, yBorderWidth;
     int numDirs;
     Algorithm algorithm;
-    template <class Archive> inline void serialize(Archive &ar) {
+    // LSD only: when tileSize > 0, images larger than a tile are split into
+    // tileSize x tileSize tiles padded by tileOverlap pixels, detected in
+    // parallel, and the segments crossing tile seams are merged
+    int tileSize;
+    int tileOverlap;
+    template <class Archive>
+    inline void serialize(Archive &ar, std::uint32_t version) {
       ar(minLength, xBorderWidth, yBorderWidth, numDirs, algorithm);
+      if (version > 0) {
+        ar(tileSize, tileOverlap);
+      }
     }
   };
 
 public:
   inline explicit LineSegmentExtractor(const Params &params = Params())
-      : _params(params) {}
+      : _params(params), _tileContexts(std::make_shared<LSDContextPool>()) {}
   const Params &params() const { return _params; }
   Params &params() { return _params; }
   Feature operator()(const Image &im) const;
+  Feature operator()(const Image &im, LSDContext &context) const;
   Feature operator()(const Image &im, int pyramidHeight,
                      int minSize = 100) const;
   template <class Archive> inline void serialize(Archive &ar) { ar(_params); }
 
 private:
   Params _params;
+  // contexts of the threads of tiled detection besides the caller's,
+  // shared by copies of the extractor
+  std::shared_ptr<LSDContextPool> _tileContexts;
 };
 
 // compute line intersections
@@ -63,14 +115,51 @@ DenseMatd ClassifyLines(std::vector<Classified<Line3>> &lines,
                         double avoidVPAngleThreshold = M_PI / 18.0,
                         double scoreAdvatangeRatio = 0.0);
 
+// classify lines with scores stored as float, or not stored if lineVPScores
+// is null
+void ClassifyLines(std::vector<Classified<Line2>> &lines,
+                   const std::vector<HPoint2> &vps,
+                   DenseMat<float> *lineVPScores,
+                   double angleThreshold = M_PI / 3.0, double sigma = 0.1,
+                   double scoreThreshold = 0.8,
+                   double avoidVPDistanceThreshold = -1.0);
+void ClassifyLines(std::vector<Classified<Line3>> &lines,
+                   const std::vector<Vec3> &vps, DenseMat<float> *lineVPScores,
+                   double angleThreshold, double sigma,
+                   double scoreThreshold = 0.8,
+                   double avoidVPAngleThreshold = M_PI / 18.0,
+                   double scoreAdvatangeRatio = 0.0);
+
 // MergeLines
+// - lines whose great circle normals (first x second) are within angleThres
+//   are grouped and their arcs merged, lines with reversed endpoints have the
+//   opposite normal and are kept apart
 std::vector<Line3> MergeLines(const std::vector<Line3> &lines,
                               double angleThres = 0.03,
                               double mergeAngleThres = 0.0);
 
+// MergeLines in 2d
+// - merges segments that are collinear (angle < angleThres, distance to the
+//   other's line < distanceThres) and overlap or leave a gap < gapThres
+std::vector<Line2> MergeLines(const std::vector<Line2> &lines,
+                              double angleThres, double distanceThres,
+                              double gapThres);
+
+// MergeLinesOfPyramid
+// - levelLines[k] are the lines of the k-th pyramid level, finest first, in
+//   the coordinates of the finest level, scales[k] is the pixel size of the
+//   k-th level in these coordinates
+// - coarse lines coinciding with finer ones extend them instead of being
+//   appended
+std::vector<Line2>
+MergeLinesOfPyramid(std::vector<std::vector<Line2>> levelLines,
+                    const std::vector<double> &scales);
+
 // compute straightness of points
 std::pair<double, Ray2>
 ComputeStraightness(const std::vector<std::vector<Pixel>> &edges,
                     double *interArea = nullptr, double *interLen = nullptr);
 }
 }
+
+CEREAL_CLASS_VERSION(pano::core::LineSegmentExtractor::Params, 1);
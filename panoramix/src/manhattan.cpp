@@ -1,13 +1,15 @@
 #include "pch.hpp"
 
-#include <VPCluster.h>
-#include <VPSample.h>
+#include <condition_variable>
+#include <mutex>
 
 #include "MSAC.h"
 
 #include "cameras.hpp"
 #include "containers.hpp"
+#include "jlinkage.hpp"
 #include "manhattan.hpp"
+#include "parallel.hpp"
 #include "utility.hpp"
 
 #include "clock.hpp"
@@ -57,21 +59,106 @@ inline double UnOrthogonality(const Vec3 &v1, const Vec3 &v2, const Vec3 &v3) {
 }
 }
 
+Imagef VoteDirections(const std::vector<Vec3> &directions,
+                      int longitudeDivideNum, int latitudeDivideNum) {
+  Imagef votePanel = Imagef::zeros(longitudeDivideNum, latitudeDivideNum);
+  for (const Vec3 &p : directions) {
+    Pixel pixel =
+        PixelFromGeoCoord(GeoCoord(p), longitudeDivideNum, latitudeDivideNum);
+    votePanel(pixel.x, pixel.y) += 1.0;
+  }
+  return votePanel;
+}
+
+Imagef VoteGreatCircles(const std::vector<Line3> &lines,
+                        int longitudeDivideNum, int latitudeDivideNum) {
+  Imagef votePanel = Imagef::zeros(longitudeDivideNum, latitudeDivideNum);
+
+  // a great circle with unit normal n crosses latitude lat at longitudes
+  // alpha +- acos(-n(2) * tan(lat) / h), alpha = atan2(n(1), n(0)),
+  // h = |(n(0), n(1))|, so within a latitude row it covers two longitude
+  // spans between the crossings at the row borders
+  std::vector<double> borderTan(latitudeDivideNum + 1);
+  for (int y = 0; y <= latitudeDivideNum; y++) {
+    borderTan[y] = tan(y * M_PI / latitudeDivideNum - M_PI_2);
+  }
+  const double longitudeScale = longitudeDivideNum / M_PI / 2;
+  const double latitudeScale = latitudeDivideNum / M_PI;
+  // the last row each longitude column is voted in, so that each line votes
+  // a panel pixel at most once
+  std::vector<int> votedRow(longitudeDivideNum);
+
+  for (const Line3 &line : lines) {
+    Vec3 normal = line.first.cross(line.second);
+    if (norm(normal) < 1e-5) {
+      continue;
+    }
+    normal /= norm(normal);
+    double h = sqrt(Square(normal(0)) + Square(normal(1)));
+    if (h < 1e-12) { // the equator
+      int y = PixelFromGeoCoord(GeoCoord(0.0, 0.0), longitudeDivideNum,
+                                latitudeDivideNum)
+                  .y;
+      for (int x = 0; x < longitudeDivideNum; x++) {
+        votePanel(x, y) += 1.0;
+      }
+      continue;
+    }
+    double alpha = atan2(normal(1), normal(0));
+    double maxLatitude = atan2(h, std::abs(normal(2)));
+    int y1 = std::max(int((M_PI_2 - maxLatitude) * latitudeScale), 0);
+    int y2 = std::min(int((M_PI_2 + maxLatitude) * latitudeScale),
+                      latitudeDivideNum - 1);
+    auto offsetAtBorder = [&borderTan, &normal, h](int y) {
+      return acos(BoundBetween(-normal(2) * borderTan[y] / h, -1.0, 1.0));
+    };
+
+    std::fill(votedRow.begin(), votedRow.end(), -1);
+    double offset2 = offsetAtBorder(y1);
+    for (int y = y1; y <= y2; y++) {
+      double offset1 = offset2;
+      offset2 = offsetAtBorder(y + 1);
+      double lo = std::min(offset1, offset2), hi = std::max(offset1, offset2);
+      for (auto &span : {std::make_pair(alpha + lo, alpha + hi),
+                         std::make_pair(alpha - hi, alpha - lo)}) {
+        int x1 = int(floor((span.first + M_PI) * longitudeScale));
+        int x2 = int(floor((span.second + M_PI) * longitudeScale));
+        x2 = std::min(x2, x1 + longitudeDivideNum - 1);
+        for (int x = x1; x <= x2; x++) {
+          int xx = WrapBetween(x, 0, longitudeDivideNum);
+          if (votedRow[xx] == y) {
+            continue;
+          }
+          votedRow[xx] = y;
+          votePanel(xx, y) += 1.0;
+        }
+      }
+    }
+  }
+  return votePanel;
+}
+
 Failable<std::vector<Vec3>> FindOrthogonalPrinicipleDirections(
     const std::vector<Vec3> &intersections, int longitudeDivideNum,
     int latitudeDivideNum, bool allowMoreThan2HorizontalVPs,
     const Vec3 &verticalSeed) {
+  // collect votes of intersection directions
+  return FindOrthogonalPrinicipleDirections(
+      VoteDirections(intersections, longitudeDivideNum, latitudeDivideNum),
+      allowMoreThan2HorizontalVPs, verticalSeed);
+}
+
+Failable<std::vector<Vec3>>
+FindOrthogonalPrinicipleDirections(const Imagef &votes,
+                                   bool allowMoreThan2HorizontalVPs,
+                                   const Vec3 &verticalSeed) {
 
   std::vector<Vec3> vps(3);
 
-  // collect votes of intersection directions
-  Imagef votePanel = Imagef::zeros(longitudeDivideNum, latitudeDivideNum);
-  for (const Vec3 &p : intersections) {
-    Pixel pixel =
-        PixelFromGeoCoord(GeoCoord(p), longitudeDivideNum, latitudeDivideNum);
-    votePanel(pixel.x, pixel.y) += 1.0;
-  }
-  cv::GaussianBlur(votePanel, votePanel,
+  const int longitudeDivideNum = votes.rows;
+  const int latitudeDivideNum = votes.cols;
+  Imagef votePanel;
+  cv::GaussianBlur(votes, votePanel,
                    cv::Size((longitudeDivideNum / 50) * 2 + 1,
                             (latitudeDivideNum / 50) * 2 + 1),
                    4, 4, cv::BORDER_REPLICATE);
@@ -200,6 +287,285 @@ Failable<std::vector<Vec3>> FindOrthogonalPrinicipleDirections(
   return std::move(vps);
 }
 
+namespace {
+
+// the blur applied on vote panels by FindOrthogonalPrinicipleDirections
+inline cv::Size VotePanelBlurKernelSize(int longitudeDivideNum,
+                                        int latitudeDivideNum) {
+  return cv::Size((longitudeDivideNum / 50) * 2 + 1,
+                  (latitudeDivideNum / 50) * 2 + 1);
+}
+static const double VotePanelBlurSigma = 4.0;
+
+// evaluates cv::GaussianBlur(votes, ..., cv::BORDER_REPLICATE) on demand at
+// single pixels, only the few pixels visited during refinement are computed
+class LazilyBlurredVotes {
+public:
+  LazilyBlurredVotes(const Imagef &votes, const cv::Size &ksize, double sigma)
+      : _votes(votes) {
+    cv::Mat kx = cv::getGaussianKernel(ksize.width, sigma, CV_64F);
+    cv::Mat ky = cv::getGaussianKernel(ksize.height, sigma, CV_64F);
+    _kernelX.assign(kx.ptr<double>(), kx.ptr<double>() + kx.rows);
+    _kernelY.assign(ky.ptr<double>(), ky.ptr<double>() + ky.rows);
+    _cache.reserve(4096);
+  }
+
+  float operator()(int row, int col) {
+    int key = row * _votes.cols + col;
+    auto it = _cache.find(key);
+    if (it != _cache.end()) {
+      return it->second;
+    }
+    const int hy = _kernelY.size() / 2, hx = _kernelX.size() / 2;
+    double sum = 0.0;
+    for (int i = 0; i < _kernelY.size(); i++) {
+      const float *votesRow =
+          _votes.ptr<float>(BoundBetween(row + i - hy, 0, _votes.rows - 1));
+      double rowSum = 0.0;
+      for (int j = 0; j < _kernelX.size(); j++) {
+        rowSum += _kernelX[j] *
+                  votesRow[BoundBetween(col + j - hx, 0, _votes.cols - 1)];
+      }
+      sum += _kernelY[i] * rowSum;
+    }
+    return _cache[key] = float(sum);
+  }
+
+private:
+  const Imagef &_votes;
+  std::vector<double> _kernelX, _kernelY;
+  std::unordered_map<int, float> _cache;
+};
+
+// sums votes in factor x factor blocks
+Imagef CoarsenVotes(const Imagef &votes, int factor) {
+  Imagef coarse = Imagef::zeros((votes.rows + factor - 1) / factor,
+                                (votes.cols + factor - 1) / factor);
+  for (int r = 0; r < votes.rows; r++) {
+    const float *votesRow = votes.ptr<float>(r);
+    float *coarseRow = coarse.ptr<float>(r / factor);
+    for (int c = 0; c < votes.cols; c++) {
+      coarseRow[c / factor] += votesRow[c];
+    }
+  }
+  return coarse;
+}
+
+template <class VotesT>
+inline double ScoreOfOrthogonalPair(VotesT &&votes, const Vec3 &vec1,
+                                    const Vec3 &vec2, int longitudeDivideNum,
+                                    int latitudeDivideNum) {
+  double score = 0;
+  for (const Vec3 &v : {vec1, Vec3(-vec1), vec2, Vec3(-vec2)}) {
+    Pixel pixel =
+        PixelFromGeoCoord(GeoCoord(v), longitudeDivideNum, latitudeDivideNum);
+    score += votes(pixel.x, pixel.y);
+  }
+  return score;
+}
+
+// indices of the (at most) n highest local maxima
+std::vector<int> HighestLocalMaxima(const std::vector<double> &scores, int n,
+                                    bool circular) {
+  const int sz = scores.size();
+  std::vector<int> maxima;
+  for (int i = 0; i < sz; i++) {
+    int prev = i - 1, next = i + 1;
+    if (circular) {
+      prev = (prev + sz) % sz;
+      next = next % sz;
+    }
+    if ((prev < 0 || scores[i] >= scores[prev]) &&
+        (next >= sz || scores[i] >= scores[next])) {
+      maxima.push_back(i);
+    }
+  }
+  std::sort(maxima.begin(), maxima.end(),
+            [&scores](int a, int b) { return scores[a] > scores[b]; });
+  if (maxima.size() > n) {
+    maxima.resize(n);
+  }
+  return maxima;
+}
+}
+
+Failable<std::vector<Vec3>> FindOrthogonalPrinicipleDirectionsCoarseToFine(
+    const Imagef &votes, int coarseFactor, bool allowMoreThan2HorizontalVPs,
+    const Vec3 &verticalSeed) {
+  assert(coarseFactor >= 1);
+  static const int candidatesNum = 3;
+
+  std::vector<Vec3> vps(3);
+
+  const int longitudeDivideNum = votes.rows;
+  const int latitudeDivideNum = votes.cols;
+  const int f = coarseFactor;
+
+  // coarse panel
+  Imagef coarsePanel = CoarsenVotes(votes, f);
+  const int coarseLongitudeDivideNum = coarsePanel.rows;
+  const int coarseLatitudeDivideNum = coarsePanel.cols;
+  cv::GaussianBlur(coarsePanel, coarsePanel, cv::Size(0, 0),
+                   VotePanelBlurSigma / f, VotePanelBlurSigma / f,
+                   cv::BORDER_REPLICATE);
+  auto coarseVotes = [&coarsePanel](int x, int y) -> double {
+    return coarsePanel(x, y);
+  };
+
+  // full resolution panel, blurred only where visited
+  LazilyBlurredVotes fineVotes(
+      votes, VotePanelBlurKernelSize(longitudeDivideNum, latitudeDivideNum),
+      VotePanelBlurSigma);
+
+  // the first vanishing point, refine the coarse max in its neighborhood
+  {
+    double minVal = 0, maxVal = 0;
+    int maxIndex[] = {-1, -1};
+    cv::minMaxIdx(coarsePanel, &minVal, &maxVal, 0, maxIndex);
+    float maxVote = -1;
+    Pixel maxPixel;
+    for (int x = std::max(maxIndex[0] * f - f, 0);
+         x < std::min(maxIndex[0] * f + 2 * f, longitudeDivideNum); x++) {
+      for (int y = std::max(maxIndex[1] * f - f, 0);
+           y < std::min(maxIndex[1] * f + 2 * f, latitudeDivideNum); y++) {
+        float vote = fineVotes(x, y);
+        if (vote > maxVote) {
+          maxVote = vote;
+          maxPixel = Pixel(x, y);
+        }
+      }
+    }
+    vps[0] = GeoCoordFromPixel(maxPixel, longitudeDivideNum, latitudeDivideNum)
+                 .toVector();
+  }
+  const Vec3 &vec0 = vps[0];
+
+  // iterate locations orthogonal to vps[0]
+  double maxScore = -1;
+  {
+    auto vecsAtLongitude = [&vec0](int x, int longiDivNum) {
+      double longt1 = double(x) / longiDivNum * M_PI * 2 - M_PI;
+      double lat1 = LatitudeFromLongitudeAndNormalVector(longt1, vec0);
+      Vec3 vec1 = GeoCoord(longt1, lat1).toVector();
+      return std::make_pair(vec1, Vec3(vec0.cross(vec1)));
+    };
+    std::vector<double> coarseScores(coarseLongitudeDivideNum);
+    for (int cx = 0; cx < coarseLongitudeDivideNum; cx++) {
+      auto vecs = vecsAtLongitude(cx, coarseLongitudeDivideNum);
+      coarseScores[cx] =
+          ScoreOfOrthogonalPair(coarseVotes, vecs.first, vecs.second,
+                                coarseLongitudeDivideNum,
+                                coarseLatitudeDivideNum);
+    }
+    for (int cx : HighestLocalMaxima(coarseScores, candidatesNum, true)) {
+      for (int dx = -f; dx <= f; dx++) {
+        int x = WrapBetween(cx * f + dx, 0, longitudeDivideNum);
+        auto vecs = vecsAtLongitude(x, longitudeDivideNum);
+        double score =
+            ScoreOfOrthogonalPair(fineVotes, vecs.first, vecs.second,
+                                  longitudeDivideNum, latitudeDivideNum);
+        if (score > maxScore) {
+          maxScore = score;
+          vps[1] = vecs.first;
+          vps[2] = vecs.second;
+        }
+      }
+    }
+  }
+
+  if (UnOrthogonality(vps[0], vps[1], vps[2]) >= 0.1) {
+    // failed, then use y instead of x
+    maxScore = -1;
+    auto vecsAtLatitude = [&vec0](int y, int latiDivNum, int k) {
+      double lat1 = double(y) / latiDivNum * M_PI - M_PI_2;
+      double longt1 = k == 0
+                          ? Longitude1FromLatitudeAndNormalVector(lat1, vec0)
+                          : Longitude2FromLatitudeAndNormalVector(lat1, vec0);
+      Vec3 vec1 = GeoCoord(longt1, lat1).toVector();
+      return std::make_pair(vec1, Vec3(vec0.cross(vec1)));
+    };
+    std::vector<double> coarseScores(coarseLatitudeDivideNum);
+    for (int cy = 0; cy < coarseLatitudeDivideNum; cy++) {
+      coarseScores[cy] = -1;
+      for (int k = 0; k < 2; k++) {
+        auto vecs = vecsAtLatitude(cy, coarseLatitudeDivideNum, k);
+        coarseScores[cy] = std::max(
+            coarseScores[cy],
+            ScoreOfOrthogonalPair(coarseVotes, vecs.first, vecs.second,
+                                  coarseLongitudeDivideNum,
+                                  coarseLatitudeDivideNum));
+      }
+    }
+    for (int cy : HighestLocalMaxima(coarseScores, candidatesNum, false)) {
+      for (int y = std::max(cy * f - f, 0);
+           y <= std::min(cy * f + f, latitudeDivideNum - 1); y++) {
+        for (int k = 0; k < 2; k++) {
+          auto vecs = vecsAtLatitude(y, latitudeDivideNum, k);
+          double score =
+              ScoreOfOrthogonalPair(fineVotes, vecs.first, vecs.second,
+                                    longitudeDivideNum, latitudeDivideNum);
+          if (score > maxScore) {
+            maxScore = score;
+            vps[1] = vecs.first;
+            vps[2] = vecs.second;
+          }
+        }
+      }
+    }
+  }
+
+  if (UnOrthogonality(vps[0], vps[1], vps[2]) >= 0.1) {
+    return nullptr; // failed
+  }
+
+  // make vps[0] the vertical vp
+  {
+    int vertVPId = -1;
+    double minAngle = std::numeric_limits<double>::max();
+    for (int i = 0; i < vps.size(); i++) {
+      double a = AngleBetweenUndirected(vps[i], verticalSeed);
+      if (a < minAngle) {
+        vertVPId = i;
+        minAngle = a;
+      }
+    }
+    std::swap(vps[0], vps[vertVPId]);
+  }
+
+  if (allowMoreThan2HorizontalVPs) {
+    // find more horizontal vps, scored at full resolution as before
+    double nextMaxScore = maxScore * 0.5; // threshold
+    double minAngleToCurHorizontalVPs = DegreesToRadians(30);
+    for (int x = 0; x < longitudeDivideNum; x++) {
+      double longt1 = double(x) / longitudeDivideNum * M_PI * 2 - M_PI;
+      double lat1 = LatitudeFromLongitudeAndNormalVector(longt1, vps[0]);
+      Vec3 vec1 = GeoCoord(longt1, lat1).toVector();
+      Vec3 vec2 = vps[0].cross(vec1);
+
+      bool tooCloseToExistingVP = false;
+      for (int i = 0; i < vps.size(); i++) {
+        if (AngleBetweenUndirected(vps[i], vec1) <
+            minAngleToCurHorizontalVPs) {
+          tooCloseToExistingVP = true;
+          break;
+        }
+      }
+      if (tooCloseToExistingVP)
+        continue;
+
+      double score = ScoreOfOrthogonalPair(
+          fineVotes, vec1, vec2, longitudeDivideNum, latitudeDivideNum);
+      if (score > nextMaxScore) {
+        nextMaxScore = score;
+        vps.push_back(vec1);
+        vps.push_back(vec2);
+      }
+    }
+  }
+
+  return std::move(vps);
+}
+
 int NearestDirectionId(const std::vector<Vec3> &directions,
                        const Vec3 &verticalSeed) {
   int vid = -1;
@@ -233,7 +599,8 @@ std::vector<Vec3> EstimateVanishingPointsAndClassifyLines(
   }
 
   auto vanishingPoints =
-      FindOrthogonalPrinicipleDirections(lineIntersections, 1000, 500, true)
+      FindOrthogonalPrinicipleDirectionsCoarseToFine(
+          VoteDirections(lineIntersections, 1000, 500), 4, true)
           .unwrap();
 
   // project lines to space
@@ -290,7 +657,8 @@ std::vector<Vec3> EstimateVanishingPointsAndClassifyLines(
   }
 
   auto vanishingPoints =
-      FindOrthogonalPrinicipleDirections(lineIntersections, 1000, 500, true)
+      FindOrthogonalPrinicipleDirectionsCoarseToFine(
+          VoteDirections(lineIntersections, 1000, 500), 4, true)
           .unwrap();
 
   // project lines to space
@@ -339,17 +707,23 @@ std::vector<Vec3> EstimateVanishingPointsAndClassifyLines(
 std::vector<Vec3>
 EstimateVanishingPointsAndClassifyLines(std::vector<Classified<Line3>> &lines,
                                         DenseMatd *lineVPScores,
-                                        bool dontClassifyUmbiguiousLines) {
-  std::vector<Vec3> lineIntersections;
-
+                                        bool dontClassifyUmbiguiousLines,
+                                        VPVotingMethod votingMethod) {
   std::vector<Line3> pureLines(lines.size());
   for (int i = 0; i < lines.size(); i++) {
     pureLines[i] = lines[i].component;
   }
-  auto inters = ComputeLineIntersections(pureLines, nullptr);
+
+  Imagef votes;
+  if (votingMethod == VPVotingMethod::GreatCircles) {
+    votes = VoteGreatCircles(pureLines, 1000, 500);
+  } else {
+    votes = VoteDirections(ComputeLineIntersections(pureLines, nullptr), 1000,
+                           500);
+  }
 
   auto vanishingPoints =
-      FindOrthogonalPrinicipleDirections(inters, 1000, 500, true).unwrap();
+      FindOrthogonalPrinicipleDirectionsCoarseToFine(votes, 4, true).unwrap();
   OrderVanishingPoints(vanishingPoints);
 
   auto scores =
@@ -636,17 +1010,13 @@ RefineIntersectionsAndProjectToSpace(const std::vector<HPoint2> &intersections,
   std::vector<Vec3> dirs;
   dirs.reserve(intersections.size());
 
-  RTreeWrapper<Vec3, DefaultInfluenceBoxFunctor<double>> rtreeRecorder(
-      DefaultInfluenceBoxFunctor<double>(angleThres * 2.0));
+  DirectionMap<int> recorded(angleThres);
   for (int i = 0; i < intersections.size(); i++) {
     Vec3 inter = normalize(VectorFromHPoint(intersections[i], fakeFocal));
-    if (rtreeRecorder.contains(
-            inter, [&angleThres](const Vec3 &a, const Vec3 &b) {
-              return AngleBetweenDirected(a, b) < angleThres;
-            })) {
+    if (recorded.contains(inter, angleThres)) {
       continue;
     }
-    rtreeRecorder.insert(inter);
+    recorded.emplace(inter, i);
     dirs.push_back(inter);
   }
   return dirs;
@@ -1008,6 +1378,270 @@ HPoint2 EstimateVanishingPointsFromLines(const std::vector<Line2> &lines,
 }
 }
 
+namespace {
+
+// parallel MSAC estimation of vanishing points in calibrated space
+// - lines are calibrated by the approximated K = [s 0 cx; 0 s cy; 0 0 1],
+//   the residual of a line l (unit) to a vp v (unit) is (l.v)^2
+// - vps are detected sequentially, inliers of each are removed before the
+//   next one
+// - hypotheses are scored by the MSAC cost, the sum of residuals truncated at
+//   the noise level
+// - hypotheses are sampled in blocks, each with its own random engine seeded
+//   by its index, in rounds of a fixed number of blocks, threads live
+//   through the whole estimation and take fixed blocks of each round
+// - the bests of the blocks are reduced in block order after each round and
+//   the iteration bound is updated then, so the result only depends on the
+//   seed, not on the concurrency or the timing of threads
+// - residuals are plain scalar loops, the truncated float cost sum is not
+//   vectorized
+class ParallelMSACVPEstimator {
+public:
+  ParallelMSACVPEstimator(const std::vector<Line2> &lines,
+                          const Point2 &projCenter, double scale)
+      : _n(lines.size()), _lxs(_n), _lys(_n), _lzs(_n), _lengths(_n) {
+    for (int i = 0; i < _n; i++) {
+      Vec3 a((lines[i].first[0] - projCenter[0]) / scale,
+             (lines[i].first[1] - projCenter[1]) / scale, 1.0);
+      Vec3 b((lines[i].second[0] - projCenter[0]) / scale,
+             (lines[i].second[1] - projCenter[1]) / scale, 1.0);
+      Vec3 l = normalize(a.cross(b));
+      _lxs[i] = l[0];
+      _lys[i] = l[1];
+      _lzs[i] = l[2];
+      _lengths[i] = lines[i].length();
+    }
+  }
+
+  // returns the vp (calibrated) and marks its inliers with claz in lineClasses
+  // (only lines with lineClasses[i] == -1 are used)
+  Failable<Vec3> estimate(std::vector<int> &lineClasses, int claz,
+                          unsigned seed, int concurrency) const {
+    std::vector<int> ids;
+    for (int i = 0; i < _n; i++) {
+      if (lineClasses[i] == -1) {
+        ids.push_back(i);
+      }
+    }
+    const int n = ids.size();
+    if (n < 3) {
+      return nullptr;
+    }
+
+    // the active lines, contiguous
+    std::vector<float> lxs(n), lys(n), lzs(n);
+    for (int i = 0; i < n; i++) {
+      lxs[i] = _lxs[ids[i]];
+      lys[i] = _lys[ids[i]];
+      lzs[i] = _lzs[ids[i]];
+    }
+
+    struct Hypothesis {
+      Vec3f vp;
+      float cost;
+      int inliersNum;
+      inline bool betterThan(const Hypothesis &h) const {
+        return cost < h.cost || (cost == h.cost && inliersNum > h.inliersNum);
+      }
+    };
+    Hypothesis best = {Vec3f(), std::numeric_limits<float>::max(), 0};
+
+    // the best hypothesis of a block
+    auto drawBlock = [&](int block) {
+      Hypothesis blockBest = {Vec3f(), std::numeric_limits<float>::max(), 0};
+      std::seed_seq seeds = {seed, unsigned(claz), unsigned(block)};
+      std::mt19937 rng(seeds);
+      std::uniform_int_distribution<int> pick(0, n - 1);
+      for (int k = 0; k < HypothesesPerBlock; k++) {
+        int i = pick(rng), j = pick(rng);
+        if (i == j) {
+          continue;
+        }
+        Vec3f vp =
+            Vec3f(lxs[i], lys[i], lzs[i]).cross(Vec3f(lxs[j], lys[j], lzs[j]));
+        float vpNorm = norm(vp);
+        if (vpNorm < 1e-8f) {
+          continue;
+        }
+        vp /= vpNorm;
+        // the MSAC cost, residuals are truncated at the noise level
+        float cost = 0.0f;
+        int inliersNum = 0;
+        for (int q = 0; q < n; q++) {
+          float d = vp[0] * lxs[q] + vp[1] * lys[q] + vp[2] * lzs[q];
+          float e = d * d;
+          bool inlier = e <= NoiseSquared;
+          inliersNum += inlier;
+          cost += inlier ? e : NoiseSquared;
+        }
+        Hypothesis h = {vp, cost, inliersNum};
+        if (inliersNum >= 2 && h.betterThan(blockBest)) {
+          blockBest = h;
+        }
+      }
+      return blockBest;
+    };
+
+    // reduces the bests of a round in block order and decides whether to go
+    // on, called by the last thread to finish the round
+    std::vector<Hypothesis> roundBests(BlocksPerRound);
+    int roundsNum = 0;
+    bool done = false;
+    int iterBound = std::numeric_limits<int>::max();
+    auto reduceRound = [&]() {
+      for (const Hypothesis &h : roundBests) {
+        if (h.inliersNum >= 2 && h.betterThan(best)) {
+          best = h;
+        }
+      }
+      if (best.inliersNum >= 2) {
+        // adaptive iteration bound
+        double q = 1.0;
+        for (int j = 0; j < 2; j++) {
+          q *= double(best.inliersNum - j) / double(n - j);
+        }
+        iterBound = (1 - q) > 1e-12
+                        ? int(std::ceil(std::log(Epsilon) / std::log(1 - q)))
+                        : 0;
+      }
+      roundsNum++;
+      int iter = roundsNum * BlocksPerRound * HypothesesPerBlock;
+      done = iter > MinIters && (iter > iterBound || iter >= MaxIters);
+    };
+
+    const int conc = std::max(1, std::min(concurrency, BlocksPerRound));
+    std::mutex mutex;
+    std::condition_variable roundFinished;
+    int finishedThreads = 0;
+    ParallelRun(conc, conc, [&](int t) {
+      std::unique_lock<std::mutex> lock(mutex);
+      while (!done) {
+        const int round = roundsNum;
+        lock.unlock();
+        for (int b = t; b < BlocksPerRound; b += conc) {
+          roundBests[b] = drawBlock(round * BlocksPerRound + b);
+        }
+        lock.lock();
+        if (++finishedThreads == conc) {
+          finishedThreads = 0;
+          reduceRound();
+          roundFinished.notify_all();
+        } else {
+          roundFinished.wait(lock, [&]() { return roundsNum != round; });
+        }
+      }
+    });
+
+    if (best.inliersNum < 2) {
+      return nullptr;
+    }
+
+    // reestimate with the length weighted inliers:
+    // the eigen vector of sum(w * l * l^T) with the smallest eigen value
+    Mat3 A = Mat3::zeros();
+    int inliersNum = 0;
+    for (int i = 0; i < n; i++) {
+      float d = best.vp[0] * lxs[i] + best.vp[1] * lys[i] + best.vp[2] * lzs[i];
+      if (d * d <= NoiseSquared) {
+        Vec3 l(lxs[i], lys[i], lzs[i]);
+        A += _lengths[ids[i]] * (l * l.t());
+        inliersNum++;
+      }
+    }
+    Vec3 vp(best.vp[0], best.vp[1], best.vp[2]);
+    if (inliersNum > 2) {
+      Mat3 eigenVectors;
+      Vec3 eigenValues;
+      cv::eigen(A, eigenValues, eigenVectors);
+      vp = normalize(Vec3(eigenVectors(2, 0), eigenVectors(2, 1),
+                          eigenVectors(2, 2)));
+    }
+    for (int i = 0; i < n; i++) {
+      double d = vp[0] * lxs[i] + vp[1] * lys[i] + vp[2] * lzs[i];
+      if (d * d <= NoiseSquared) {
+        lineClasses[ids[i]] = claz;
+      }
+    }
+    return std::move(vp);
+  }
+
+private:
+  static constexpr float NoiseSquared = 0.01623f * 2;
+  static constexpr double Epsilon = 1e-6;
+  static const int MinIters = 5;
+  static const int MaxIters = 100000;
+  static const int HypothesesPerBlock = 32;
+  static const int BlocksPerRound = 16;
+
+  int _n;
+  std::vector<float> _lxs, _lys, _lzs;
+  std::vector<double> _lengths;
+};
+
+Failable<std::tuple<std::vector<HPoint2>, double, std::vector<int>>>
+EstimateVanishingPointsUsingParallelMSAC(const std::vector<Line2> &lines,
+                                         const Point2 &projCenter,
+                                         double imScale, double minFocalLength,
+                                         double maxFocalLength,
+                                         double maxPrinciplePointOffset) {
+  const int concurrency = DefaultConcurrency();
+  ParallelMSACVPEstimator estimator(lines, projCenter, imScale);
+
+  std::vector<int> lineClasses(lines.size(), -1);
+  std::vector<Vec3> calibratedVPs;
+  for (int k = 0; k < 3; k++) {
+    auto vp = estimator.estimate(lineClasses, k, 0, concurrency);
+    if (vp.null()) {
+      return nullptr;
+    }
+    calibratedVPs.push_back(vp.unwrap());
+  }
+
+  // uncalibrate
+  std::vector<HPoint2> vps(3);
+  for (int k = 0; k < 3; k++) {
+    const Vec3 &v = calibratedVPs[k];
+    vps[k] = HPoint2(Point2(v[0] * imScale + projCenter[0] * v[2],
+                            v[1] * imScale + projCenter[1] * v[2]),
+                     v[2]);
+  }
+
+  // focal length, from all three vps if they are finite, otherwise from an
+  // orthogonal pair of finite vps assuming the principle point at the center
+  double focal = -1.0;
+  auto isFinite = [](const Vec3 &v) { return std::abs(v[2]) > 1e-6; };
+  if (isFinite(calibratedVPs[0]) && isFinite(calibratedVPs[1]) &&
+      isFinite(calibratedVPs[2])) {
+    Point2 pp;
+    std::tie(pp, focal) = ComputePrinciplePointAndFocalLength(
+        vps[0].value(), vps[1].value(), vps[2].value());
+    if (std::isnan(focal) ||
+        Distance(pp, projCenter) > maxPrinciplePointOffset) {
+      focal = -1.0;
+    }
+  }
+  for (int i = 0; i < 3 && !IsBetween(focal, minFocalLength, maxFocalLength);
+       i++) {
+    for (int j = i + 1; j < 3; j++) {
+      if (!isFinite(calibratedVPs[i]) || !isFinite(calibratedVPs[j])) {
+        continue;
+      }
+      double f2 = -(vps[i].value() - projCenter).dot(vps[j].value() -
+                                                      projCenter);
+      if (f2 > 0 && IsBetween(sqrt(f2), minFocalLength, maxFocalLength)) {
+        focal = sqrt(f2);
+        break;
+      }
+    }
+  }
+  if (!IsBetween(focal, minFocalLength, maxFocalLength)) {
+    return nullptr;
+  }
+
+  return std::make_tuple(std::move(vps), focal, std::move(lineClasses));
+}
+}
+
 Failable<std::tuple<std::vector<HPoint2>, double, std::vector<int>>>
 VanishingPointsDetector::operator()(const std::vector<Line2> &lines,
                                     const Sizei &imSize) const {
@@ -1036,6 +1670,10 @@ VanishingPointsDetector::operator()(const std::vector<Line2> &lines,
       vp = vp + HPoint2(projCenter);
     }
     return std::move(results);
+  } else if (_params.algorithm == ParallelMSAC) {
+    return EstimateVanishingPointsUsingParallelMSAC(
+        lines, projCenter, imScale, minFocalLength, maxFocalLength,
+        maxPrinciplePointOffset);
   } else if (_params.algorithm == MATLAB_PanoContext) {
     misc::Matlab matlab;
     // install lines
@@ -1075,28 +1713,11 @@ VanishingPointsDetector::operator()(const std::vector<Line2> &lines,
     int classNum = 0;
 
     {
-      std::vector<std::vector<float> *> pts(lines.size());
-      for (int i = 0; i < lines.size(); i++) {
-        pts[i] = new std::vector<float>{
-            (float)lines[i].first[0], (float)lines[i].first[1],
-            (float)lines[i].second[0], (float)lines[i].second[1]};
-      }
-
-      std::vector<std::vector<float> *> *mModels =
-          VPSample::run(&pts, 5000, 2, 0, 3);
-      std::vector<unsigned int> labels;
-      std::vector<unsigned int> labelCount;
-      classNum = VPCluster::run(labels, labelCount, &pts, mModels, 2, 2);
+      std::vector<int> labels;
+      classNum = LineJLinkage()(lines, labels);
 
       assert(classNum >= 3);
 
-      for (unsigned int i = 0; i < mModels->size(); ++i)
-        delete (*mModels)[i];
-      delete mModels;
-      for (auto &p : pts) {
-        delete p;
-      }
-
       // estimate vps
       assert(lines.size() == labels.size());
       lineClusters.resize(classNum);
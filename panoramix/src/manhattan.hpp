@@ -13,6 +13,28 @@ Failable<std::vector<Vec3>> FindOrthogonalPrinicipleDirections(
     const std::vector<Vec3> &directions, int longitudeDivideNum = 1000,
     int latitudeDivideNum = 500, bool allowMoreThan2HorizontalVPs = false,
     const Vec3 &verticalSeed = Vec3(0, 0, 1));
+// find 3 orthogonal directions from a (longitude x latitude) vote panel
+Failable<std::vector<Vec3>>
+FindOrthogonalPrinicipleDirections(const Imagef &votePanel,
+                                   bool allowMoreThan2HorizontalVPs = false,
+                                   const Vec3 &verticalSeed = Vec3(0, 0, 1));
+
+// coarse-to-fine version of the above, votes are blurred and swept on a
+// panel coarsened by coarseFactor, candidates are then refined in small
+// windows at full resolution
+Failable<std::vector<Vec3>> FindOrthogonalPrinicipleDirectionsCoarseToFine(
+    const Imagef &votePanel, int coarseFactor = 4,
+    bool allowMoreThan2HorizontalVPs = false,
+    const Vec3 &verticalSeed = Vec3(0, 0, 1));
+
+// vote directions on a (longitude x latitude) panel
+Imagef VoteDirections(const std::vector<Vec3> &directions,
+                      int longitudeDivideNum, int latitudeDivideNum);
+// vote the great circles spanned by lines on a (longitude x latitude) panel
+// each line votes every panel pixel its great circle passes through once, the
+// circle is rasterized row by row from its analytic longitudes
+Imagef VoteGreatCircles(const std::vector<Line3> &lines,
+                        int longitudeDivideNum, int latitudeDivideNum);
 
 int NearestDirectionId(const std::vector<Vec3> &directions,
                        const Vec3 &verticalSeed = Vec3(0, 0, 1));
@@ -26,9 +48,14 @@ std::vector<Vec3> EstimateVanishingPointsAndClassifyLines(
     std::vector<std::vector<Classified<Line2>>> &lineSegments,
     std::vector<DenseMatd> *lineVPScores = nullptr);
 
+enum class VPVotingMethod {
+  LineIntersections, // votes all pairwise line intersections, O(n^2)
+  GreatCircles       // votes the great circle of each line, O(n)
+};
 std::vector<Vec3> EstimateVanishingPointsAndClassifyLines(
     std::vector<Classified<Line3>> &lines, DenseMatd *lineVPScores = nullptr,
-    bool dontClassifyUmbiguiousLines = false);
+    bool dontClassifyUmbiguiousLines = false,
+    VPVotingMethod votingMethod = VPVotingMethod::LineIntersections);
 
 // [vert, horiz1, horiz2, other]
 std::vector<int> OrderVanishingPoints(std::vector<Vec3> &vps,
@@ -74,7 +101,8 @@ ComputePrinciplePointAndFocalLengthCandidates(
 // 2d vanishing point detection
 class VanishingPointsDetector {
 public:
-  enum Algorithm { Naive, TardifSimplified, MATLAB_PanoContext };
+  // ParallelMSAC: sequential multi-threaded MSAC on calibrated lines
+  enum Algorithm { Naive, TardifSimplified, MATLAB_PanoContext, ParallelMSAC };
   struct Params {
     inline Params(Algorithm algo = Naive, double maxPPOffsetRatio = 2.0,
                   double minFocalRatio = 0.05, double maxFocalRatio = 20.0)
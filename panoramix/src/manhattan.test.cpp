@@ -152,4 +152,217 @@ TEST(ManhattanTest, LocalManhattanVanishingPointDetector) {
   }
 
   viz.show();
-}
\ No newline at end of file
+}
+namespace {
+std::vector<core::Line3> CollectPanoramaLines(const core::Image3ub &pano) {
+  using namespace core;
+  auto view = CreatePanoramicView(pano);
+  auto cams = CreateCubicFacedCameras(view.camera, pano.rows, pano.rows,
+                                      pano.rows * 0.4);
+  std::vector<Line3> rawLine3s;
+  LineSegmentExtractor lineExtractor;
+  lineExtractor.params().algorithm = LineSegmentExtractor::LSD;
+  for (auto &cam : cams) {
+    auto pim = view.sampled(cam).image;
+    for (auto &l : lineExtractor(pim)) {
+      rawLine3s.emplace_back(normalize(cam.toSpace(l.first)),
+                             normalize(cam.toSpace(l.second)));
+    }
+  }
+  return MergeLines(rawLine3s, DegreesToRadians(3), DegreesToRadians(5));
+}
+
+// the first vp should match, the following two may be swapped
+void ExpectSameManhattanDirections(const std::vector<core::Vec3> &vps1,
+                                   const std::vector<core::Vec3> &vps2,
+                                   double angleThres) {
+  using namespace core;
+  ASSERT_GE(vps1.size(), 3);
+  ASSERT_GE(vps2.size(), 3);
+  EXPECT_LT(AngleBetweenUndirected(vps1[0], vps2[0]), angleThres);
+  for (int i = 1; i < 3; i++) {
+    double angle = std::min(AngleBetweenUndirected(vps1[i], vps2[1]),
+                            AngleBetweenUndirected(vps1[i], vps2[2]));
+    EXPECT_LT(angle, angleThres);
+  }
+}
+}
+
+TEST(ManhattanTest, GreatCircleVotingParity) {
+  using namespace core;
+
+  for (auto &imName : {PANORAMIX_TEST_DATA_DIR_STR "/indoor_pano1.jpg",
+                       PANORAMIX_TEST_DATA_DIR_STR "/indoor_pano2.jpg"}) {
+    Image3ub im = ImageRead(imName);
+    if (im.empty()) {
+      continue;
+    }
+    ResizeToHeight(im, 700);
+
+    auto lines1 = ClassifyEachAs(CollectPanoramaLines(im), -1);
+    auto lines2 = lines1;
+    auto vps1 = EstimateVanishingPointsAndClassifyLines(
+        lines1, nullptr, true, VPVotingMethod::LineIntersections);
+    auto vps2 = EstimateVanishingPointsAndClassifyLines(
+        lines2, nullptr, true, VPVotingMethod::GreatCircles);
+    ExpectSameManhattanDirections(vps1, vps2, DegreesToRadians(3));
+  }
+}
+
+TEST(ManhattanTest, GreatCircleVotingCoverage) {
+  using namespace core;
+
+  const int longitudeDivideNum = 1000, latitudeDivideNum = 500;
+  std::mt19937 rng(0);
+  std::normal_distribution<double> coord;
+  std::vector<Line3> lines = {Line3(Point3(1, 0.001, 0), Point3(0, 0, 1)),
+                              Line3(Point3(0, 1, 0), Point3(1, 0, 0.01))};
+  while (lines.size() < 50) {
+    lines.emplace_back(Point3(coord(rng), coord(rng), coord(rng)),
+                       Point3(coord(rng), coord(rng), coord(rng)));
+  }
+  for (auto &line : lines) {
+    Imagef votes = VoteGreatCircles({line}, longitudeDivideNum,
+                                    latitudeDivideNum);
+    // no pixel is voted twice
+    double maxVote = 0;
+    cv::minMaxLoc(votes, nullptr, &maxVote);
+    EXPECT_EQ(maxVote, 1.0);
+    // densely sampled points of the circle all land on voted pixels
+    Vec3 normal = normalize(line.first.cross(line.second));
+    Vec3 x, y;
+    std::tie(x, y) = ProposeXYDirectionsFromZDirection(normal);
+    const int sampleNum = 100000;
+    for (int i = 0; i < sampleNum; i++) {
+      double angle = i * M_PI * 2 / sampleNum;
+      Pixel p = PixelFromGeoCoord(GeoCoord(x * cos(angle) + y * sin(angle)),
+                                  longitudeDivideNum, latitudeDivideNum);
+      ASSERT_EQ(votes(p.x, p.y), 1.0);
+    }
+    // voted pixels all touch the circle
+    const double halfDiagonal =
+        sqrt(Square(M_PI * 2 / longitudeDivideNum) +
+             Square(M_PI / latitudeDivideNum)) /
+        2;
+    for (int px = 0; px < longitudeDivideNum; px++) {
+      for (int py = 0; py < latitudeDivideNum; py++) {
+        if (votes(px, py) == 0) {
+          continue;
+        }
+        Vec3 center = GeoCoord((px + 0.5) * M_PI * 2 / longitudeDivideNum -
+                                   M_PI,
+                               (py + 0.5) * M_PI / latitudeDivideNum - M_PI_2)
+                          .toVector();
+        EXPECT_LE(std::abs(asin(center.dot(normal))), halfDiagonal + 1e-9);
+      }
+    }
+  }
+}
+
+TEST(ManhattanTest, FindOrthogonalPrinicipleDirectionsCoarseToFine) {
+  using namespace core;
+
+  for (auto &imName : {PANORAMIX_TEST_DATA_DIR_STR "/indoor_pano1.jpg",
+                       PANORAMIX_TEST_DATA_DIR_STR "/indoor_pano2.jpg"}) {
+    Image3ub im = ImageRead(imName);
+    if (im.empty()) {
+      continue;
+    }
+    ResizeToHeight(im, 700);
+
+    auto lines = CollectPanoramaLines(im);
+    for (auto &votes :
+         {VoteDirections(ComputeLineIntersections(lines, nullptr), 1000, 500),
+          VoteGreatCircles(lines, 1000, 500)}) {
+      auto vps1 = FindOrthogonalPrinicipleDirections(votes, true);
+      auto vps2 =
+          FindOrthogonalPrinicipleDirectionsCoarseToFine(votes, 4, true);
+      ASSERT_FALSE(vps1.null());
+      ASSERT_FALSE(vps2.null());
+      // one full resolution pixel is 0.36 degrees
+      ExpectSameManhattanDirections(vps1.unwrap(), vps2.unwrap(),
+                                    DegreesToRadians(1));
+    }
+  }
+}
+
+TEST(ManhattanTest, ParallelMSACVanishingPointsDetector) {
+  using namespace core;
+
+  // synthetic manhattan segments seen by a perspective camera
+  PerspectiveCamera cam(640, 480, Point2(320, 240), 500.0, Point3(0, 0, 0),
+                        Point3(1, 0.7, -0.4), Vec3(0, 0, -1));
+  std::mt19937 rng(0);
+  std::uniform_real_distribution<double> posDist(-5.0, 5.0);
+  std::uniform_real_distribution<double> lenDist(1.0, 3.0);
+  std::vector<Classified<Line2>> lines;
+  std::vector<int> axes;
+  while (lines.size() < 300) {
+    Point3 p(posDist(rng) + 10.0, posDist(rng) + 7.0, posDist(rng) - 4.0);
+    int axis = lines.size() % 3;
+    Point3 q = p;
+    q[axis] += lenDist(rng);
+    if (!cam.isVisibleOnScreen(p) || !cam.isVisibleOnScreen(q)) {
+      continue;
+    }
+    Line2 line(cam.toScreen(p), cam.toScreen(q));
+    if (line.length() < 15) {
+      continue;
+    }
+    lines.push_back(ClassifyAs(line, -1));
+    axes.push_back(axis);
+  }
+
+  VanishingPointsDetector vpdetector;
+  vpdetector.params().algorithm = VanishingPointsDetector::ParallelMSAC;
+  auto result = vpdetector(lines, cam.screenSize());
+  ASSERT_FALSE(result.null());
+  std::vector<HPoint2> vps;
+  double focal = 0;
+  std::tie(vps, focal) = result.unwrap();
+  ASSERT_EQ(3, vps.size());
+  EXPECT_NEAR(cam.focal(), focal, cam.focal() * 0.2);
+
+  // each axis should be dominated by a distinct vp class
+  std::set<int> majorities;
+  for (int axis = 0; axis < 3; axis++) {
+    std::map<int, int> counts;
+    int classifiedNum = 0;
+    for (int i = 0; i < lines.size(); i++) {
+      if (axes[i] == axis && lines[i].claz != -1) {
+        counts[lines[i].claz]++;
+        classifiedNum++;
+      }
+    }
+    ASSERT_FALSE(counts.empty());
+    auto majority = std::max_element(
+        counts.begin(), counts.end(),
+        [](const std::pair<const int, int> &a,
+           const std::pair<const int, int> &b) { return a.second < b.second; });
+    EXPECT_GE(majority->second, classifiedNum * 0.9);
+    majorities.insert(majority->first);
+  }
+  EXPECT_EQ(3, majorities.size());
+
+  // blocks are reduced in a fixed order, so reruns give the same result
+  // whatever the timing of the threads
+  for (int k = 0; k < 5; k++) {
+    auto relines = lines;
+    for (auto &l : relines) {
+      l.claz = -1;
+    }
+    auto rerun = vpdetector(relines, cam.screenSize());
+    ASSERT_FALSE(rerun.null());
+    std::vector<HPoint2> revps;
+    double refocal = 0;
+    std::tie(revps, refocal) = rerun.unwrap();
+    EXPECT_EQ(focal, refocal);
+    for (int i = 0; i < 3; i++) {
+      EXPECT_EQ(vps[i].numerator, revps[i].numerator);
+      EXPECT_EQ(vps[i].denominator, revps[i].denominator);
+    }
+    for (int i = 0; i < lines.size(); i++) {
+      EXPECT_EQ(lines[i].claz, relines[i].claz);
+    }
+  }
+}
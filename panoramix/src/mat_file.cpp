@@ -0,0 +1,283 @@
+#include "pch.hpp"
+
+#ifdef PANORAMIX_USE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "mat_file.hpp"
+
+namespace pano {
+namespace misc {
+
+namespace {
+// data types of data elements
+enum class MIType : uint32_t {
+  Int8 = 1,
+  UInt8 = 2,
+  Int16 = 3,
+  UInt16 = 4,
+  Int32 = 5,
+  UInt32 = 6,
+  Single = 7,
+  Double = 9,
+  Int64 = 12,
+  UInt64 = 13,
+  Matrix = 14,
+  Compressed = 15
+};
+
+// classes of arrays
+enum class MXClass : uint32_t {
+  Struct = 2,
+  Char = 4,
+  Double = 6,
+  Single = 7,
+  Int8 = 8,
+  UInt8 = 9,
+  Int16 = 10,
+  UInt16 = 11,
+  Int32 = 12,
+  UInt32 = 13
+};
+
+static const uint32_t LogicalFlag = 0x0200;
+
+template <class T> inline void Append(std::vector<uint8_t> &out, const T &v) {
+  const uint8_t *p = reinterpret_cast<const uint8_t *>(&v);
+  out.insert(out.end(), p, p + sizeof(T));
+}
+
+// tag, data and the padding to 8 bytes
+inline void AppendElement(std::vector<uint8_t> &out, MIType type,
+                          const void *data, size_t nbytes) {
+  Append(out, uint32_t(type));
+  Append(out, uint32_t(nbytes));
+  const uint8_t *p = static_cast<const uint8_t *>(data);
+  out.insert(out.end(), p, p + nbytes);
+  out.resize((out.size() + 7) / 8 * 8, 0);
+}
+
+inline void AppendHeader(std::vector<uint8_t> &out, MXClass claz,
+                         uint32_t flags, const std::vector<int32_t> &dims,
+                         const std::string &name) {
+  uint32_t arrayFlags[2] = {uint32_t(claz) | flags, 0};
+  AppendElement(out, MIType::UInt32, arrayFlags, sizeof(arrayFlags));
+  AppendElement(out, MIType::Int32, dims.data(), dims.size() * 4);
+  AppendElement(out, MIType::Int8, name.data(), name.size());
+}
+
+inline bool ClassOfDepth(int depth, MXClass &claz, MIType &type) {
+  switch (depth) {
+  case CV_8U:
+    claz = MXClass::UInt8, type = MIType::UInt8;
+    return true;
+  case CV_8S:
+    claz = MXClass::Int8, type = MIType::Int8;
+    return true;
+  case CV_16U:
+    claz = MXClass::UInt16, type = MIType::UInt16;
+    return true;
+  case CV_16S:
+    claz = MXClass::Int16, type = MIType::Int16;
+    return true;
+  case CV_32S:
+    claz = MXClass::Int32, type = MIType::Int32;
+    return true;
+  case CV_32F:
+    claz = MXClass::Single, type = MIType::Single;
+    return true;
+  case CV_64F:
+    claz = MXClass::Double, type = MIType::Double;
+    return true;
+  default:
+    return false;
+  }
+}
+
+// column major planar bytes of a mat, channels being the last dimension
+std::vector<uint8_t> ColumnMajorBytes(const cv::Mat &m) {
+  const size_t es = m.elemSize1();
+  const int cn = m.channels();
+  std::vector<uint8_t> bytes(m.total() * cn * es);
+  if (bytes.empty()) {
+    return bytes;
+  }
+  if (m.dims == 2) {
+    const size_t plane = size_t(m.rows) * m.cols;
+    for (int r = 0; r < m.rows; r++) {
+      const uint8_t *from = m.ptr(r);
+      for (int c = 0; c < m.cols; c++) {
+        for (int k = 0; k < cn; k++, from += es) {
+          std::memcpy(&bytes[(k * plane + size_t(c) * m.rows + r) * es], from,
+                      es);
+        }
+      }
+    }
+    return bytes;
+  }
+  std::vector<int> pos(m.dims);
+  cv::MatConstIterator iter(&m);
+  for (size_t i = 0; i < m.total(); i++, ++iter) {
+    iter.pos(pos.data());
+    size_t index = 0, stride = 1;
+    for (int d = 0; d < m.dims; d++) {
+      index += pos[d] * stride;
+      stride *= m.size[d];
+    }
+    for (int k = 0; k < cn; k++) {
+      std::memcpy(&bytes[(k * m.total() + index) * es], *iter + k * es, es);
+    }
+  }
+  return bytes;
+}
+}
+
+MATValue::MATValue() : _kind(Numeric), _data(0, 0, CV_64FC1), _m(0), _n(0) {}
+
+MATValue::MATValue(const cv::Mat &m) : _kind(Numeric), _data(m), _m(0), _n(0) {
+  MXClass claz;
+  MIType type;
+  if (!ClassOfDepth(m.depth(), claz, type)) {
+    std::cout << "this cv depth type cannot be written into a mat file"
+              << std::endl;
+    _data = cv::Mat(0, 0, CV_64FC1);
+  }
+}
+
+MATValue::MATValue(double scalar)
+    : _kind(Numeric), _data(1, 1, CV_64FC1, cv::Scalar(scalar)), _m(0),
+      _n(0) {}
+
+MATValue::MATValue(int scalar)
+    : _kind(Numeric), _data(1, 1, CV_64FC1, cv::Scalar(scalar)), _m(0),
+      _n(0) {}
+
+MATValue::MATValue(bool scalar)
+    : _kind(Logical), _data(1, 1, CV_8UC1, cv::Scalar(scalar ? 1 : 0)), _m(0),
+      _n(0) {}
+
+MATValue::MATValue(const std::string &str)
+    : _kind(Char), _chars(str), _m(0), _n(0) {}
+
+MATValue
+MATValue::createStructMatrix(int m, int n,
+                             const std::vector<std::string> &fieldNames) {
+  MATValue v;
+  v._kind = Struct;
+  v._data = cv::Mat();
+  v._m = m;
+  v._n = n;
+  v._fieldNames = fieldNames;
+  v._fields.resize(size_t(m) * n * fieldNames.size());
+  return v;
+}
+
+void MATValue::setField(const std::string &name, int index,
+                        const MATValue &value) {
+  assert(_kind == Struct && index >= 0 && index < _m * _n);
+  auto it = std::find(_fieldNames.begin(), _fieldNames.end(), name);
+  assert(it != _fieldNames.end());
+  _fields[index * _fieldNames.size() + (it - _fieldNames.begin())] =
+      std::make_shared<MATValue>(value);
+}
+
+void MATValue::appendTo(const std::string &name,
+                        std::vector<uint8_t> &out) const {
+  const size_t start = out.size();
+  Append(out, uint32_t(MIType::Matrix));
+  Append(out, uint32_t(0)); // filled at last
+
+  if (_kind == Numeric || _kind == Logical) {
+    MXClass claz;
+    MIType type;
+    ClassOfDepth(_data.depth(), claz, type);
+    std::vector<int32_t> dims(_data.size.p, _data.size.p + _data.dims);
+    if (dims.size() < 2) {
+      dims.resize(2, 0);
+    }
+    if (_data.channels() > 1) {
+      dims.push_back(_data.channels());
+    }
+    AppendHeader(out, claz, _kind == Logical ? LogicalFlag : 0, dims, name);
+    auto bytes = ColumnMajorBytes(_data);
+    AppendElement(out, type, bytes.data(), bytes.size());
+  } else if (_kind == Char) {
+    AppendHeader(out, MXClass::Char, 0, {1, int32_t(_chars.size())}, name);
+    std::vector<uint16_t> chars(_chars.size());
+    for (int i = 0; i < _chars.size(); i++) {
+      chars[i] = static_cast<unsigned char>(_chars[i]);
+    }
+    AppendElement(out, MIType::UInt16, chars.data(), chars.size() * 2);
+  } else {
+    AppendHeader(out, MXClass::Struct, 0, {_m, _n}, name);
+    // field names are of the same length, in a small data element
+    int32_t nameLength = 1;
+    for (auto &fn : _fieldNames) {
+      nameLength = std::max(nameLength, int32_t(fn.size() + 1));
+    }
+    Append(out, uint32_t(MIType::Int32) | (4u << 16));
+    Append(out, nameLength);
+    std::vector<char> names(_fieldNames.size() * nameLength, '\0');
+    for (int i = 0; i < _fieldNames.size(); i++) {
+      std::copy(_fieldNames[i].begin(), _fieldNames[i].end(),
+                names.begin() + i * nameLength);
+    }
+    AppendElement(out, MIType::Int8, names.data(), names.size());
+    for (auto &field : _fields) {
+      if (field) {
+        field->appendTo(std::string(), out);
+      } else {
+        MATValue().appendTo(std::string(), out);
+      }
+    }
+  }
+
+  uint32_t nbytes = out.size() - start - 8;
+  std::memcpy(&out[start + 4], &nbytes, sizeof(nbytes));
+}
+
+MATFileWriter::MATFileWriter(const std::string &fname, bool compress)
+    : _ofs(fname, std::ios::binary), _compress(compress) {
+  if (!_ofs.is_open()) {
+    std::cout << "file \"" << fname << "\" cannot be opened!" << std::endl;
+    return;
+  }
+  // 116 bytes of text, 8 bytes of subsystem data offset, version and endian
+  char header[128];
+  std::memset(header, ' ', 116);
+  std::memset(header + 116, 0, 8);
+  static const std::string text =
+      "MATLAB 5.0 MAT-file, Created by: Panoramix";
+  std::copy(text.begin(), text.end(), header);
+  uint16_t version = 0x0100;
+  uint16_t endian = ('M' << 8) | 'I';
+  std::memcpy(header + 124, &version, 2);
+  std::memcpy(header + 126, &endian, 2);
+  _ofs.write(header, sizeof(header));
+}
+
+bool MATFileWriter::setVar(const std::string &name, const MATValue &value) {
+  if (null()) {
+    return false;
+  }
+  std::vector<uint8_t> element;
+  value.appendTo(name, element);
+#ifdef PANORAMIX_USE_ZLIB
+  if (_compress) {
+    uLongf size = compressBound(element.size());
+    std::vector<uint8_t> compressed(8 + size);
+    if (compress2(compressed.data() + 8, &size, element.data(), element.size(),
+                  Z_DEFAULT_COMPRESSION) == Z_OK) {
+      uint32_t tag[2] = {uint32_t(MIType::Compressed), uint32_t(size)};
+      std::memcpy(compressed.data(), tag, sizeof(tag));
+      compressed.resize(8 + size);
+      element.swap(compressed);
+    }
+  }
+#endif
+  std::lock_guard<std::mutex> lock(_mutex);
+  _ofs.write(reinterpret_cast<const char *>(element.data()), element.size());
+  return bool(_ofs);
+}
+}
+}
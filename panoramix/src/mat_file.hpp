@@ -0,0 +1,68 @@
+#pragma once
+
+#include <fstream>
+#include <mutex>
+
+#include "basic_types.hpp"
+
+namespace pano {
+namespace misc {
+
+// value to be written into MAT-files (level 5) without MATLAB
+// - numeric and logical arrays, char strings and struct arrays
+// - channels of cv::Mats become the last dimension, as in MXA
+class MATValue {
+public:
+  MATValue(); // the empty double array []
+  MATValue(const cv::Mat &m);
+  MATValue(double scalar);
+  MATValue(int scalar);
+  MATValue(bool scalar); // logical
+  MATValue(const std::string &str);
+  MATValue(const char *str) : MATValue(std::string(str)) {}
+  template <class T, int N>
+  MATValue(const core::Vec<T, N> &v) : MATValue(cv::Mat(v, true)) {}
+
+  static MATValue
+  createStructMatrix(int m, int n, const std::vector<std::string> &fieldNames);
+
+public:
+  bool isStruct() const { return _kind == Struct; }
+  // index is the linear index of the struct element in column major order
+  void setField(const std::string &name, int index, const MATValue &value);
+
+  // appends the miMATRIX data element
+  void appendTo(const std::string &name, std::vector<uint8_t> &out) const;
+
+private:
+  enum Kind { Numeric, Logical, Char, Struct };
+  Kind _kind;
+  cv::Mat _data;
+  std::string _chars;
+  int _m, _n;
+  std::vector<std::string> _fieldNames;
+  // element major, null fields are empty arrays
+  std::vector<std::shared_ptr<MATValue>> _fields;
+};
+
+// MAT-file (level 5) writer
+// - variables are encoded, and compressed if built with zlib and compress is
+//   on, on the calling thread, only appending them to the file is serialized,
+//   so setVar can be called from multiple threads
+class MATFileWriter {
+public:
+  explicit MATFileWriter(const std::string &fname, bool compress = true);
+
+  MATFileWriter(const MATFileWriter &) = delete;
+  MATFileWriter &operator=(const MATFileWriter &) = delete;
+
+  bool null() const { return !_ofs.is_open(); }
+  bool setVar(const std::string &name, const MATValue &value);
+
+private:
+  std::ofstream _ofs;
+  bool _compress;
+  std::mutex _mutex;
+};
+}
+}
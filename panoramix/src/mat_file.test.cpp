@@ -0,0 +1,164 @@
+#ifdef PANORAMIX_USE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "mat_file.hpp"
+
+#include "../panoramix.unittest.hpp"
+
+using namespace pano;
+
+namespace {
+std::vector<char> ReadBytes(const std::string &fname) {
+  std::ifstream ifs(fname, std::ios::binary);
+  return std::vector<char>((std::istreambuf_iterator<char>(ifs)),
+                           std::istreambuf_iterator<char>());
+}
+
+uint32_t U32(const std::vector<char> &bytes, int offset) {
+  uint32_t v;
+  std::memcpy(&v, &bytes[offset], 4);
+  return v;
+}
+
+template <class ValueT>
+std::vector<char> WriteVar(const std::string &fname, const std::string &name,
+                           const ValueT &value, bool compress = false) {
+  {
+    misc::MATFileWriter matFile(fname, compress);
+    EXPECT_FALSE(matFile.null());
+    EXPECT_TRUE(matFile.setVar(name, value));
+  }
+  return ReadBytes(fname);
+}
+}
+
+TEST(MATFileTest, Layout) {
+  const std::string fname = PANORAMIX_TEST_DATA_DIR_STR "/layout.mat";
+  {
+    misc::MATFileWriter matFile(fname, false);
+    ASSERT_FALSE(matFile.null());
+    core::Imaged x(2, 3);
+    for (int i = 0; i < 6; i++) {
+      x(i / 3, i % 3) = i + 1;
+    }
+    EXPECT_TRUE(matFile.setVar("x", x));
+  }
+
+  auto bytes = ReadBytes(fname);
+  ASSERT_EQ(bytes.size(), 128 + 8 + 104);
+  EXPECT_EQ(std::string(bytes.begin(), bytes.begin() + 10), "MATLAB 5.0");
+  EXPECT_EQ(bytes[126], 'I');
+  EXPECT_EQ(bytes[127], 'M');
+
+  EXPECT_EQ(U32(bytes, 128), 14); // miMATRIX
+  EXPECT_EQ(U32(bytes, 132), 104);
+  EXPECT_EQ(U32(bytes, 144), 6); // mxDOUBLE_CLASS
+  EXPECT_EQ(U32(bytes, 160), 2); // rows
+  EXPECT_EQ(U32(bytes, 164), 3); // cols
+  EXPECT_EQ(bytes[176], 'x');
+  EXPECT_EQ(U32(bytes, 184), 9); // miDOUBLE
+  EXPECT_EQ(U32(bytes, 188), 48);
+
+  // column major
+  double data[6];
+  std::memcpy(data, &bytes[192], sizeof(data));
+  const double expected[6] = {1, 4, 2, 5, 3, 6};
+  for (int i = 0; i < 6; i++) {
+    EXPECT_EQ(data[i], expected[i]);
+  }
+}
+
+TEST(MATFileTest, Logical) {
+  auto bytes = WriteVar(PANORAMIX_TEST_DATA_DIR_STR "/logical.mat", "b", true);
+  ASSERT_EQ(bytes.size(), 128 + 8 + 64);
+  EXPECT_EQ(U32(bytes, 132), 64);
+  EXPECT_EQ(U32(bytes, 144), 0x0209); // mxUINT8_CLASS, logical
+  EXPECT_EQ(U32(bytes, 160), 1);
+  EXPECT_EQ(U32(bytes, 164), 1);
+  EXPECT_EQ(bytes[176], 'b');
+  EXPECT_EQ(U32(bytes, 184), 2); // miUINT8
+  EXPECT_EQ(U32(bytes, 188), 1);
+  EXPECT_EQ(bytes[192], 1);
+}
+
+TEST(MATFileTest, Char) {
+  auto bytes = WriteVar(PANORAMIX_TEST_DATA_DIR_STR "/char.mat", "c", "ab");
+  ASSERT_EQ(bytes.size(), 128 + 8 + 64);
+  EXPECT_EQ(U32(bytes, 144), 4); // mxCHAR_CLASS
+  EXPECT_EQ(U32(bytes, 160), 1);
+  EXPECT_EQ(U32(bytes, 164), 2);
+  EXPECT_EQ(bytes[176], 'c');
+  EXPECT_EQ(U32(bytes, 184), 4); // miUINT16
+  EXPECT_EQ(U32(bytes, 188), 4);
+  uint16_t chars[2];
+  std::memcpy(chars, &bytes[192], sizeof(chars));
+  EXPECT_EQ(chars[0], 'a');
+  EXPECT_EQ(chars[1], 'b');
+}
+
+TEST(MATFileTest, Struct) {
+  auto s = misc::MATValue::createStructMatrix(1, 1, {"a", "bc"});
+  EXPECT_TRUE(s.isStruct());
+  s.setField("a", 0, 2.0);
+  auto bytes = WriteVar(PANORAMIX_TEST_DATA_DIR_STR "/struct.mat", "s", s);
+  ASSERT_EQ(bytes.size(), 328);
+  EXPECT_EQ(U32(bytes, 132), 192);
+  EXPECT_EQ(U32(bytes, 144), 2); // mxSTRUCT_CLASS
+  EXPECT_EQ(U32(bytes, 160), 1);
+  EXPECT_EQ(U32(bytes, 164), 1);
+  EXPECT_EQ(bytes[176], 's');
+
+  // field name length in a small data element, then the padded names
+  EXPECT_EQ(U32(bytes, 184), 5 | (4 << 16));
+  EXPECT_EQ(U32(bytes, 188), 3);
+  EXPECT_EQ(U32(bytes, 192), 1); // miINT8
+  EXPECT_EQ(U32(bytes, 196), 6);
+  EXPECT_EQ(std::string(&bytes[200], 6), std::string("a\0\0bc\0", 6));
+
+  // field a, a nameless double scalar
+  EXPECT_EQ(U32(bytes, 208), 14);
+  EXPECT_EQ(U32(bytes, 212), 56);
+  EXPECT_EQ(U32(bytes, 224), 6);
+  EXPECT_EQ(U32(bytes, 252), 0);
+  EXPECT_EQ(U32(bytes, 256), 9);
+  double a;
+  std::memcpy(&a, &bytes[264], sizeof(a));
+  EXPECT_EQ(a, 2.0);
+
+  // field bc, unset, the empty double array
+  EXPECT_EQ(U32(bytes, 272), 14);
+  EXPECT_EQ(U32(bytes, 276), 48);
+  EXPECT_EQ(U32(bytes, 288), 6);
+  EXPECT_EQ(U32(bytes, 304), 0);
+  EXPECT_EQ(U32(bytes, 308), 0);
+  EXPECT_EQ(U32(bytes, 320), 9);
+  EXPECT_EQ(U32(bytes, 324), 0);
+}
+
+#ifdef PANORAMIX_USE_ZLIB
+TEST(MATFileTest, Compressed) {
+  auto s = misc::MATValue::createStructMatrix(1, 2, {"x", "name"});
+  s.setField("x", 0, core::Imaged(20, 30, 1.0));
+  s.setField("name", 1, "panorama");
+  auto plain = WriteVar(PANORAMIX_TEST_DATA_DIR_STR "/plain.mat", "s", s);
+  auto compressed = WriteVar(PANORAMIX_TEST_DATA_DIR_STR "/compressed.mat",
+                             "s", s, true);
+  ASSERT_GT(compressed.size(), 136);
+  EXPECT_LT(compressed.size(), plain.size());
+  EXPECT_TRUE(std::equal(plain.begin(), plain.begin() + 128,
+                         compressed.begin()));
+  EXPECT_EQ(U32(compressed, 128), 15); // miCOMPRESSED
+  ASSERT_EQ(U32(compressed, 132), compressed.size() - 136);
+
+  // inflates to the uncompressed element
+  std::vector<char> element(plain.size() - 128);
+  uLongf size = element.size();
+  ASSERT_EQ(uncompress(reinterpret_cast<Bytef *>(element.data()), &size,
+                       reinterpret_cast<const Bytef *>(&compressed[136]),
+                       compressed.size() - 136),
+            Z_OK);
+  ASSERT_EQ(size, element.size());
+  EXPECT_TRUE(std::equal(element.begin(), element.end(), plain.begin() + 128));
+}
+#endif
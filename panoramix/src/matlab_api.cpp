@@ -89,6 +89,45 @@ inline int MxClassIDToCVDepth(mxClassID id) {
   }
 }
 
+namespace {
+// a channel of a 2d cv::Mat is stored by matlab as a column major plane, i.e.
+// the row major transpose of the channel, so the interleaved channels are
+// split into planes and each one is transposed by cv::transpose right into
+// or out of the matlab data
+bool CopyCVMatToMatlab(const cv::Mat &im, void *mad) {
+  if (im.dims != 2) {
+    return false;
+  }
+  const int planeType = CV_MAKETYPE(im.depth(), 1);
+  const size_t planeBytes = im.total() * im.elemSize1();
+  std::vector<cv::Mat> channels;
+  cv::split(im, channels);
+  for (int k = 0; k < channels.size(); k++) {
+    cv::Mat plane(im.cols, im.rows, planeType,
+                  static_cast<uint8_t *>(mad) + k * planeBytes);
+    cv::transpose(channels[k], plane);
+  }
+  return true;
+}
+
+bool CopyMatlabToCVMat(const void *mad, cv::Mat &im) {
+  if (im.dims != 2) {
+    return false;
+  }
+  const int planeType = CV_MAKETYPE(im.depth(), 1);
+  const size_t planeBytes = im.total() * im.elemSize1();
+  std::vector<cv::Mat> channels(im.channels());
+  for (int k = 0; k < channels.size(); k++) {
+    cv::Mat plane(im.cols, im.rows, planeType,
+                  const_cast<uint8_t *>(static_cast<const uint8_t *>(mad)) +
+                      k * planeBytes);
+    cv::transpose(plane, channels[k]);
+  }
+  cv::merge(channels, im);
+  return true;
+}
+}
+
 MXA::MXA() : _mxa(0), _destroyWhenOutofScope(false) {}
 MXA::MXA(void *mxa, bool dos) : _mxa(mxa), _destroyWhenOutofScope(dos) {}
 MXA::MXA(MXA &&a) {
@@ -115,30 +154,32 @@ MXA::MXA(const cv::Mat &im, bool dos /*= false*/)
   if (!ma)
     return;
 
-  uint8_t *mad = (uint8_t *)mxGetData(ma);
-  const size_t szForEachElem = im.elemSize1();
-  mwIndex *mxIndices = new mwIndex[im.dims + 1];
-  int *cvIndices = new int[im.dims];
-
-  cv::MatConstIterator iter(&im);
-  int imTotal = im.total();
-  for (int i = 0; i < imTotal; i++, ++iter) {
-    // get indices in cv::Mat
-    iter.pos(cvIndices);
-    // copy indices to mxIndices
-    std::copy(cvIndices, cvIndices + im.dims, mxIndices);
-    for (mwIndex k = 0; k < channelNum; k++) {
-      const uint8_t *fromDataHead = (*iter) + k * szForEachElem;
-      mxIndices[im.dims] = k; // set the last indices
-      uint8_t *toDataHead =
-          mad +
-          mxCalcSingleSubscript(ma, im.dims + 1, mxIndices) * szForEachElem;
-      std::memcpy(toDataHead, fromDataHead, szForEachElem);
+  if (!CopyCVMatToMatlab(im, mxGetData(ma))) {
+    uint8_t *mad = (uint8_t *)mxGetData(ma);
+    const size_t szForEachElem = im.elemSize1();
+    mwIndex *mxIndices = new mwIndex[im.dims + 1];
+    int *cvIndices = new int[im.dims];
+
+    cv::MatConstIterator iter(&im);
+    int imTotal = im.total();
+    for (int i = 0; i < imTotal; i++, ++iter) {
+      // get indices in cv::Mat
+      iter.pos(cvIndices);
+      // copy indices to mxIndices
+      std::copy(cvIndices, cvIndices + im.dims, mxIndices);
+      for (mwIndex k = 0; k < channelNum; k++) {
+        const uint8_t *fromDataHead = (*iter) + k * szForEachElem;
+        mxIndices[im.dims] = k; // set the last indices
+        uint8_t *toDataHead =
+            mad +
+            mxCalcSingleSubscript(ma, im.dims + 1, mxIndices) * szForEachElem;
+        std::memcpy(toDataHead, fromDataHead, szForEachElem);
+      }
     }
-  }
 
-  delete[] mxIndices;
-  delete[] cvIndices;
+    delete[] mxIndices;
+    delete[] cvIndices;
+  }
 
   _mxa = static_cast<void *>(ma);
   _destroyWhenOutofScope = dos;
@@ -191,79 +232,34 @@ MXA::MXA(const std::string &string, bool dos /*= false*/)
 
 MXA::MXA(const cv::SparseMat &mat, bool dos /*= false*/)
     : _mxa(0), _destroyWhenOutofScope(false) {
-  // collect all dimensions of im
-  int channelNum = mat.channels();
-  assert(channelNum == 1);
+  assert(mat.channels() == 1 && mat.dims() == 2);
 
-  // create mxArray
-  int nzc = mat.nzcount();
-  mxArray *ma = mxCreateSparse(mat.size(0), mat.size(1), nzc, mxREAL);
-
-  if (!ma)
-    return;
-
-  std::vector<std::tuple<int, int, double>> triplets; // col - row - val
-  triplets.reserve(nzc);
-
-  THERE_ARE_BOTTLENECKS_HERE(); // we should only iterate non zero elements
+  // only the stored nodes are visited
+  std::vector<core::SparseMatElementd> elements;
+  elements.reserve(mat.nzcount());
   for (auto iter = mat.begin(); iter != mat.end(); ++iter) {
-    int ii = iter.node()->idx[0];
-    int jj = iter.node()->idx[1];
-    uchar *data = iter.ptr;
     double v = 0.0;
-    if (mat.type() == CV_32FC1) {
-      float value = 0.0f;
-      std::memcpy(&value, data, sizeof(value));
-      v = value;
-    } else if (mat.type() == CV_64FC1) {
-      double value = 0.0f;
-      std::memcpy(&value, data, sizeof(value));
-      v = value;
-    } else if (mat.type() == CV_32SC1) {
-      int32_t value = 0;
-      std::memcpy(&value, data, sizeof(value));
-      v = value;
-    } else if (mat.type() == CV_64FC1) {
-      int64_t value = 0;
-      std::memcpy(&value, data, sizeof(value));
-      v = value;
-    } else if (mat.type() == CV_8UC1) {
-      uint8_t value = 0;
-      std::memcpy(&value, data, sizeof(value));
-      v = value;
-    } else {
+    switch (mat.type()) {
+    case CV_32FC1:
+      v = iter.value<float>();
+      break;
+    case CV_64FC1:
+      v = iter.value<double>();
+      break;
+    case CV_32SC1:
+      v = iter.value<int32_t>();
+      break;
+    case CV_8UC1:
+      v = iter.value<uint8_t>();
+      break;
+    default:
       assert(false && "element type is not supported here!");
     }
-    if (v != 0.0)
-      triplets.emplace_back(jj, ii, v); // col - row - val
-  }
-
-  // make triplets ordered in column indices to satisfy matlab interface
-  std::sort(triplets.begin(), triplets.end());
-
-  // fill in matlab data
-  auto sr = mxGetPr(ma);
-  // auto si = mxGetPi(ma);
-  auto irs = mxGetIr(ma);
-  auto jcs = mxGetJc(ma);
-  jcs = (mwIndex *)mxRealloc(jcs, (mat.size(1) + 1) * sizeof(mwIndex));
-  std::fill(jcs, jcs + (mat.size(1) + 1), 0);
-  mxSetJc(ma, jcs);
-
-  for (int i = 0; i < triplets.size(); i++) {
-    sr[i] = std::get<2>(triplets[i]);
-    int ii = std::get<1>(triplets[i]) + 1;
-    int jj = std::get<0>(triplets[i]) + 1;
-    irs[i] = ii - 1;
-    jcs[jj]++;
-  }
-
-  for (int j = 1; j < (mat.size(1) + 1); j++) {
-    jcs[j] += jcs[j - 1];
+    if (v != 0.0) {
+      elements.emplace_back(iter.node()->idx[0], iter.node()->idx[1], v);
+    }
   }
-
-  _mxa = ma;
-  _destroyWhenOutofScope = dos;
+  *this = createSparseMatrix(mat.size(0), mat.size(1), elements, dos);
 }
 
 MXA::MXA(cv::InputArray m, bool dos /*= false*/) {
@@ -283,30 +279,32 @@ MXA::MXA(cv::InputArray m, bool dos /*= false*/) {
   if (!ma)
     return;
 
-  uint8_t *mad = (uint8_t *)mxGetData(ma);
-  const size_t szForEachElem = im.elemSize1();
-  mwIndex *mxIndices = new mwIndex[im.dims + 1];
-  int *cvIndices = new int[im.dims];
-
-  cv::MatConstIterator iter(&im);
-  int imTotal = im.total();
-  for (int i = 0; i < imTotal; i++, ++iter) {
-    // get indices in cv::Mat
-    iter.pos(cvIndices);
-    // copy indices to mxIndices
-    std::copy(cvIndices, cvIndices + im.dims, mxIndices);
-    for (mwIndex k = 0; k < channelNum; k++) {
-      const uint8_t *fromDataHead = (*iter) + k * szForEachElem;
-      mxIndices[im.dims] = k; // set the last indices
-      uint8_t *toDataHead =
-          mad +
-          mxCalcSingleSubscript(ma, im.dims + 1, mxIndices) * szForEachElem;
-      std::memcpy(toDataHead, fromDataHead, szForEachElem);
+  if (!CopyCVMatToMatlab(im, mxGetData(ma))) {
+    uint8_t *mad = (uint8_t *)mxGetData(ma);
+    const size_t szForEachElem = im.elemSize1();
+    mwIndex *mxIndices = new mwIndex[im.dims + 1];
+    int *cvIndices = new int[im.dims];
+
+    cv::MatConstIterator iter(&im);
+    int imTotal = im.total();
+    for (int i = 0; i < imTotal; i++, ++iter) {
+      // get indices in cv::Mat
+      iter.pos(cvIndices);
+      // copy indices to mxIndices
+      std::copy(cvIndices, cvIndices + im.dims, mxIndices);
+      for (mwIndex k = 0; k < channelNum; k++) {
+        const uint8_t *fromDataHead = (*iter) + k * szForEachElem;
+        mxIndices[im.dims] = k; // set the last indices
+        uint8_t *toDataHead =
+            mad +
+            mxCalcSingleSubscript(ma, im.dims + 1, mxIndices) * szForEachElem;
+        std::memcpy(toDataHead, fromDataHead, szForEachElem);
+      }
     }
-  }
 
-  delete[] mxIndices;
-  delete[] cvIndices;
+    delete[] mxIndices;
+    delete[] cvIndices;
+  }
 
   _mxa = ma;
   _destroyWhenOutofScope = dos;
@@ -401,6 +399,11 @@ bool MXA::toCVOutputArray(cv::OutputArray mat,
   mat.create(cvDims, cvDimSizes, CV_MAKETYPE(depth, channels));
   cv::Mat im = mat.getMat();
 
+  delete[] cvDimSizes;
+  if (CopyMatlabToCVMat(mad, im)) {
+    return true;
+  }
+
   mwIndex *mxIndices = new mwIndex[im.dims + 1];
   int *cvIndices = new int[im.dims];
 
@@ -421,7 +424,6 @@ bool MXA::toCVOutputArray(cv::OutputArray mat,
     }
   }
 
-  delete[] cvDimSizes;
   delete[] mxIndices;
   delete[] cvIndices;
   return true;
@@ -535,6 +537,83 @@ MXA MXA::createCellMatrix(int m, int n, bool dos) {
   return MXA(mxCreateCellMatrix(m, n), dos);
 }
 
+MXA MXA::createSparseMatrix(int m, int n, const std::vector<int> &colOffsets,
+                            const std::vector<int> &rowIds,
+                            const std::vector<double> &values, bool dos) {
+  assert(colOffsets.size() == n + 1 && rowIds.size() == values.size());
+  mxArray *ma =
+      mxCreateSparse(m, n, std::max<size_t>(values.size(), 1), mxREAL);
+  if (!ma) {
+    return MXA();
+  }
+  std::copy(values.begin(), values.end(), mxGetPr(ma));
+  std::copy(rowIds.begin(), rowIds.end(), mxGetIr(ma));
+  std::copy(colOffsets.begin(), colOffsets.end(), mxGetJc(ma));
+  return MXA(ma, dos);
+}
+
+MXA MXA::createSparseMatrix(
+    int m, int n, const std::vector<core::SparseMatElementd> &elements,
+    bool dos) {
+  std::vector<int> colOffsets, rowIds;
+  std::vector<double> values;
+  compressSparseColumns(n, elements, colOffsets, rowIds, values);
+  return createSparseMatrix(m, n, colOffsets, rowIds, values, dos);
+}
+
+void MXA::compressSparseColumns(
+    int n, const std::vector<core::SparseMatElementd> &elements,
+    std::vector<int> &colOffsets, std::vector<int> &rowIds,
+    std::vector<double> &values) {
+  // bucket elements by columns, keeping their order
+  std::vector<int> cursors(n + 1, 0);
+  for (auto &e : elements) {
+    cursors[e.col + 1]++;
+  }
+  std::partial_sum(cursors.begin(), cursors.end(), cursors.begin());
+  std::vector<int> order(elements.size());
+  for (int i = 0; i < elements.size(); i++) {
+    order[cursors[elements[i].col]++] = i;
+  }
+
+  // sort rows in each column, the last one of duplicates wins
+  colOffsets.assign(n + 1, 0);
+  rowIds.clear();
+  values.clear();
+  rowIds.reserve(elements.size());
+  values.reserve(elements.size());
+  int first = 0;
+  for (int col = 0; col < n; col++) {
+    int last = cursors[col];
+    std::stable_sort(order.begin() + first, order.begin() + last,
+                     [&elements](int a, int b) {
+                       return elements[a].row < elements[b].row;
+                     });
+    for (int k = first; k < last; k++) {
+      auto &e = elements[order[k]];
+      if (rowIds.size() > colOffsets[col] && rowIds.back() == e.row) {
+        values.back() = e.value;
+      } else {
+        rowIds.push_back(e.row);
+        values.push_back(e.value);
+      }
+    }
+    // drop zeros once duplicates are resolved
+    int kept = colOffsets[col];
+    for (int k = colOffsets[col]; k < values.size(); k++) {
+      if (values[k] != 0.0) {
+        rowIds[kept] = rowIds[k];
+        values[kept] = values[k];
+        kept++;
+      }
+    }
+    rowIds.resize(kept);
+    values.resize(kept);
+    colOffsets[col + 1] = kept;
+    first = last;
+  }
+}
+
 MXA MXA::createStructMatrix(int m, int n,
                             const std::vector<std::string> &fieldNames,
                             bool dos) {
@@ -630,32 +709,12 @@ bool MAT::removeVar(const std::string &name) {
   return matDeleteVariable(static_cast<::MATFile *>(_fp), name.c_str()) == 0;
 }
 
-Matlab::Matlab(const std::string &defaultDir, bool singleUse, bool printMsg)
-    : _eng(nullptr), _buffer(nullptr), _printMessage(printMsg) {
-  static const int bufferSize = 1024;
-  if (singleUse) {
-    _eng = engOpenSingleUse(nullptr, nullptr, nullptr);
-  } else {
-    _eng = engOpen(nullptr);
-  }
-  if (_eng) {
-    engSetVisible(static_cast<::Engine *>(_eng), false);
-    _buffer = new char[bufferSize];
-    std::memset(_buffer, 0, bufferSize);
-    engOutputBuffer(static_cast<::Engine *>(_eng), _buffer, bufferSize);
-    if (_printMessage) {
-      std::cout << "Matlab Engine Launched" << std::endl;
-    }
-    if (!defaultDir.empty()) {
-      engEvalString(static_cast<::Engine *>(_eng),
-                    ("cd " + defaultDir + "; startup; pwd").c_str());
-    } else {
-      (*this) << (std::string("cd ") + PANORAMIX_MATLAB_CODE_DIR_STR +
-                  "; startup; pwd");
-    }
-    if (_printMessage) {
-      std::cout << _buffer << std::endl;
-    }
+Matlab::Matlab(const std::string &defaultDir, bool singleUse, bool printMsg,
+               bool lazyStart)
+    : _eng(nullptr), _buffer(nullptr), _printMessage(printMsg),
+      _defaultDir(defaultDir), _singleUse(singleUse) {
+  if (!lazyStart) {
+    start();
   }
 }
 
@@ -671,7 +730,9 @@ Matlab::~Matlab() {
   _buffer = nullptr;
 }
 
-Matlab::Matlab(Matlab &&e) {
+Matlab::Matlab(Matlab &&e)
+    : _printMessage(e._printMessage), _defaultDir(std::move(e._defaultDir)),
+      _singleUse(e._singleUse) {
   _eng = e._eng;
   e._eng = nullptr;
   _buffer = e._buffer;
@@ -681,12 +742,50 @@ Matlab::Matlab(Matlab &&e) {
 Matlab &Matlab::operator=(Matlab &&e) {
   std::swap(e._eng, _eng);
   std::swap(e._buffer, _buffer);
+  std::swap(e._printMessage, _printMessage);
+  std::swap(e._defaultDir, _defaultDir);
+  std::swap(e._singleUse, _singleUse);
   return *this;
 }
 
 bool Matlab::started() const { return _eng != nullptr; }
 
+bool Matlab::start() const {
+  static const int bufferSize = 1024;
+  if (_eng) {
+    return true;
+  }
+  if (_singleUse) {
+    _eng = engOpenSingleUse(nullptr, nullptr, nullptr);
+  } else {
+    _eng = engOpen(nullptr);
+  }
+  if (_eng) {
+    engSetVisible(static_cast<::Engine *>(_eng), false);
+    _buffer = new char[bufferSize];
+    std::memset(_buffer, 0, bufferSize);
+    engOutputBuffer(static_cast<::Engine *>(_eng), _buffer, bufferSize);
+    if (_printMessage) {
+      std::cout << "Matlab Engine Launched" << std::endl;
+    }
+    if (!_defaultDir.empty()) {
+      engEvalString(static_cast<::Engine *>(_eng),
+                    ("cd " + _defaultDir + "; startup; pwd").c_str());
+    } else {
+      (*this) << (std::string("cd ") + PANORAMIX_MATLAB_CODE_DIR_STR +
+                  "; startup; pwd");
+    }
+    if (_printMessage) {
+      std::cout << _buffer << std::endl;
+    }
+  }
+  return _eng != nullptr;
+}
+
 bool Matlab::run(const std::string &cmd) const {
+  if (!start()) {
+    return false;
+  }
   bool ret = engEvalString(static_cast<::Engine *>(_eng), cmd.c_str()) == 0;
   if (_printMessage && strlen(_buffer) > 0) {
     std::cout << "[Message when executing '" << cmd << "']:\n" << _buffer
@@ -695,17 +794,25 @@ bool Matlab::run(const std::string &cmd) const {
   return ret;
 }
 
-std::string Matlab::lastMessage() const { return _buffer; }
+std::string Matlab::lastMessage() const {
+  return _buffer ? _buffer : std::string();
+}
 
 bool Matlab::errorLastRun() const {
-  return std::string(_buffer).substr(0, 5) == "Error";
+  return lastMessage().substr(0, 5) == "Error";
 }
 
 MXA Matlab::var(const std::string &name) const {
+  if (!start()) {
+    return MXA();
+  }
   return MXA(engGetVariable(static_cast<::Engine *>(_eng), name.c_str()), true);
 }
 
 bool Matlab::setVar(const std::string &name, const MXA &mxa) {
+  if (!start()) {
+    return false;
+  }
   return engPutVariable(static_cast<::Engine *>(_eng), name.c_str(),
                         static_cast<mxArray *>(mxa.mxa())) == 0;
 }
@@ -718,5 +825,54 @@ const Matlab &Matlab::operator<<(const std::string &cmd) const {
 bool Matlab::cdAndAddAllSubfolders(const std::string &dir) {
   return run("cd " + dir) && run("addpath(genpath('.'));");
 }
+
+MatlabPool::MatlabPool(int maxEngines, const std::string &defaultDir,
+                       bool printMsg)
+    : _maxEngines(std::max(maxEngines, 1)), _defaultDir(defaultDir),
+      _printMessage(printMsg) {}
+
+MatlabPool::Handle MatlabPool::acquire() {
+  std::unique_lock<std::mutex> lock(_mutex);
+  if (_idleEngines.empty() && _engines.size() < _maxEngines) {
+    // engines serving concurrent pipelines must not share a session
+    _engines.push_back(std::make_unique<Matlab>(
+        _defaultDir, _maxEngines > 1, _printMessage, true));
+    return Handle(this, _engines.back().get());
+  }
+  _idleCondition.wait(lock, [this]() { return !_idleEngines.empty(); });
+  Matlab *matlab = _idleEngines.back();
+  _idleEngines.pop_back();
+  return Handle(this, matlab);
+}
+
+int MatlabPool::nengines() const {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _engines.size();
+}
+
+void MatlabPool::release(Matlab *matlab) {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _idleEngines.push_back(matlab);
+  }
+  _idleCondition.notify_one();
+}
+
+MatlabPool::Handle::Handle(Handle &&h) : _pool(h._pool), _matlab(h._matlab) {
+  h._pool = nullptr;
+  h._matlab = nullptr;
+}
+
+MatlabPool::Handle &MatlabPool::Handle::operator=(Handle &&h) {
+  std::swap(_pool, h._pool);
+  std::swap(_matlab, h._matlab);
+  return *this;
+}
+
+MatlabPool::Handle::~Handle() {
+  if (_pool && _matlab) {
+    _pool->release(_matlab);
+  }
+}
 }
 }
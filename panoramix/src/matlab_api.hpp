@@ -1,5 +1,8 @@
 #pragma once
 
+#include <condition_variable>
+#include <mutex>
+
 #include "basic_types.hpp"
 
 #include "eigen.hpp"
@@ -25,6 +28,25 @@ public:
   static MXA createStructMatrix(int m, int n,
                                 const std::vector<std::string> &fieldNames,
                                 bool dos = false);
+  // sparse matrices from compressed sparse columns, rows of each column
+  // should be ascending
+  static MXA createSparseMatrix(int m, int n,
+                                const std::vector<int> &colOffsets,
+                                const std::vector<int> &rowIds,
+                                const std::vector<double> &values,
+                                bool dos = false);
+  // - the last one of duplicate elements wins, zeros are not stored, as by
+  //   cv::SparseMat
+  static MXA
+  createSparseMatrix(int m, int n,
+                     const std::vector<core::SparseMatElementd> &elements,
+                     bool dos = false);
+  // compressed sparse columns of elements, as createSparseMatrix stores them
+  static void
+  compressSparseColumns(int n,
+                        const std::vector<core::SparseMatElementd> &elements,
+                        std::vector<int> &colOffsets, std::vector<int> &rowIds,
+                        std::vector<double> &values);
 
 public:
   MXA clone(bool dos = false) const;
@@ -215,10 +237,11 @@ private:
 };
 
 // the matlab engine
+// - lazyStart: launch the engine on its first use instead of on construction
 class Matlab {
 public:
   Matlab(const std::string &defaultDir = std::string(), bool singleUse = false,
-         bool printMsg = true);
+         bool printMsg = true, bool lazyStart = false);
   ~Matlab();
 
   Matlab(Matlab &&e);
@@ -229,6 +252,7 @@ public:
 
 public:
   bool started() const;
+  bool start() const;
   bool run(const std::string &cmd) const;
   std::string lastMessage() const;
   bool errorLastRun() const;
@@ -242,9 +266,63 @@ public:
   bool cdAndAddAllSubfolders(const std::string &dir);
 
 private:
-  char *_buffer;
-  void *_eng;
+  mutable char *_buffer;
+  mutable void *_eng;
+  bool _printMessage;
+  std::string _defaultDir;
+  bool _singleUse;
+};
+
+// the pool of matlab engines
+// - engines are created lazily, and launched on their first use
+// - released engines are reused by later acquisitions, at most maxEngines
+//   engines exist, acquire() blocks until one of them is idle
+// - the engine and mx apis are not thread safe, a handle gives a pipeline its
+//   own session but calls into engines should still come from one thread
+class MatlabPool {
+public:
+  explicit MatlabPool(int maxEngines = 1,
+                      const std::string &defaultDir = std::string(),
+                      bool printMsg = true);
+
+  MatlabPool(const MatlabPool &) = delete;
+  MatlabPool &operator=(const MatlabPool &) = delete;
+
+  // exclusive access to an engine, returns it to the pool on destruction
+  class Handle {
+  public:
+    Handle(Handle &&h);
+    Handle &operator=(Handle &&h);
+    Handle(const Handle &) = delete;
+    Handle &operator=(const Handle &) = delete;
+    ~Handle();
+
+    Matlab &operator*() const { return *_matlab; }
+    Matlab *operator->() const { return _matlab; }
+
+  private:
+    friend class MatlabPool;
+    Handle(MatlabPool *pool, Matlab *matlab) : _pool(pool), _matlab(matlab) {}
+    MatlabPool *_pool;
+    Matlab *_matlab;
+  };
+
+public:
+  Handle acquire();
+  int maxEngines() const { return _maxEngines; }
+  int nengines() const;
+
+private:
+  void release(Matlab *matlab);
+
+private:
+  int _maxEngines;
+  std::string _defaultDir;
   bool _printMessage;
+  std::vector<std::unique_ptr<Matlab>> _engines;
+  std::vector<Matlab *> _idleEngines;
+  mutable std::mutex _mutex;
+  std::condition_variable _idleCondition;
 };
 }
 }
@@ -0,0 +1,113 @@
+#include <atomic>
+#include <thread>
+
+#include "matlab_api.hpp"
+
+#include "../panoramix.unittest.hpp"
+
+using namespace pano;
+
+TEST(MatlabApiTest, CompressSparseColumns) {
+  using core::SparseMatElementd;
+  // 3 x 3, given out of order, with duplicates and zeros
+  std::vector<SparseMatElementd> elements = {
+      {2, 0, 1.0}, {0, 0, 2.0}, {1, 2, 0.0}, // explicit zero
+      {1, 1, 3.0}, {1, 1, 0.0},              // duplicate overwritten by zero
+      {0, 2, 0.0}, {0, 2, 4.0},              // zero overwritten by duplicate
+      {2, 2, 5.0}};
+  std::vector<int> colOffsets, rowIds;
+  std::vector<double> values;
+  misc::MXA::compressSparseColumns(3, elements, colOffsets, rowIds, values);
+
+  EXPECT_EQ(colOffsets, std::vector<int>({0, 2, 2, 4}));
+  EXPECT_EQ(rowIds, std::vector<int>({0, 2, 0, 2}));
+  EXPECT_EQ(values, std::vector<double>({2.0, 1.0, 4.0, 5.0}));
+
+  // the same entries as a cv::SparseMat holding nonzeros only
+  auto mat = core::MakeSparseMatFromElements(3, 3, elements.begin(),
+                                             elements.end());
+  int nonzeros = 0;
+  for (auto it = mat.begin(); it != mat.end(); ++it) {
+    nonzeros += it.value<double>() != 0.0;
+  }
+  EXPECT_EQ(nonzeros, static_cast<int>(values.size()));
+  for (int col = 0; col < 3; col++) {
+    for (int k = colOffsets[col]; k < colOffsets[col + 1]; k++) {
+      EXPECT_EQ(mat(rowIds[k], col), values[k]);
+    }
+  }
+
+  // all zeros leave empty columns
+  misc::MXA::compressSparseColumns(2, {{0, 0, 0.0}, {1, 1, 0.0}}, colOffsets,
+                                   rowIds, values);
+  EXPECT_EQ(colOffsets, std::vector<int>({0, 0, 0}));
+  EXPECT_TRUE(rowIds.empty());
+  EXPECT_TRUE(values.empty());
+}
+
+// engines are only launched on their first use, so none of these start MATLAB
+TEST(MatlabPoolTest, EnginesAreCreatedLazily) {
+  misc::MatlabPool pool(2, std::string(), false);
+  EXPECT_EQ(pool.maxEngines(), 2);
+  EXPECT_EQ(pool.nengines(), 0);
+  misc::Matlab *first = nullptr;
+  {
+    auto h1 = pool.acquire();
+    EXPECT_EQ(pool.nengines(), 1);
+    EXPECT_FALSE(h1->started());
+    auto h2 = pool.acquire();
+    EXPECT_EQ(pool.nengines(), 2);
+    EXPECT_FALSE(h2->started());
+    EXPECT_TRUE(&*h1 != &*h2);
+    first = &*h1;
+  }
+  // released engines are reused, the last released first
+  auto h = pool.acquire();
+  EXPECT_EQ(pool.nengines(), 2);
+  EXPECT_EQ(&*h, first);
+  EXPECT_FALSE(h->started());
+}
+
+TEST(MatlabPoolTest, HandleMove) {
+  misc::MatlabPool pool(2, std::string(), false);
+  {
+    auto a = pool.acquire();
+    misc::Matlab *ea = &*a;
+    misc::MatlabPool::Handle moved(std::move(a));
+    EXPECT_EQ(&*moved, ea);
+
+    auto b = pool.acquire();
+    misc::Matlab *eb = &*b;
+    moved = std::move(b); // swaps, b returns ea on destruction
+    EXPECT_EQ(&*moved, eb);
+    EXPECT_EQ(&*b, ea);
+  }
+  // each engine is released exactly once, so both are idle again
+  EXPECT_EQ(pool.nengines(), 2);
+  auto h1 = pool.acquire();
+  auto h2 = pool.acquire();
+  EXPECT_TRUE(&*h1 != &*h2);
+  EXPECT_EQ(pool.nengines(), 2);
+}
+
+TEST(MatlabPoolTest, AcquireBlocksUntilRelease) {
+  misc::MatlabPool pool(1, std::string(), false);
+  std::atomic<bool> acquired(false);
+  misc::Matlab *engine = nullptr, *reacquired = nullptr;
+  std::thread waiter;
+  {
+    auto h = pool.acquire();
+    engine = &*h;
+    waiter = std::thread([&]() {
+      auto h2 = pool.acquire();
+      reacquired = &*h2;
+      acquired = true;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    EXPECT_FALSE(acquired);
+  }
+  waiter.join();
+  EXPECT_TRUE(acquired);
+  EXPECT_EQ(reacquired, engine);
+  EXPECT_EQ(pool.nengines(), 1);
+}
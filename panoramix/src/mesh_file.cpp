@@ -0,0 +1,375 @@
+#include "pch.hpp"
+
+#include <fstream>
+#include <iomanip>
+
+#include "mesh_file.hpp"
+#include "utility.hpp"
+
+namespace pano {
+namespace misc {
+
+namespace {
+// position and texture coordinates of a corner
+struct Corner {
+  float values[5];
+  bool operator==(const Corner &c) const {
+    return std::equal(values, values + 5, c.values);
+  }
+};
+
+struct CornerHash {
+  size_t operator()(const Corner &c) const {
+    size_t h = 0;
+    for (float v : c.values) {
+      uint32_t bits;
+      std::memcpy(&bits, &v, sizeof(bits));
+      h = h * 1000003u ^ std::hash<uint32_t>()(bits);
+    }
+    return h;
+  }
+};
+
+template <class T> inline void Append(std::vector<char> &out, const T &v) {
+  const char *p = reinterpret_cast<const char *>(&v);
+  out.insert(out.end(), p, p + sizeof(T));
+}
+
+inline bool IsBigEndian() {
+  const uint16_t v = 1;
+  return *reinterpret_cast<const uint8_t *>(&v) == 0;
+}
+
+inline bool WriteOnce(const std::string &fname, const std::vector<char> &data) {
+  std::ofstream ofs(fname, std::ios::binary);
+  if (!ofs.is_open()) {
+    std::cout << "file \"" << fname << "\" cannot be opened!" << std::endl;
+    return false;
+  }
+  ofs.write(data.data(), data.size());
+  return bool(ofs);
+}
+
+std::string EscapeJSON(const std::string &s) {
+  std::string escaped;
+  for (char c : s) {
+    if (c == '"' || c == '\\') {
+      escaped.push_back('\\');
+    }
+    escaped.push_back(c);
+  }
+  return escaped;
+}
+}
+
+int MeshFile::addObject(const std::vector<core::Polygon3> &polygons,
+                        const std::vector<std::vector<core::Vec2>> &texCoords,
+                        int texture) {
+  using namespace core;
+  assert(texCoords.empty() || texCoords.size() == polygons.size());
+  const bool withTexCoords = !texCoords.empty();
+  _hasTexCoords |= withTexCoords;
+
+  Object object;
+  object.vertexOffset = verticesNum();
+  object.faceOffset = facesNum();
+  object.triangleIndexOffset = _triangleIndices.size();
+  object.texture = withTexCoords ? texture : -1;
+  std::fill(object.minPosition, object.minPosition + 3,
+            std::numeric_limits<float>::max());
+  std::fill(object.maxPosition, object.maxPosition + 3,
+            std::numeric_limits<float>::lowest());
+
+  std::unordered_map<Corner, uint32_t, CornerHash> corner2vertex;
+  std::vector<uint32_t> face;
+  for (int i = 0; i < polygons.size(); i++) {
+    auto &poly = polygons[i];
+    if (poly.corners.size() < 3) {
+      continue;
+    }
+    face.clear();
+    for (int k = 0; k < poly.corners.size(); k++) {
+      auto &p = poly.corners[k];
+      Corner corner = {{float(p[0]), float(p[1]), float(p[2]), 0.0f, 0.0f}};
+      if (withTexCoords) {
+        corner.values[3] = float(texCoords[i][k][0]);
+        corner.values[4] = float(texCoords[i][k][1]);
+      }
+      auto it = corner2vertex.find(corner);
+      if (it == corner2vertex.end()) {
+        it = corner2vertex.emplace(corner, corner2vertex.size()).first;
+        _positions.insert(_positions.end(), corner.values, corner.values + 3);
+        _texCoords.insert(_texCoords.end(), corner.values + 3,
+                          corner.values + 5);
+        for (int d = 0; d < 3; d++) {
+          object.minPosition[d] =
+              std::min(object.minPosition[d], corner.values[d]);
+          object.maxPosition[d] =
+              std::max(object.maxPosition[d], corner.values[d]);
+        }
+      }
+      if (face.empty() || face.back() != it->second) {
+        face.push_back(it->second);
+      }
+    }
+    if (face.size() > 1 && face.front() == face.back()) {
+      face.pop_back();
+    }
+    if (face.size() < 3) {
+      continue;
+    }
+    _faceSizes.push_back(face.size());
+    _faceIndices.insert(_faceIndices.end(), face.begin(), face.end());
+
+    // triangulate on the plane of the polygon
+    const float *positions = _positions.data() + object.vertexOffset * 3;
+    Vec3 normal = poly.normal;
+    if (normal == Origin()) { // Newell's method
+      for (int k = 0; k < face.size(); k++) {
+        const float *p = positions + face[k] * 3;
+        const float *q = positions + face[(k + 1) % face.size()] * 3;
+        normal += Vec3((p[1] - q[1]) * (p[2] + q[2]),
+                       (p[2] - q[2]) * (p[0] + q[0]),
+                       (p[0] - q[0]) * (p[1] + q[1]));
+      }
+    }
+    Vec3 x, y;
+    std::tie(x, y) = ProposeXYDirectionsFromZDirection(normal);
+    TriangulatePolygon(face.begin(), face.end(),
+                       [positions, &x, &y](uint32_t v) {
+                         const float *p = positions + v * 3;
+                         Vec3 pos(p[0], p[1], p[2]);
+                         return Vec2(pos.dot(x), pos.dot(y));
+                       },
+                       [this](uint32_t a, uint32_t b, uint32_t c) {
+                         _triangleIndices.push_back(a);
+                         _triangleIndices.push_back(b);
+                         _triangleIndices.push_back(c);
+                       });
+  }
+
+  object.verticesNum = verticesNum() - object.vertexOffset;
+  object.facesNum = facesNum() - object.faceOffset;
+  object.triangleIndicesNum =
+      _triangleIndices.size() - object.triangleIndexOffset;
+  _objects.push_back(object);
+  return _objects.size() - 1;
+}
+
+void MeshFile::clear() {
+  _objects.clear();
+  _hasTexCoords = false;
+  _positions.clear();
+  _texCoords.clear();
+  _faceSizes.clear();
+  _faceIndices.clear();
+  _triangleIndices.clear();
+}
+
+bool MeshFile::savePLY(const std::string &fname) const {
+  const bool smallFaces =
+      std::all_of(_faceSizes.begin(), _faceSizes.end(),
+                  [](uint32_t s) { return s <= 0xff; });
+  std::ostringstream header;
+  header << "ply\n"
+         << "format "
+         << (IsBigEndian() ? "binary_big_endian" : "binary_little_endian")
+         << " 1.0\n"
+         << "comment generated by Panoramix\n"
+         << "element vertex " << verticesNum() << "\n"
+         << "property float x\nproperty float y\nproperty float z\n";
+  if (_hasTexCoords) {
+    header << "property float s\nproperty float t\n";
+  }
+  header << "element face " << facesNum() << "\n"
+         << "property list " << (smallFaces ? "uchar" : "int")
+         << " int vertex_indices\n"
+         << "property int object\n"
+         << "end_header\n";
+
+  const std::string headerStr = header.str();
+  std::vector<char> data(headerStr.begin(), headerStr.end());
+  data.reserve(data.size() + verticesNum() * 20 + facesNum() * 8 +
+               _faceIndices.size() * 4);
+  for (size_t v = 0; v < verticesNum(); v++) {
+    Append(data, _positions[v * 3]);
+    Append(data, _positions[v * 3 + 1]);
+    Append(data, _positions[v * 3 + 2]);
+    if (_hasTexCoords) { // t goes upwards
+      Append(data, _texCoords[v * 2]);
+      Append(data, 1.0f - _texCoords[v * 2 + 1]);
+    }
+  }
+  size_t indexOffset = 0;
+  for (int32_t o = 0; o < _objects.size(); o++) {
+    auto &object = _objects[o];
+    for (size_t f = object.faceOffset; f < object.faceOffset + object.facesNum;
+         f++) {
+      if (smallFaces) {
+        Append(data, uint8_t(_faceSizes[f]));
+      } else {
+        Append(data, int32_t(_faceSizes[f]));
+      }
+      for (uint32_t k = 0; k < _faceSizes[f]; k++) {
+        Append(data,
+               int32_t(object.vertexOffset + _faceIndices[indexOffset++]));
+      }
+      Append(data, o);
+    }
+  }
+  return WriteOnce(fname, data);
+}
+
+bool MeshFile::saveGLB(const std::string &fname,
+                       const std::string &textureURI) const {
+  std::vector<std::string> textureURIs;
+  if (!textureURI.empty()) {
+    textureURIs.push_back(textureURI);
+  }
+  return saveGLB(fname, textureURIs);
+}
+
+bool MeshFile::saveGLB(const std::string &fname,
+                       const std::vector<std::string> &textureURIs) const {
+  // binary chunk: positions, texture coordinates and triangle indices
+  const size_t positionsBytes = _positions.size() * sizeof(float);
+  const size_t texCoordsBytes =
+      _hasTexCoords ? _texCoords.size() * sizeof(float) : 0;
+  const size_t indicesBytes = _triangleIndices.size() * sizeof(uint32_t);
+  const int indicesView = _hasTexCoords ? 2 : 1;
+
+  // a material for each texture
+  std::vector<int> materialOfTexture(textureURIs.size(), -1);
+  int materialsNum = 0;
+  for (int i = 0; i < textureURIs.size(); i++) {
+    if (_hasTexCoords && !textureURIs[i].empty()) {
+      materialOfTexture[i] = materialsNum++;
+    }
+  }
+
+  // accessors, meshes and nodes of the objects with triangles
+  std::ostringstream accessors, meshes, nodes;
+  int accessorsNum = 0, meshesNum = 0;
+  for (auto &object : _objects) {
+    if (object.triangleIndicesNum == 0) {
+      continue;
+    }
+    const char *sep = meshesNum == 0 ? "" : ",";
+    accessors << (accessorsNum == 0 ? "" : ",") << "{\"bufferView\":0,"
+              << "\"byteOffset\":" << object.vertexOffset * 12
+              << ",\"componentType\":5126,\"count\":" << object.verticesNum
+              << ",\"type\":\"VEC3\",\"min\":[" << object.minPosition[0]
+              << "," << object.minPosition[1] << "," << object.minPosition[2]
+              << "],\"max\":[" << object.maxPosition[0] << ","
+              << object.maxPosition[1] << "," << object.maxPosition[2]
+              << "]}";
+    const int positionAccessor = accessorsNum++;
+    int texCoordAccessor = -1;
+    if (_hasTexCoords) {
+      accessors << ",{\"bufferView\":1,\"byteOffset\":"
+                << object.vertexOffset * 8
+                << ",\"componentType\":5126,\"count\":" << object.verticesNum
+                << ",\"type\":\"VEC2\"}";
+      texCoordAccessor = accessorsNum++;
+    }
+    accessors << ",{\"bufferView\":" << indicesView
+              << ",\"byteOffset\":" << object.triangleIndexOffset * 4
+              << ",\"componentType\":5125,\"count\":"
+              << object.triangleIndicesNum << ",\"type\":\"SCALAR\"}";
+    const int indicesAccessor = accessorsNum++;
+
+    meshes << sep << "{\"primitives\":[{\"attributes\":{\"POSITION\":"
+           << positionAccessor;
+    if (texCoordAccessor != -1) {
+      meshes << ",\"TEXCOORD_0\":" << texCoordAccessor;
+    }
+    meshes << "},\"indices\":" << indicesAccessor << ",\"mode\":4";
+    if (object.texture >= 0 && object.texture < materialOfTexture.size() &&
+        materialOfTexture[object.texture] != -1) {
+      meshes << ",\"material\":" << materialOfTexture[object.texture];
+    }
+    meshes << "}]}";
+    nodes << sep << "{\"mesh\":" << meshesNum << "}";
+    meshesNum++;
+  }
+  // glTF buffers may not be empty, they are left out without triangles
+  const size_t binBytes =
+      meshesNum > 0 ? positionsBytes + texCoordsBytes + indicesBytes : 0;
+  std::ostringstream json;
+  json << std::setprecision(9);
+  json << "{\"asset\":{\"version\":\"2.0\",\"generator\":\"Panoramix\"},";
+  if (meshesNum > 0) {
+    json << "\"buffers\":[{\"byteLength\":" << binBytes << "}],";
+    json << "\"bufferViews\":[";
+    json << "{\"buffer\":0,\"byteOffset\":0,\"byteLength\":" << positionsBytes
+         << ",\"target\":34962},";
+    if (_hasTexCoords) {
+      json << "{\"buffer\":0,\"byteOffset\":" << positionsBytes
+           << ",\"byteLength\":" << texCoordsBytes << ",\"target\":34962},";
+    }
+    json << "{\"buffer\":0,\"byteOffset\":" << positionsBytes + texCoordsBytes
+         << ",\"byteLength\":" << indicesBytes << ",\"target\":34963}],";
+    json << "\"accessors\":[" << accessors.str() << "],";
+    json << "\"meshes\":[" << meshes.str() << "],";
+    json << "\"nodes\":[" << nodes.str() << "],";
+  }
+  json << "\"scene\":0,\"scenes\":[{";
+  for (int i = 0; i < meshesNum; i++) {
+    json << (i == 0 ? "\"nodes\":[" : ",") << i;
+  }
+  json << (meshesNum > 0 ? "]}]" : "}]");
+  if (materialsNum > 0) {
+    std::ostringstream images, textures, materials;
+    for (int i = 0; i < textureURIs.size(); i++) {
+      const int m = materialOfTexture[i];
+      if (m == -1) {
+        continue;
+      }
+      const char *sep = m == 0 ? "" : ",";
+      images << sep << "{\"uri\":\"" << EscapeJSON(textureURIs[i]) << "\"}";
+      textures << sep << "{\"source\":" << m << ",\"sampler\":0}";
+      materials << sep << "{\"pbrMetallicRoughness\":{\"baseColorTexture\":"
+                << "{\"index\":" << m
+                << "},\"metallicFactor\":0},\"doubleSided\":true}";
+    }
+    json << ",\"images\":[" << images.str() << "]"
+         << ",\"samplers\":[{\"wrapS\":10497,\"wrapT\":33071}]"
+         << ",\"textures\":[" << textures.str() << "]"
+         << ",\"materials\":[" << materials.str() << "]";
+  }
+  json << "}";
+
+  // chunks are padded to 4 bytes
+  std::string jsonStr = json.str();
+  jsonStr.resize((jsonStr.size() + 3) / 4 * 4, ' ');
+  const uint32_t binChunkBytes = (binBytes + 3) / 4 * 4;
+  const uint32_t totalBytes =
+      12 + 8 + jsonStr.size() + (binBytes > 0 ? 8 + binChunkBytes : 0);
+
+  std::vector<char> data;
+  data.reserve(totalBytes);
+  Append(data, uint32_t(0x46546C67)); // glTF
+  Append(data, uint32_t(2));
+  Append(data, totalBytes);
+  Append(data, uint32_t(jsonStr.size()));
+  Append(data, uint32_t(0x4E4F534A)); // JSON
+  data.insert(data.end(), jsonStr.begin(), jsonStr.end());
+  if (binBytes > 0) {
+    Append(data, binChunkBytes);
+    Append(data, uint32_t(0x004E4942)); // BIN
+    const char *positions = reinterpret_cast<const char *>(_positions.data());
+    data.insert(data.end(), positions, positions + positionsBytes);
+    if (_hasTexCoords) {
+      const char *texCoords =
+          reinterpret_cast<const char *>(_texCoords.data());
+      data.insert(data.end(), texCoords, texCoords + texCoordsBytes);
+    }
+    const char *indices =
+        reinterpret_cast<const char *>(_triangleIndices.data());
+    data.insert(data.end(), indices, indices + indicesBytes);
+    data.resize(totalBytes, 0);
+  }
+  return WriteOnce(fname, data);
+}
+}
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "basic_types.hpp"
+
+namespace pano {
+namespace misc {
+
+// polygon meshes to be saved as binary PLY or binary glTF (.glb) files
+// - objects (e.g. rooms) are all kept in memory until saved, each file is
+//   written at once from a buffer
+// - identical corners of the polygons of an object are merged
+// - texture coordinates follow the image convention, (0, 0) is the top left
+//   corner of the texture
+class MeshFile {
+public:
+  // adds the polygons as a new object and returns its id
+  // - texCoords, if not empty, gives the texture coordinates of the corners
+  //   of each polygon, on the texture-th texture given to saveGLB
+  int addObject(const std::vector<core::Polygon3> &polygons,
+                const std::vector<std::vector<core::Vec2>> &texCoords = {},
+                int texture = 0);
+  void clear();
+
+  int objectsNum() const { return _objects.size(); }
+  size_t verticesNum() const { return _positions.size() / 3; }
+  size_t facesNum() const { return _faceSizes.size(); }
+  bool hasTexCoords() const { return _hasTexCoords; }
+
+  // faces are polygons, with an extra property "object" of their object ids
+  bool savePLY(const std::string &fname) const;
+  // faces are triangulated, each object becomes a node with its own mesh,
+  // the texture files, if given, are referred by their uris
+  // - a file without triangles has no buffers
+  bool saveGLB(const std::string &fname,
+               const std::vector<std::string> &textureURIs) const;
+  bool saveGLB(const std::string &fname,
+               const std::string &textureURI = std::string()) const;
+
+private:
+  struct Object {
+    uint32_t vertexOffset, verticesNum;
+    uint32_t faceOffset, facesNum;
+    uint32_t triangleIndexOffset, triangleIndicesNum;
+    float minPosition[3], maxPosition[3];
+    int texture; // -1 without texture coordinates
+  };
+  std::vector<Object> _objects;
+  bool _hasTexCoords = false;
+  std::vector<float> _positions; // xyz
+  std::vector<float> _texCoords; // uv, zeros for objects without them
+  // indices are relative to the first vertices of the objects
+  std::vector<uint32_t> _faceSizes;
+  std::vector<uint32_t> _faceIndices;
+  std::vector<uint32_t> _triangleIndices;
+};
+}
+}
@@ -0,0 +1,118 @@
+#include "mesh_file.hpp"
+
+#include "../panoramix.unittest.hpp"
+
+using namespace pano;
+
+TEST(MeshFileTest, SharedCorners) {
+  using namespace core;
+  // a square and a concave pentagon sharing an edge
+  std::vector<Polygon3> polygons = {
+      Polygon3({Point3(0, 0, 0), Point3(1, 0, 0), Point3(1, 1, 0),
+                Point3(0, 1, 0)},
+               Vec3(0, 0, 1)),
+      Polygon3({Point3(1, 0, 0), Point3(2, 0, 0), Point3(2, 1, 0),
+                Point3(1.5, 0.5, 0), Point3(1, 1, 0)},
+               Vec3(0, 0, 1))};
+
+  misc::MeshFile meshFile;
+  EXPECT_EQ(meshFile.addObject(polygons), 0);
+  EXPECT_EQ(meshFile.verticesNum(), 7);
+  EXPECT_EQ(meshFile.facesNum(), 2);
+  EXPECT_FALSE(meshFile.hasTexCoords());
+
+  // corners with different texture coordinates are not merged
+  std::vector<std::vector<Vec2>> texCoords = {
+      {Vec2(0, 0), Vec2(0.5, 0), Vec2(0.5, 1), Vec2(0, 1)},
+      {Vec2(0.6, 0), Vec2(1, 0), Vec2(1, 1), Vec2(0.8, 0.5), Vec2(0.6, 1)}};
+  EXPECT_EQ(meshFile.addObject(polygons, texCoords), 1);
+  EXPECT_EQ(meshFile.objectsNum(), 2);
+  EXPECT_EQ(meshFile.verticesNum(), 7 + 9);
+  EXPECT_EQ(meshFile.facesNum(), 4);
+  EXPECT_TRUE(meshFile.hasTexCoords());
+
+  const std::string plyName = PANORAMIX_TEST_DATA_DIR_STR "/meshes.ply";
+  ASSERT_TRUE(meshFile.savePLY(plyName));
+  std::ifstream ply(plyName, std::ios::binary);
+  std::string line;
+  std::getline(ply, line);
+  EXPECT_EQ(line, "ply");
+  while (std::getline(ply, line) && line != "end_header") {
+    if (line.find("element") == 0) {
+      EXPECT_TRUE(line == "element vertex 16" || line == "element face 4");
+    }
+  }
+  EXPECT_EQ(line, "end_header");
+
+  const std::string glbName = PANORAMIX_TEST_DATA_DIR_STR "/meshes.glb";
+  ASSERT_TRUE(meshFile.saveGLB(glbName, "texture.png"));
+  std::ifstream glb(glbName, std::ios::binary);
+  std::vector<char> bytes((std::istreambuf_iterator<char>(glb)),
+                          std::istreambuf_iterator<char>());
+  ASSERT_GE(bytes.size(), 20);
+  uint32_t header[3];
+  std::memcpy(header, bytes.data(), sizeof(header));
+  EXPECT_EQ(header[0], 0x46546C67);
+  EXPECT_EQ(header[1], 2);
+  EXPECT_EQ(header[2], bytes.size());
+  EXPECT_EQ(bytes.size() % 4, 0);
+}
+
+namespace {
+// the JSON chunk of a .glb file
+std::string ReadGLBJSON(const std::string &fname, uint32_t &totalBytes) {
+  std::ifstream glb(fname, std::ios::binary);
+  std::vector<char> bytes((std::istreambuf_iterator<char>(glb)),
+                          std::istreambuf_iterator<char>());
+  if (bytes.size() < 20) {
+    return std::string();
+  }
+  uint32_t header[5];
+  std::memcpy(header, bytes.data(), sizeof(header));
+  totalBytes = header[2];
+  EXPECT_EQ(totalBytes, bytes.size());
+  return std::string(bytes.data() + 20,
+                     std::min<size_t>(header[3], bytes.size() - 20));
+}
+}
+
+TEST(MeshFileTest, EmptyGLB) {
+  // without triangles there are no (empty) buffers
+  misc::MeshFile meshFile;
+  meshFile.addObject(std::vector<core::Polygon3>());
+  const std::string glbName = PANORAMIX_TEST_DATA_DIR_STR "/empty.glb";
+  ASSERT_TRUE(meshFile.saveGLB(glbName));
+  uint32_t totalBytes = 0;
+  std::string json = ReadGLBJSON(glbName, totalBytes);
+  ASSERT_FALSE(json.empty());
+  EXPECT_EQ(totalBytes, 20 + json.size());
+  EXPECT_EQ(json.find("buffer"), std::string::npos);
+  EXPECT_EQ(json.find("byteLength"), std::string::npos);
+  EXPECT_EQ(json.find("\"nodes\":[]"), std::string::npos);
+}
+
+TEST(MeshFileTest, TexturesOfObjects) {
+  using namespace core;
+  std::vector<Polygon3> square = {Polygon3(
+      {Point3(0, 0, 0), Point3(1, 0, 0), Point3(1, 1, 0), Point3(0, 1, 0)},
+      Vec3(0, 0, 1))};
+  std::vector<std::vector<Vec2>> texCoords = {
+      {Vec2(0, 0), Vec2(1, 0), Vec2(1, 1), Vec2(0, 1)}};
+
+  // each room refers to its own texture
+  misc::MeshFile meshFile;
+  meshFile.addObject(square, texCoords, 0);
+  meshFile.addObject(square, texCoords, 1);
+  meshFile.addObject(square);
+  const std::string glbName = PANORAMIX_TEST_DATA_DIR_STR "/rooms.glb";
+  const std::vector<std::string> textureURIs = {"room0.png", "room1.png"};
+  ASSERT_TRUE(meshFile.saveGLB(glbName, textureURIs));
+  uint32_t totalBytes = 0;
+  std::string json = ReadGLBJSON(glbName, totalBytes);
+  EXPECT_NE(json.find("\"images\":[{\"uri\":\"room0.png\"},"
+                      "{\"uri\":\"room1.png\"}]"),
+            std::string::npos);
+  EXPECT_NE(json.find("\"material\":0"), std::string::npos);
+  EXPECT_NE(json.find("\"material\":1"), std::string::npos);
+  EXPECT_EQ(json.find("\"material\":2"), std::string::npos);
+}
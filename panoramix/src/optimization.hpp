@@ -3,6 +3,7 @@
 #include "basic_types.hpp"
 #include "containers.hpp"
 #include "eigen.hpp"
+#include "parallel.hpp"
 
 namespace pano {
 namespace experimental {
@@ -20,6 +21,21 @@ int SimulatedAnnealing(StateT &initialState, EnergyFunT energyFun,
                        NeighborsFunT neighborsFun, RNG &&rng,
                        double stopWhenEnergyIsLowerThan = 1e-5);
 
+// ParallelTemperingSimulatedAnnealing
+// - runs nchains annealing chains concurrently, chain k uses temperature
+//   temperatureFun(iter) * pow(temperatureRatio, k)
+// - every exchangeInterval iterations, adjacent chains try to swap states
+// - each chain owns an RNG stream seeded from rng
+// - energyFun and neighborsFun must be safe to call from multiple threads
+// - the lowest energy state ever visited is written back to initialState
+template <class StateT, class EnergyFunT, class TemperatureFunT,
+          class NeighborsFunT, class RNG>
+int ParallelTemperingSimulatedAnnealing(
+    StateT &initialState, EnergyFunT energyFun, TemperatureFunT temperatureFun,
+    NeighborsFunT neighborsFun, RNG &&rng, int nchains,
+    double temperatureRatio = 2.0, int exchangeInterval = 100,
+    double stopWhenEnergyIsLowerThan = 1e-5);
+
 template <class EnergyFunT>
 std::vector<bool> BeamSearch(size_t nconfigs, EnergyFunT energy_fun,
                              size_t beam_width);
@@ -94,6 +110,136 @@ int SimulatedAnnealing(StateT &initialState, EnergyFunT energyFun,
   return i;
 }
 
+// ParallelTemperingSimulatedAnnealing
+template <class StateT, class EnergyFunT, class TemperatureFunT,
+          class NeighborsFunT, class RNG>
+int ParallelTemperingSimulatedAnnealing(
+    StateT &initialState, EnergyFunT energyFun, TemperatureFunT temperatureFun,
+    NeighborsFunT neighborsFun, RNG &&rng, int nchains,
+    double temperatureRatio, int exchangeInterval,
+    double stopWhenEnergyIsLowerThan) {
+  assert(nchains > 0 && exchangeInterval > 0);
+
+  struct Chain {
+    StateT state;
+    double energy;
+    StateT bestState;
+    double bestEnergy;
+    double temperatureScale;
+    std::mt19937_64 rng;
+    bool finished;
+  };
+
+  double initialEnergy = energyFun(initialState);
+  std::vector<Chain> chains(nchains);
+  for (int k = 0; k < nchains; k++) {
+    Chain &c = chains[k];
+    c.state = initialState;
+    c.energy = initialEnergy;
+    c.bestState = initialState;
+    c.bestEnergy = initialEnergy;
+    c.temperatureScale = std::pow(temperatureRatio, k);
+    std::seed_seq seq = {(uint64_t)rng(), (uint64_t)k};
+    c.rng.seed(seq);
+    c.finished = false;
+  }
+
+  // the annealing step of SimulatedAnnealing, applied to one chain
+  auto stepChain = [&energyFun, &temperatureFun, &neighborsFun,
+                    stopWhenEnergyIsLowerThan](Chain &c, int i) {
+    double temperature = temperatureFun(i) * c.temperatureScale;
+
+    StateT newStateWithLowestEnergy;
+    double lowestEnergy = std::numeric_limits<double>::infinity();
+    bool hasNewState = false;
+    neighborsFun(c.state, i, [&newStateWithLowestEnergy, &lowestEnergy,
+                              &hasNewState, &energyFun](auto &&newState) {
+      double newEnergy = energyFun(newState);
+      if (newEnergy < lowestEnergy) {
+        newStateWithLowestEnergy = newState;
+        lowestEnergy = newEnergy;
+        hasNewState = true;
+      }
+    });
+
+    if (!hasNewState) {
+      c.finished = true;
+      return;
+    }
+
+    double prob = 1.0;
+    if (c.energy <= lowestEnergy) {
+      prob = exp(-(lowestEnergy - c.energy) / temperature);
+    }
+    std::uniform_real_distribution<double> dist(0.0, 1.0);
+    if (prob >= dist(c.rng)) {
+      c.state = std::move(newStateWithLowestEnergy);
+      c.energy = lowestEnergy;
+      if (c.energy < c.bestEnergy) {
+        c.bestState = c.state;
+        c.bestEnergy = c.energy;
+        if (c.bestEnergy < stopWhenEnergyIsLowerThan) {
+          c.finished = true;
+        }
+      }
+    }
+  };
+
+  std::mt19937_64 exchangeRNG(rng());
+  std::uniform_real_distribution<double> dist(0.0, 1.0);
+  int i = 0;
+  while (true) {
+    // advance all chains concurrently for one exchange interval
+    ParallelRun(nchains, nchains, [&chains, &stepChain, i,
+                                   exchangeInterval](int k) {
+      Chain &c = chains[k];
+      for (int j = i; j < i + exchangeInterval && !c.finished; j++) {
+        stepChain(c, j);
+      }
+    });
+    i += exchangeInterval;
+
+    bool allFinished = true;
+    bool reachedTarget = false;
+    for (auto &c : chains) {
+      allFinished = allFinished && c.finished;
+      reachedTarget = reachedTarget || c.bestEnergy < stopWhenEnergyIsLowerThan;
+    }
+    if (allFinished || reachedTarget) {
+      break;
+    }
+
+    // exchange states between adjacent temperatures
+    for (int k = 0; k + 1 < nchains; k++) {
+      Chain &cold = chains[k];
+      Chain &hot = chains[k + 1];
+      if (cold.finished || hot.finished) {
+        continue;
+      }
+      double coldT = temperatureFun(i) * cold.temperatureScale;
+      double hotT = temperatureFun(i) * hot.temperatureScale;
+      double prob =
+          exp((cold.energy - hot.energy) * (1.0 / coldT - 1.0 / hotT));
+      if (prob >= dist(exchangeRNG)) {
+        std::swap(cold.state, hot.state);
+        std::swap(cold.energy, hot.energy);
+      }
+    }
+  }
+
+  const Chain *bestChain = &chains.front();
+  for (auto &c : chains) {
+    if (c.bestEnergy < bestChain->bestEnergy) {
+      bestChain = &c;
+    }
+  }
+  if (bestChain->bestEnergy < initialEnergy) {
+    initialState = bestChain->bestState;
+  }
+  std::cout << "final energy: " << bestChain->bestEnergy << '\n';
+  return i;
+}
+
 template <class EnergyFunT>
 std::vector<bool> BeamSearch(size_t nconfigs, EnergyFunT energy_fun,
                              size_t beam_width) {
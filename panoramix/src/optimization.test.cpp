@@ -18,4 +18,20 @@ TEST(OptimizationTest, SimulatedAnnealing) {
                          },
                          rng);
   ASSERT_TRUE(abs(solution - 1) < 0.1);
+}
+
+TEST(OptimizationTest, ParallelTemperingSimulatedAnnealing) {
+  double solution = 0.0;
+  std::default_random_engine rng;
+  int niters = ParallelTemperingSimulatedAnnealing(
+      solution, [](double s) { return (s - 1) * (s - 1); },
+      [](int iter) { return 1.0 / (iter + 1); },
+      [](double s, int iter, auto &&forEachNeighbor) {
+        if (iter < 100000) {
+          forEachNeighbor(s + 0.1 / (iter + 1));
+          forEachNeighbor(s - 0.1 / (iter + 1));
+        }
+      },
+      rng, 4);
+  ASSERT_TRUE(abs(solution - 1) < 0.1);
 }
\ No newline at end of file
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <thread>
 
 namespace pano {
@@ -7,6 +8,18 @@ namespace core {
 template <class FunT> void ParallelRun(int n, int concurrency_num, FunT &&fun);
 template <class FunT>
 void ParallelRun(int n, int concurrency_num, int batch_num, FunT &&fun);
+
+// the number of threads to use by default, at least 1
+inline int DefaultConcurrency() {
+  return std::max<int>(std::thread::hardware_concurrency(), 1);
+}
+
+// calls fun(i, t) for all i in [0, n) on concurrency threads, thread t takes
+// i = t, t + concurrency, t + 2 * concurrency ..., so data owned by a thread
+// can be indexed by t
+// - runs on the calling thread if concurrency is 1, callers already running
+//   in parallel should pass 1 to keep one level of threads
+template <class FunT> void ParallelStride(int n, int concurrency, FunT &&fun);
 }
 }
 
@@ -53,5 +66,19 @@ void ParallelRun(int n, int concurrency_num, int batch_num, FunT &&fun) {
     }
   }
 }
+
+template <class FunT> void ParallelStride(int n, int concurrency, FunT &&fun) {
+  concurrency = std::max(1, std::min(concurrency, n));
+  auto stride = [n, concurrency, &fun](int t) {
+    for (int i = t; i < n; i += concurrency) {
+      fun(i, t);
+    }
+  };
+  if (concurrency == 1) {
+    stride(0);
+  } else {
+    ParallelRun(concurrency, concurrency, stride);
+  }
+}
+}
 }
-}
\ No newline at end of file
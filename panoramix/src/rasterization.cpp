@@ -0,0 +1,429 @@
+#include "pch.hpp"
+
+#include "rasterization.hpp"
+
+namespace pano {
+namespace core {
+
+void AppendScreenTriangles(const PerspectiveCamera &cam, const Point3 &a,
+                           const Point3 &b, const Point3 &c, int id,
+                           double maxTriangleAngle,
+                           std::vector<ScreenTriangle> &triangles) {
+  const Point3 &eye = cam.eye();
+  const Vec3 forward = cam.forward();
+
+  // clip by the near plane
+  const Point3 cs[3] = {a, b, c};
+  double zs[3];
+  for (int k = 0; k < 3; k++) {
+    zs[k] = (cs[k] - eye).dot(forward) - cam.nearPlane();
+  }
+  std::vector<Point3> clipped;
+  clipped.reserve(4);
+  for (int k = 0; k < 3; k++) {
+    int next = (k + 1) % 3;
+    if (zs[k] >= 0) {
+      clipped.push_back(cs[k]);
+    }
+    if ((zs[k] >= 0) != (zs[next] >= 0)) {
+      double t = zs[k] / (zs[k] - zs[next]);
+      clipped.push_back(cs[k] + (cs[next] - cs[k]) * t);
+    }
+  }
+
+  // directions divided by their depths are linear on screen
+  for (int k = 1; k + 1 < clipped.size(); k++) {
+    ScreenTriangle tri;
+    const Point3 *fan[3] = {&clipped[0], &clipped[k], &clipped[k + 1]};
+    for (int j = 0; j < 3; j++) {
+      Vec3 d = *fan[j] - eye;
+      tri.corners[j] = cam.toScreen(*fan[j]);
+      tri.dirs[j] = d / d.dot(forward);
+    }
+    tri.id = id;
+    triangles.push_back(tri);
+  }
+}
+
+namespace {
+// splits as SplitPanoramicTriangle, edges are halved while
+// length(pole, p, q) > maxLength, pole is the pole in the triangle or null
+template <class LengthFunT>
+void SplitPanoramicTriangleBy(
+    const PanoramicCamera &cam, const Point3 &a, const Point3 &b,
+    const Point3 &c, LengthFunT &&length, double maxLength,
+    const std::function<void(const Point3 *points, const Point2 *corners)>
+        &fun) {
+  const Point3 &eye = cam.eye();
+  const Sizei sz = cam.screenSize();
+  const double width = sz.width;
+  // the poles are on the first and the last rows
+  const Vec3 poles[2] = {normalize(cam.direction(Point2(0, 0))),
+                         normalize(cam.direction(Point2(0, sz.height)))};
+  const double poleYs[2] = {0.0, double(sz.height)};
+
+  // split the triangle around the pole it contains, if any, so that the pole
+  // only appears as a corner
+  // - poles on edges count as contained, the neighbor sharing the edge is
+  //   split too
+  const double poleEpsilon = 1e-9;
+  Point3 pole;
+  int poleId = -1;
+  for (int k = 0; k < 2 && poleId == -1; k++) {
+    Vec3 e1 = b - a, e2 = c - a;
+    Vec3 pv = poles[k].cross(e2);
+    double det = e1.dot(pv);
+    if (std::abs(det) < 1e-12) {
+      continue;
+    }
+    Vec3 tv = eye - a;
+    double u = tv.dot(pv) / det;
+    Vec3 qv = tv.cross(e1);
+    double v = poles[k].dot(qv) / det;
+    double t = e2.dot(qv) / det;
+    if (u >= -poleEpsilon && v >= -poleEpsilon && u + v <= 1 + poleEpsilon &&
+        t > 0) {
+      pole = eye + poles[k] * t;
+      poleId = k;
+    }
+  }
+
+  auto splitPiece = [&](const Point3 &aa, const Point3 &bb,
+                        const Point3 &cc) {
+    const Point3 cs[3] = {aa, bb, cc};
+    int poleCorner = -1;
+    Point2 ps[3];
+    for (int k = 0; k < 3; k++) {
+      if (poleId != -1 && cs[k] == pole) {
+        if (poleCorner != -1) {
+          return; // degenerated, the pole was a corner already
+        }
+        poleCorner = k;
+        continue;
+      }
+      ps[k] = cam.toScreen(cs[k]);
+    }
+
+    if (poleCorner != -1) {
+      // the pole spreads over the whole pole row, the piece becomes a quad
+      // between its opposite edge and the pole row
+      int e = (poleCorner + 1) % 3, f = (poleCorner + 2) % 3;
+      Point2 p = ps[e], q = ps[f];
+      if (q[0] - p[0] > width / 2) {
+        q[0] -= width;
+      } else if (q[0] - p[0] < -width / 2) {
+        q[0] += width;
+      }
+      const Point3 points1[3] = {pole, cs[e], cs[f]};
+      const Point2 corners1[3] = {Point2(p[0], poleYs[poleId]), p, q};
+      fun(points1, corners1);
+      const Point3 points2[3] = {pole, cs[f], pole};
+      const Point2 corners2[3] = {Point2(p[0], poleYs[poleId]), q,
+                                  Point2(q[0], poleYs[poleId])};
+      fun(points2, corners2);
+      return;
+    }
+
+    // unwrap the longitudes by cutting at the largest gap between them,
+    // pieces near a pole may span more than half of the width
+    int order[3] = {0, 1, 2};
+    std::sort(order, order + 3,
+              [&ps](int i, int j) { return ps[i][0] < ps[j][0]; });
+    double gaps[3] = {ps[order[1]][0] - ps[order[0]][0],
+                      ps[order[2]][0] - ps[order[1]][0],
+                      ps[order[0]][0] + width - ps[order[2]][0]};
+    int cut = std::max_element(gaps, gaps + 3) - gaps;
+    for (int k = 0; k <= cut && cut < 2; k++) {
+      ps[order[k]][0] += width;
+    }
+    fun(cs, ps);
+  };
+
+  auto edgeLength = [&](const Point3 &p, const Point3 &q) {
+    return length(poleId == -1 ? nullptr : &pole, p, q);
+  };
+  if (poleId == -1) {
+    SubdivideTriangle(a, b, c, edgeLength, maxLength, splitPiece);
+  } else {
+    // the fan around a pole on an edge has an empty piece, whose edge through
+    // the pole is never short enough on screen
+    const Point3 cs[3] = {a, b, c};
+    for (int k = 0; k < 3; k++) {
+      const Point3 &p = cs[k], &q = cs[(k + 1) % 3];
+      if (norm(Vec3(p - pole).cross(Vec3(q - pole))) >
+          1e-9 * norm(p - pole) * norm(q - pole)) {
+        SubdivideTriangle(pole, p, q, edgeLength, maxLength, splitPiece);
+      }
+    }
+  }
+}
+}
+
+void SplitPanoramicTriangle(
+    const PanoramicCamera &cam, const Point3 &a, const Point3 &b,
+    const Point3 &c, double maxTriangleAngle,
+    const std::function<void(const Point3 *points, const Point2 *corners)>
+        &fun) {
+  const Point3 &eye = cam.eye();
+  const double width = cam.screenSize().width;
+  // edges are measured on screen, in radians, since directions are
+  // interpolated there, longitudes stretch near the poles so edges there are
+  // halved at most twice more than by their angles
+  const double focal = cam.focal();
+  auto length = [&](const Point3 *pole, const Point3 &p, const Point3 &q) {
+    double angle = AngleBetweenDirected(Vec3(p - eye), Vec3(q - eye));
+    if (pole && (p == *pole || q == *pole)) {
+      return angle;
+    }
+    Point2 pp = cam.toScreen(p), qq = cam.toScreen(q);
+    double dx = std::abs(pp[0] - qq[0]);
+    dx = std::min(dx, width - dx);
+    double onScreen = std::sqrt(dx * dx + Square(pp[1] - qq[1])) / focal;
+    return std::min(std::max(angle, onScreen), angle * 4.0);
+  };
+  SplitPanoramicTriangleBy(cam, a, b, c, length, maxTriangleAngle, fun);
+}
+
+void SplitPanoramicTriangleByError(
+    const PanoramicCamera &cam, const Point3 &a, const Point3 &b,
+    const Point3 &c, double maxError,
+    const std::function<void(const Point3 *points, const Point2 *corners)>
+        &fun) {
+  const Point3 &eye = cam.eye();
+  const double width = cam.screenSize().width;
+  const double focal = cam.focal();
+  // the largest angle, in pixels at the equator, between where the points at
+  // quarters of the edge p-q are and where the corners ps on screen put them
+  auto error = [&](const Point3 &p, const Point3 &q, const Point2 *ps) {
+    double maxAngle = 0.0;
+    for (double t : {0.25, 0.5, 0.75}) {
+      Vec3 dir = p + (q - p) * t - eye;
+      Vec3 dirOnScreen = cam.direction(ps[0] + (ps[1] - ps[0]) * t);
+      maxAngle = std::max(maxAngle, AngleBetweenDirected(dir, dirOnScreen));
+    }
+    return maxAngle * focal;
+  };
+  auto length = [&](const Point3 *pole, const Point3 &p0, const Point3 &q0) {
+    // measured in a fixed order, so the triangles sharing the edge agree
+    const bool swapped = std::make_tuple(q0[0], q0[1], q0[2]) <
+                         std::make_tuple(p0[0], p0[1], p0[2]);
+    const Point3 &p = swapped ? q0 : p0, &q = swapped ? p0 : q0;
+    Point2 ps[2] = {cam.toScreen(p), cam.toScreen(q)};
+    if (ps[1][0] - ps[0][0] > width / 2) {
+      ps[1][0] -= width;
+    } else if (ps[1][0] - ps[0][0] < -width / 2) {
+      ps[1][0] += width;
+    }
+    if (!pole) {
+      return error(p, q, ps);
+    }
+    // a pole corner is put on the pole row below or above the other corner
+    // of its edge, the edges from the pole are meridians
+    if (p == *pole || q == *pole) {
+      int k = p == *pole ? 0 : 1;
+      ps[k][0] = ps[1 - k][0];
+      return error(p, q, ps);
+    }
+    // or below or above one of the ends of the opposite edge, its edge to
+    // the other end then leaves the meridian, by up to the length of the
+    // opposite edge
+    const double poleY = cam.toScreen(*pole)[1];
+    double maxError = error(p, q, ps);
+    for (int k = 0; k < 2; k++) {
+      const Point2 &end = ps[1 - k];
+      const Point2 offMeridian[2] = {Point2(ps[k][0], poleY), end};
+      const Point2 meridian[2] = {Point2(end[0], poleY), end};
+      for (double t : {0.25, 0.5, 0.75}) {
+        Vec3 dir1 = cam.direction(offMeridian[0] * (1 - t) + end * t);
+        Vec3 dir2 = cam.direction(meridian[0] * (1 - t) + end * t);
+        maxError = std::max(maxError, AngleBetweenDirected(dir1, dir2) * focal);
+      }
+    }
+    return maxError;
+  };
+  SplitPanoramicTriangleBy(cam, a, b, c, length, maxError, fun);
+}
+
+void AppendScreenTriangles(const PanoramicCamera &cam, const Point3 &a,
+                           const Point3 &b, const Point3 &c, int id,
+                           double maxTriangleAngle,
+                           std::vector<ScreenTriangle> &triangles) {
+  const Point3 &eye = cam.eye();
+  const double width = cam.screenSize().width;
+  // appends the piece and its copy across the seam
+  SplitPanoramicTriangle(
+      cam, a, b, c, maxTriangleAngle,
+      [&](const Point3 *points, const Point2 *corners) {
+        ScreenTriangle tri;
+        for (int k = 0; k < 3; k++) {
+          tri.corners[k] = corners[k];
+          tri.dirs[k] = normalize(points[k] - eye);
+        }
+        tri.id = id;
+        triangles.push_back(tri);
+        double minX = std::min({corners[0][0], corners[1][0], corners[2][0]});
+        double maxX = std::max({corners[0][0], corners[1][0], corners[2][0]});
+        if (minX < 0 || maxX >= width) {
+          double shift = minX < 0 ? width : -width;
+          for (auto &corner : tri.corners) {
+            corner[0] += shift;
+          }
+          triangles.push_back(tri);
+        }
+      });
+}
+
+namespace {
+// affine functions on screen of a triangle
+struct TriangleSetup {
+  // barycentric coordinates, lambdas[k] = (dx, dy, d0)
+  Vec3 lambdas[3];
+  // interpolated direction = dirX * x + dirY * y + dir0
+  Vec3 dirX, dirY, dir0;
+  int minX, maxX, minY, maxY;
+  int id;
+};
+
+static const int RasterTileSize = 64;
+static const double BarycentricEpsilon = 1e-7;
+}
+
+SurfaceRendering
+RasterizeScreenTriangles(const Sizei &screenSize,
+                         const std::vector<ScreenTriangle> &triangles,
+                         const std::vector<Polygon3> &polygons,
+                         const Point3 &eye) {
+  SurfaceRendering rendering;
+  rendering.depths = Imaged(screenSize, 0.0);
+  rendering.normals = Image3d(screenSize, Vec3());
+  rendering.ids = Imagei(screenSize, -1);
+
+  // planes of the polygons, distances along a direction d from the eye are
+  // offsets[i] / equations[i].dot(d) * norm(d)
+  std::vector<Vec3> equations(polygons.size());
+  std::vector<double> offsets(polygons.size(), 0.0);
+  for (int i = 0; i < polygons.size(); i++) {
+    auto &poly = polygons[i];
+    if (poly.corners.empty() || poly.normal == Origin()) {
+      continue;
+    }
+    double dotv = poly.corners.front().dot(poly.normal);
+    if (dotv == 0.0) {
+      continue;
+    }
+    equations[i] = poly.normal / dotv;
+    offsets[i] = 1.0 - equations[i].dot(eye);
+  }
+
+  // setup triangles in parallel
+  const int conc = DefaultConcurrency();
+  std::vector<TriangleSetup> setups(triangles.size());
+  std::vector<uint8_t> valid(triangles.size(), false);
+  ParallelStride(triangles.size(), conc, [&](int i, int) {
+    auto &tri = triangles[i];
+    if (offsets[tri.id] == 0.0) {
+      return;
+    }
+    auto &v = tri.corners;
+    double area2 = (v[1][0] - v[0][0]) * (v[2][1] - v[0][1]) -
+                   (v[1][1] - v[0][1]) * (v[2][0] - v[0][0]);
+    if (!(std::abs(area2) >= 1e-12)) {
+      return; // degenerated or invalid
+    }
+    auto &setup = setups[i];
+    setup.dirX = setup.dirY = setup.dir0 = Vec3();
+    for (int k = 0; k < 3; k++) {
+      auto &u = v[(k + 1) % 3];
+      auto &w = v[(k + 2) % 3];
+      setup.lambdas[k] = Vec3(u[1] - w[1], w[0] - u[0],
+                              u[0] * w[1] - u[1] * w[0]) /
+                         area2;
+      setup.dirX += setup.lambdas[k][0] * tri.dirs[k];
+      setup.dirY += setup.lambdas[k][1] * tri.dirs[k];
+      setup.dir0 += setup.lambdas[k][2] * tri.dirs[k];
+    }
+    double minX = std::min({v[0][0], v[1][0], v[2][0]});
+    double maxX = std::max({v[0][0], v[1][0], v[2][0]});
+    double minY = std::min({v[0][1], v[1][1], v[2][1]});
+    double maxY = std::max({v[0][1], v[1][1], v[2][1]});
+    setup.minX = std::max(0.0, std::ceil(minX));
+    setup.maxX = std::min(screenSize.width - 1.0, std::floor(maxX));
+    setup.minY = std::max(0.0, std::ceil(minY));
+    setup.maxY = std::min(screenSize.height - 1.0, std::floor(maxY));
+    setup.id = tri.id;
+    valid[i] = setup.minX <= setup.maxX && setup.minY <= setup.maxY;
+  });
+
+  // bin triangles into tiles
+  const int tilesX = (screenSize.width + RasterTileSize - 1) / RasterTileSize;
+  const int tilesY = (screenSize.height + RasterTileSize - 1) / RasterTileSize;
+  std::vector<std::vector<int>> tile2triangles(tilesX * tilesY);
+  for (int i = 0; i < setups.size(); i++) {
+    if (!valid[i]) {
+      continue;
+    }
+    auto &setup = setups[i];
+    for (int ty = setup.minY / RasterTileSize;
+         ty <= setup.maxY / RasterTileSize; ty++) {
+      for (int tx = setup.minX / RasterTileSize;
+           tx <= setup.maxX / RasterTileSize; tx++) {
+        tile2triangles[ty * tilesX + tx].push_back(i);
+      }
+    }
+  }
+
+  // rasterize tiles in parallel, scanline by scanline
+  ParallelStride(tile2triangles.size(), conc, [&](int tile, int) {
+    const int tileX0 = tile % tilesX * RasterTileSize;
+    const int tileY0 = tile / tilesX * RasterTileSize;
+    const int tileX1 = std::min(tileX0 + RasterTileSize, screenSize.width) - 1;
+    const int tileY1 = std::min(tileY0 + RasterTileSize, screenSize.height) - 1;
+    for (int i : tile2triangles[tile]) {
+      auto &setup = setups[i];
+      const Vec3 &equation = equations[setup.id];
+      const double offset = offsets[setup.id];
+      const Vec3 &normal = polygons[setup.id].normal;
+      for (int y = std::max(setup.minY, tileY0);
+           y <= std::min(setup.maxY, tileY1); y++) {
+        // the span where all barycentric coordinates are nonnegative
+        double left = std::max(setup.minX, tileX0);
+        double right = std::min(setup.maxX, tileX1);
+        for (int k = 0; k < 3 && left <= right; k++) {
+          const Vec3 &l = setup.lambdas[k];
+          double lx = l[0], rest = l[1] * y + l[2] + BarycentricEpsilon;
+          if (lx > 0) {
+            left = std::max(left, std::ceil(-rest / lx));
+          } else if (lx < 0) {
+            right = std::min(right, std::floor(-rest / lx));
+          } else if (rest < 0) {
+            right = left - 1;
+          }
+        }
+        if (left > right) {
+          continue;
+        }
+        double *depthRow = rendering.depths[y];
+        Vec3 *normalRow = rendering.normals[y];
+        int *idRow = rendering.ids[y];
+        const Vec3 dirRow = setup.dirY * y + setup.dir0;
+        for (int x = left; x <= right; x++) {
+          Vec3 dir = dirRow + setup.dirX * x;
+          double s = offset / equation.dot(dir);
+          if (!(s > 0)) {
+            continue;
+          }
+          double depth = s * norm(dir);
+          if (depthRow[x] == 0.0 || depth < depthRow[x]) {
+            depthRow[x] = depth;
+            normalRow[x] = normal;
+            idRow[x] = setup.id;
+          }
+        }
+      }
+    }
+  });
+
+  return rendering;
+}
+}
+}
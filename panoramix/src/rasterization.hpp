@@ -0,0 +1,182 @@
+#pragma once
+
+#include "cameras.hpp"
+#include "parallel.hpp"
+#include "utility.hpp"
+
+namespace pano {
+namespace core {
+
+// buffers rendered from polygons
+struct SurfaceRendering {
+  Imaged depths;   // distances to the eye, 0 where nothing is rendered
+  Image3d normals; // normals of the polygons
+  Imagei ids;      // indices of the polygons, -1 where nothing is rendered
+};
+
+// triangle on screen
+// - dirs are the directions from the eye to the corners, scaled such that
+//   they are (close to) linear on screen
+struct ScreenTriangle {
+  Point2 corners[3];
+  Vec3 dirs[3];
+  int id;
+};
+
+// appends the screen triangles of a 3d triangle
+// - triangles are clipped by the near plane of perspective cameras
+// - triangles are split by the seam and the poles of panoramic cameras
+// - triangles of nonlinear projections are subdivided until no edge spans
+//   more than maxTriangleAngle, panoramas also measure edges on screen
+void AppendScreenTriangles(const PerspectiveCamera &cam, const Point3 &a,
+                           const Point3 &b, const Point3 &c, int id,
+                           double maxTriangleAngle,
+                           std::vector<ScreenTriangle> &triangles);
+void AppendScreenTriangles(const PanoramicCamera &cam, const Point3 &a,
+                           const Point3 &b, const Point3 &c, int id,
+                           double maxTriangleAngle,
+                           std::vector<ScreenTriangle> &triangles);
+
+// calls fun(points, corners) on the pieces of a 3d triangle on a panorama,
+// points are the 3 corners of a piece in space and corners are on screen
+// - pieces are split by the poles, a pole spreads over its whole row so the
+//   pieces touching it come as a quad of two triangles, the one with the pole
+//   twice is degenerated in space
+// - corners are continuous on screen within a piece, so they may lie across
+//   the seam, outside of [0, width)
+// - pieces are subdivided as by AppendScreenTriangles
+void SplitPanoramicTriangle(
+    const PanoramicCamera &cam, const Point3 &a, const Point3 &b,
+    const Point3 &c, double maxTriangleAngle,
+    const std::function<void(const Point3 *points, const Point2 *corners)>
+        &fun);
+
+// as SplitPanoramicTriangle, but edges are halved only where the directions
+// interpolated from the corners on screen are more than maxError pixels (at
+// the equator) away from the points of the edge, e.g. for texture coordinates
+// - a pole corner counts as below or above either other corner of its piece
+void SplitPanoramicTriangleByError(
+    const PanoramicCamera &cam, const Point3 &a, const Point3 &b,
+    const Point3 &c, double maxError,
+    const std::function<void(const Point3 *points, const Point2 *corners)>
+        &fun);
+
+// calls fun(a, b, c) on the pieces of the triangle, whose edges are halved
+// until none is longer than maxLength as measured by length(p, q)
+// - whether an edge is halved only depends on the edge, so triangles sharing
+//   an edge split it the same way and no cracks open between them
+template <class LengthFunT, class FunT>
+void SubdivideTriangle(const Point3 &a, const Point3 &b, const Point3 &c,
+                       LengthFunT &&length, double maxLength, FunT &&fun,
+                       int maxLevel = 24) {
+  // edge k is opposite to corner k
+  const Point3 cs[3] = {a, b, c};
+  bool halved[3];
+  Point3 ms[3];
+  int nhalved = 0;
+  for (int k = 0; k < 3; k++) {
+    const Point3 &q = cs[(k + 1) % 3], &r = cs[(k + 2) % 3];
+    halved[k] = maxLevel > 0 && length(q, r) > maxLength;
+    if (halved[k]) {
+      ms[k] = (q + r) / 2.0;
+      nhalved++;
+    }
+  }
+  auto recurse = [&](const Point3 &aa, const Point3 &bb, const Point3 &cc) {
+    SubdivideTriangle(aa, bb, cc, length, maxLength, fun, maxLevel - 1);
+  };
+  if (nhalved == 0) {
+    fun(a, b, c);
+  } else if (nhalved == 3) {
+    recurse(a, ms[2], ms[1]);
+    recurse(ms[2], b, ms[0]);
+    recurse(ms[1], ms[0], c);
+    recurse(ms[0], ms[1], ms[2]);
+  } else if (nhalved == 1) {
+    int k = std::find(halved, halved + 3, true) - halved;
+    recurse(cs[k], cs[(k + 1) % 3], ms[k]);
+    recurse(cs[k], ms[k], cs[(k + 2) % 3]);
+  } else {
+    int k = std::find(halved, halved + 3, false) - halved;
+    const Point3 &p = cs[k], &q = cs[(k + 1) % 3], &r = cs[(k + 2) % 3];
+    const Point3 &mq = ms[(k + 1) % 3], &mr = ms[(k + 2) % 3];
+    recurse(p, mr, mq);
+    recurse(mr, q, r);
+    recurse(mr, r, mq);
+  }
+}
+
+// edges are measured by the angles they span from the eye
+template <class FunT>
+void SubdivideTriangle(const Point3 &eye, const Point3 &a, const Point3 &b,
+                       const Point3 &c, double maxAngle, FunT &&fun,
+                       int maxLevel = 24) {
+  SubdivideTriangle(a, b, c,
+                    [&eye](const Point3 &p, const Point3 &q) {
+                      return AngleBetweenDirected(Vec3(p - eye),
+                                                  Vec3(q - eye));
+                    },
+                    maxAngle, fun, maxLevel);
+}
+
+// other cameras, whose projections are treated as continuous
+template <class CameraT>
+void AppendScreenTriangles(const CameraT &cam, const Point3 &a,
+                           const Point3 &b, const Point3 &c, int id,
+                           double maxTriangleAngle,
+                           std::vector<ScreenTriangle> &triangles) {
+  const Point3 &eye = cam.eye();
+  SubdivideTriangle(
+      eye, a, b, c, maxTriangleAngle,
+      [&](const Point3 &aa, const Point3 &bb, const Point3 &cc) {
+        ScreenTriangle tri;
+        const Point3 *cs[3] = {&aa, &bb, &cc};
+        for (int k = 0; k < 3; k++) {
+          tri.corners[k] = cam.toScreen(*cs[k]);
+          tri.dirs[k] = normalize(*cs[k] - eye);
+        }
+        tri.id = id;
+        triangles.push_back(tri);
+      });
+}
+
+// z-buffered scanline rasterization of screen triangles, in tiles in parallel
+// - the depth of a pixel is computed on the plane of its polygon, along the
+//   direction interpolated from the corners
+SurfaceRendering
+RasterizeScreenTriangles(const Sizei &screenSize,
+                         const std::vector<ScreenTriangle> &triangles,
+                         const std::vector<Polygon3> &polygons,
+                         const Point3 &eye);
+
+// renders the depths, normals and ids of polygons (e.g. the CompactModel)
+template <class CameraT>
+SurfaceRendering RenderPolygons(const CameraT &cam,
+                                const std::vector<Polygon3> &polygons,
+                                double maxTriangleAngle = M_PI / 90.0) {
+  const int conc = DefaultConcurrency();
+  std::vector<std::vector<ScreenTriangle>> threadTriangles(conc);
+  ParallelStride(polygons.size(), conc, [&](int i, int t) {
+    auto &triangles = threadTriangles[t];
+    auto &poly = polygons[i];
+    if (poly.corners.size() < 3 || poly.normal == Origin()) {
+      return;
+    }
+    Vec3 x, y;
+    std::tie(x, y) = ProposeXYDirectionsFromZDirection(poly.normal);
+    TriangulatePolygon(
+        poly.corners.begin(), poly.corners.end(),
+        [&x, &y](const Point3 &v) { return Vec2(v.dot(x), v.dot(y)); },
+        [&](const Point3 &a, const Point3 &b, const Point3 &c) {
+          AppendScreenTriangles(cam, a, b, c, i, maxTriangleAngle, triangles);
+        });
+  });
+  std::vector<ScreenTriangle> triangles;
+  for (auto &ts : threadTriangles) {
+    triangles.insert(triangles.end(), ts.begin(), ts.end());
+  }
+  return RasterizeScreenTriangles(cam.screenSize(), triangles, polygons,
+                                  cam.eye());
+}
+}
+}
@@ -0,0 +1,226 @@
+#include "rasterization.hpp"
+
+#include "../panoramix.unittest.hpp"
+
+using namespace pano;
+using namespace pano::core;
+
+namespace {
+// faces of the axis aligned box, face 2 * axis + side lies on minc[axis] if
+// side is 0, on maxc[axis] if side is 1
+std::vector<Polygon3> BoxFaces(const Point3 &minc, const Point3 &maxc) {
+  std::vector<Polygon3> faces;
+  for (int axis = 0; axis < 3; axis++) {
+    int u = (axis + 1) % 3, v = (axis + 2) % 3;
+    for (int side = 0; side < 2; side++) {
+      double w = side == 0 ? minc[axis] : maxc[axis];
+      std::vector<Point3> corners(4);
+      double us[4] = {minc[u], maxc[u], maxc[u], minc[u]};
+      double vs[4] = {minc[v], minc[v], maxc[v], maxc[v]};
+      for (int k = 0; k < 4; k++) {
+        corners[k][axis] = w;
+        corners[k][u] = us[k];
+        corners[k][v] = vs[k];
+      }
+      Vec3 normal;
+      normal[axis] = side == 0 ? -1 : 1;
+      faces.emplace_back(std::move(corners), normal);
+    }
+  }
+  return faces;
+}
+
+// first hit of the ray from eye along the unit direction dir on the box, by
+// slabs
+bool RayBoxHit(const Point3 &minc, const Point3 &maxc, const Point3 &eye,
+               const Vec3 &dir, double &depth) {
+  double tnear = -std::numeric_limits<double>::infinity();
+  double tfar = std::numeric_limits<double>::infinity();
+  for (int axis = 0; axis < 3; axis++) {
+    if (dir[axis] == 0) {
+      if (eye[axis] < minc[axis] || eye[axis] > maxc[axis]) {
+        return false;
+      }
+      continue;
+    }
+    double t1 = (minc[axis] - eye[axis]) / dir[axis];
+    double t2 = (maxc[axis] - eye[axis]) / dir[axis];
+    tnear = std::max(tnear, std::min(t1, t2));
+    tfar = std::min(tfar, std::max(t1, t2));
+  }
+  if (tnear > tfar || tfar <= 0) {
+    return false;
+  }
+  depth = tnear > 0 ? tnear : tfar;
+  return true;
+}
+
+// compares the rendering of the box with ray casting on every pixel, which
+// includes the seam columns and pole rows of panoramas and all tile borders
+// - pixels whose rays graze the silhouette of the box are skipped
+template <class CameraT>
+void ExpectRendersBox(const CameraT &cam, const Point3 &minc,
+                      const Point3 &maxc, double depthTolerance) {
+  auto faces = BoxFaces(minc, maxc);
+  SurfaceRendering rendering = RenderPolygons(cam, faces);
+  auto sz = cam.screenSize();
+  ASSERT_EQ(rendering.depths.size(), sz);
+  ASSERT_EQ(rendering.normals.size(), sz);
+  ASSERT_EQ(rendering.ids.size(), sz);
+
+  const Vec3 margin(1e-3, 1e-3, 1e-3);
+  int covered = 0;
+  for (int y = 0; y < sz.height; y++) {
+    for (int x = 0; x < sz.width; x++) {
+      Vec3 dir = normalize(cam.toSpace(Point2(x, y)) - cam.eye());
+      double depth = 0.0, innerDepth = 0.0, outerDepth = 0.0;
+      bool hit = RayBoxHit(minc, maxc, cam.eye(), dir, depth);
+      if (RayBoxHit(minc + margin, maxc - margin, cam.eye(), dir,
+                    innerDepth) !=
+          RayBoxHit(minc - margin, maxc + margin, cam.eye(), dir,
+                    outerDepth)) {
+        continue;
+      }
+      int id = rendering.ids(y, x);
+      if (!hit) {
+        EXPECT_EQ(id, -1) << "pixel (" << x << ", " << y << ")";
+        EXPECT_EQ(rendering.depths(y, x), 0.0);
+        continue;
+      }
+      covered++;
+      ASSERT_GE(id, 0) << "pixel (" << x << ", " << y << ")";
+      ASSERT_LT(id, faces.size());
+      EXPECT_NEAR(rendering.depths(y, x), depth, depth * depthTolerance)
+          << "pixel (" << x << ", " << y << ")";
+      EXPECT_EQ(rendering.normals(y, x), faces[id].normal);
+      // the face rendered is the one hit, up to ties on the box edges
+      auto plane = faces[id].plane();
+      double faceDepth = (plane.anchor - cam.eye()).dot(plane.normal) /
+                         dir.dot(plane.normal);
+      EXPECT_NEAR(faceDepth, depth, depth * depthTolerance)
+          << "pixel (" << x << ", " << y << ")";
+    }
+  }
+  EXPECT_GT(covered, 0);
+}
+}
+
+TEST(Rasterization, PerspectiveCameraBox) {
+  // looking at a corner of the room, the box is around the eye and spans many
+  // tiles
+  PerspectiveCamera cam(640, 480, Point2(320, 240), 300, Point3(0, 0, 0),
+                        Point3(1, 0.7, -0.4), Vec3(0, 0, -1));
+  ExpectRendersBox(cam, Point3(-1.5, -2, -1.2), Point3(3, 1, 0.8), 1e-6);
+
+  // looking at a box outside, only some of its front faces are visible
+  PerspectiveCamera cam2(640, 480, Point2(320, 240), 300, Point3(-4, -3, 1),
+                         Point3(0, 0, 0), Vec3(0, 0, -1));
+  ExpectRendersBox(cam2, Point3(-1, -1, -1), Point3(1, 2, 1), 1e-6);
+}
+
+TEST(Rasterization, PanoramicCameraBox) {
+  // the box is off the eye so its faces cross the seam and contain the poles,
+  // the pole below lies on the diagonal splitting the floor
+  PanoramicCamera cam(640 / M_PI / 2.0);
+  // depths are exact up to the interpolation of directions on pieces of
+  // maxTriangleAngle
+  ExpectRendersBox(cam, Point3(-1.5, -2, -1.2), Point3(3, 1, 0.8), 5e-3);
+
+  // a box not containing the eye, crossing the seam behind the camera
+  PanoramicCamera cam2(640 / M_PI / 2.0, Point3(0, 0, 0), Point3(1, 0, 0),
+                       Vec3(0, 0, 1));
+  ExpectRendersBox(cam2, Point3(-4, -1, -0.5), Point3(-2, 1, 1.5), 5e-3);
+}
+
+TEST(Rasterization, SplitPanoramicTriangle) {
+  // the faces of the box cross the seam and contain the poles
+  PanoramicCamera cam(640 / M_PI / 2.0);
+  const double width = cam.screenSize().width;
+  const double height = cam.screenSize().height;
+  auto faces = BoxFaces(Point3(-1.5, -2, -1.2), Point3(3, 1, 0.8));
+  int pieces = 0;
+  double maxAngle = 0.0;
+  for (auto &face : faces) {
+    auto &cs = face.corners;
+    for (int t = 0; t < 2; t++) {
+      SplitPanoramicTriangle(
+          cam, cs[0], cs[t + 1], cs[t + 2], M_PI / 90.0,
+          [&](const Point3 *points, const Point2 *corners) {
+            if (points[0] == points[2]) {
+              return; // the degenerated half of a quad at a pole
+            }
+            pieces++;
+            // corners are the projections of the points up to the seam
+            for (int k = 0; k < 3; k++) {
+              Point2 p = cam.toScreen(points[k]);
+              if (corners[k][1] == 0 || corners[k][1] == height) {
+                EXPECT_NEAR(p[1], corners[k][1], 1e-6);
+                continue;
+              }
+              double dx = corners[k][0] - p[0];
+              EXPECT_NEAR(dx - std::round(dx / width) * width, 0.0, 1e-6);
+              EXPECT_NEAR(corners[k][1], p[1], 1e-6);
+            }
+            // the centers are in close directions, so the pieces are not
+            // flipped across the seam
+            Point2 center = (corners[0] + corners[1] + corners[2]) / 3.0;
+            Point3 center3 = (points[0] + points[1] + points[2]) / 3.0;
+            maxAngle = std::max(
+                maxAngle, AngleBetweenDirected(cam.direction(center),
+                                               Vec3(center3 - cam.eye())));
+          });
+    }
+  }
+  EXPECT_GT(pieces, 0);
+  EXPECT_LT(maxAngle, M_PI / 900.0);
+}
+
+TEST(Rasterization, SplitPanoramicTriangleByError) {
+  // directions interpolated on the pieces of the faces stay within the error
+  PanoramicCamera cam(640 / M_PI / 2.0);
+  const double maxError = 0.5;
+  auto faces = BoxFaces(Point3(-1.5, -2, -1.2), Point3(3, 1, 0.8));
+  int pieces = 0;
+  double maxPieceError = 0.0;
+  for (auto &face : faces) {
+    auto &cs = face.corners;
+    for (int t = 0; t < 2; t++) {
+      SplitPanoramicTriangleByError(
+          cam, cs[0], cs[t + 1], cs[t + 2], maxError,
+          [&](const Point3 *points, const Point2 *corners) {
+            if (points[0] == points[2]) {
+              return;
+            }
+            pieces++;
+            for (int i = 0; i <= 8; i++) {
+              for (int j = 0; i + j <= 8; j++) {
+                double ws[3] = {i / 8.0, j / 8.0, (8 - i - j) / 8.0};
+                Point3 point = points[0] * ws[0] + points[1] * ws[1] +
+                               points[2] * ws[2];
+                Point2 corner = corners[0] * ws[0] + corners[1] * ws[1] +
+                                corners[2] * ws[2];
+                maxPieceError = std::max(
+                    maxPieceError,
+                    AngleBetweenDirected(cam.direction(corner),
+                                         Vec3(point - cam.eye())) *
+                        cam.focal());
+              }
+            }
+          });
+    }
+  }
+  EXPECT_GT(pieces, 0);
+  EXPECT_LT(maxPieceError, maxError * 2);
+
+  // a far small quad in front needs no split, unlike by angles
+  int piecesByError = 0, piecesByAngle = 0;
+  const Point3 a(10, -0.5, -0.5), b(10, 0.5, -0.5), c(10, 0.5, 0.5);
+  SplitPanoramicTriangleByError(
+      cam, a, b, c, maxError,
+      [&](const Point3 *, const Point2 *) { piecesByError++; });
+  SplitPanoramicTriangle(
+      cam, a, b, c, M_PI / 90.0,
+      [&](const Point3 *, const Point2 *) { piecesByAngle++; });
+  EXPECT_EQ(piecesByError, 1);
+  EXPECT_GT(piecesByAngle, 1);
+}
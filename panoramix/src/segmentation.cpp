@@ -1354,5 +1354,22 @@ SegmentationTopo::SegmentationTopo(const Imagei &segs, bool crossBorder) {
                                     bnd2segs, seg2juncs, junc2segs, bnd2juncs,
                                     junc2bnds, crossBorder);
 }
+
+PanoramaEqualAreaGrid::PanoramaEqualAreaGrid(int w, int h)
+    : width(w), height(h), rowWidths(h), rowOffsets(h + 1, 0),
+      cellOfPixel(h, w) {
+  for (int y = 0; y < height; y++) {
+    double latitude = (y - height / 2.0) / height * M_PI;
+    rowWidths[y] =
+        BoundBetween(int(std::round(width * cos(latitude))), 1, width);
+    rowOffsets[y + 1] = rowOffsets[y] + rowWidths[y];
+    for (int x = 0; x < rowWidths[y]; x++) {
+      auto range = pixelsOfCell(x, y);
+      for (int px = range.first; px < range.second; px++) {
+        cellOfPixel(y, px) = rowOffsets[y] + x;
+      }
+    }
+  }
+}
 }
 }
\ No newline at end of file
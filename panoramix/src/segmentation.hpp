@@ -117,5 +117,28 @@ struct SegmentationTopo {
        bnd2juncs, junc2bnds);
   }
 };
+
+// PanoramaEqualAreaGrid
+// - row y of a width x height panorama keeps about width * cos(latitude)
+//   cells, so that every cell covers about the same area, cell x of row y
+//   covers the pixels [x * width / n, (x + 1) * width / n), n = rowWidths[y]
+// - cells are numbered row by row, cellOfPixel is built from the same
+//   partition and maps every pixel to the cell covering it
+struct PanoramaEqualAreaGrid {
+  int width, height;
+  std::vector<int> rowWidths;
+  std::vector<int> rowOffsets; // the first cell of each row, and the count
+  Imagei cellOfPixel;
+
+  PanoramaEqualAreaGrid() : width(0), height(0) {}
+  PanoramaEqualAreaGrid(int width, int height);
+
+  int cellsNum() const { return rowOffsets.empty() ? 0 : rowOffsets.back(); }
+  // pixels [first, second) of row y covered by the x-th cell of the row
+  std::pair<int, int> pixelsOfCell(int x, int y) const {
+    return std::make_pair(x * width / rowWidths[y],
+                          (x + 1) * width / rowWidths[y]);
+  }
+};
 }
 }
@@ -152,4 +152,29 @@ TEST(SegmentationTest, ExtractSegmentationTopology) {
       .thickness(2)
       .add(bndpixels)
       .show();
-}
\ No newline at end of file
+}
+TEST(SegmentationTest, PanoramaEqualAreaGrid) {
+  for (auto &size : {core::Sizei(10, 5), core::Sizei(37, 19),
+                     core::Sizei(1000, 500)}) {
+    core::PanoramaEqualAreaGrid grid(size.width, size.height);
+    ASSERT_EQ(grid.cellOfPixel.size(), cv::Size(size.width, size.height));
+    std::vector<int> pixelsNum(grid.cellsNum(), 0);
+    for (int y = 0; y < size.height; y++) {
+      ASSERT_GE(grid.rowWidths[y], 1);
+      ASSERT_LE(grid.rowWidths[y], size.width);
+      // each pixel maps back to the cell that covers it
+      for (int x = 0; x < grid.rowWidths[y]; x++) {
+        auto range = grid.pixelsOfCell(x, y);
+        ASSERT_LT(range.first, range.second);
+        for (int px = range.first; px < range.second; px++) {
+          EXPECT_EQ(grid.rowOffsets[y] + x, grid.cellOfPixel(y, px));
+          pixelsNum[grid.rowOffsets[y] + x]++;
+        }
+      }
+    }
+    // and is covered exactly once
+    EXPECT_EQ(size.area(),
+              std::accumulate(pixelsNum.begin(), pixelsNum.end(), 0));
+    EXPECT_LT(grid.cellsNum(), size.area() * 0.7);
+  }
+}
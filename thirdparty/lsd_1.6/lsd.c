@@ -96,6 +96,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <limits.h>
 #include <float.h>
@@ -733,35 +734,34 @@ static image_double gaussian_sampler( image_double in, double scale,
 /*----------------------------------------------------------------------------*/
 
 /*----------------------------------------------------------------------------*/
-/** Computes the direction of the level line of 'in' at each point.
+/** Computes the direction of the level line of 'in' at each point,
+    writing into caller provided memory.
 
     The result is:
-    - an image_double with the angle at each pixel, or NOTDEF if not defined.
-    - the image_double 'modgrad' (a pointer is passed as argument)
-      with the gradient magnitude at each point.
-    - a list of pixels 'list_p' roughly ordered by decreasing
+    - the image_double 'g' with the angle at each pixel, or NOTDEF if
+      not defined.
+    - the image_double 'modgrad' with the gradient magnitude at each point.
+    - the returned list of pixels, roughly ordered by decreasing
       gradient magnitude. (The order is made by classifying points
       into bins by gradient magnitude. The parameters 'n_bins' and
       'max_grad' specify the number of bins and the gradient modulus
       at the highest bin. The pixels in the list would be in
       decreasing gradient magnitude, up to a precision of the size of
-      the bins.)
-    - a pointer 'mem_p' to the memory used by 'list_p' to be able to
-      free the memory when it is not used anymore.
+      the bins.) Its nodes live in 'list', which must hold one node per
+      pixel; 'range_l_s' and 'range_l_e' must hold 'n_bins' pointers.
  */
-static image_double ll_angle( image_double in, double threshold,
-                              struct coorlist ** list_p, void ** mem_p,
-                              image_double * modgrad, unsigned int n_bins )
+static struct coorlist * ll_angle_into( image_double in, double threshold,
+                                        image_double g, image_double modgrad,
+                                        struct coorlist * list,
+                                        struct coorlist ** range_l_s,
+                                        struct coorlist ** range_l_e,
+                                        unsigned int n_bins )
 {
-  image_double g;
   unsigned int n,p,x,y,adr,i;
   double com1,com2,gx,gy,norm,norm2;
   /* the rest of the variables are used for pseudo-ordering
      the gradient magnitude values */
   int list_count = 0;
-  struct coorlist * list;
-  struct coorlist ** range_l_s; /* array of pointers to start of bin list */
-  struct coorlist ** range_l_e; /* array of pointers to end of bin list */
   struct coorlist * start;
   struct coorlist * end;
   double max_grad = 0.0;
@@ -770,39 +770,27 @@ static image_double ll_angle( image_double in, double threshold,
   if( in == NULL || in->data == NULL || in->xsize == 0 || in->ysize == 0 )
     error("ll_angle: invalid image.");
   if( threshold < 0.0 ) error("ll_angle: 'threshold' must be positive.");
-  if( list_p == NULL ) error("ll_angle: NULL pointer 'list_p'.");
-  if( mem_p == NULL ) error("ll_angle: NULL pointer 'mem_p'.");
-  if( modgrad == NULL ) error("ll_angle: NULL pointer 'modgrad'.");
+  if( g == NULL || g->data == NULL || modgrad == NULL || modgrad->data == NULL )
+    error("ll_angle: invalid output images.");
+  if( list == NULL || range_l_s == NULL || range_l_e == NULL )
+    error("ll_angle: invalid pixel list buffers.");
   if( n_bins == 0 ) error("ll_angle: 'n_bins' must be positive.");
 
   /* image size shortcuts */
   n = in->ysize;
   p = in->xsize;
 
-  /* allocate output image */
-  g = new_image_double(in->xsize,in->ysize);
-
-  /* get memory for the image of gradient modulus */
-  *modgrad = new_image_double(in->xsize,in->ysize);
-
-  /* get memory for "ordered" list of pixels */
-  list = (struct coorlist *) calloc( (size_t) (n*p), sizeof(struct coorlist) );
-  *mem_p = (void *) list;
-  range_l_s = (struct coorlist **) calloc( (size_t) n_bins,
-                                           sizeof(struct coorlist *) );
-  range_l_e = (struct coorlist **) calloc( (size_t) n_bins,
-                                           sizeof(struct coorlist *) );
-  if( list == NULL || range_l_s == NULL || range_l_e == NULL )
-    error("not enough memory.");
   for(i=0;i<n_bins;i++) range_l_s[i] = range_l_e[i] = NULL;
 
   /* 'undefined' on the down and right boundaries */
   for(x=0;x<p;x++) g->data[(n-1)*p+x] = NOTDEF;
   for(y=0;y<n;y++) g->data[p*y+p-1]   = NOTDEF;
+  for(x=0;x<p;x++) modgrad->data[(n-1)*p+x] = 0.0;
+  for(y=0;y<n;y++) modgrad->data[p*y+p-1]   = 0.0;
 
-  /* compute gradient on the remaining pixels */
-  for(x=0;x<p-1;x++)
-    for(y=0;y<n-1;y++)
+  /* compute gradient on the remaining pixels, row by row */
+  for(y=0;y<n-1;y++)
+    for(x=0;x<p-1;x++)
       {
         adr = y*p+x;
 
@@ -825,7 +813,7 @@ static image_double ll_angle( image_double in, double threshold,
         norm2 = gx*gx+gy*gy;
         norm = sqrt( norm2 / 4.0 ); /* gradient norm */
 
-        (*modgrad)->data[adr] = norm; /* store gradient norm */
+        modgrad->data[adr] = norm; /* store gradient norm */
 
         if( norm <= threshold ) /* norm too small, gradient no defined */
           g->data[adr] = NOTDEF; /* gradient angle not defined */
@@ -839,11 +827,13 @@ static image_double ll_angle( image_double in, double threshold,
           }
       }
 
-  /* compute histogram of gradient values */
+  /* compute histogram of gradient values
+     (column by column, so that the pseudo-ordering inside each bin
+      is the one of the reference implementation) */
   for(x=0;x<p-1;x++)
     for(y=0;y<n-1;y++)
       {
-        norm = (*modgrad)->data[y*p+x];
+        norm = modgrad->data[y*p+x];
 
         /* store the point in the right bin according to its norm */
         i = (unsigned int) (norm * (double) n_bins / max_grad);
@@ -878,7 +868,57 @@ static image_double ll_angle( image_double in, double threshold,
             end = range_l_e[i];
           }
       }
-  *list_p = start;
+
+  return start;
+}
+
+/*----------------------------------------------------------------------------*/
+/** Computes the direction of the level line of 'in' at each point,
+    allocating the output images and the pixel list.
+    See 'll_angle_into' for the description of the results.
+    The pointer 'mem_p' receives the memory used by 'list_p' to be able to
+    free the memory when it is not used anymore.
+ */
+static image_double ll_angle( image_double in, double threshold,
+                              struct coorlist ** list_p, void ** mem_p,
+                              image_double * modgrad, unsigned int n_bins )
+{
+  image_double g;
+  unsigned int n,p;
+  struct coorlist * list;
+  struct coorlist ** range_l_s; /* array of pointers to start of bin list */
+  struct coorlist ** range_l_e; /* array of pointers to end of bin list */
+
+  /* check parameters */
+  if( in == NULL || in->data == NULL || in->xsize == 0 || in->ysize == 0 )
+    error("ll_angle: invalid image.");
+  if( list_p == NULL ) error("ll_angle: NULL pointer 'list_p'.");
+  if( mem_p == NULL ) error("ll_angle: NULL pointer 'mem_p'.");
+  if( modgrad == NULL ) error("ll_angle: NULL pointer 'modgrad'.");
+  if( n_bins == 0 ) error("ll_angle: 'n_bins' must be positive.");
+
+  /* image size shortcuts */
+  n = in->ysize;
+  p = in->xsize;
+
+  /* allocate output image */
+  g = new_image_double(in->xsize,in->ysize);
+
+  /* get memory for the image of gradient modulus */
+  *modgrad = new_image_double(in->xsize,in->ysize);
+
+  /* get memory for "ordered" list of pixels */
+  list = (struct coorlist *) calloc( (size_t) (n*p), sizeof(struct coorlist) );
+  *mem_p = (void *) list;
+  range_l_s = (struct coorlist **) calloc( (size_t) n_bins,
+                                           sizeof(struct coorlist *) );
+  range_l_e = (struct coorlist **) calloc( (size_t) n_bins,
+                                           sizeof(struct coorlist *) );
+  if( list == NULL || range_l_s == NULL || range_l_e == NULL )
+    error("not enough memory.");
+
+  *list_p = ll_angle_into( in, threshold, g, *modgrad, list,
+                           range_l_s, range_l_e, n_bins );
 
   /* free memory */
   free( (void *) range_l_s );
@@ -2020,64 +2060,25 @@ static int refine( struct point * reg, int * reg_size, image_double modgrad,
 /*----------------------------------------------------------------------------*/
 
 /*----------------------------------------------------------------------------*/
-/** LSD full interface.
+/** Search line segments on the level-line field of an image.
+
+    'angles', 'modgrad' and 'list_p' are the results of ll_angle on the
+    (possibly scaled) image, 'used' must be initialized to NOTUSED and
+    'reg' must hold one point per pixel. The detections are appended to
+    'out', and, when 'region' is not NULL, labeled in it.
  */
-double * LineSegmentDetection( int * n_out,
-                               double * img, int X, int Y,
-                               double scale, double sigma_scale, double quant,
-                               double ang_th, double log_eps, double density_th,
-                               int n_bins,
-                               int ** reg_img, int * reg_x, int * reg_y )
+static void detect_line_segments( image_double angles, image_double modgrad,
+                                  struct coorlist * list_p, image_char used,
+                                  struct point * reg, double scale,
+                                  double prec, double p, double log_eps,
+                                  double density_th, ntuple_list out,
+                                  image_int region )
 {
-  image_double image;
-  ntuple_list out = new_ntuple_list(7);
-  double * return_value;
-  image_double scaled_image,angles,modgrad;
-  image_char used;
-  image_int region = NULL;
-  struct coorlist * list_p;
-  void * mem_p;
   struct rect rec;
-  struct point * reg;
   int reg_size,min_reg_size,i;
-  unsigned int xsize,ysize;
-  double rho,reg_angle,prec,p,log_nfa,logNT;
+  double reg_angle,log_nfa,logNT;
   int ls_count = 0;                   /* line segments are numbered 1,2,3,... */
 
-
-  /* check parameters */
-  if( img == NULL || X <= 0 || Y <= 0 ) error("invalid image input.");
-  if( scale <= 0.0 ) error("'scale' value must be positive.");
-  if( sigma_scale <= 0.0 ) error("'sigma_scale' value must be positive.");
-  if( quant < 0.0 ) error("'quant' value must be positive.");
-  if( ang_th <= 0.0 || ang_th >= 180.0 )
-    error("'ang_th' value must be in the range (0,180).");
-  if( density_th < 0.0 || density_th > 1.0 )
-    error("'density_th' value must be in the range [0,1].");
-  if( n_bins <= 0 ) error("'n_bins' value must be positive.");
-
-
-  /* angle tolerance */
-  prec = M_PI * ang_th / 180.0;
-  p = ang_th / 180.0;
-  rho = quant / sin(prec); /* gradient magnitude threshold */
-
-
-  /* load and scale image (if necessary) and compute angle at each pixel */
-  image = new_image_double_ptr( (unsigned int) X, (unsigned int) Y, img );
-  if( scale != 1.0 )
-    {
-      scaled_image = gaussian_sampler( image, scale, sigma_scale );
-      angles = ll_angle( scaled_image, rho, &list_p, &mem_p,
-                         &modgrad, (unsigned int) n_bins );
-      free_image_double(scaled_image);
-    }
-  else
-    angles = ll_angle( image, rho, &list_p, &mem_p, &modgrad,
-                       (unsigned int) n_bins );
-  xsize = angles->xsize;
-  ysize = angles->ysize;
-
   /* Number of Tests - NT
 
      The theoretical number of tests is Np.(XY)^(5/2)
@@ -2091,20 +2092,12 @@ double * LineSegmentDetection( int * n_out,
      whose logarithm value is
        log10(11) + 5/2 * (log10(X) + log10(Y)).
   */
-  logNT = 5.0 * ( log10( (double) xsize ) + log10( (double) ysize ) ) / 2.0
+  logNT = 5.0 * ( log10( (double) angles->xsize )
+                  + log10( (double) angles->ysize ) ) / 2.0
           + log10(11.0);
   min_reg_size = (int) (-logNT/log10(p)); /* minimal number of points in region
                                              that can give a meaningful event */
 
-
-  /* initialize some structures */
-  if( reg_img != NULL && reg_x != NULL && reg_y != NULL ) /* save region data */
-    region = new_image_int_ini(angles->xsize,angles->ysize,0);
-  used = new_image_char_ini(xsize,ysize,NOTUSED);
-  reg = (struct point *) calloc( (size_t) (xsize*ysize), sizeof(struct point) );
-  if( reg == NULL ) error("not enough memory!");
-
-
   /* search for line segments */
   for(; list_p != NULL; list_p = list_p->next )
     if( used->data[ list_p->x + list_p->y * used->xsize ] == NOTUSED &&
@@ -2166,6 +2159,86 @@ double * LineSegmentDetection( int * n_out,
           for(i=0; i<reg_size; i++)
             region->data[ reg[i].x + reg[i].y * region->xsize ] = ls_count;
       }
+}
+
+/*----------------------------------------------------------------------------*/
+/** Check the parameters shared by all the LSD interfaces.
+ */
+static void check_lsd_parameters( double scale, double sigma_scale,
+                                  double quant, double ang_th,
+                                  double density_th, int n_bins )
+{
+  if( scale <= 0.0 ) error("'scale' value must be positive.");
+  if( sigma_scale <= 0.0 ) error("'sigma_scale' value must be positive.");
+  if( quant < 0.0 ) error("'quant' value must be positive.");
+  if( ang_th <= 0.0 || ang_th >= 180.0 )
+    error("'ang_th' value must be in the range (0,180).");
+  if( density_th < 0.0 || density_th > 1.0 )
+    error("'density_th' value must be in the range [0,1].");
+  if( n_bins <= 0 ) error("'n_bins' value must be positive.");
+}
+
+/*----------------------------------------------------------------------------*/
+/** LSD full interface.
+ */
+double * LineSegmentDetection( int * n_out,
+                               double * img, int X, int Y,
+                               double scale, double sigma_scale, double quant,
+                               double ang_th, double log_eps, double density_th,
+                               int n_bins,
+                               int ** reg_img, int * reg_x, int * reg_y )
+{
+  image_double image;
+  ntuple_list out = new_ntuple_list(7);
+  double * return_value;
+  image_double scaled_image,angles,modgrad;
+  image_char used;
+  image_int region = NULL;
+  struct coorlist * list_p;
+  void * mem_p;
+  struct point * reg;
+  unsigned int xsize,ysize;
+  double rho,prec,p;
+
+
+  /* check parameters */
+  if( img == NULL || X <= 0 || Y <= 0 ) error("invalid image input.");
+  check_lsd_parameters(scale,sigma_scale,quant,ang_th,density_th,n_bins);
+
+
+  /* angle tolerance */
+  prec = M_PI * ang_th / 180.0;
+  p = ang_th / 180.0;
+  rho = quant / sin(prec); /* gradient magnitude threshold */
+
+
+  /* load and scale image (if necessary) and compute angle at each pixel */
+  image = new_image_double_ptr( (unsigned int) X, (unsigned int) Y, img );
+  if( scale != 1.0 )
+    {
+      scaled_image = gaussian_sampler( image, scale, sigma_scale );
+      angles = ll_angle( scaled_image, rho, &list_p, &mem_p,
+                         &modgrad, (unsigned int) n_bins );
+      free_image_double(scaled_image);
+    }
+  else
+    angles = ll_angle( image, rho, &list_p, &mem_p, &modgrad,
+                       (unsigned int) n_bins );
+  xsize = angles->xsize;
+  ysize = angles->ysize;
+
+
+  /* initialize some structures */
+  if( reg_img != NULL && reg_x != NULL && reg_y != NULL ) /* save region data */
+    region = new_image_int_ini(angles->xsize,angles->ysize,0);
+  used = new_image_char_ini(xsize,ysize,NOTUSED);
+  reg = (struct point *) calloc( (size_t) (xsize*ysize), sizeof(struct point) );
+  if( reg == NULL ) error("not enough memory!");
+
+
+  /* search for line segments */
+  detect_line_segments( angles, modgrad, list_p, used, reg, scale,
+                        prec, p, log_eps, density_th, out, region );
 
 
   /* free memory */
@@ -2248,3 +2321,353 @@ double * lsd(int * n_out, double * img, int X, int Y)
   return lsd_scale(n_out,img,X,Y,scale);
 }
 /*----------------------------------------------------------------------------*/
+
+/*----------------------------------------------------------------------------*/
+/*--------------------------- Reusable Workspace -----------------------------*/
+/*----------------------------------------------------------------------------*/
+
+/*----------------------------------------------------------------------------*/
+/** Scratch memory kept between calls of LineSegmentDetectionWorkspace.
+
+    Every buffer only grows, so once the workspace has processed an image
+    of a given size, later images of the same or smaller size are handled
+    without any large allocation.
+ */
+struct lsd_workspace_s
+{
+  double * row;                 size_t row_size;     /* one input row        */
+  double * kernels;             size_t kernels_size; /* x-axis kernels       */
+  int * kernel_idx;             size_t kernel_idx_size;
+  double * aux;                 size_t aux_size;     /* x-axis sampled image */
+  double * scaled;              size_t scaled_size;
+  double * angles;              size_t angles_size;
+  double * modgrad;             size_t modgrad_size;
+  unsigned char * used;         size_t used_size;
+  struct point * reg;           size_t reg_size;
+  struct coorlist * list;       size_t list_size;
+  struct coorlist ** range_l_s; size_t range_l_s_size;
+  struct coorlist ** range_l_e; size_t range_l_e_size;
+  double * kernel_values;       size_t kernel_values_size;
+  struct ntuple_list_s kernel;  /* wraps 'kernel_values' */
+  struct ntuple_list_s out;     /* detections, grown by add_7tuple */
+};
+
+/*----------------------------------------------------------------------------*/
+/** Make sure 'buf' can hold 'n' elements of 'elem_size' bytes.
+    The old content is not preserved when the buffer is enlarged.
+ */
+static void * ws_reserve( void * buf, size_t * capacity, size_t n,
+                          size_t elem_size )
+{
+  if( n <= *capacity ) return buf;
+  free(buf);
+  buf = malloc( n * elem_size );
+  if( buf == NULL ) error("not enough memory.");
+  *capacity = n;
+  return buf;
+}
+
+/*----------------------------------------------------------------------------*/
+/** Convert row 'y' of a strided input image to doubles.
+ */
+static void ws_load_row( double * row, const void * img, int pixel_type,
+                         int row_stride, unsigned int X, unsigned int y )
+{
+  const unsigned char * r = (const unsigned char *) img
+                            + (size_t) row_stride * y;
+  unsigned int x;
+
+  switch( pixel_type )
+    {
+      case LSD_PIXEL_UCHAR:
+        for(x=0;x<X;x++) row[x] = (double) r[x];
+        break;
+      case LSD_PIXEL_FLOAT:
+        for(x=0;x<X;x++) row[x] = (double) ((const float *) r)[x];
+        break;
+      case LSD_PIXEL_DOUBLE:
+        for(x=0;x<X;x++) row[x] = ((const double *) r)[x];
+        break;
+      default:
+        error("ws_load_row: unknown pixel type.");
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+/** Gaussian sub-sampling of a strided input image into the workspace.
+
+    Same result as 'gaussian_sampler', but the input is read row by row
+    without an intermediate double image, the x-axis kernels are computed
+    once per output column, and the y-axis pass runs along rows.
+ */
+static void ws_gaussian_sampler( lsd_workspace ws, const void * img,
+                                 int pixel_type, int row_stride,
+                                 unsigned int X, unsigned int Y,
+                                 double scale, double sigma_scale,
+                                 struct image_double_s * out )
+{
+  unsigned int N,M,h,n,x,y,i;
+  int xc,yc,j,double_x_size,double_y_size;
+  double sigma,xx,yy,sum,prec,kv;
+  const double * k;
+  const int * kid;
+  const double * a;
+  double * o;
+
+  /* compute new image size */
+  if( X * scale > (double) UINT_MAX || Y * scale > (double) UINT_MAX )
+    error("gaussian_sampler: the output image size exceeds the handled size.");
+  N = (unsigned int) ceil( X * scale );
+  M = (unsigned int) ceil( Y * scale );
+
+  /* sigma and kernel size, see 'gaussian_sampler' */
+  sigma = scale < 1.0 ? sigma_scale / scale : sigma_scale;
+  prec = 3.0;
+  h = (unsigned int) ceil( sigma * sqrt( 2.0 * prec * log(10.0) ) );
+  n = 1+2*h; /* kernel size */
+
+  /* get memory */
+  ws->kernel_values = (double *) ws_reserve( ws->kernel_values,
+                        &ws->kernel_values_size, n, sizeof(double) );
+  ws->kernel.values = ws->kernel_values;
+  ws->kernel.dim = n;
+  ws->kernel.size = 0;
+  ws->kernel.max_size = 1;
+  ws->kernels = (double *) ws_reserve( ws->kernels, &ws->kernels_size,
+                                       (size_t) N * n, sizeof(double) );
+  ws->kernel_idx = (int *) ws_reserve( ws->kernel_idx, &ws->kernel_idx_size,
+                                       (size_t) N * n, sizeof(int) );
+  ws->row = (double *) ws_reserve( ws->row, &ws->row_size, X,
+                                   sizeof(double) );
+  ws->aux = (double *) ws_reserve( ws->aux, &ws->aux_size, (size_t) N * Y,
+                                   sizeof(double) );
+  ws->scaled = (double *) ws_reserve( ws->scaled, &ws->scaled_size,
+                                      (size_t) N * M, sizeof(double) );
+
+  /* auxiliary double image size variables */
+  double_x_size = (int) (2 * X);
+  double_y_size = (int) (2 * Y);
+
+  /* x axis kernels and source columns, one set per output column */
+  for(x=0;x<N;x++)
+    {
+      xx = (double) x / scale;
+      xc = (int) floor( xx + 0.5 );
+      gaussian_kernel( &ws->kernel, sigma, (double) h + xx - (double) xc );
+      for(i=0;i<n;i++)
+        {
+          j = xc - h + i;
+
+          /* symmetry boundary condition */
+          while( j < 0 ) j += double_x_size;
+          while( j >= double_x_size ) j -= double_x_size;
+          if( j >= (int) X ) j = double_x_size-1-j;
+
+          ws->kernels[ x * n + i ] = ws->kernel.values[i];
+          ws->kernel_idx[ x * n + i ] = j;
+        }
+    }
+
+  /* First subsampling: x axis */
+  for(y=0;y<Y;y++)
+    {
+      ws_load_row( ws->row, img, pixel_type, row_stride, X, y );
+      for(x=0;x<N;x++)
+        {
+          k = ws->kernels + x * n;
+          kid = ws->kernel_idx + x * n;
+          sum = 0.0;
+          for(i=0;i<n;i++) sum += ws->row[ kid[i] ] * k[i];
+          ws->aux[ x + y * N ] = sum;
+        }
+    }
+
+  /* Second subsampling: y axis */
+  for(y=0;y<M;y++)
+    {
+      yy = (double) y / scale;
+      yc = (int) floor( yy + 0.5 );
+      gaussian_kernel( &ws->kernel, sigma, (double) h + yy - (double) yc );
+
+      o = ws->scaled + y * N;
+      for(x=0;x<N;x++) o[x] = 0.0;
+      for(i=0;i<n;i++)
+        {
+          j = yc - h + i;
+
+          /* symmetry boundary condition */
+          while( j < 0 ) j += double_y_size;
+          while( j >= double_y_size ) j -= double_y_size;
+          if( j >= (int) Y ) j = double_y_size-1-j;
+
+          a = ws->aux + (size_t) j * N;
+          kv = ws->kernel.values[i];
+          for(x=0;x<N;x++) o[x] += a[x] * kv;
+        }
+    }
+
+  out->data = ws->scaled;
+  out->xsize = N;
+  out->ysize = M;
+}
+
+/*----------------------------------------------------------------------------*/
+/** Create an empty LSD workspace.
+ */
+lsd_workspace lsd_workspace_new(void)
+{
+  lsd_workspace ws;
+
+  ws = (lsd_workspace) calloc( 1, sizeof(struct lsd_workspace_s) );
+  if( ws == NULL ) error("not enough memory.");
+
+  ws->out.dim = 7;
+  ws->out.size = 0;
+  ws->out.max_size = 1;
+  ws->out.values = (double *) malloc( 7 * sizeof(double) );
+  if( ws->out.values == NULL ) error("not enough memory.");
+
+  return ws;
+}
+
+/*----------------------------------------------------------------------------*/
+/** Free an LSD workspace and all its buffers.
+ */
+void lsd_workspace_free(lsd_workspace ws)
+{
+  if( ws == NULL ) return;
+  free( (void *) ws->row );
+  free( (void *) ws->kernels );
+  free( (void *) ws->kernel_idx );
+  free( (void *) ws->aux );
+  free( (void *) ws->scaled );
+  free( (void *) ws->angles );
+  free( (void *) ws->modgrad );
+  free( (void *) ws->used );
+  free( (void *) ws->reg );
+  free( (void *) ws->list );
+  free( (void *) ws->range_l_s );
+  free( (void *) ws->range_l_e );
+  free( (void *) ws->kernel_values );
+  free( (void *) ws->out.values );
+  free( (void *) ws );
+}
+
+/*----------------------------------------------------------------------------*/
+/** LSD full interface on a reusable workspace.
+ */
+const double * LineSegmentDetectionWorkspace( lsd_workspace ws, int * n_out,
+                                              const void * img, int pixel_type,
+                                              int X, int Y, int row_stride,
+                                              double scale, double sigma_scale,
+                                              double quant, double ang_th,
+                                              double log_eps,
+                                              double density_th, int n_bins )
+{
+  struct image_double_s image,angles,modgrad;
+  struct image_char_s used;
+  struct coorlist * list_p;
+  size_t npixels;
+  unsigned int y;
+  double rho,prec,p;
+
+  /* check parameters */
+  if( ws == NULL ) error("invalid workspace.");
+  if( n_out == NULL ) error("NULL pointer 'n_out'.");
+  if( img == NULL || X <= 0 || Y <= 0 ) error("invalid image input.");
+  if( pixel_type != LSD_PIXEL_UCHAR && pixel_type != LSD_PIXEL_FLOAT &&
+      pixel_type != LSD_PIXEL_DOUBLE ) error("invalid pixel type.");
+  check_lsd_parameters(scale,sigma_scale,quant,ang_th,density_th,n_bins);
+
+  /* angle tolerance */
+  prec = M_PI * ang_th / 180.0;
+  p = ang_th / 180.0;
+  rho = quant / sin(prec); /* gradient magnitude threshold */
+
+  /* load and scale image (if necessary) */
+  if( scale != 1.0 )
+    ws_gaussian_sampler( ws, img, pixel_type, row_stride,
+                         (unsigned int) X, (unsigned int) Y,
+                         scale, sigma_scale, &image );
+  else
+    {
+      ws->scaled = (double *) ws_reserve( ws->scaled, &ws->scaled_size,
+                                          (size_t) X * Y, sizeof(double) );
+      for(y=0;y<(unsigned int) Y;y++)
+        ws_load_row( ws->scaled + (size_t) y * X, img, pixel_type,
+                     row_stride, (unsigned int) X, y );
+      image.data = ws->scaled;
+      image.xsize = (unsigned int) X;
+      image.ysize = (unsigned int) Y;
+    }
+
+  /* get the per pixel buffers */
+  npixels = (size_t) image.xsize * image.ysize;
+  ws->angles = (double *) ws_reserve( ws->angles, &ws->angles_size, npixels,
+                                      sizeof(double) );
+  ws->modgrad = (double *) ws_reserve( ws->modgrad, &ws->modgrad_size,
+                                       npixels, sizeof(double) );
+  ws->used = (unsigned char *) ws_reserve( ws->used, &ws->used_size, npixels,
+                                           sizeof(unsigned char) );
+  ws->reg = (struct point *) ws_reserve( ws->reg, &ws->reg_size, npixels,
+                                         sizeof(struct point) );
+  ws->list = (struct coorlist *) ws_reserve( ws->list, &ws->list_size,
+                                             npixels,
+                                             sizeof(struct coorlist) );
+  ws->range_l_s = (struct coorlist **) ws_reserve( ws->range_l_s,
+                    &ws->range_l_s_size, (size_t) n_bins,
+                    sizeof(struct coorlist *) );
+  ws->range_l_e = (struct coorlist **) ws_reserve( ws->range_l_e,
+                    &ws->range_l_e_size, (size_t) n_bins,
+                    sizeof(struct coorlist *) );
+
+  angles.data = ws->angles;
+  angles.xsize = image.xsize;
+  angles.ysize = image.ysize;
+  modgrad.data = ws->modgrad;
+  modgrad.xsize = image.xsize;
+  modgrad.ysize = image.ysize;
+  used.data = ws->used;
+  used.xsize = image.xsize;
+  used.ysize = image.ysize;
+  memset( (void *) ws->used, NOTUSED, npixels );
+
+  /* compute angle at each pixel */
+  list_p = ll_angle_into( &image, rho, &angles, &modgrad, ws->list,
+                          ws->range_l_s, ws->range_l_e,
+                          (unsigned int) n_bins );
+
+  /* search for line segments */
+  ws->out.size = 0;
+  detect_line_segments( &angles, &modgrad, list_p, &used, ws->reg, scale,
+                        prec, p, log_eps, density_th, &ws->out, NULL );
+
+  if( ws->out.size > (unsigned int) INT_MAX )
+    error("too many detections to fit in an INT.");
+  *n_out = (int) (ws->out.size);
+
+  return ws->out.values;
+}
+
+/*----------------------------------------------------------------------------*/
+/** LSD Simple Interface with Scale on a reusable workspace.
+ */
+const double * lsd_workspace_scale( lsd_workspace ws, int * n_out,
+                                    const void * img, int pixel_type,
+                                    int X, int Y, int row_stride,
+                                    double scale )
+{
+  /* LSD parameters, see 'lsd_scale_region' */
+  double sigma_scale = 0.6;
+  double quant = 2.0;
+  double ang_th = 22.5;
+  double log_eps = 0.0;
+  double density_th = 0.7;
+  int n_bins = 1024;
+
+  return LineSegmentDetectionWorkspace( ws, n_out, img, pixel_type,
+                                        X, Y, row_stride, scale, sigma_scale,
+                                        quant, ang_th, log_eps, density_th,
+                                        n_bins );
+}
+/*----------------------------------------------------------------------------*/
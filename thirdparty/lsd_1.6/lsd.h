@@ -277,5 +277,80 @@ double * lsd_scale(int * n_out, double * img, int X, int Y, double scale);
  */
 double * lsd(int * n_out, double * img, int X, int Y);
 
+/*----------------------------------------------------------------------------*/
+/** Pixel types accepted by the workspace interfaces.
+ */
+#define LSD_PIXEL_UCHAR  0
+#define LSD_PIXEL_FLOAT  1
+#define LSD_PIXEL_DOUBLE 2
+
+/*----------------------------------------------------------------------------*/
+/** Reusable LSD scratch memory.
+
+    A workspace keeps the images and lists LSD needs between calls, so that
+    repeated detections on images of similar size do not allocate.
+    A workspace must not be used by several threads at the same time.
+    There is no single precision mode: every pixel type is widened to
+    double as it is read and all the computations are done in double.
+ */
+typedef struct lsd_workspace_s * lsd_workspace;
+
+/*----------------------------------------------------------------------------*/
+/** Create an empty LSD workspace.
+ */
+lsd_workspace lsd_workspace_new(void);
+
+/*----------------------------------------------------------------------------*/
+/** Free an LSD workspace created by lsd_workspace_new.
+ */
+void lsd_workspace_free(lsd_workspace ws);
+
+/*----------------------------------------------------------------------------*/
+/** LSD Full Interface on a reusable workspace
+
+    @param ws          Workspace providing all the scratch memory.
+
+    @param n_out       Pointer to an int where LSD will store the number of
+                       line segments detected.
+
+    @param img         Pointer to the first row of the input image. Rows are
+                       'row_stride' bytes apart and hold X pixels of type
+                       'pixel_type' each, so the image is read in place
+                       without a conversion copy.
+
+    @param pixel_type  One of LSD_PIXEL_UCHAR, LSD_PIXEL_FLOAT or
+                       LSD_PIXEL_DOUBLE.
+
+    @param X           X size of the image: the number of columns.
+
+    @param Y           Y size of the image: the number of rows.
+
+    @param row_stride  Distance in bytes between two consecutive rows.
+
+    The remaining parameters are those of LineSegmentDetection.
+
+    @return            The 7 x n_out detections, laid out as for
+                       LineSegmentDetection. The array is owned by the
+                       workspace and is valid until its next use.
+ */
+const double * LineSegmentDetectionWorkspace( lsd_workspace ws, int * n_out,
+                                              const void * img, int pixel_type,
+                                              int X, int Y, int row_stride,
+                                              double scale, double sigma_scale,
+                                              double quant, double ang_th,
+                                              double log_eps,
+                                              double density_th, int n_bins );
+
+/*----------------------------------------------------------------------------*/
+/** LSD Simple Interface with Scale on a reusable workspace.
+
+    Same as LineSegmentDetectionWorkspace with the suggested parameters
+    of lsd_scale.
+ */
+const double * lsd_workspace_scale( lsd_workspace ws, int * n_out,
+                                    const void * img, int pixel_type,
+                                    int X, int Y, int row_stride,
+                                    double scale );
+
 #endif /* !LSD_HEADER */
 /*----------------------------------------------------------------------------*/